@@ -0,0 +1,989 @@
+/* Benchmark of the liberad acquisition path without hardware.
+*
+* Scenarios:
+*   loop      - liberad_handle_io_async on one thread, traces delivered to a LiberadCallbackIn
+*   pooled    - as loop, with a trace pool lending buffers to a LiberadCallbackInPooled
+*   executor  - the library executor with an event thread and one delivery thread
+*   simulated - a simulated device producing traces as fast as they are consumed
+*   wireless  - as simulated, with traces split into packets of up to 64 bytes and every 100th packet lost
+*   batched   - as loop, with transfers of BENCH_BATCH traces delivered to a LiberadCallbackBatch
+*   recording - as loop, with every trace also recorded into a survey file in the temporary directory
+*
+* The loopback scenarios run on a transport which completes every posted IN request at once with traces
+* recorded from the simulator, so only liberad itself is measured. The time a request completed is
+* written into the first bytes of its first trace, giving the latency from completion to the user callback.
+* For the loop scenario the time from the callback returning to the request being posted again is the
+* resubmit cost. The recording scenario shows the recorder adds little to the latency however far the disk falls
+* behind; traces the disk couldn't take are counted as dropped from the recording. Elog cost is measured at every
+* LogLevel with cout discarded.
+*
+* The trace decoder and the sample encoder are checked against their scalar references on every instruction set
+* the CPU supports, then decoding batches of the recorded traces is timed. The trace framer is fed the recorded traces as whole
+* transfers with every 20th doubled, as packets of 1 to 64 bytes, and as packets with every 100th lost. Every
+* trace it puts out must be one of the recorded traces. The trace codec packs and unpacks chunks of the recorded
+* traces, of noise, and of traces of mixed lengths; every unpacked chunk must equal the chunk it was packed from.
+* Migration is fed sections of noise longer than its window and compared with a direct sum over the aperture of
+* every trace it still holds. A recorded survey is transposed into a depth store, whose records and slices must
+* equal the survey.
+*
+* Usage: liberad_bench [--seconds S] [--depth D] [--json]
+*/
+
+#include "../include/liberad.h"
+#include "../include/EradCodec.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_TRACES 64
+#define BENCH_MAX_SAMPLES (1 << 21)
+#define BENCH_BATCH 16
+
+static long long now_ns(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/* Latency samples of one scenario. Only touched by the thread delivering traces. */
+struct Samples {
+  std::vector<long long> values;
+  Samples(){ values.reserve(BENCH_MAX_SAMPLES); }
+  void add(long long v){ if (values.size() < BENCH_MAX_SAMPLES) values.push_back(v); }
+  long long percentile(double p){
+    if (values.empty()) return 0;
+    size_t i = std::min(values.size() - 1, (size_t)(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+  }
+  long long max(){ return values.empty() ? 0 : *std::max_element(values.begin(), values.end()); }
+};
+
+struct ScenarioResult {
+  const char* name;
+  unsigned long long traces;
+  double seconds;
+  long long latency[4];
+  long long resubmit[4];
+  bool has_resubmit;
+  bool has_recorder;
+  LiberadRecorderStats recorder;
+};
+
+static std::atomic<unsigned long long> delivered{0};
+static Samples latency;
+static Samples resubmit;
+static std::atomic<long long> callback_returned{0};
+
+static void record_latency(unsigned char* buffer, int length){
+  long long completed;
+  if (length < (int)sizeof(completed)) return;
+  memcpy(&completed, buffer, sizeof(completed));
+  latency.add(now_ns() - completed);
+  delivered++;
+}
+
+static void on_trace(unsigned char* buffer, int length, signed char steps){
+  record_latency(buffer, length);
+  callback_returned.store(now_ns(), std::memory_order_relaxed);
+}
+
+static void on_trace_pooled(LiberadTraceBuffer* trace){
+  record_latency(trace->buffer, trace->length);
+}
+
+/* Simulated traces carry no completion time */
+static void on_trace_counted(unsigned char* buffer, int length, signed char steps){
+  delivered++;
+}
+
+static void on_batch(const Trace* traces, int count){
+  record_latency((unsigned char*)traces[0].data, traces[0].length);
+  delivered += count - 1;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/* Transport completing every posted IN request as soon as events are handled */
+class LoopbackTransport : public OeradarTransport {
+
+public:
+
+  LoopbackTransport(Oeradar* radar, const std::vector<std::vector<unsigned char> >& traces, bool measure_resubmit, int batch) :
+    radar(radar), traces(traces), measure_resubmit(measure_resubmit), batch(batch){}
+
+  int open(){ return LIBERAD_SUCCESS; }
+  int configure(){ return LIBERAD_SUCCESS; }
+  int close(){ return LIBERAD_SUCCESS; }
+  int setup_in(int count){ return LIBERAD_SUCCESS; }
+  int setup_out(int count){ return LIBERAD_SUCCESS; }
+
+  int submit_in(int slot, unsigned char* buffer, int length){
+    if (measure_resubmit){
+      long long returned = callback_returned.exchange(0, std::memory_order_relaxed);
+      if (returned) resubmit.add(now_ns() - returned);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    Request request = {slot, buffer, length, true};
+    posted.push_back(request);
+    return 0;
+  }
+
+  int submit_out(int slot, unsigned char* buffer, int length){
+    std::lock_guard<std::mutex> lock(mutex);
+    Request request = {slot, buffer, length, false};
+    posted.push_back(request);
+    return 0;
+  }
+
+  void cancel_all(){}
+
+  int write_sync(unsigned char* data, int length, int* actual, unsigned int timeout_ms){ *actual = length; return 0; }
+  int read_sync(unsigned char* buffer, int length, int* actual, unsigned int timeout_ms){ *actual = 0; return LIBUSB_ERROR_TIMEOUT; }
+
+  int handle_events(long timeout_us){
+
+    std::vector<Request> ready;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (posted.empty() && !interrupted && timeout_us != 0){
+        if (timeout_us < 0) wake.wait(lock);
+        else wake.wait_for(lock, std::chrono::microseconds(timeout_us));
+      }
+      interrupted = false;
+      ready.swap(posted);
+    }
+
+    for (size_t i = 0; i < ready.size(); i++){
+      Request& request = ready[i];
+      if (!request.in){
+        radar->complete_out(request.slot, request.length, LIBUSB_TRANSFER_COMPLETED);
+        continue;
+      }
+      int length = 0;
+      for (int k = 0; k < batch && (k == 0 || request.length - length >= TRACE_LENGTH); k++){
+        const std::vector<unsigned char>& trace = traces[next++ % traces.size()];
+        int part = std::min(request.length - length, (int)trace.size());
+        memcpy(request.buffer + length, &trace[0], part);
+        length += part;
+      }
+      long long completed = now_ns();
+      memcpy(request.buffer, &completed, sizeof(completed));
+      radar->complete_in(request.slot, request.buffer, length, LIBUSB_TRANSFER_COMPLETED);
+    }
+    return 0;
+  }
+
+  void interrupt(){
+    std::lock_guard<std::mutex> lock(mutex);
+    interrupted = true;
+    wake.notify_one();
+  }
+
+  long next_event_us(){
+    std::lock_guard<std::mutex> lock(mutex);
+    return posted.empty() ? -1 : 0;
+  }
+
+private:
+
+  struct Request {
+    int slot;
+    unsigned char* buffer;
+    int length;
+    bool in;
+  };
+
+  Oeradar* radar;
+  const std::vector<std::vector<unsigned char> >& traces;
+  bool measure_resubmit;
+  int batch;
+  size_t next = 0;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool interrupted = false;
+  std::vector<Request> posted;
+};
+
+// -------------------------------------------------------------------------------------------------
+
+enum Mode {LOOP, POOLED, EXECUTOR, SIMULATED, WIRELESS, BATCHED, RECORDING};
+
+static Oeradar* make_device(Mode mode, const std::vector<std::vector<unsigned char> >& traces){
+
+  if (mode == SIMULATED || mode == WIRELESS){
+    LiberadSimParams params;
+    params.trace_period_us = 0;
+    if (mode == WIRELESS){
+      params.packet_size = 64;
+      params.packet_loss_every = 100;
+    }
+    return liberad_create_simulated_device(&params);
+  }
+
+  Oeradar* radar = new Oeradar();
+  radar->transport = new LoopbackTransport(radar, traces, mode == LOOP, mode == BATCHED ? BENCH_BATCH : 1);
+  radar->state = Oeradar::ON_BUS;
+  return radar;
+}
+
+static ScenarioResult run_scenario(const char* name, Mode mode, const std::vector<std::vector<unsigned char> >& traces,
+                                   double seconds, int depth){
+
+  delivered = 0;
+  latency.values.clear();
+  resubmit.values.clear();
+  callback_returned = 0;
+
+  Oeradar* radar = make_device(mode, traces);
+  liberad_connect_to_device(radar);
+  liberad_init_device(radar);
+
+  std::vector<unsigned char> buffer_in(depth * (mode == BATCHED ? LIBERAD_BATCH_BUFFER_SIZE(BENCH_BATCH) : LIBERAD_POOL_BUFFER_SIZE));
+  if (mode == POOLED) liberad_enable_trace_pool(radar, on_trace_pooled, depth + 4);
+  if (mode == BATCHED) liberad_set_batch_callback(radar, on_batch, BENCH_BATCH);
+
+  bool simulated = mode == SIMULATED || mode == WIRELESS;
+  LiberadCallbackIn callback = mode == POOLED || mode == BATCHED ? nullptr : simulated ? on_trace_counted : on_trace;
+  liberad_start_io_async(radar, SHORT, LEVEL3, callback, nullptr,
+                         &buffer_in[0], (int)buffer_in.size(), nullptr, 0, depth);
+
+  std::string record_path = std::string(P_tmpdir) + "/liberad_bench.srv";
+  if (mode == RECORDING) liberad_start_recording(radar, record_path.c_str());
+
+  std::thread io;
+  if (mode == EXECUTOR){
+    liberad_executor_start(2);
+    liberad_executor_add(radar);
+  } else {
+    io = std::thread(liberad_handle_io_async, radar);
+  }
+
+  long long start = now_ns();
+  std::this_thread::sleep_for(std::chrono::milliseconds((long)(seconds * 1000)));
+  unsigned long long traces_done = delivered;
+  double elapsed = (now_ns() - start) / 1e9;
+
+  if (mode == EXECUTOR){
+    liberad_executor_stop();
+  } else {
+    liberad_stop_io(radar);
+    io.join();
+  }
+  liberad_disconnect_device(radar);
+
+  ScenarioResult result;
+  result.has_recorder = mode == RECORDING;
+  if (mode == RECORDING){
+    liberad_stop_recording(radar);
+    liberad_get_recorder_stats(radar, &result.recorder);
+    remove(record_path.c_str());
+  }
+  result.name = name;
+  result.traces = traces_done;
+  result.seconds = elapsed;
+  result.latency[0] = latency.percentile(0.5);
+  result.latency[1] = latency.percentile(0.99);
+  result.latency[2] = latency.percentile(0.999);
+  result.latency[3] = latency.max();
+  result.has_resubmit = mode == LOOP;
+  result.resubmit[0] = resubmit.percentile(0.5);
+  result.resubmit[1] = resubmit.percentile(0.99);
+  result.resubmit[2] = resubmit.percentile(0.999);
+  result.resubmit[3] = resubmit.max();
+
+  if (simulated) result.latency[0] = result.latency[1] = result.latency[2] = result.latency[3] = -1;
+
+  delete radar;
+  return result;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c){ return c; }
+  std::streamsize xsputn(const char* s, std::streamsize n){ return n; }
+};
+
+struct ElogResult {
+  const char* level;
+  double debug2_ns;
+  double error_ns;
+};
+
+static double time_elog(LogLevel message_level, int iterations){
+  long long start = now_ns();
+  for (int i = 0; i < iterations; i++){
+    ELOG(message_level) << "complete_in submit slot: " << i;
+  }
+  return (double)(now_ns() - start) / iterations;
+}
+
+static std::vector<ElogResult> run_elog(int iterations){
+
+  static const LogLevel levels[] = {LIBERAD_DEBUG_2, LIBERAD_DEBUG, LIBERAD_INFO, LIBERAD_WARN, LIBERAD_ERROR, LIBERAD_NONE};
+  static const char* names[] = {"DEBUG_2", "DEBUG", "INFO", "WARN", "ERROR", "NONE"};
+
+  NullBuffer null;
+  std::streambuf* original = cout.rdbuf(&null);
+
+  std::vector<ElogResult> results;
+  for (int i = 0; i < 6; i++){
+    liberad_set_logger(levels[i]);
+    ElogResult result;
+    result.level = names[i];
+    result.debug2_ns = time_elog(LIBERAD_DEBUG_2, iterations);
+    result.error_ns = time_elog(LIBERAD_ERROR, iterations);
+    results.push_back(result);
+  }
+
+  cout.rdbuf(original);
+  liberad_set_logger(LIBERAD_WARN);
+  return results;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+struct DecodeResult {
+  const char* isa;
+  bool valid;
+  double int16_traces_per_s;
+  double float_traces_per_s;
+};
+
+/* Compares the decoder running on isa with the scalar reference over every sample value, gain and
+* a range of lengths covering all vector tails. Encoding is compared over values in steps of a quarter, ties
+* included, past both clipping limits and far out of range.
+*/
+static bool validate_decode(LiberadDecodeIsa isa){
+
+  std::vector<unsigned char> samples(TRACE_LENGTH);
+  for (int i = 0; i < TRACE_LENGTH; i++) samples[i] = (unsigned char)(i * 7 + 3);
+
+  std::vector<short> expected_int16(TRACE_LENGTH), int16(TRACE_LENGTH);
+  std::vector<float> expected_float(TRACE_LENGTH), floats(TRACE_LENGTH);
+
+  std::vector<float> values(TRACE_LENGTH);
+  for (int i = 0; i < TRACE_LENGTH; i++) values[i] = (i - TRACE_LENGTH / 2) * 0.25f;
+  for (int i = 0; i < TRACE_LENGTH; i += 61) values[i] = i % 2 ? 1e9f : -1e9f;
+  std::vector<unsigned char> expected_encoded(TRACE_LENGTH), encoded(TRACE_LENGTH);
+  liberad_set_decode_isa(LIBERAD_DECODE_SCALAR);
+  liberad_encode_float(&values[0], TRACE_LENGTH, &expected_encoded[0]);
+  liberad_set_decode_isa(isa);
+  liberad_encode_float(&values[0], TRACE_LENGTH, &encoded[0]);
+  if (memcmp(&expected_encoded[0], &encoded[0], TRACE_LENGTH)) return false;
+
+  for (int count = 0; count <= 80; count++){
+    for (int shift = 0; shift <= LEVEL5 - LEVEL1; shift++){
+      float scale = liberad_gain_scale((Gain)(LEVEL5 - shift));
+      liberad_set_decode_isa(LIBERAD_DECODE_SCALAR);
+      liberad_decode_int16(&samples[0], count, shift, &expected_int16[0]);
+      liberad_decode_float(&samples[0], count, scale, &expected_float[0]);
+      liberad_set_decode_isa(isa);
+      liberad_decode_int16(&samples[0], count, shift, &int16[0]);
+      liberad_decode_float(&samples[0], count, scale, &floats[0]);
+      if (memcmp(&expected_int16[0], &int16[0], count * sizeof(short)) ||
+          memcmp(&expected_float[0], &floats[0], count * sizeof(float))) return false;
+    }
+    liberad_set_decode_isa(LIBERAD_DECODE_SCALAR);
+    liberad_encode_float(&values[0] + count, count, &expected_encoded[0]);
+    liberad_set_decode_isa(isa);
+    liberad_encode_float(&values[0] + count, count, &encoded[0]);
+    if (memcmp(&expected_encoded[0], &encoded[0], count)) return false;
+    for (int at = 0; at <= count; at++){
+      std::vector<unsigned char> haystack(count + 1, 0);
+      if (at < count) haystack[at] = CONTROL_B;
+      if (liberad_find_byte(&haystack[0], count, CONTROL_B) != at) return false;
+    }
+  }
+  return true;
+}
+
+static double time_decode(const std::vector<Trace>& batch, LiberadSampleMatrix* matrix, int iterations){
+  long long start = now_ns();
+  for (int i = 0; i < iterations; i++){
+    liberad_decode_traces(&batch[0], (int)batch.size(), matrix, true);
+  }
+  return (double)iterations * batch.size() / ((now_ns() - start) / 1e9);
+}
+
+static std::vector<DecodeResult> run_decode(const std::vector<std::vector<unsigned char> >& traces, int iterations){
+
+  static const LiberadDecodeIsa isas[] = {LIBERAD_DECODE_SCALAR, LIBERAD_DECODE_SSE2, LIBERAD_DECODE_AVX2, LIBERAD_DECODE_NEON};
+  static const char* names[] = {"scalar", "sse2", "avx2", "neon"};
+
+  std::vector<Trace> batch(traces.size());
+  for (size_t i = 0; i < traces.size(); i++){
+    batch[i].samples = &traces[i][0];
+    batch[i].sample_count = TRACE_LENGTH - 2;
+    batch[i].gain = (Gain)(LEVEL1 + i % 5);
+  }
+  LiberadSampleMatrix int16(batch.size(), TRACE_LENGTH - 2, LIBERAD_SAMPLES_INT16);
+  LiberadSampleMatrix floats(batch.size(), TRACE_LENGTH - 2, LIBERAD_SAMPLES_FLOAT);
+
+  std::vector<DecodeResult> results;
+  for (int i = 0; i < 4; i++){
+    if (liberad_set_decode_isa(isas[i]) == LIBERAD_ERR) continue;
+    DecodeResult result;
+    result.isa = names[i];
+    result.valid = validate_decode(isas[i]);
+    result.int16_traces_per_s = time_decode(batch, &int16, iterations);
+    result.float_traces_per_s = time_decode(batch, &floats, iterations);
+    results.push_back(result);
+  }
+
+  liberad_set_decode_isa(LIBERAD_DECODE_AUTO);
+  return results;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+struct FramerResult {
+  const char* stream;
+  bool valid;
+  double recovered;
+  double traces_per_s;
+  double mb_per_s;
+};
+
+/* Traces put out by the framer, checked against the recorded ones in the validation pass */
+struct FramerCheck {
+  const std::vector<std::vector<unsigned char> >* traces;
+  unsigned long long frames;
+  bool valid;
+};
+
+static void on_frame(void* context, const unsigned char* frame, int length){
+  FramerCheck* check = (FramerCheck*)context;
+  check->frames++;
+  if (!check->traces) return;
+  bool known = false;
+  for (size_t i = 0; i < check->traces->size() && !known; i++){
+    known = length == (int)(*check->traces)[i].size() && !memcmp(frame, &(*check->traces)[i][0], length);
+  }
+  if (!known) check->valid = false;
+}
+
+/* Splits the concatenated traces into fragments: whole transfers (every 20th holding two traces) if packet_size
+* is 0, packets of 1 to packet_size bytes otherwise, dropping every loss_every-th fragment
+*/
+static std::vector<std::pair<int, int> > fragment_stream(int bytes, int packet_size, int loss_every){
+
+  std::vector<std::pair<int, int> > fragments;
+  unsigned int state = 12345;
+  int at = 0;
+  while (at < bytes){
+    int size = TRACE_LENGTH * (fragments.size() % 20 == 19 ? 2 : 1);
+    if (packet_size > 0){
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      size = 1 + (int)(state % (unsigned)packet_size);
+    }
+    size = std::min(size, bytes - at);
+    if (loss_every == 0 || (fragments.size() + 1) % loss_every != 0) fragments.push_back(std::make_pair(at, size));
+    else fragments.push_back(std::make_pair(at, 0));
+    at += size;
+  }
+  return fragments;
+}
+
+static FramerResult run_framer_stream(const char* name, const std::vector<unsigned char>& stream,
+                                      const std::vector<std::vector<unsigned char> >& traces,
+                                      int packet_size, int loss_every, int iterations){
+
+  std::vector<std::pair<int, int> > fragments = fragment_stream((int)stream.size(), packet_size, loss_every);
+
+  FramerResult result;
+  result.stream = name;
+
+  TraceFramer checked(TRACE_LENGTH, CONTROL_B);
+  FramerCheck check = {&traces, 0, true};
+  for (size_t i = 0; i < fragments.size(); i++){
+    checked.push(&stream[fragments[i].first], fragments[i].second, on_frame, &check);
+  }
+  result.valid = check.valid;
+  result.recovered = (double)check.frames / (stream.size() / TRACE_LENGTH);
+
+  TraceFramer framer(TRACE_LENGTH, CONTROL_B);
+  FramerCheck count = {nullptr, 0, true};
+  long long start = now_ns();
+  for (int n = 0; n < iterations; n++){
+    for (size_t i = 0; i < fragments.size(); i++){
+      framer.push(&stream[fragments[i].first], fragments[i].second, on_frame, &count);
+    }
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+  result.traces_per_s = count.frames / elapsed;
+  result.mb_per_s = (double)iterations * stream.size() / elapsed / 1e6;
+  return result;
+}
+
+static std::vector<FramerResult> run_framer(const std::vector<std::vector<unsigned char> >& traces, int iterations){
+
+  std::vector<unsigned char> stream;
+  for (int repeat = 0; repeat < 16; repeat++){
+    for (size_t i = 0; i < traces.size(); i++) stream.insert(stream.end(), traces[i].begin(), traces[i].end());
+  }
+
+  std::vector<FramerResult> results;
+  results.push_back(run_framer_stream("wired", stream, traces, 0, 0, iterations));
+  results.push_back(run_framer_stream("packets", stream, traces, 64, 0, iterations));
+  results.push_back(run_framer_stream("lossy", stream, traces, 64, 100, iterations));
+  return results;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+struct CodecResult {
+  const char* chunk;
+  bool valid;
+  double ratio;
+  double pack_mb_per_s;
+  double unpack_mb_per_s;
+};
+
+/* Builds a trace chunk as the recorder writes it, with the traces given by length and content */
+static std::vector<unsigned char> build_chunk(const std::vector<std::vector<unsigned char> >& traces){
+
+  std::vector<unsigned char> chunk(sizeof(LiberadChunkHeader));
+  for (size_t i = 0; i < traces.size(); i++){
+    LiberadTraceRecord r;
+    memset(&r, 0, sizeof(r));
+    r.sequence = i;
+    r.length = (uint16_t)traces[i].size();
+    const unsigned char* bytes = (const unsigned char*)&r;
+    chunk.insert(chunk.end(), bytes, bytes + sizeof(r));
+    chunk.insert(chunk.end(), traces[i].begin(), traces[i].end());
+    chunk.resize(chunk.size() + ((8 - traces[i].size() % 8) % 8), 0);
+  }
+
+  LiberadChunkHeader* h = (LiberadChunkHeader*)&chunk[0];
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, LIBERAD_CHUNK_MAGIC, sizeof(h->magic));
+  h->type = LIBERAD_CHUNK_TRACES;
+  h->payload_bytes = (uint32_t)(chunk.size() - sizeof(LiberadChunkHeader));
+  h->chunk_bytes = (uint32_t)chunk.size();
+  h->trace_count = (uint32_t)traces.size();
+  return chunk;
+}
+
+/* Packs chunk into a packed chunk, unpacks it again and compares the records, then times both directions */
+static CodecResult run_codec_chunk(const char* name, const std::vector<unsigned char>& chunk, int iterations){
+
+  CodecResult result = {name, false, 0.0, 0.0, 0.0};
+  const LiberadChunkHeader* h = (const LiberadChunkHeader*)&chunk[0];
+  size_t records = (size_t)h->trace_count * sizeof(LiberadTraceRecord);
+  size_t capacity = records;
+  size_t offset = sizeof(LiberadChunkHeader);
+  for (uint32_t t = 0; t < h->trace_count; t++){
+    const LiberadTraceRecord* r = (const LiberadTraceRecord*)&chunk[offset];
+    capacity += LIBERAD_PACK_BOUND(r->length);
+    offset += sizeof(LiberadTraceRecord) + ((r->length + 7u) & ~7u);
+  }
+
+  std::vector<unsigned char> packed(sizeof(LiberadChunkHeader) + capacity);
+  size_t bytes = liberad_pack_chunk(&chunk[0], &packed[sizeof(LiberadChunkHeader)], capacity);
+  if (bytes == 0) return result;
+  LiberadChunkHeader* p = (LiberadChunkHeader*)&packed[0];
+  *p = *h;
+  p->type = LIBERAD_CHUNK_PACKED;
+  p->payload_bytes = (uint32_t)bytes;
+  p->unpacked_bytes = h->payload_bytes;
+
+  std::vector<unsigned char> image(chunk.size());
+  result.valid = liberad_unpack_chunk(&packed[0], &image[0]) &&
+                 ((const LiberadChunkHeader*)&image[0])->type == LIBERAD_CHUNK_TRACES &&
+                 !memcmp(&image[sizeof(LiberadChunkHeader)], &chunk[sizeof(LiberadChunkHeader)], h->payload_bytes);
+  result.ratio = (double)h->payload_bytes / bytes;
+
+  long long start = now_ns();
+  for (int i = 0; i < iterations; i++) liberad_pack_chunk(&chunk[0], &packed[sizeof(LiberadChunkHeader)], capacity);
+  result.pack_mb_per_s = (double)iterations * h->payload_bytes / ((now_ns() - start) / 1e9) / 1e6;
+  start = now_ns();
+  for (int i = 0; i < iterations; i++) liberad_unpack_chunk(&packed[0], &image[0]);
+  result.unpack_mb_per_s = (double)iterations * h->payload_bytes / ((now_ns() - start) / 1e9) / 1e6;
+  return result;
+}
+
+static std::vector<CodecResult> run_codec(const std::vector<std::vector<unsigned char> >& traces, int iterations){
+
+  std::vector<std::vector<unsigned char> > noise(traces.size(), std::vector<unsigned char>(TRACE_LENGTH));
+  unsigned int state = 12345;
+  for (size_t i = 0; i < noise.size(); i++){
+    for (int k = 0; k < TRACE_LENGTH; k++){
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      noise[i][k] = (unsigned char)state;
+    }
+  }
+
+  /* Lengths changing from trace to trace, including empty traces, make the codec fall back to the intra predictor */
+  std::vector<std::vector<unsigned char> > mixed;
+  for (size_t i = 0; i < traces.size(); i++){
+    size_t length = i % 7 == 3 ? 0 : TRACE_LENGTH - (i % 3) * 17;
+    mixed.push_back(std::vector<unsigned char>(traces[i].begin(), traces[i].begin() + length));
+  }
+
+  std::vector<CodecResult> results;
+  results.push_back(run_codec_chunk("simulated", build_chunk(traces), iterations));
+  results.push_back(run_codec_chunk("noise", build_chunk(noise), iterations));
+  results.push_back(run_codec_chunk("mixed", build_chunk(mixed), iterations));
+  return results;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+struct MigrationResult {
+  const char* section;
+  bool valid;
+  double error;
+  double traces_per_s;
+};
+
+/* Migrates trace index of traces by summing over its aperture directly, as MigrationWindow defines it, with
+* the traces pushed so far
+*/
+static void migrate_reference(const std::vector<std::vector<float> >& traces, size_t index, size_t pushed,
+                              const LiberadMigrationParams& params, std::vector<double>* out){
+
+  int n = (int)traces[index].size();
+  double interval = liberad_window_ns(params.model, SHORT) / n;
+  size_t first = index > (size_t)params.aperture ? index - params.aperture : 0;
+  size_t end = std::min(pushed, index + params.aperture + 1);
+  out->assign(n, 0.0);
+  for (size_t j = first; j < end; j++){
+    double offset = j > index ? (double)(j - index) : (double)(index - j);
+    double lateral = 2.0 * offset * params.spacing_m / params.velocity_m_per_ns;
+    for (int k = 0; k < n; k++){
+      double t0 = k * interval;
+      double t = sqrt(t0 * t0 + lateral * lateral);
+      int sample = (int)(t / interval);
+      if (sample >= n) continue;
+      double fraction = t / interval - sample;
+      double after = sample + 1 < n ? traces[j][sample + 1] : 0.0;
+      (*out)[k] += (traces[j][sample] * (1.0 - fraction) + after * fraction) * (t > 0 ? t0 / t : 1.0);
+    }
+  }
+  for (int k = 0; k < n; k++) (*out)[k] /= (double)(end - first);
+}
+
+/* Pushes count traces of noise into a window holding fewer, so its ring wraps, and compares every trace still held
+* with the reference, complete or not. The error is the largest difference relative to the peak of its trace.
+*/
+static MigrationResult run_migration_section(const char* name, const LiberadMigrationParams& params, int sample_count,
+                                             int count){
+
+  std::vector<std::vector<float> > traces(count, std::vector<float>(sample_count));
+  unsigned int state = 2463534242u;
+  for (int i = 0; i < count; i++){
+    for (int k = 0; k < sample_count; k++){
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      traces[i][k] = (float)(state % 2001) / 10.0f - 100.0f;
+    }
+  }
+
+  MigrationWindow window(params);
+  long long start = now_ns();
+  for (int i = 0; i < count; i++) window.push(&traces[i][0], sample_count, SHORT);
+  MigrationResult result = {name, true, 0.0, count / ((now_ns() - start) / 1e9)};
+
+  LiberadMigrationInfo info;
+  window.get_info(&info);
+  std::vector<float> migrated(sample_count);
+  std::vector<double> expected;
+  for (unsigned long long i = info.first; i < info.traces; i++){
+    if (window.read(i, &migrated[0], sample_count) != sample_count){
+      result.valid = false;
+      continue;
+    }
+    migrate_reference(traces, (size_t)i, (size_t)info.traces, params, &expected);
+    double peak = 1.0, difference = 0.0;
+    for (int k = 0; k < sample_count; k++){
+      peak = std::max(peak, fabs(expected[k]));
+      difference = std::max(difference, fabs(migrated[k] - expected[k]));
+    }
+    result.error = std::max(result.error, difference / peak);
+  }
+  if (info.first == 0 || result.error > 1e-4) result.valid = false;
+  return result;
+}
+
+static std::vector<MigrationResult> run_migration(){
+
+  LiberadMigrationParams small;
+  small.aperture = 4;
+  small.window_traces = 12;
+  LiberadMigrationParams wide;
+
+  std::vector<MigrationResult> results;
+  results.push_back(run_migration_section("small", small, 70, 100));
+  results.push_back(run_migration_section("default", wide, TRACE_LENGTH - 2, 1200));
+  return results;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+struct DepthResult {
+  bool valid;
+  unsigned long long traces;
+  double transpose_traces_per_s;
+};
+
+/* Records count traces into a survey file, transposes it in blocks that don't divide count and compares the records
+* and every slice of the store with the traces read back from the survey, cut or padded with 128 to the samples of
+* the first. Some traces are shorter or longer than the others.
+*/
+static DepthResult run_depth(const std::vector<std::vector<unsigned char> >& traces, int count){
+
+  DepthResult result = {false, 0, 0.0};
+  std::string survey_path = std::string(P_tmpdir) + "/liberad_bench_depth.srv";
+  std::string store_path = std::string(P_tmpdir) + "/liberad_bench_depth.dep";
+
+  LiberadRecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.trace_length = TRACE_LENGTH;
+  LiberadRecorderParams params;
+  params.chunk_size = 64 * 1024;
+  params.chunk_count = 64;
+  params.sync_every = 0;
+  SurveyRecorder recorder;
+  if (recorder.open(survey_path.c_str(), params, header) != LIBERAD_SUCCESS) return result;
+  std::vector<unsigned char> data(TRACE_LENGTH + 40);
+  for (int i = 0; i < count; i++){
+    int length = i % 97 == 5 ? TRACE_LENGTH - 40 : i % 101 == 7 ? TRACE_LENGTH + 40 : TRACE_LENGTH;
+    for (int k = 0; k < length; k++) data[k] = traces[i % traces.size()][k % TRACE_LENGTH];
+    data[0] = (unsigned char)i;
+    data[1] = (unsigned char)(i >> 8);
+    Trace trace;
+    trace.sequence = i;
+    trace.timestamp_ns = i * 1000LL;
+    trace.position = i;
+    trace.data = &data[0];
+    trace.length = length;
+    trace.samples = &data[0];
+    trace.sample_count = length - 2;
+    recorder.record(trace);
+  }
+  if (recorder.close() != LIBERAD_SUCCESS) return result;
+
+  LiberadTransposeParams transpose;
+  transpose.block_traces = 1000;
+  long long start = now_ns();
+  int transposed = liberad_transpose_survey(survey_path.c_str(), store_path.c_str(), &transpose);
+  result.transpose_traces_per_s = count / ((now_ns() - start) / 1e9);
+
+  SurveyFile survey;
+  DepthStore store;
+  if (transposed == LIBERAD_SUCCESS && survey.open(survey_path.c_str()) == LIBERAD_SUCCESS &&
+      store.open(store_path.c_str()) == LIBERAD_SUCCESS && store.trace_count() == survey.trace_count()){
+    size_t n = (size_t)survey.trace_count();
+    int samples = store.sample_count();
+    std::vector<unsigned char> expected((size_t)samples * n, 128);
+    const LiberadTraceRecord* records = store.records();
+    result.valid = samples == TRACE_LENGTH - 2 && n > 0;
+    LiberadSurveyCursor cursor = survey.seek_index(0);
+    Trace trace;
+    for (size_t i = 0; i < n && survey.read(cursor, &trace); i++){
+      if (records[i].sequence != trace.sequence || records[i].position != trace.position ||
+          records[i].length != trace.length) result.valid = false;
+      for (int k = 0; k < std::min(samples, trace.sample_count); k++) expected[(size_t)k * n + i] = trace.samples[k];
+    }
+    for (int k = 0; k < samples; k++){
+      const unsigned char* slice = store.slice(k);
+      if (!slice || memcmp(slice, &expected[(size_t)k * n], n)) result.valid = false;
+    }
+    result.traces = n;
+  }
+
+  store.close();
+  survey.close();
+  remove(survey_path.c_str());
+  remove(store_path.c_str());
+  return result;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void print_text(const std::vector<ScenarioResult>& scenarios, const std::vector<ElogResult>& elog,
+                       const std::vector<DecodeResult>& decode, const std::vector<FramerResult>& framer,
+                       const std::vector<CodecResult>& codec, const std::vector<MigrationResult>& migration,
+                       const DepthResult& store, int depth){
+
+  printf("liberad_bench, IN queue depth %d\n\n", depth);
+  printf("%-10s %12s %12s %10s %10s %10s %10s\n", "scenario", "traces", "traces/s", "p50 ns", "p99 ns", "p999 ns", "max ns");
+  for (size_t i = 0; i < scenarios.size(); i++){
+    const ScenarioResult& s = scenarios[i];
+    printf("%-10s %12llu %12.0f %10lld %10lld %10lld %10lld\n", s.name, s.traces, s.traces / s.seconds,
+           s.latency[0], s.latency[1], s.latency[2], s.latency[3]);
+  }
+  printf("\nlatency: completion to user callback, -1 where not measured\n");
+
+  for (size_t i = 0; i < scenarios.size(); i++){
+    const ScenarioResult& s = scenarios[i];
+    if (!s.has_resubmit) continue;
+    printf("resubmit (%s): p50 %lld ns, p99 %lld ns, p999 %lld ns, max %lld ns\n", s.name,
+           s.resubmit[0], s.resubmit[1], s.resubmit[2], s.resubmit[3]);
+  }
+  for (size_t i = 0; i < scenarios.size(); i++){
+    const LiberadRecorderStats& r = scenarios[i].recorder;
+    if (!scenarios[i].has_recorder) continue;
+    printf("recorder (%s): %llu traces, %.1f MB in %llu chunks (%.2fx packed, %lld us packing), %llu dropped, max chunk write %lld us\n",
+           scenarios[i].name, r.traces, r.bytes / 1e6, r.chunks, r.bytes ? (double)r.unpacked_bytes / r.bytes : 0.0, r.pack_us,
+           r.dropped, r.max_write_us);
+  }
+
+  printf("\n%-10s %16s %16s\n", "log level", "DEBUG_2 msg ns", "ERROR msg ns");
+  for (size_t i = 0; i < elog.size(); i++){
+    printf("%-10s %16.1f %16.1f\n", elog[i].level, elog[i].debug2_ns, elog[i].error_ns);
+  }
+
+  printf("\n%-10s %8s %16s %16s\n", "decoder", "valid", "int16 traces/s", "float traces/s");
+  for (size_t i = 0; i < decode.size(); i++){
+    printf("%-10s %8s %16.0f %16.0f\n", decode[i].isa, decode[i].valid ? "yes" : "NO",
+           decode[i].int16_traces_per_s, decode[i].float_traces_per_s);
+  }
+
+  printf("\n%-10s %8s %10s %12s %10s\n", "framer", "valid", "recovered", "traces/s", "MB/s");
+  for (size_t i = 0; i < framer.size(); i++){
+    printf("%-10s %8s %9.1f%% %12.0f %10.1f\n", framer[i].stream, framer[i].valid ? "yes" : "NO",
+           framer[i].recovered * 100.0, framer[i].traces_per_s, framer[i].mb_per_s);
+  }
+
+  printf("\n%-10s %8s %10s %12s %12s\n", "codec", "valid", "ratio", "pack MB/s", "unpack MB/s");
+  for (size_t i = 0; i < codec.size(); i++){
+    printf("%-10s %8s %9.2fx %12.1f %12.1f\n", codec[i].chunk, codec[i].valid ? "yes" : "NO",
+           codec[i].ratio, codec[i].pack_mb_per_s, codec[i].unpack_mb_per_s);
+  }
+
+  printf("\n%-10s %8s %10s %12s\n", "migration", "valid", "error", "traces/s");
+  for (size_t i = 0; i < migration.size(); i++){
+    printf("%-10s %8s %10.1e %12.0f\n", migration[i].section, migration[i].valid ? "yes" : "NO", migration[i].error,
+           migration[i].traces_per_s);
+  }
+
+  printf("\ndepth store: %s, %llu traces, transposed at %.0f traces/s\n", store.valid ? "valid" : "NOT VALID", store.traces,
+         store.transpose_traces_per_s);
+}
+
+static void print_json(const std::vector<ScenarioResult>& scenarios, const std::vector<ElogResult>& elog,
+                       const std::vector<DecodeResult>& decode, const std::vector<FramerResult>& framer,
+                       const std::vector<CodecResult>& codec, const std::vector<MigrationResult>& migration,
+                       const DepthResult& store, int depth){
+
+  printf("{\n  \"queue_depth\": %d,\n  \"scenarios\": {\n", depth);
+  for (size_t i = 0; i < scenarios.size(); i++){
+    const ScenarioResult& s = scenarios[i];
+    printf("    \"%s\": {\"traces\": %llu, \"seconds\": %.3f, \"traces_per_s\": %.1f, "
+           "\"latency_ns\": {\"p50\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld}",
+           s.name, s.traces, s.seconds, s.traces / s.seconds, s.latency[0], s.latency[1], s.latency[2], s.latency[3]);
+    if (s.has_resubmit){
+      printf(", \"resubmit_ns\": {\"p50\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld}",
+             s.resubmit[0], s.resubmit[1], s.resubmit[2], s.resubmit[3]);
+    }
+    if (s.has_recorder){
+      printf(", \"recorder\": {\"traces\": %llu, \"bytes\": %llu, \"unpacked_bytes\": %llu, \"chunks\": %llu, \"dropped\": %llu, "
+             "\"max_write_us\": %lld, \"pack_us\": %lld}",
+             s.recorder.traces, s.recorder.bytes, s.recorder.unpacked_bytes, s.recorder.chunks, s.recorder.dropped,
+             s.recorder.max_write_us, s.recorder.pack_us);
+    }
+    printf("}%s\n", i + 1 < scenarios.size() ? "," : "");
+  }
+  printf("  },\n  \"elog_ns\": {\n");
+  for (size_t i = 0; i < elog.size(); i++){
+    printf("    \"%s\": {\"debug2_message\": %.1f, \"error_message\": %.1f}%s\n", elog[i].level,
+           elog[i].debug2_ns, elog[i].error_ns, i + 1 < elog.size() ? "," : "");
+  }
+  printf("  },\n  \"decode\": {\n");
+  for (size_t i = 0; i < decode.size(); i++){
+    printf("    \"%s\": {\"valid\": %s, \"int16_traces_per_s\": %.1f, \"float_traces_per_s\": %.1f}%s\n", decode[i].isa,
+           decode[i].valid ? "true" : "false", decode[i].int16_traces_per_s, decode[i].float_traces_per_s,
+           i + 1 < decode.size() ? "," : "");
+  }
+  printf("  },\n  \"framer\": {\n");
+  for (size_t i = 0; i < framer.size(); i++){
+    printf("    \"%s\": {\"valid\": %s, \"recovered\": %.4f, \"traces_per_s\": %.1f, \"mb_per_s\": %.1f}%s\n",
+           framer[i].stream, framer[i].valid ? "true" : "false", framer[i].recovered, framer[i].traces_per_s,
+           framer[i].mb_per_s, i + 1 < framer.size() ? "," : "");
+  }
+  printf("  },\n  \"codec\": {\n");
+  for (size_t i = 0; i < codec.size(); i++){
+    printf("    \"%s\": {\"valid\": %s, \"ratio\": %.3f, \"pack_mb_per_s\": %.1f, \"unpack_mb_per_s\": %.1f}%s\n",
+           codec[i].chunk, codec[i].valid ? "true" : "false", codec[i].ratio, codec[i].pack_mb_per_s,
+           codec[i].unpack_mb_per_s, i + 1 < codec.size() ? "," : "");
+  }
+  printf("  },\n  \"migration\": {\n");
+  for (size_t i = 0; i < migration.size(); i++){
+    printf("    \"%s\": {\"valid\": %s, \"error\": %.3g, \"traces_per_s\": %.1f}%s\n", migration[i].section,
+           migration[i].valid ? "true" : "false", migration[i].error, migration[i].traces_per_s,
+           i + 1 < migration.size() ? "," : "");
+  }
+  printf("  },\n  \"depth\": {\"valid\": %s, \"traces\": %llu, \"transpose_traces_per_s\": %.1f}\n}\n",
+         store.valid ? "true" : "false", store.traces, store.transpose_traces_per_s);
+}
+
+int main(int argc, char** argv){
+
+  double seconds = 2.0;
+  int depth = LIBERAD_IN_QUEUE_DEPTH;
+  bool json = false;
+
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--seconds") && i + 1 < argc) seconds = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--depth") && i + 1 < argc) depth = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--json")) json = true;
+    else {
+      fprintf(stderr, "Usage: %s [--seconds S] [--depth D] [--json]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (liberad_init(LIBERAD_WARN) != LIBERAD_SUCCESS) return 1;
+
+  /* Record traces from the simulator for the loopback transport */
+  std::vector<std::vector<unsigned char> > traces(BENCH_TRACES, std::vector<unsigned char>(TRACE_LENGTH));
+  LiberadSimParams params;
+  params.trace_period_us = 0;
+  Oeradar* sim = liberad_create_simulated_device(&params);
+  for (int i = 0; i < BENCH_TRACES; i++){
+    int actual = 0;
+    sim->transport->read_sync(&traces[i][0], TRACE_LENGTH, &actual, 0);
+  }
+  delete sim;
+
+  std::vector<ScenarioResult> scenarios;
+  scenarios.push_back(run_scenario("loop", LOOP, traces, seconds, depth));
+  scenarios.push_back(run_scenario("pooled", POOLED, traces, seconds, depth));
+  scenarios.push_back(run_scenario("executor", EXECUTOR, traces, seconds, depth));
+  scenarios.push_back(run_scenario("simulated", SIMULATED, traces, seconds, depth));
+  scenarios.push_back(run_scenario("wireless", WIRELESS, traces, seconds, depth));
+  scenarios.push_back(run_scenario("batched", BATCHED, traces, seconds, depth));
+  scenarios.push_back(run_scenario("recording", RECORDING, traces, seconds, depth));
+
+  std::vector<ElogResult> elog = run_elog(200000);
+  std::vector<DecodeResult> decode = run_decode(traces, 2000);
+  std::vector<FramerResult> framer = run_framer(traces, 50);
+  std::vector<CodecResult> codec = run_codec(traces, 200);
+  std::vector<MigrationResult> migration = run_migration();
+  DepthResult store = run_depth(traces, 20500);
+
+  if (json) print_json(scenarios, elog, decode, framer, codec, migration, store, depth);
+  else print_text(scenarios, elog, decode, framer, codec, migration, store, depth);
+
+  liberad_exit();
+  return 0;
+}
@@ -7,17 +7,19 @@
 
 #define IN_BUFFER_SIZE 1024*8
 #define OUT_BUFFER_SIZE 8*8
+#define RING_SLOTS 256
 
 using namespace std;
 
 static uint8_t in_buffer[IN_BUFFER_SIZE];
 static uint8_t out_buffer[OUT_BUFFER_SIZE];
+static uint8_t trace[LIBERAD_RING_SLOT_SIZE];
 
 Oeradar* active_gpr;
 bool running;
 
-void callback_in(unsigned char* buffer, int received, signed char steps);
 void callback_out(unsigned char* buffer, int sent);
+void process_traces();
 void user_input();
 
 int main(){
@@ -36,34 +38,44 @@ int main(){
   liberad_connect_to_device(active_gpr);
   liberad_init_device(active_gpr);
 
+  // Traces are queued by liberad and processed on our own thread so slow processing does not stall USB handling
+  liberad_enable_trace_ring(active_gpr, RING_SLOTS);
+
 /*
 *This function may be broken down in three other functions depending on your use case flow:
 * liberad_set_async_in_params(active_gpr, callback_in, in_buffer, IN_BUFFER_SIZE); + liberad_register_in_handling(active_gpr);
 * liberad_set_async_out_params(active_gpr, callback_out, out_buffer, OUT_BUFFER_SIZE);
 * liberad_start_transmission_async(active_gpr, SHORT, LEVEL1);
 */
-  liberad_start_io_async(active_gpr, SHORT, LEVEL1, callback_in, callback_out, in_buffer, IN_BUFFER_SIZE, out_buffer, OUT_BUFFER_SIZE);
+  liberad_start_io_async(active_gpr, SHORT, LEVEL1, nullptr, callback_out, in_buffer, IN_BUFFER_SIZE, out_buffer, OUT_BUFFER_SIZE);
 
+  running = true;
   thread user_input_thread(user_input);
   thread gpr_connection_thread(liberad_handle_io_async, active_gpr);
+  thread processing_thread(process_traces);
 
-  running = true;
   user_input_thread.join();
   gpr_connection_thread.join();
+  processing_thread.join();
 
   return 0;
 
 }
 
-/* This is typedefed as LiberadCallbackIn - must return void and take two params.
-* This is called when new data is available from GPR
-* @param unsigned char* buffer - pointer to user allocated buffer
-* @param int received - num of bytes received
-* @param signed char steps - registered steps from distance measuring encoder attached to Oerad hardware
+/* Reads traces queued by liberad. Runs at its own pace - if it falls behind, traces are
+* dropped from the ring and counted as overflows instead of stalling the USB event thread.
 */
-void callback_in(unsigned char* buffer, int received, signed char steps){
-  cout << "received: " << received << " bytes" << endl; // this may block your console for input. Best is to feed this to file, some drawing funct or some other stream.
-  printf("steps: %hhd '\n'", steps);
+void process_traces(){
+  while (running){
+    signed char steps;
+    int received = liberad_read_trace(active_gpr, trace, sizeof(trace), &steps, 100);
+    if (received <= 0) continue;
+    cout << "received: " << received << " bytes" << endl; // this may block your console for input. Best is to feed this to file, some drawing funct or some other stream.
+    printf("steps: %hhd '\n'", steps);
+  }
+  LiberadRingStats stats;
+  liberad_get_ring_stats(active_gpr, &stats);
+  cout << "read " << stats.read << " traces, dropped " << stats.overflows << endl;
 }
 
 /* This is typedefed as LiberadCallbackOut - must return void and take two params
@@ -0,0 +1,106 @@
+#ifndef ERADBINNING_H
+#define ERADBINNING_H
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+#include "EradStage.h"
+
+/* How a spatial bin holding several traces is turned into one */
+enum LiberadBinMode {
+  /* Rounded mean of the samples of all traces in the bin */
+  LIBERAD_BIN_STACK,
+  /* The trace captured closest to the centre of the bin */
+  LIBERAD_BIN_NEAREST
+};
+
+/* Settings of encoder driven binning */
+struct LiberadBinningParams {
+  /* Encoder steps per metre of travel, from calibrating the wheel */
+  double steps_per_meter = 100.0;
+  /* Distance between the centres of neighbouring bins */
+  double spacing_m = 0.05;
+  LiberadBinMode mode = LIBERAD_BIN_STACK;
+  /* 1 if the survey runs towards growing encoder positions, -1 if towards falling ones */
+  int direction = 1;
+  /* Most empty bins filled in between two traces, by interpolating between them. Longer gaps, e.g. after an
+  * encoder glitch, are left out.
+  */
+  int max_gap_bins = 16;
+};
+
+/* Counters describing encoder driven binning */
+struct LiberadBinningStats {
+  /* Traces taken in and traces passed on, one per bin */
+  unsigned long long traces = 0;
+  unsigned long long bins = 0;
+  /* Bins passed on without a trace of their own, interpolated from their neighbours */
+  unsigned long long interpolated = 0;
+  /* Bins of gaps longer than max_gap_bins, left out */
+  unsigned long long skipped = 0;
+  /* Traces dropped because they were captured behind the bin being filled, while moving backwards */
+  unsigned long long reversed = 0;
+  /* Traces dropped because their gain, time window or length differed from those of the first trace of their bin */
+  unsigned long long mismatched = 0;
+};
+
+/* Turns traces captured at irregular distances into one trace per spatial bin. The encoder position of each
+* trace, steps accumulated including backward movement, gives its bin. Traces of a bin are stacked or the one
+* closest to its centre is chosen, and the bin is passed on once a trace reaches a later bin, with the position
+* of its centre. Bins are passed on in survey order, each exactly once: traces captured while backing up over bins
+* already passed on are dropped, and bins skipped when the antenna moved faster than one bin per trace are
+* interpolated. Standing still or walking slowly yields one trace per bin however many were captured.
+* A bin only takes traces of the gain, time window and length of its first one, so stacks don't mix them.
+* The bin the antenna is in is passed on once it leaves it.
+*/
+class BinningStage : public TraceStage {
+
+public:
+
+  BinningStage(const LiberadBinningParams& params);
+
+  void accept(const Trace& trace);
+
+  void get_stats(LiberadBinningStats* stats) const;
+
+private:
+
+  void open(long long bin, const Trace& trace, double offset);
+  void add(const Trace& trace, double offset);
+  void close();
+  void fill_gap(long long bin, const Trace& trace, double x);
+  void emit(long long bin, const Trace& like);
+
+  LiberadBinningParams params;
+  /* Bins per encoder step, negative for surveys towards falling positions */
+  double bins_per_step;
+
+  /* Bin being filled */
+  bool filling = false;
+  long long bin = 0;
+  int length = 0;
+  std::vector<uint32_t> sums;
+  uint32_t count = 0;
+  std::vector<unsigned char> nearest;
+  double nearest_offset = 0.0;
+  Trace first_trace;
+  Trace nearest_trace;
+  Trace last_trace;
+
+  /* Last bin passed on, as interpolation starts from it */
+  bool emitted = false;
+  long long emitted_bin = 0;
+  long long emitted_position = 0;
+  std::vector<unsigned char> previous;
+  std::vector<unsigned char> out;
+  unsigned long long sequence = 0;
+
+  std::atomic<unsigned long long> traces{0};
+  std::atomic<unsigned long long> bins{0};
+  std::atomic<unsigned long long> interpolated{0};
+  std::atomic<unsigned long long> skipped{0};
+  std::atomic<unsigned long long> reversed{0};
+  std::atomic<unsigned long long> mismatched{0};
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef ERADCODEC_H
+#define ERADCODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Lossless trace codec. Each sample is predicted from the sample before it, from the same sample of the previous
+* trace, or from both (the previous trace plus the change since the sample before), whichever leaves the smallest
+* residuals for the trace. Residuals are Rice coded in blocks of LIBERAD_PACK_BLOCK samples, each block with its own
+* parameter, so the code adapts to quiet and busy parts of the trace. A packed trace is byte aligned and decodes on
+* its own given the previous trace, so packed traces can be stored or sent one by one.
+*/
+#define LIBERAD_PACK_BLOCK 16
+
+/* Most bytes a trace of length bytes packs into */
+#define LIBERAD_PACK_BOUND(length) (4 * (length) + 8)
+
+/* Packs a trace.
+* @param const unsigned char* data - trace bytes
+* @param int length - bytes of the trace
+* @param const unsigned char* previous - previous trace of the stream, nullptr for the first one. Only used if it
+* has the same length.
+* @param int previous_length - bytes of the previous trace
+* @param unsigned char* out - receives the packed trace
+* @param int capacity - bytes available at out. LIBERAD_PACK_BOUND(length) is always enough.
+* @return bytes written, 0 if they don't fit
+*/
+int liberad_pack_trace(const unsigned char* data, int length, const unsigned char* previous, int previous_length,
+                       unsigned char* out, int capacity);
+
+/* Unpacks a trace packed by liberad_pack_trace with the same previous trace.
+* @param const unsigned char* in - packed trace
+* @param int available - bytes readable at in
+* @param const unsigned char* previous - previous trace of the stream as passed to liberad_pack_trace
+* @param int previous_length - bytes of the previous trace
+* @param unsigned char* data - receives the trace
+* @param int length - bytes of the trace
+* @return bytes of in consumed, 0 if the packed trace is damaged or cut off
+*/
+int liberad_unpack_trace(const unsigned char* in, int available, const unsigned char* previous, int previous_length,
+                         unsigned char* data, int length);
+
+/* Packs the records of a trace chunk (LIBERAD_CHUNK_TRACES) into the payload of a LIBERAD_CHUNK_PACKED chunk: the
+* LiberadTraceRecord of every trace, followed by the traces packed one after another, each predicted from the one
+* before it in the chunk.
+* @param const unsigned char* chunk - trace chunk starting with its LiberadChunkHeader
+* @param unsigned char* payload - receives the packed payload
+* @param size_t capacity - bytes available at payload
+* @return bytes of the packed payload, 0 if they don't fit
+*/
+size_t liberad_pack_chunk(const unsigned char* chunk, unsigned char* payload, size_t capacity);
+
+/* Restores the trace chunk a packed chunk was made from, header included
+* @param const unsigned char* chunk - packed chunk starting with its LiberadChunkHeader
+* @param unsigned char* image - receives the trace chunk, sizeof(LiberadChunkHeader) + unpacked_bytes of the header
+* @return false if the packed chunk is damaged
+*/
+bool liberad_unpack_chunk(const unsigned char* chunk, unsigned char* image);
+
+#endif
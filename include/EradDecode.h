@@ -0,0 +1,80 @@
+#ifndef ERADDECODE_H
+#define ERADDECODE_H
+
+#include "EradTrace.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Instruction sets the decoder can run on. LIBERAD_DECODE_AUTO picks the best one the CPU supports. */
+enum LiberadDecodeIsa {LIBERAD_DECODE_AUTO, LIBERAD_DECODE_SCALAR, LIBERAD_DECODE_SSE2, LIBERAD_DECODE_AVX2, LIBERAD_DECODE_NEON};
+
+enum LiberadSampleFormat {LIBERAD_SAMPLES_INT16, LIBERAD_SAMPLES_FLOAT};
+
+/* Decoded traces, one per row. Rows start on 64 byte boundaries and hold stride elements, of which the
+* first columns are samples; traces shorter than columns are padded with zeros, longer ones truncated.
+*/
+class LiberadSampleMatrix {
+
+public:
+
+  LiberadSampleMatrix(int capacity, int columns, LiberadSampleFormat format = LIBERAD_SAMPLES_FLOAT)
+    : format(format), capacity(capacity), columns(columns){
+    int element = format == LIBERAD_SAMPLES_FLOAT ? sizeof(float) : sizeof(short);
+    int per_line = 64 / element;
+    stride = (columns + per_line - 1) / per_line * per_line;
+    storage.resize((size_t)capacity * stride * element + 63);
+    base = &storage[0] + ((64 - ((uintptr_t)&storage[0] & 63)) & 63);
+  }
+
+  short* row_int16(int row){ return (short*)base + (size_t)row * stride; }
+  float* row_float(int row){ return (float*)base + (size_t)row * stride; }
+
+  const LiberadSampleFormat format;
+  const int capacity;
+  const int columns;
+  int stride;
+  /* Rows filled by the last decode */
+  int rows = 0;
+
+private:
+
+  std::vector<unsigned char> storage;
+  unsigned char* base;
+};
+
+/* Factor bringing samples recorded at gain to the amplitude scale of LEVEL5, assuming the levels are 6 dB apart.
+* 1 for unknown values.
+*/
+float liberad_gain_scale(Gain gain);
+
+/* Decodes count quantized samples to signed values, sample - 128, shifted left by shift bits */
+void liberad_decode_int16(const unsigned char* samples, int count, int shift, short* out);
+
+/* Decodes count quantized samples to (sample - 128) * scale */
+void liberad_decode_float(const unsigned char* samples, int count, float scale, float* out);
+
+/* @return index of the first of count bytes equal to value, count if there is none */
+int liberad_find_byte(const unsigned char* data, int count, unsigned char value);
+
+/* Quantizes count values to samples, rounded to nearest plus 128 and clipped to 0 and 255 */
+void liberad_encode_float(const float* values, int count, unsigned char* samples);
+
+/* Adds count quantized samples to 16 bit sums and lowers low and raises high to them, index by index */
+void liberad_stack_samples(const unsigned char* samples, int count, uint16_t* sums, unsigned char* low, unsigned char* high);
+
+/* Decodes the samples of count traces into rows 0 to count - 1 of matrix. The trailer is not part of
+* Trace::samples, so it is never decoded. With scale_by_gain each row is scaled by liberad_gain_scale of its
+* trace's gain; in LIBERAD_SAMPLES_INT16 format this is a left shift and loses nothing.
+*/
+int liberad_decode_traces(const Trace* traces, int count, LiberadSampleMatrix* matrix, bool scale_by_gain = false);
+
+/* Selects the decoder's instruction set. Meant for validating and benchmarking the SIMD paths.
+* @return the instruction set now in use, LIBERAD_ERR if isa is not supported by this CPU or build
+*/
+int liberad_set_decode_isa(LiberadDecodeIsa isa);
+
+/* @return instruction set the decoder runs on */
+LiberadDecodeIsa liberad_get_decode_isa();
+
+#endif
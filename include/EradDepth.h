@@ -0,0 +1,96 @@
+#ifndef ERADDEPTH_H
+#define ERADDEPTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "EradRecord.h"
+
+/* Depth-major survey store, version 1. All fields are little-endian.
+*
+*   LiberadDepthHeader, zero-padded to LIBERAD_RECORD_ALIGN
+*   trace_count LiberadTraceRecord, one per trace in survey order, zero-padded to a multiple of LIBERAD_RECORD_ALIGN
+*   sample_count rows of row_stride bytes: row k holds quantized sample k of every trace, in survey order
+*
+* A survey file holds the samples of a trace together, so a constant depth slice touches every trace of it. Here
+* it is one contiguous row. Traces keep their records, with length as recorded; their samples are cut or padded
+* with 128 to sample_count, that of the first trace.
+*/
+#define LIBERAD_DEPTH_MAGIC "OERADDEP"
+#define LIBERAD_DEPTH_VERSION 1
+#define LIBERAD_DEPTH_ROW_ALIGN 64
+
+/* Set in LiberadDepthHeader::flags once every trace was written */
+#define LIBERAD_DEPTH_COMPLETE 1
+
+struct LiberadDepthHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t trace_count;
+  uint32_t sample_count;
+  uint32_t reserved;
+  /* File offsets of the trace records and of the first row, and bytes from one row to the next */
+  uint64_t records_offset;
+  uint64_t rows_offset;
+  uint64_t row_stride;
+  /* Header of the survey file the store was made from */
+  LiberadRecordHeader survey;
+};
+
+static_assert(sizeof(LiberadDepthHeader) <= LIBERAD_RECORD_ALIGN, "depth store header must fit its block");
+
+/* Settings of liberad_transpose_survey */
+struct LiberadTransposeParams {
+  /* Traces transposed at a time. Memory used is about twice block_traces times the samples of a trace. */
+  int block_traces = 4096;
+};
+
+/* Converts a survey file into a depth-major store. Traces are read block_traces at a time, transposed in cache sized
+* tiles, and each row of the block is written to its place in the rows of the store, so memory stays bounded
+* however long the survey.
+* @param const char* survey_path - survey file written by SurveyRecorder
+* @param const char* store_path - depth store to create or overwrite
+* @param const LiberadTransposeParams* params - block size, nullptr for defaults
+* @return LIBERAD_ERR if the survey can't be read, holds no traces or the store can't be written
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_transpose_survey(const char* survey_path, const char* store_path, const LiberadTransposeParams* params = nullptr);
+
+/* Read access to a depth store written by liberad_transpose_survey. The file is mapped into memory, so slices are
+* read in place and only the rows used are read from the disk. Reading is safe from several threads.
+*/
+class DepthStore {
+
+public:
+
+  DepthStore(){}
+  ~DepthStore();
+
+  /* Maps the store at path and checks its header */
+  int open(const char* path);
+  void close();
+
+  const LiberadDepthHeader& header() const { return file_header; }
+  unsigned long long trace_count() const { return file_header.trace_count; }
+  int sample_count() const { return (int)file_header.sample_count; }
+
+  /* Records of all traces, trace_count of them */
+  const LiberadTraceRecord* records() const;
+
+  /* Sample sample of every trace, trace_count bytes, nullptr if sample is out of range */
+  const unsigned char* slice(int sample) const;
+
+  /* Fills out with the mean absolute amplitude of each trace over samples first_sample to end_sample, reading those
+  * rows one after another
+  * @return LIBERAD_ERR if the samples are out of range
+  */
+  int amplitude_map(int first_sample, int end_sample, float* out) const;
+
+private:
+
+  unsigned char* map = nullptr;
+  size_t map_size = 0;
+  LiberadDepthHeader file_header = LiberadDepthHeader();
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef ERADFRAMER_H
+#define ERADFRAMER_H
+
+#include <atomic>
+#include <vector>
+
+/* Counters describing the work of a TraceFramer */
+struct LiberadFramerStats {
+  /* Complete traces found, and how many of them had to be joined from more than one fragment */
+  unsigned long long frames = 0;
+  unsigned long long assembled = 0;
+  /* Times a trace didn't end with the delimiter and the framer had to search for the next one */
+  unsigned long long resyncs = 0;
+  /* Bytes thrown away while out of sync */
+  unsigned long long discarded = 0;
+};
+
+/* Function called by TraceFramer::push for every complete trace. frame points into the pushed data or, for a trace
+* joined from several fragments, into the framer, where it stays until the next push.
+*/
+typedef void (*LiberadFrameSink)(void* context, const unsigned char* frame, int length);
+
+/* Splits a byte stream into traces of frame_length bytes, each ending with the delimiter. Fragments can
+* be of any size: a transfer may hold part of a trace, one trace or several. Traces lying within a fragment
+* are passed on where they are; only a trace spread over fragments is copied, into a buffer of the framer.
+* While in sync a trace costs a single comparison. If a trace doesn't end with the delimiter the framer
+* searches the stream for the next trace boundary, preferring a delimiter confirmed by another one a trace
+* further on, and carries on from there.
+* Owned by the thread handling events; only get_stats() may be called from other threads.
+*/
+class TraceFramer {
+
+public:
+
+  TraceFramer(int frame_length, unsigned char delimiter);
+
+  int frame_length() const { return length; }
+
+  /* Frames data, calling sink for each trace completed by it. Bytes of an incomplete trace at the end are kept for the next call. */
+  void push(const unsigned char* data, int count, LiberadFrameSink sink, void* context);
+
+  /* Drops a partial trace, e.g. after the device was restarted. The next byte is taken as the start of a trace. */
+  void reset();
+
+  void get_stats(LiberadFramerStats* stats) const;
+
+private:
+
+  void lose_sync();
+  void resync_carry(const unsigned char* data, int count);
+  int find_boundary(const unsigned char* data, int count) const;
+
+  int length;
+  unsigned char delimiter;
+  bool synced = true;
+
+  /* Beginning of a trace continued in the next fragment, and the last trace joined from fragments */
+  std::vector<unsigned char> carry;
+  std::vector<unsigned char> joined;
+  int carried = 0;
+
+  std::atomic<unsigned long long> frames{0};
+  std::atomic<unsigned long long> assembled{0};
+  std::atomic<unsigned long long> resyncs{0};
+  std::atomic<unsigned long long> discarded{0};
+};
+
+#endif
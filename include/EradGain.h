@@ -0,0 +1,71 @@
+#ifndef ERADGAIN_H
+#define ERADGAIN_H
+
+#include <atomic>
+#include <map>
+#include <utility>
+#include <vector>
+#include "EradStage.h"
+#include "EradSpectral.h"
+
+/* Settings of time varying gain. The hardware Gain levels set the transmit level of the whole trace; this gain
+* grows with the two way travel time of each sample, to make up for spreading and attenuation, and evens out
+* amplitudes with automatic gain control.
+*/
+struct LiberadGainParams {
+  /* Model the traces come from, whose time window spans give the time of each sample */
+  LiberadModel model = LIBERAD_DIPOLO;
+  /* Spreading and exponential compensation (SEC): sample at t ns is multiplied by
+  * (1 + linear_per_ns * t) * 10^(exponential_db_per_ns * t / 20). 0 and 0 for none.
+  */
+  float linear_per_ns = 0;
+  float exponential_db_per_ns = 0;
+  /* Samples of the AGC window. Each sample is scaled so the mean amplitude of the window centred on it becomes
+  * agc_target. 0 for no AGC.
+  */
+  int agc_window = 0;
+  float agc_target = 32.0f;
+  /* Largest factor SEC applies to a sample, and largest factor AGC applies */
+  float max_gain = 100.0f;
+};
+
+/* Counters describing time varying gain */
+struct LiberadGainStats {
+  unsigned long long traces = 0;
+  /* SEC tables computed, one per time window and trace length seen */
+  int tables = 0;
+};
+
+/* Applies SEC and AGC to each trace as it arrives and passes it on. The SEC factor of every sample is computed
+* once per time window and trace length and reused; AGC runs over the decoded samples with running sums, so its
+* cost doesn't depend on the window.
+*/
+class GainStage : public TraceStage {
+
+public:
+
+  GainStage(const LiberadGainParams& params);
+
+  void accept(const Trace& trace);
+
+  void get_stats(LiberadGainStats* stats) const;
+
+private:
+
+  const std::vector<float>& sec_table(TimeWindow window, int sample_count);
+  void agc(int sample_count);
+
+  LiberadGainParams params;
+
+  /* SEC factor per sample, by time window and trace length */
+  std::map<std::pair<int, int>, std::vector<float>> tables;
+
+  std::vector<float> work;
+  std::vector<float> prefix;
+  std::vector<unsigned char> out;
+
+  std::atomic<unsigned long long> traces{0};
+  std::atomic<int> table_count{0};
+};
+
+#endif
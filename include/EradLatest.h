@@ -0,0 +1,122 @@
+#ifndef ERADLATEST_H
+#define ERADLATEST_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <string.h>
+#include "EradTrace.h"
+
+/* Sequence to pass to LatestTrace::wait_newer before any trace was seen, matching the first trace received */
+#define LIBERAD_NO_SEQUENCE (~0ULL)
+
+/* Holds the newest trace of a device for readers that only care about the current one, e.g. stepped surveys.
+* The writer is the thread delivering traces and never waits for readers: it publishes each trace under a
+* sequence lock, and readers copy it out and retry if a newer trace was written meanwhile. Readers only take
+* a lock when they block waiting for a newer trace. Any number of threads may read.
+*/
+class LatestTrace {
+
+public:
+
+  LatestTrace(int slot_size) : slot_size(slot_size), storage(slot_size){}
+
+  /* Writer side. Replaces the held trace with a copy of trace, truncated to slot_size. */
+  void store(const Trace& trace){
+    int length = trace.length < slot_size ? trace.length : slot_size;
+    unsigned v = version.load(std::memory_order_relaxed);
+    version.store(v + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&storage[0], trace.data, length);
+    record = trace;
+    record.length = length;
+    record.sample_count = trace.sample_count < length ? trace.sample_count : length;
+    record.lent = nullptr;
+    version.store(v + 2, std::memory_order_release);
+    newest.store(trace.sequence, std::memory_order_seq_cst);
+
+    if (waiting.load(std::memory_order_seq_cst) > 0){
+      std::lock_guard<std::mutex> lock(wait_mutex);
+      ready.notify_all();
+    }
+  }
+
+  /* Reader side. Copies the held trace into buffer, truncating it to buffer_size, and fills trace with its
+  * record. The data and samples pointers of trace point into buffer.
+  * @return number of bytes copied, 0 if no trace was stored yet
+  */
+  int load(Trace* trace, unsigned char* buffer, int buffer_size) const {
+    if (newest.load(std::memory_order_acquire) == LIBERAD_NO_SEQUENCE) return 0;
+    unsigned v;
+    Trace copy;
+    int length = 0;
+    do {
+      v = version.load(std::memory_order_acquire);
+      if (v & 1) continue;
+      copy = record;
+      length = copy.length < buffer_size ? copy.length : buffer_size;
+      memcpy(buffer, &storage[0], length);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((v & 1) || version.load(std::memory_order_relaxed) != v);
+
+    *trace = copy;
+    trace->data = buffer;
+    trace->length = length;
+    trace->samples = buffer;
+    trace->sample_count = copy.sample_count < length ? copy.sample_count : length;
+    return length;
+  }
+
+  /* Reader side. Like load() but only returns a trace with a sequence number above sequence, waiting up to
+  * timeout_ms for it if the held one is not newer. A negative timeout waits indefinitely.
+  * @param unsigned long long sequence - newest sequence already seen, LIBERAD_NO_SEQUENCE to take any trace
+  * @return number of bytes copied, 0 on timeout
+  */
+  int wait_newer(unsigned long long sequence, Trace* trace, unsigned char* buffer, int buffer_size, int timeout_ms){
+    if (is_newer(sequence)) return load(trace, buffer, buffer_size);
+    if (timeout_ms == 0) return 0;
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    waiting.fetch_add(1, std::memory_order_seq_cst);
+    bool found = true;
+    while (!is_newer(sequence)){
+      if (timeout_ms < 0){
+        ready.wait(lock);
+      } else if (ready.wait_until(lock, deadline) == std::cv_status::timeout){
+        found = is_newer(sequence);
+        break;
+      }
+    }
+    waiting.fetch_sub(1, std::memory_order_relaxed);
+    lock.unlock();
+    return found ? load(trace, buffer, buffer_size) : 0;
+  }
+
+  /* Sequence number of the held trace, LIBERAD_NO_SEQUENCE if there is none */
+  unsigned long long sequence() const {
+    return newest.load(std::memory_order_acquire);
+  }
+
+private:
+
+  bool is_newer(unsigned long long sequence) const {
+    unsigned long long held = newest.load(std::memory_order_seq_cst);
+    return held != LIBERAD_NO_SEQUENCE && (sequence == LIBERAD_NO_SEQUENCE || held > sequence);
+  }
+
+  int slot_size;
+  std::vector<unsigned char> storage;
+  Trace record;
+  std::atomic<unsigned> version{0};
+  std::atomic<unsigned long long> newest{LIBERAD_NO_SEQUENCE};
+
+  char pad_waiting[64];
+  std::atomic<int> waiting{0};
+  std::mutex wait_mutex;
+  std::condition_variable ready;
+};
+
+#endif
@@ -2,9 +2,23 @@
 #define ERADLOG_H
 
 #include <iostream>
+#include <string>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
 
 enum LogLevel{LIBERAD_DEBUG_2, LIBERAD_DEBUG, LIBERAD_INFO, LIBERAD_WARN, LIBERAD_ERROR, LIBERAD_NONE};
 
+/* Messages below this level are removed at compile time when logged with ELOG. 0 keeps all of them,
+* 1 removes LIBERAD_DEBUG_2 and so on. Set it with -DLIBERAD_MIN_LOG_LEVEL=n.
+*/
+#ifndef LIBERAD_MIN_LOG_LEVEL
+#define LIBERAD_MIN_LOG_LEVEL 0
+#endif
+
+/* Maximum length of a single log message. Longer messages are truncated. */
+#define LIBERAD_LOG_RECORD_SIZE 240
+
 using namespace std;
 
 struct structlog {
@@ -14,6 +28,19 @@ struct structlog {
 
 extern structlog LOGCFG;
 
+/* Writes a finished message to the log sink, or queues it for the log writer thread in asynchronous mode */
+void liberad_log_emit(LogLevel level, const char* text, int length);
+
+/* Logs a message if lvl passes both the compile-time and the runtime level. Otherwise nothing after it
+* is evaluated, and below LIBERAD_MIN_LOG_LEVEL the statement compiles to nothing. ElogVoidify lets the
+* whole << chain be one operand of the conditional; & binds looser than <<.
+*/
+#define ELOG(lvl) \
+  ((int)(lvl) < LIBERAD_MIN_LOG_LEVEL || (lvl) < LOGCFG.level) ? (void)0 : ElogVoidify() & Elog(lvl)
+
+/* Builds a log message in a fixed buffer and emits it when destroyed. Nothing is allocated for
+* strings and numbers. Prefer the ELOG macro, which skips building messages that would be dropped.
+*/
 class Elog {
 
 public:
@@ -21,42 +48,102 @@ public:
   Elog(){}
   Elog(LogLevel lvl){
     msglvl = lvl;
-    if (LOGCFG.headers){
-      operator << ("["+getLabel(lvl)+"]");
+    enabled = lvl >= LOGCFG.level;
+    if (enabled && LOGCFG.headers){
+      append("[", 1);
+      append(getLabel(lvl));
+      append("]", 1);
     }
   }
   ~Elog(){
     if (opened){
-      cout << endl;
+      liberad_log_emit(msglvl, text, length);
     }
     opened = false;
   }
+
+  Elog &operator<<(const char* msg){ if (enabled) append(msg); return *this; }
+  Elog &operator<<(const std::string& msg){ if (enabled) append(msg.c_str(), (int)msg.size()); return *this; }
+  Elog &operator<<(char msg){ if (enabled) append(&msg, 1); return *this; }
+  Elog &operator<<(unsigned char msg){ if (enabled) append((const char*)&msg, 1); return *this; }
+  Elog &operator<<(bool msg){ return format("%d", (int)msg); }
+  Elog &operator<<(int msg){ return format("%d", msg); }
+  Elog &operator<<(unsigned int msg){ return format("%u", msg); }
+  Elog &operator<<(long msg){ return format("%ld", msg); }
+  Elog &operator<<(unsigned long msg){ return format("%lu", msg); }
+  Elog &operator<<(long long msg){ return format("%lld", msg); }
+  Elog &operator<<(unsigned long long msg){ return format("%llu", msg); }
+  Elog &operator<<(float msg){ return format("%g", (double)msg); }
+  Elog &operator<<(double msg){ return format("%g", msg); }
+
   template<class T>
   Elog &operator<<(const T &msg){
-    if (msglvl >= LOGCFG.level){
-      cout << msg;
-      opened = true;
+    if (enabled){
+      std::ostringstream stream;
+      stream << msg;
+      std::string formatted = stream.str();
+      append(formatted.c_str(), (int)formatted.size());
     }
     return *this;
   }
 
 private:
 
+  bool enabled = false;
   bool opened = false;
   LogLevel msglvl = LIBERAD_DEBUG;
-  inline string getLabel(LogLevel lvl){
-    string label;
+  int length = 0;
+  char text[LIBERAD_LOG_RECORD_SIZE];
+
+  void append(const char* msg){
+    append(msg, (int)strlen(msg));
+  }
+
+  void append(const char* msg, int count){
+    opened = true;
+    if (count > LIBERAD_LOG_RECORD_SIZE - length) count = LIBERAD_LOG_RECORD_SIZE - length;
+    memcpy(text + length, msg, count);
+    length += count;
+  }
+
+  template<class T>
+  Elog &format(const char* spec, T value){
+    if (enabled){
+      char number[32];
+      int count = snprintf(number, sizeof(number), spec, value);
+      if (count > 0) append(number, count < (int)sizeof(number) ? count : (int)sizeof(number) - 1);
+    }
+    return *this;
+  }
+
+  inline const char* getLabel(LogLevel lvl){
     switch (lvl) {
-      case LIBERAD_NONE : label = " "; break;
-      case LIBERAD_ERROR : label = "ERROR "; break;
-      case LIBERAD_DEBUG : label = "DEBUG "; break;
-      case LIBERAD_INFO : label = "INFO "; break;
-      case LIBERAD_WARN : label = "WARN "; break;
-      case LIBERAD_DEBUG_2 : label = "DEBUG2"; break;
+      case LIBERAD_NONE : return " ";
+      case LIBERAD_ERROR : return "ERROR ";
+      case LIBERAD_DEBUG : return "DEBUG ";
+      case LIBERAD_INFO : return "INFO ";
+      case LIBERAD_WARN : return "WARN ";
+      case LIBERAD_DEBUG_2 : return "DEBUG2";
     }
-    return label;
+    return "";
   }
 };
 
+class ElogVoidify {
+public:
+  void operator&(const Elog&){}
+};
+
+/* Writes log messages to fd instead of cout. -1 restores cout. */
+void liberad_set_log_sink(int fd);
+
+/* In asynchronous mode log messages are queued in a lock-free ring of queue_size records and written
+* to the sink by a background thread. Logging never blocks; messages arriving while the ring is full
+* are dropped and counted.
+*/
+int liberad_set_log_async(bool enabled, int queue_size = 4096);
+
+/* Number of log messages dropped because the asynchronous log ring was full */
+unsigned long long liberad_get_log_dropped();
 
 #endif
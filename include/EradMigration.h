@@ -0,0 +1,108 @@
+#ifndef ERADMIGRATION_H
+#define ERADMIGRATION_H
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+#include "EradStage.h"
+#include "EradSpectral.h"
+
+/* Settings of Kirchhoff migration */
+struct LiberadMigrationParams {
+  /* Model the traces come from, whose time window spans give the sample interval */
+  LiberadModel model = LIBERAD_DIPOLO;
+  /* Propagation velocity in the ground, 0.1 m/ns for dry soil, 0.3 in air */
+  float velocity_m_per_ns = 0.1f;
+  /* Distance between neighbouring traces, the bin spacing of binned traces */
+  float spacing_m = 0.05f;
+  /* Traces on each side of a trace summed into it. A diffraction wider than the aperture is only partly collapsed. */
+  int aperture = 32;
+  /* Migrated traces kept for reading, at least 2 * aperture + 1 */
+  int window_traces = 512;
+};
+
+/* Progress of a migration */
+struct LiberadMigrationInfo {
+  /* Traces pushed */
+  unsigned long long traces = 0;
+  /* Leading traces whose migration is complete, as every trace of their aperture was pushed */
+  unsigned long long complete = 0;
+  /* Oldest trace still held */
+  unsigned long long first = 0;
+  int sample_count = 0;
+};
+
+/* Kirchhoff time migration of a growing section of equidistant traces at a constant velocity. Each migrated
+* sample is the mean, over the traces of the aperture, of the input sampled along the diffraction hyperbola through
+* it, weighted by the obliquity factor. Travel times depend only on the distance between two traces, so they are
+* computed once per trace offset. A pushed trace only adds its own contributions: to itself and the aperture
+* traces before it, and from them to itself, so each pair of traces is summed once however long the survey. A
+* migrated trace is complete once aperture traces after it were pushed.
+* The section is split into tiles of samples run in parallel on the library's processing threads, each tile
+* keeping the samples it sums in cache. Traces are pushed from one thread and may be read from others.
+*/
+class MigrationWindow {
+
+public:
+
+  MigrationWindow(const LiberadMigrationParams& params);
+
+  /* Adds the next trace of the section. Samples are decoded at the LEVEL5 amplitude scale. A change of time window
+  * or trace length starts a new section.
+  */
+  void push(const Trace& trace);
+
+  /* Adds the next trace of the section from decoded samples */
+  void push(const float* samples, int sample_count, TimeWindow window);
+
+  /* Copies migrated trace index, complete or not yet
+  * @return samples copied, 0 if the trace is no longer or not yet held
+  */
+  int read(unsigned long long index, float* out, int capacity);
+
+  void get_info(LiberadMigrationInfo* info);
+
+private:
+
+  void restart(int sample_count, TimeWindow window);
+  void migrate_tile(int first_sample, int end_sample);
+
+  LiberadMigrationParams params;
+  std::mutex mutex;
+
+  int sample_count = 0;
+  TimeWindow window = SHORT;
+  /* Rows of a ring of window_traces inputs and outputs, each padded by one sample for interpolation */
+  int stride = 0;
+  std::vector<float> inputs;
+  std::vector<float> outputs;
+  std::vector<uint16_t> contributors;
+
+  /* Per trace offset 0 to aperture and output sample: input sample read and the weights of it and the next one */
+  std::vector<int32_t> travel;
+  std::vector<float> weight_at;
+  std::vector<float> weight_after;
+
+  /* Traces pushed since the section started, and the index of its first trace overall */
+  unsigned long long pushed = 0;
+  unsigned long long base = 0;
+  std::vector<float> decoded;
+};
+
+/* Passes traces on unchanged and migrates them in a MigrationWindow read by liberad_read_migrated */
+class MigrationStage : public TraceStage {
+
+public:
+
+  MigrationStage(const LiberadMigrationParams& params) : window(params){}
+
+  void accept(const Trace& trace){
+    window.push(trace);
+    next->accept(trace);
+  }
+
+  MigrationWindow window;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef ERADPOOL_H
+#define ERADPOOL_H
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+#include "EradQueue.h"
+#include "EradTrace.h"
+
+class TracePool;
+
+/* Handle to a pool-owned trace buffer lent to the user. The handle is valid until the last
+* reference is released with liberad_trace_release(). It may be passed between threads.
+*/
+struct LiberadTraceBuffer {
+  unsigned char* buffer = nullptr;
+  int length = 0;
+  signed char steps = 0;
+
+  /* Capture state of the trace in buffer */
+  Trace trace;
+
+  std::atomic<int> refs{0};
+  TracePool* pool = nullptr;
+};
+
+/* Fixed set of equally sized, cache-line aligned trace buffers. Buffers are handed out by the
+* thread handling USB events and may be returned from any thread. Nothing is allocated after
+* construction.
+*/
+class TracePool {
+
+public:
+
+  TracePool(int count, int size) : count(count), size(size), free_list(count){
+    storage.resize((size_t)count * size + 63);
+    base = &storage[0] + ((64 - ((uintptr_t)&storage[0] & 63)) & 63);
+    handles.reset(new LiberadTraceBuffer[count]);
+    for (int i = 0; i < count; i++){
+      handles[i].buffer = base + (size_t)i * size;
+      handles[i].pool = this;
+      free_list.push(i);
+    }
+  }
+
+  int buffer_size() const { return size; }
+  int buffer_count() const { return count; }
+
+  /* Takes a free buffer out of the pool with one reference held by the caller.
+  * @return nullptr if every buffer is lent out
+  */
+  LiberadTraceBuffer* acquire(){
+    int i;
+    if (!free_list.pop(i)) return nullptr;
+    handles[i].refs.store(1, std::memory_order_relaxed);
+    return &handles[i];
+  }
+
+  /* Maps a buffer pointer returned by acquire() back to its handle */
+  LiberadTraceBuffer* handle_of(unsigned char* buffer){
+    return &handles[(buffer - base) / size];
+  }
+
+  void retain(LiberadTraceBuffer* trace){
+    trace->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void release(LiberadTraceBuffer* trace){
+    if (trace->refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+      free_list.push((int)(trace - &handles[0]));
+    }
+  }
+
+  std::atomic<unsigned long long> starved{0};
+
+private:
+
+  int count;
+  int size;
+  std::vector<unsigned char> storage;
+  unsigned char* base;
+  std::unique_ptr<LiberadTraceBuffer[]> handles;
+  BoundedQueue<int> free_list;
+};
+
+#endif
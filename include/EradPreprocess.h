@@ -0,0 +1,87 @@
+#ifndef ERADPREPROCESS_H
+#define ERADPREPROCESS_H
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+#include "EradStage.h"
+
+/* How time zero, the arrival of the direct wave, is found */
+enum LiberadTimeZero {
+  /* Traces are not shifted */
+  LIBERAD_TIME_ZERO_OFF,
+  /* At time_zero_sample in every trace, e.g. as measured for the antenna */
+  LIBERAD_TIME_ZERO_FIXED,
+  /* At the first sample of each trace reaching time_zero_threshold of its peak amplitude */
+  LIBERAD_TIME_ZERO_PICK
+};
+
+/* Settings of the standard preprocessing chain: dewow, time zero alignment and background removal */
+struct LiberadPreprocessParams {
+  /* Samples of the sliding window whose mean dewow subtracts from each sample, 0 for no dewow */
+  int dewow_window = 31;
+  LiberadTimeZero time_zero = LIBERAD_TIME_ZERO_OFF;
+  int time_zero_sample = 0;
+  float time_zero_threshold = 0.5f;
+  /* Traces in the running mean trace subtracted as background, 0 for no background removal */
+  int background_window = 64;
+};
+
+/* Counters describing preprocessing */
+struct LiberadPreprocessStats {
+  unsigned long long traces = 0;
+  /* Sample time zero was found at in the last trace */
+  int time_zero = 0;
+  /* Traces in the background mean, background_window once enough traces passed */
+  int background_traces = 0;
+};
+
+/* Removes the low frequency wow, aligns time zero to the first sample and subtracts the mean of the last
+* background_window traces from every trace, one trace at a time as they arrive. Each trace is passed on as soon as
+* it is processed. Samples are filtered as signed values and quantized back around 128, clipped to 0 and 255.
+* The background mean restarts when gain, time window or trace length changes.
+*/
+class PreprocessStage : public TraceStage {
+
+public:
+
+  PreprocessStage(const LiberadPreprocessParams& params);
+
+  void accept(const Trace& trace);
+
+  void get_stats(LiberadPreprocessStats* stats) const;
+
+private:
+
+  void reshape(const Trace& trace);
+  void dewow();
+  void align_time_zero();
+  void remove_background();
+
+  LiberadPreprocessParams params;
+
+  /* Shape of the traces processed, the background restarting when it changes */
+  int sample_count = -1;
+  Gain gain = LEVEL1;
+  TimeWindow window = SHORT;
+
+  /* Samples of the trace being processed, sample - 128 */
+  std::vector<short> work;
+  std::vector<int32_t> prefix;
+  /* Reciprocal of the number of samples averaged by dewow around each sample */
+  std::vector<float> dewow_scale;
+
+  /* Last background_window traces after alignment, and their sums */
+  std::vector<short> history;
+  std::vector<int32_t> background;
+  int history_head = 0;
+  int history_count = 0;
+
+  std::vector<unsigned char> out;
+
+  std::atomic<unsigned long long> traces{0};
+  std::atomic<int> time_zero{0};
+  std::atomic<int> background_traces{0};
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef ERADPYRAMID_H
+#define ERADPYRAMID_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+#include "EradStage.h"
+
+/* Most levels of a pyramid. With a factor of 4 a column of the top level covers 4^11, about 4 million, traces. */
+#define LIBERAD_PYRAMID_LEVELS 12
+
+/* Settings of a radargram tile pyramid */
+struct LiberadPyramidParams {
+  /* Columns of a tile, 1 to 65536 */
+  int tile_columns = 256;
+  /* Columns of a level merged into one of the level above, 2 to 16. TilePyramid clamps both to their range;
+  * liberad_enable_pyramid rejects values outside it.
+  */
+  int factor = 4;
+  /* Keep level 0, the traces themselves. Off when they can be read from a recording instead. */
+  bool keep_traces = true;
+};
+
+/* Columns of one level of a pyramid, as returned by TilePyramid::fetch. Column c holds samples
+* [c * sample_count, (c + 1) * sample_count) of min, max and mean, which are the lowest, highest and rounded mean
+* quantized sample at each depth over the traces the column covers. At level 0 all three are the trace.
+*/
+struct LiberadTile {
+  int level = 0;
+  /* Column of the level the tile starts with, and the number of complete columns it holds */
+  unsigned long long first_column = 0;
+  int columns = 0;
+  /* Traces covered by each column, factor^level */
+  unsigned long long traces_per_column = 1;
+  int sample_count = 0;
+  const unsigned char* min = nullptr;
+  const unsigned char* max = nullptr;
+  const unsigned char* mean = nullptr;
+};
+
+/* Multi-resolution radargram kept up to date as traces arrive, so viewers draw any part of a survey at any zoom
+* from a bounded number of columns. Level 0 holds the traces, every level above merges factor columns of the one
+* below into one. Levels are stored in tiles of tile_columns columns which, once allocated, never move, so fetched
+* tiles stay valid while the pyramid lives and fill up as traces arrive. A column is published once all its
+* traces arrived. Traces are pushed from one thread and fetched from any.
+*/
+class TilePyramid {
+
+public:
+
+  TilePyramid(const LiberadPyramidParams& params = LiberadPyramidParams());
+
+  /* Adds the next trace. The sample count is fixed by the first trace; longer traces are cut, shorter padded with
+  * 128.
+  */
+  void push(const Trace& trace);
+  void push(const unsigned char* samples, int sample_count);
+
+  /* @return traces pushed */
+  unsigned long long traces() const;
+
+  /* @return complete columns of level */
+  unsigned long long columns(int level) const;
+
+  /* @return lowest level drawing traces traces in at most pixels columns, so the cost of drawing doesn't grow with
+  * the span shown
+  */
+  int level_for(unsigned long long traces, int pixels) const;
+
+  /* Collects the tiles of level covering traces first_trace to end_trace
+  * @return number of tiles added to tiles
+  */
+  int fetch(int level, unsigned long long first_trace, unsigned long long end_trace, std::vector<LiberadTile>* tiles);
+
+  const LiberadPyramidParams& parameters() const { return params; }
+
+private:
+
+  struct Tile {
+    std::unique_ptr<unsigned char[]> data;
+  };
+
+  /* A level: its tiles, the number of complete columns and the column being merged */
+  struct Level {
+    std::vector<std::unique_ptr<Tile>> tiles;
+    std::atomic<unsigned long long> columns{0};
+    unsigned long long traces_per_column = 1;
+    std::vector<uint64_t> sum;
+    std::vector<unsigned char> low;
+    std::vector<unsigned char> high;
+    int merged = 0;
+  };
+
+  void publish(int level, const unsigned char* mean, const unsigned char* low, const unsigned char* high);
+  void merge(int level, const uint64_t* sum, const unsigned char* low, const unsigned char* high);
+
+  LiberadPyramidParams params;
+  int sample_count = 0;
+  std::atomic<unsigned long long> pushed{0};
+  Level levels[LIBERAD_PYRAMID_LEVELS];
+
+  /* Level 1 is merged from traces with the 16 bit stacking kernel */
+  std::vector<uint16_t> first_sum;
+  std::vector<unsigned char> padded;
+  std::vector<unsigned char> mean;
+
+  /* Guards the tile lists while a tile is added */
+  mutable std::mutex mutex;
+};
+
+/* Passes traces on unchanged and adds them to a TilePyramid */
+class PyramidStage : public TraceStage {
+
+public:
+
+  PyramidStage(const LiberadPyramidParams& params) : pyramid(params){}
+
+  void accept(const Trace& trace){
+    pyramid.push(trace);
+    next->accept(trace);
+  }
+
+  TilePyramid pyramid;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef ERADQUEUE_H
+#define ERADQUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bounded lock-free multi-producer/multi-consumer queue. Each cell carries a sequence number
+* telling producers and consumers whether it is free or holds a value, so push and pop only
+* need a single compare-and-swap on the shared position. Capacity is rounded up to a power of two.
+*/
+template<class T>
+class BoundedQueue {
+
+public:
+
+  explicit BoundedQueue(size_t capacity){
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+    mask = cap - 1;
+    cells.reset(new Cell[cap]);
+    for (size_t i = 0; i < cap; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+  /* @return false if the queue is full */
+  bool push(const T& value){
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;){
+      Cell& cell = cells[pos & mask];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0){
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+          cell.data = value;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0){
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /* @return false if the queue is empty */
+  bool pop(T& value){
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    for (;;){
+      Cell& cell = cells[pos & mask];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0){
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+          value = cell.data;
+          cell.seq.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0){
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+private:
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  size_t mask;
+  std::unique_ptr<Cell[]> cells;
+
+  char pad_enqueue[64];
+  std::atomic<size_t> enqueue_pos{0};
+  char pad_dequeue[64];
+  std::atomic<size_t> dequeue_pos{0};
+};
+
+#endif
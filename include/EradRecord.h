@@ -0,0 +1,271 @@
+#ifndef ERADRECORD_H
+#define ERADRECORD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "EradQueue.h"
+#include "EradTrace.h"
+
+/* Survey file format, version 2. All fields are little-endian.
+*
+*   LiberadRecordHeader, zero-padded to align bytes
+*   chunk, chunk, ...  each a LiberadChunkHeader followed by payload_bytes of records, zero-padded to a multiple of align
+*
+* A trace chunk holds trace_count records, each a LiberadTraceRecord followed by length bytes of the trace as received,
+* zero-padded to a multiple of 8. A packed chunk (LIBERAD_CHUNK_PACKED, see EradCodec.h) holds the same records
+* losslessly compressed and unpacks to the trace chunk it was made from. Chunks are written whole and in order, so
+* after a power loss every chunk with a valid magic and checksum is intact and the file ends at the first one that
+* isn't. Readers skip chunk types they don't know.
+*
+* Closing a recording appends an index chunk, holding a LiberadIndexEntry for every block of up to
+* LIBERAD_INDEX_STRIDE consecutive traces of a trace chunk, in file order. Each entry gives the capture time span
+* and the lowest and highest encoder position of its block, so a reader finds traces by time or distance without
+* reading the traces themselves. Recordings cut short have no index chunk; readers build the same entries from the
+* trace chunks.
+*
+* Version 1 files hold no packed chunks. Files with packed chunks are written as version 2, so that readers of
+* version 1 refuse them instead of skipping the packed chunks.
+*/
+#define LIBERAD_RECORD_MAGIC "OERADSRV"
+#define LIBERAD_RECORD_VERSION 2
+#define LIBERAD_RECORD_ALIGN 4096
+#define LIBERAD_CHUNK_MAGIC "CHNK"
+#define LIBERAD_CHUNK_TRACES 1
+#define LIBERAD_CHUNK_INDEX 2
+#define LIBERAD_CHUNK_PACKED 3
+#define LIBERAD_INDEX_STRIDE 64
+
+/* Set in LiberadRecordHeader::flags once the recording was closed, with trace_count and chunk_count filled in */
+#define LIBERAD_RECORD_COMPLETE 1
+/* Set in LiberadRecordHeader::flags if an index chunk follows the last trace chunk */
+#define LIBERAD_RECORD_INDEXED 2
+
+struct LiberadRecordHeader {
+  char magic[8];
+  uint32_t version;
+  /* Bytes before the first chunk, and the alignment of chunks */
+  uint32_t header_size;
+  uint32_t align;
+  uint32_t flags;
+  uint64_t trace_count;
+  uint64_t chunk_count;
+  /* USB product id of the device, 0 for a simulated one, and a readable model name */
+  uint16_t product_id;
+  uint16_t trace_length;
+  int32_t device_id;
+  char model[32];
+  /* Wall clock and steady_clock time at the start. Trace timestamps are steady_clock, so their wall clock
+  * time is created_unix_ns + timestamp_ns - created_steady_ns.
+  */
+  int64_t created_unix_ns;
+  int64_t created_steady_ns;
+  /* Gain and time window signals in effect at the start. Each trace records its own. */
+  uint8_t gain;
+  uint8_t window;
+  uint8_t reserved[6];
+  char description[128];
+};
+
+struct LiberadChunkHeader {
+  char magic[4];
+  uint32_t type;
+  /* Bytes of the chunk on disk including this header and padding, and of the records following the header */
+  uint32_t chunk_bytes;
+  uint32_t payload_bytes;
+  uint32_t trace_count;
+  /* liberad_crc32 of the payload */
+  uint32_t checksum;
+  uint64_t chunk_index;
+  uint64_t first_sequence;
+  int64_t first_timestamp_ns;
+  int64_t last_timestamp_ns;
+  /* Payload bytes of a packed chunk once unpacked, 0 for other chunks */
+  uint32_t unpacked_bytes;
+  uint8_t reserved[4];
+};
+
+struct LiberadTraceRecord {
+  uint64_t sequence;
+  int64_t timestamp_ns;
+  int64_t position;
+  uint16_t length;
+  uint8_t gain;
+  uint8_t window;
+  int8_t steps;
+  uint8_t reserved[3];
+};
+
+struct LiberadIndexEntry {
+  /* File offset of the trace chunk, and byte offset of the first record of the block within the chunk */
+  uint64_t chunk_offset;
+  uint32_t record_offset;
+  uint32_t trace_count;
+  /* Index of the first trace of the block within the survey */
+  uint64_t first_index;
+  int64_t first_timestamp_ns;
+  int64_t last_timestamp_ns;
+  /* Encoder positions reached within the block. Moving backwards makes them overlap those of other blocks. */
+  int64_t min_position;
+  int64_t max_position;
+};
+
+static_assert(sizeof(LiberadRecordHeader) <= LIBERAD_RECORD_ALIGN, "survey file header must fit its block");
+static_assert(sizeof(LiberadChunkHeader) == 64, "chunk header layout changed");
+static_assert(sizeof(LiberadTraceRecord) == 32, "trace record layout changed");
+static_assert(sizeof(LiberadIndexEntry) == 56, "index entry layout changed");
+
+/* CRC-32 (IEEE) of length bytes, continuing from crc. Pass 0 to start. */
+uint32_t liberad_crc32(uint32_t crc, const void* data, size_t length);
+
+/* Writes count bytes at offset of file fd, continuing after partial writes. Returns false if they couldn't be written. */
+bool liberad_write_all(int fd, const unsigned char* data, size_t count, long long offset);
+
+/* Appends the index entries of a trace chunk, one per LIBERAD_INDEX_STRIDE records
+* @param const unsigned char* chunk - trace chunk starting with its LiberadChunkHeader
+* @param uint64_t chunk_offset - file offset of the chunk
+* @param uint64_t first_index - survey index of the first trace of the chunk
+* @param std::vector<LiberadIndexEntry>* entries - entries are appended here
+*/
+void liberad_index_chunk(const unsigned char* chunk, uint64_t chunk_offset, uint64_t first_index, std::vector<LiberadIndexEntry>* entries);
+
+/* Settings of a recording */
+struct LiberadRecorderParams {
+  /* Bytes of a chunk, rounded up to a multiple of LIBERAD_RECORD_ALIGN. A chunk is written once it is full. */
+  int chunk_size = 1 << 20;
+  /* Chunks buffered for the writer thread. When all are waiting to be written new traces are dropped. */
+  int chunk_count = 16;
+  /* A chunk that isn't full is written once a trace arrives this much later than its first one, and when IO stops.
+  * While no traces arrive it waits in memory for the next one.
+  */
+  int flush_interval_ms = 1000;
+  /* Chunks written between durability points, at which the data is flushed to the disk. 0 leaves it to the OS. */
+  int sync_every = 1;
+  /* File space reserved ahead of the data written, so a long survey isn't slowed by a fragmenting file system */
+  long long preallocate_bytes = 64LL << 20;
+  /* Packs chunks losslessly on the writer thread. Chunks that don't get smaller, or are written while more than
+  * half of chunk_count wait for the disk, are written as they are.
+  */
+  bool compress = true;
+  /* Free text stored in the file header, may be nullptr */
+  const char* description = nullptr;
+};
+
+/* Counters describing a recording */
+struct LiberadRecorderStats {
+  /* Traces taken into chunks, chunks and bytes written */
+  unsigned long long traces = 0;
+  unsigned long long chunks = 0;
+  unsigned long long bytes = 0;
+  /* Bytes the chunks written would have taken unpacked */
+  unsigned long long unpacked_bytes = 0;
+  /* Traces not recorded because every chunk was waiting for the disk */
+  unsigned long long dropped = 0;
+  unsigned long long syncs = 0;
+  unsigned long long write_errors = 0;
+  /* Longest time a chunk took to write, including packing and its durability point */
+  long long max_write_us = 0;
+  /* Time spent packing chunks */
+  long long pack_us = 0;
+};
+
+/* Records the traces of a device into a survey file. The thread delivering traces copies each one into the chunk
+* being filled and never waits for the disk: full chunks are passed to a writer thread, which writes them with a
+* single call each, packed unless compression is off, and flushes them at durability points. If the disk falls
+* behind by chunk_count chunks traces are dropped and counted instead of holding up the capture.
+* Owned by its device and reused for each recording. record() is called by the thread delivering traces, flush() by
+* the thread handling IO once it stops, the other functions by any one user thread.
+*/
+class SurveyRecorder {
+
+public:
+
+  SurveyRecorder(){}
+  ~SurveyRecorder();
+
+  /* Creates the file at path, writes its header and starts recording */
+  int open(const char* path, const LiberadRecorderParams& params, const LiberadRecordHeader& header);
+
+  /* Writes the traces recorded so far, completes the header and closes the file. Returns once nothing is recorded any more. */
+  int close();
+
+  bool is_open() const { return recording.load(std::memory_order_acquire); }
+
+  void record(const Trace& trace);
+
+  /* Passes the chunk being filled to the writer, so the traces recorded so far reach the disk while none arrive */
+  void flush();
+
+  void get_stats(LiberadRecorderStats* stats) const;
+
+private:
+
+  struct Chunk {
+    unsigned char* data;
+    uint32_t used;
+    uint32_t traces;
+    uint64_t index;
+    uint64_t first_sequence;
+    int64_t first_timestamp_ns;
+    int64_t last_timestamp_ns;
+  };
+
+  void seal();
+  void write_chunk(Chunk& chunk);
+  bool write_index();
+  void writer_loop();
+  void notify_writer();
+
+  int fd = -1;
+  LiberadRecorderParams params;
+  LiberadRecordHeader header;
+  uint32_t chunk_size = 0;
+  int64_t flush_interval_ns = 0;
+
+  unsigned char* storage = nullptr;
+  /* Writer's chunk for packing into */
+  unsigned char* packed = nullptr;
+  std::vector<Chunk> chunks;
+  BoundedQueue<int>* free_chunks = nullptr;
+  BoundedQueue<int>* full_chunks = nullptr;
+
+  /* Producer side */
+  std::atomic<bool> recording{false};
+  std::atomic<int> active{0};
+  /* Set while flush() takes the chunk being filled; record() waits for it */
+  std::atomic<bool> flushing{false};
+  /* Keeps flush() and close() from sealing the same chunk */
+  std::mutex seal_mutex;
+  /* Chunks sealed and not written yet */
+  std::atomic<int> pending{0};
+  Chunk* filling = nullptr;
+  uint64_t next_chunk_index = 0;
+
+  /* Writer side */
+  std::thread writer;
+  std::atomic<bool> stopping{false};
+  std::atomic<bool> sleeping{false};
+  std::mutex wait_mutex;
+  std::condition_variable wake;
+  long long offset = 0;
+  long long allocated = 0;
+  int unsynced = 0;
+  uint64_t traces_written = 0;
+  std::vector<LiberadIndexEntry> index;
+
+  std::atomic<unsigned long long> traces{0};
+  std::atomic<unsigned long long> written_chunks{0};
+  std::atomic<unsigned long long> bytes{0};
+  std::atomic<unsigned long long> unpacked_bytes{0};
+  std::atomic<unsigned long long> dropped{0};
+  std::atomic<unsigned long long> syncs{0};
+  std::atomic<unsigned long long> write_errors{0};
+  std::atomic<long long> max_write_us{0};
+  std::atomic<long long> pack_us{0};
+};
+
+#endif
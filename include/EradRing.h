@@ -0,0 +1,161 @@
+#ifndef ERADRING_H
+#define ERADRING_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <string.h>
+#include "EradTrace.h"
+
+/* Counters describing the traffic through a TraceRing */
+struct LiberadRingStats {
+  unsigned long long written = 0;
+  unsigned long long read = 0;
+  unsigned long long overflows = 0;
+  unsigned long long truncated = 0;
+  int capacity = 0;
+  int pending = 0;
+};
+
+/* Single-producer/single-consumer ring of fixed-size trace slots. The producer is the thread
+* handling events (Oeradar::complete_in), the consumer is any one user thread. Neither side
+* takes a lock unless the consumer is blocked waiting for data. When the ring is full new
+* traces are dropped and counted as overflows.
+*/
+class TraceRing {
+
+public:
+
+  TraceRing(int slot_count, int slot_size) : slot_size(slot_size){
+    size_t cap = 1;
+    while (cap < (size_t)slot_count) cap <<= 1;
+    mask = cap - 1;
+    storage.resize(cap * slot_size);
+    records.resize(cap);
+  }
+
+  int capacity() const { return (int)(mask + 1); }
+
+  /* Producer side. Copies a trace and its record into the next free slot.
+  * @return false if the ring is full and the trace was dropped
+  */
+  bool push(const Trace& trace){
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) > mask){
+      overflows.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    int length = trace.length;
+    if (length > slot_size){
+      truncated.fetch_add(1, std::memory_order_relaxed);
+      length = slot_size;
+    }
+    size_t i = h & mask;
+    memcpy(&storage[i * slot_size], trace.data, length);
+    records[i] = trace;
+    records[i].length = length;
+    records[i].lent = nullptr;
+    head.store(h + 1, std::memory_order_seq_cst);
+    written.fetch_add(1, std::memory_order_relaxed);
+
+    if (waiting.load(std::memory_order_seq_cst)){
+      std::lock_guard<std::mutex> lock(wait_mutex);
+      ready.notify_one();
+    }
+    return true;
+  }
+
+  /* Consumer side. Copies the oldest trace into buffer, truncating it to buffer_size, and fills
+  * record with its capture state. The data and samples pointers of record point into buffer.
+  * @return number of bytes copied or 0 if the ring is empty
+  */
+  int pop(Trace* record, unsigned char* buffer, int buffer_size){
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return 0;
+    size_t i = t & mask;
+    const Trace& stored = records[i];
+    int length = stored.length < buffer_size ? stored.length : buffer_size;
+    memcpy(buffer, &storage[i * slot_size], length);
+    *record = stored;
+    record->data = buffer;
+    record->length = length;
+    record->samples = buffer;
+    record->sample_count = stored.sample_count < length ? stored.sample_count : length;
+    tail.store(t + 1, std::memory_order_release);
+    read.fetch_add(1, std::memory_order_relaxed);
+    return length;
+  }
+
+  int pop(unsigned char* buffer, int buffer_size, signed char* step){
+    Trace record;
+    int length = pop(&record, buffer, buffer_size);
+    if (length > 0 && step) *step = record.steps;
+    return length;
+  }
+
+  /* Consumer side. Like pop() but blocks until a trace is available or timeout_ms passes.
+  * A negative timeout waits indefinitely.
+  */
+  int pop_wait(unsigned char* buffer, int buffer_size, signed char* step, int timeout_ms){
+    Trace record;
+    int length = pop_wait(&record, buffer, buffer_size, timeout_ms);
+    if (length > 0 && step) *step = record.steps;
+    return length;
+  }
+
+  int pop_wait(Trace* record, unsigned char* buffer, int buffer_size, int timeout_ms){
+    int r = pop(record, buffer, buffer_size);
+    if (r > 0 || timeout_ms == 0) return r;
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    waiting.store(true, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while ((r = pop(record, buffer, buffer_size)) == 0){
+      if (timeout_ms < 0){
+        ready.wait(lock);
+      } else if (ready.wait_until(lock, deadline) == std::cv_status::timeout){
+        r = pop(record, buffer, buffer_size);
+        break;
+      }
+    }
+    waiting.store(false, std::memory_order_relaxed);
+    return r;
+  }
+
+  void get_stats(LiberadRingStats* stats) const {
+    stats->written = written.load(std::memory_order_relaxed);
+    stats->read = read.load(std::memory_order_relaxed);
+    stats->overflows = overflows.load(std::memory_order_relaxed);
+    stats->truncated = truncated.load(std::memory_order_relaxed);
+    stats->capacity = capacity();
+    stats->pending = (int)(head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire));
+  }
+
+private:
+
+  int slot_size;
+  size_t mask;
+  std::vector<unsigned char> storage;
+  std::vector<Trace> records;
+
+  /* producer and consumer fields are kept on separate cache lines */
+  char pad_producer[64];
+  std::atomic<size_t> head{0};
+  std::atomic<unsigned long long> written{0};
+  std::atomic<unsigned long long> overflows{0};
+  std::atomic<unsigned long long> truncated{0};
+
+  char pad_consumer[64];
+  std::atomic<size_t> tail{0};
+  std::atomic<unsigned long long> read{0};
+
+  char pad_waiting[64];
+  std::atomic<bool> waiting{false};
+  std::mutex wait_mutex;
+  std::condition_variable ready;
+};
+
+#endif
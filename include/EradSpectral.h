@@ -0,0 +1,47 @@
+#ifndef ERADSPECTRAL_H
+#define ERADSPECTRAL_H
+
+#include "EradDecode.h"
+
+/* Oerad device models, which differ in antenna centre frequency and in the span of their time windows */
+enum LiberadModel {LIBERAD_DIPOLO, LIBERAD_SCUDO, LIBERAD_CONCRETTO};
+
+/* What liberad_filter_traces leaves in the rows of the matrix */
+enum LiberadSpectralOutput {
+  /* The band-passed traces */
+  LIBERAD_SPECTRAL_BANDPASS,
+  /* The instantaneous amplitude of the band-passed traces, the magnitude of their analytic signal */
+  LIBERAD_SPECTRAL_ENVELOPE
+};
+
+/* Settings of frequency domain filtering */
+struct LiberadSpectralParams {
+  LiberadModel model = LIBERAD_DIPOLO;
+  /* Time window the traces were captured with, giving their sample interval together with the model */
+  TimeWindow window = SHORT;
+  /* Samples of the traces, which span the time window. 0 takes the columns of the matrix. Set it if the matrix is
+  * wider than the traces, as liberad_decode_traces pads shorter traces with zeros up to its columns.
+  */
+  int sample_count = 0;
+  /* Pass band in MHz. Frequencies between low_mhz and high_mhz pass unchanged; the response falls off with a
+  * cosine taper to zero at low_mhz / 2 and 1.5 * high_mhz. 0 takes half and twice the centre frequency of the model.
+  */
+  float low_mhz = 0;
+  float high_mhz = 0;
+  LiberadSpectralOutput output = LIBERAD_SPECTRAL_BANDPASS;
+};
+
+/* @return span of window on model in nanoseconds */
+float liberad_window_ns(LiberadModel model, TimeWindow window);
+
+/* @return nominal antenna centre frequency of model in MHz */
+float liberad_centre_mhz(LiberadModel model);
+
+/* Band-pass filters the rows of a LIBERAD_SAMPLES_FLOAT matrix filled by liberad_decode_traces, or replaces them
+* with their envelope. The first sample_count columns of each row are transformed zero padded to a power of two;
+* transforms are planned once per length and reused. Rows are spread over the library's processing threads.
+* @return LIBERAD_ERR if the matrix is not float, params are invalid or sample_count exceeds the columns
+*/
+int liberad_filter_traces(LiberadSampleMatrix* matrix, const LiberadSpectralParams* params);
+
+#endif
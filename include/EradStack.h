@@ -0,0 +1,74 @@
+#ifndef ERADSTACK_H
+#define ERADSTACK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+#include "EradStage.h"
+
+/* Most traces in one stack, as the sums of the samples are 16 bits wide */
+#define LIBERAD_MAX_FOLD 256
+
+/* Settings of vertical stacking */
+struct LiberadStackingParams {
+  /* Traces averaged into each one passed on */
+  int fold = 8;
+  /* Leave out the lowest and highest sample at every depth before averaging, so a single spike or dropout doesn't
+  * reach the stack. Needs a fold of at least 3.
+  */
+  bool reject_extremes = false;
+};
+
+/* Counters describing vertical stacking */
+struct LiberadStackingStats {
+  /* Traces taken in and stacks passed on */
+  unsigned long long traces = 0;
+  unsigned long long stacks = 0;
+  /* Stacks passed on with fewer than fold traces, because gain, time window or trace length changed */
+  unsigned long long partial = 0;
+};
+
+/* Averages every fold consecutive traces into one, to raise the signal to noise ratio of stationary or slow
+* surveys. Samples are summed straight from the buffers traces are received in, nothing is copied per trace.
+* A stack holds traces of one gain, time window and length; a change passes on the traces collected so far.
+* The stack has the capture state of its last trace and the encoder steps of all its traces.
+*/
+class StackingStage : public TraceStage {
+
+public:
+
+  StackingStage(const LiberadStackingParams& params);
+
+  void accept(const Trace& trace);
+
+  void get_stats(LiberadStackingStats* stats) const;
+
+private:
+
+  void reset(const Trace& trace);
+  void keep_frame(const Trace& trace);
+  void emit();
+
+  LiberadStackingParams params;
+
+  /* Stack being filled */
+  int count = 0;
+  int length = 0;
+  int steps = 0;
+  /* Capture state of the last trace, and its bytes around the samples, which start at offset */
+  Trace last_trace;
+  std::vector<unsigned char> frame;
+  int offset = 0;
+  std::vector<uint16_t> sums;
+  std::vector<unsigned char> low;
+  std::vector<unsigned char> high;
+
+  std::vector<unsigned char> out;
+  unsigned long long sequence = 0;
+
+  std::atomic<unsigned long long> traces{0};
+  std::atomic<unsigned long long> stacks{0};
+  std::atomic<unsigned long long> partial{0};
+};
+
+#endif
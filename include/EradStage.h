@@ -0,0 +1,31 @@
+#ifndef ERADSTAGE_H
+#define ERADSTAGE_H
+
+#include "EradTrace.h"
+
+/* Receiver of the traces passed on by a TraceStage */
+class TraceSink {
+
+public:
+
+  virtual ~TraceSink(){}
+
+  /* Takes a trace. Its data is only valid for the duration of the call. */
+  virtual void accept(const Trace& trace) = 0;
+};
+
+/* A processing step between the reception of traces and their delivery to rings, recordings and callbacks.
+* Stages of a device form a chain in the order they were enabled: each takes the traces passed on by the one
+* before it and passes on its own to next, one for each trace, fewer or more. Stages run on the thread delivering
+* traces, one trace at a time. Buffers a stage passes on belong to the stage and are only read during the call.
+* The data of a trace given to a stage is read only, as the batch callback or a replayed survey may share it.
+* Owned by the device; settings are fixed when it is enabled, before the IO loop runs.
+*/
+class TraceStage : public TraceSink {
+
+public:
+
+  TraceSink* next = nullptr;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef ERADSURVEY_H
+#define ERADSURVEY_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "EradRecord.h"
+#include "EradTrace.h"
+
+/* Position of a trace in a SurveyFile */
+struct LiberadSurveyCursor {
+  /* Index of the trace within the survey, counting from 0 */
+  unsigned long long index = 0;
+  size_t chunk = 0;
+  /* Byte offset of the trace record within its chunk, unpacked */
+  size_t offset = sizeof(LiberadChunkHeader);
+  /* Unpacked copy of the packed chunk last read from, shared with other cursors reading it */
+  std::shared_ptr<const std::vector<unsigned char> > image;
+  size_t image_chunk = 0;
+};
+
+/* Read access to a survey file written by SurveyRecorder. The file is mapped into memory and traces are read
+* in place, so reading copies nothing; packed chunks are unpacked once into memory shared by the cursors reading
+* them, and released when no cursor holds them any more. Opening only visits the chunk headers, one page per chunk; a trace is
+* found by a binary search over the chunks and a walk within one. Recordings cut short, e.g. by a power loss,
+* end at the last intact chunk. Chunks are checked against their checksum when first read from, and skipped
+* if damaged. Reading is safe from several threads; each needs its own cursor.
+* Traces are found by capture time or encoder position through the index at the end of the file, a capture time
+* span and position range per LIBERAD_INDEX_STRIDE traces. For recordings without one it is built from the traces
+* the first time a position is looked up. Position ranges are kept in a tree, so blocks of traces outside a range
+* are skipped in O(log n) even where the survey went back and forth.
+*/
+class SurveyFile {
+
+public:
+
+  SurveyFile(){}
+  ~SurveyFile();
+
+  /* Maps the file at path and reads its header and chunk headers */
+  int open(const char* path);
+  void close();
+
+  const LiberadRecordHeader& header() const { return file_header; }
+  unsigned long long trace_count() const { return traces; }
+
+  /* Capture time of the first and last trace, steady_clock nanoseconds as recorded */
+  int64_t first_timestamp_ns() const;
+  int64_t last_timestamp_ns() const;
+
+  /* Cursor at trace index, or at the end if index is past the last trace */
+  LiberadSurveyCursor seek_index(unsigned long long index) const;
+
+  /* Cursor at the first trace captured at or after timestamp_ns */
+  LiberadSurveyCursor seek_time(int64_t timestamp_ns) const;
+
+  bool at_end(const LiberadSurveyCursor& cursor) const { return cursor.index >= traces; }
+
+  /* Whether the file holds an index written when the recording was closed */
+  bool has_index() const { return stored_index != nullptr; }
+
+  /* Lowest and highest encoder position of the survey. Returns false if it holds no traces. */
+  bool position_range(int64_t* min_position, int64_t* max_position) const;
+
+  /* Reads the next trace at or after cursor whose encoder position is within [min_position, max_position] and moves
+  * the cursor past it. Reading a range from seek_index(0) until this returns false yields every pass of the survey
+  * over it, in capture order.
+  * @return false if no later trace is within the range
+  */
+  bool read_range(LiberadSurveyCursor& cursor, int64_t min_position, int64_t max_position, Trace* trace) const;
+
+  /* Fills trace with the record at cursor and moves the cursor to the next trace. data and samples point into
+  * the mapped file and stay valid until close(); the mapping is private, so writing to them doesn't change the file.
+  * Traces of a packed chunk point into its unpacked copy instead, which stays valid as long as a cursor holds it:
+  * keep a copy of cursor.image to use them after the cursor moved on to another chunk.
+  * @return false at the end of the survey
+  */
+  bool read(LiberadSurveyCursor& cursor, Trace* trace) const;
+
+private:
+
+  struct ChunkEntry {
+    unsigned char* data;
+    const LiberadChunkHeader* header;
+    unsigned long long first_index;
+    bool packed;
+  };
+
+  bool verify(size_t chunk) const;
+  const unsigned char* records(size_t chunk, LiberadSurveyCursor& cursor) const;
+  uint32_t unpacked_payload(size_t chunk) const;
+  void skip_damaged(LiberadSurveyCursor& cursor) const;
+  bool load_index() const;
+  void ensure_index() const;
+  size_t block_of(unsigned long long index) const;
+  size_t next_block_in_range(size_t node, size_t first, size_t last, size_t from, int64_t min_position, int64_t max_position) const;
+  LiberadSurveyCursor block_cursor(size_t block) const;
+
+  unsigned char* map = nullptr;
+  size_t map_size = 0;
+  LiberadRecordHeader file_header;
+  std::vector<ChunkEntry> chunks;
+  unsigned long long traces = 0;
+
+  /* Checksum state of each chunk: 0 not checked yet, 1 intact, 2 damaged */
+  std::unique_ptr<std::atomic<unsigned char>[]> checked;
+
+  /* Unpacked packed chunks, kept while a cursor holds them */
+  mutable std::mutex images_mutex;
+  mutable std::vector<std::weak_ptr<const std::vector<unsigned char> > > images;
+
+  /* Index chunk of the file, nullptr if it has none */
+  const LiberadChunkHeader* stored_index = nullptr;
+
+  /* Index blocks and the chunk of each, loaded or built on first use. A tree over the blocks holds the lowest and
+  * highest position below each node, leaves from tree_leaves on.
+  */
+  mutable std::mutex index_mutex;
+  mutable std::atomic<bool> indexed{false};
+  mutable std::vector<LiberadIndexEntry> blocks;
+  mutable std::vector<size_t> block_chunks;
+  mutable std::vector<int64_t> tree_min;
+  mutable std::vector<int64_t> tree_max;
+  mutable size_t tree_leaves = 0;
+};
+
+#endif
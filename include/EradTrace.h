@@ -0,0 +1,45 @@
+#ifndef ERADTRACE_H
+#define ERADTRACE_H
+
+struct LiberadTraceBuffer;
+
+/* Signals for changing the operational time window of Oerad hardware */
+enum TimeWindow {SHORT = 0b00110001, LONG = 0b00110111};
+
+/* Signals for changing gain levels of Oerad hardware  */
+enum Gain {LEVEL1 = 0b00110010, LEVEL2 = 0b00110011, LEVEL3 = 0b00110100, LEVEL4 = 0b00110101, LEVEL5 = 0b00110110};
+
+/* A received trace together with the state it was captured in. Filled in by liberad when the
+* transfer completes, so every consumer sees the same capture time, sequence and device settings.
+* data points to memory owned by liberad which is only valid for the duration of the callback, or
+* into the user buffer the trace was read into.
+*/
+struct Trace {
+  /* Per device count of received traces, starting at 0. A gap means traces were dropped. */
+  unsigned long long sequence = 0;
+  /* steady_clock time in nanoseconds at which the transfer completed */
+  long long timestamp_ns = 0;
+  /* Id of the Oeradar, unique within the process */
+  int device_id = 0;
+
+  /* Gain and time window last sent to the device before the trace was received */
+  Gain gain = LEVEL1;
+  TimeWindow window = SHORT;
+
+  /* Encoder steps of this trace and the device's cumulative encoder position including them */
+  signed char steps = 0;
+  long long position = 0;
+
+  /* Bytes as received, including the steps and delimiter trailer */
+  const unsigned char* data = nullptr;
+  int length = 0;
+
+  /* Quantized samples, the received bytes without the trailer */
+  const unsigned char* samples = nullptr;
+  int sample_count = 0;
+
+  /* Pool buffer holding data in pooled mode, nullptr otherwise */
+  LiberadTraceBuffer* lent = nullptr;
+};
+
+#endif
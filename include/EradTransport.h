@@ -0,0 +1,102 @@
+#ifndef ERADTRANSPORT_H
+#define ERADTRANSPORT_H
+
+class Oeradar;
+
+/* Parameters of a simulated Oerad device. Defaults match the timing of real hardware. */
+struct LiberadSimParams {
+  /* Time between traces. 0 produces a trace as soon as an IN transfer is posted. */
+  int trace_period_us = 55000;
+  /* Bytes per trace (TRACE_LENGTH) including the encoder step and delimiter trailer */
+  int trace_length = 585;
+  /* Encoder steps per trace. Fractions accumulate, negative values walk backwards. */
+  float steps_per_trace = 1.0f;
+  /* Every n-th transfer carries two traces, as the hardware sometimes produces. 0 disables. */
+  int doubled_every = 0;
+  /* Most traces a transfer is filled with, if that many are due (at a trace period of 0, if they fit) and the transfer
+  * has room for them. 1 completes each transfer with the next trace only.
+  */
+  int traces_per_transfer = 1;
+  /* Splits the trace stream into packets of 1 to packet_size bytes, as the wireless dongle does. 0 completes each
+  * transfer with whole traces, as over a wired link.
+  */
+  int packet_size = 0;
+  /* Every n-th packet is lost on the way. 0 disables. */
+  int packet_loss_every = 0;
+  unsigned int seed = 1;
+};
+
+/* Parameters of a replayed survey */
+struct LiberadReplayParams {
+  /* Speed relative to the recording: 1 replays traces at their original timing, 4 four times as fast. 0 replays
+  * traces as fast as they are consumed.
+  */
+  double speed = 1.0;
+  /* Starts again from the first trace after the last one */
+  bool loop = false;
+};
+
+/* Progress of a replayed survey */
+struct LiberadReplayInfo {
+  unsigned long long trace_count = 0;
+  /* Index of the next trace to be replayed */
+  unsigned long long next_index = 0;
+  /* Time between the first and last trace, and from the first to the next trace to be replayed */
+  long long duration_ns = 0;
+  long long position_ns = 0;
+  /* Every trace was replayed and the replay doesn't loop */
+  bool finished = false;
+};
+
+/* Backend moving data between an Oeradar and its hardware, or a stand-in for it.
+* Asynchronous IN and OUT requests are posted to numbered slots. Their completions are reported
+* through Oeradar::complete_in() and Oeradar::complete_out() on the thread calling handle_events().
+* Completion status uses the libusb_transfer_status values.
+*/
+class OeradarTransport {
+
+public:
+
+  virtual ~OeradarTransport(){}
+
+  /* Opens the device and claims its interface */
+  virtual int open() = 0;
+
+  /* Sends connection parameters - baud rate, stop bits, parity */
+  virtual int configure() = 0;
+
+  /* Releases the interface and closes the device */
+  virtual int close() = 0;
+
+  /* Prepares count IN or OUT slots. Slots already posted must not be resized. */
+  virtual int setup_in(int count) = 0;
+  virtual int setup_out(int count) = 0;
+
+  /* Posts an IN read of up to length bytes into buffer */
+  virtual int submit_in(int slot, unsigned char* buffer, int length) = 0;
+
+  /* Posts an OUT write of length bytes from buffer */
+  virtual int submit_out(int slot, unsigned char* buffer, int length) = 0;
+
+  /* Cancels every posted request. Each is completed with LIBUSB_TRANSFER_CANCELLED. */
+  virtual void cancel_all() = 0;
+
+  virtual int write_sync(unsigned char* data, int length, int* actual, unsigned int timeout_ms) = 0;
+  virtual int read_sync(unsigned char* buffer, int length, int* actual, unsigned int timeout_ms) = 0;
+
+  /* Waits up to timeout_us for events, forever if negative, and reports completions */
+  virtual int handle_events(long timeout_us) = 0;
+
+  /* Wakes a thread blocked in handle_events() */
+  virtual void interrupt() = 0;
+
+  /* True if events are handled on the shared libusb context. Such transports are served together
+  * by a single libusb event loop.
+  */
+  virtual bool shares_libusb_context() const { return false; }
+
+  /* Microseconds until this transport has its next event to report, negative if unknown */
+  virtual long next_event_us() { return -1; }
+};
+
+#endif
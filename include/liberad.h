@@ -6,7 +6,26 @@
 #include <signal.h>
 #include <vector>
 #include <atomic>
+#include <thread>
 #include "EradLogger.h"
+#include "EradTrace.h"
+#include "EradDecode.h"
+#include "EradSpectral.h"
+#include "EradFramer.h"
+#include "EradRing.h"
+#include "EradLatest.h"
+#include "EradRecord.h"
+#include "EradSurvey.h"
+#include "EradDepth.h"
+#include "EradPool.h"
+#include "EradStage.h"
+#include "EradBinning.h"
+#include "EradStack.h"
+#include "EradPreprocess.h"
+#include "EradGain.h"
+#include "EradMigration.h"
+#include "EradPyramid.h"
+#include "EradTransport.h"
 
 using namespace std;
 
@@ -15,12 +34,14 @@ using namespace std;
 #define LIBERAD_ENDPOINT_IN (0x81 | LIBUSB_ENDPOINT_IN)
 #define MIN_BUFFER_IN_SIZE 600
 #define TRACE_LENGTH 585
-
-/* Signals for changing the operational time window of Oerad hardware */
-enum TimeWindow {SHORT = 0b00110001, LONG = 0b00110111};
-
-/* Signals for changing gain levels of Oerad hardware  */
-enum Gain {LEVEL1 = 0b00110010, LEVEL2 = 0b00110011, LEVEL3 = 0b00110100, LEVEL4 = 0b00110101, LEVEL5 = 0b00110110};
+#define LIBERAD_IN_QUEUE_DEPTH 4
+#define LIBERAD_RING_SLOT_SIZE (2 * TRACE_LENGTH)
+#define LIBERAD_COMMAND_QUEUE_SIZE 64
+#define LIBERAD_OUT_POOL_SIZE 4
+/* Fits a doubled trace, rounded up to whole 64 byte USB packets */
+#define LIBERAD_POOL_BUFFER_SIZE ((2 * TRACE_LENGTH + 63) / 64 * 64)
+/* IN transfer size for traces traces, rounded up to whole 64 byte USB packets */
+#define LIBERAD_BATCH_BUFFER_SIZE(traces) (((traces) * TRACE_LENGTH + 63) / 64 * 64)
 
 /* Liberad functions return values */
 enum LiberadErrorCodes {LIBERAD_SUCCESS = 1, LIBERAD_ERR = -1, LIBERAD_NOT_INIT = -2, LIBERAD_OERADAR_FIELDS_EMPTY = -3};
@@ -28,9 +49,20 @@ enum LiberadErrorCodes {LIBERAD_SUCCESS = 1, LIBERAD_ERR = -1, LIBERAD_NOT_INIT
 /* Function prototype for user defined callback function called on receipt of data from Oerad hardware */
 typedef void (*LiberadCallbackIn)(unsigned char* buffer, int length, signed char steps);
 
+/* Function prototype for user defined callback function called with a lent pool buffer on receipt of data from Oerad hardware */
+typedef void (*LiberadCallbackInPooled)(LiberadTraceBuffer* trace);
+
+/* Function prototype for user defined callback function called with the full record of each trace received from Oerad hardware */
+typedef void (*LiberadCallbackTrace)(const Trace* trace);
+
+/* Function prototype for user defined callback function called with all traces received in one transfer */
+typedef void (*LiberadCallbackBatch)(const Trace* traces, int count);
+
 /* Function prototype for user defined callback function called on sending data to Oerad hardware */
 typedef void (*LiberadCallbackOut)(unsigned char* buffer, int length);
 
+class ExecutorLane;
+
 /* Structure representing an Oerad hardware device. Can be handled via liberad functions or directly if further functionality is required. */
 class Oeradar{
 public:
@@ -40,6 +72,19 @@ public:
   TimeWindow window;
   Gain gain;
 
+  /* Id unique within the process, reported in each Trace */
+  int id;
+
+  /* USB product id, 0 for a simulated device */
+  int product_id = 0;
+
+  /* Capture state stamped on received traces. The active gain and window follow signals once they are sent. */
+  unsigned long long next_sequence = 0;
+  long long position = 0;
+  std::atomic<int> active_gain{LEVEL1};
+  std::atomic<int> active_window{SHORT};
+  void signal_sent(unsigned char signal);
+
   unsigned char* buffer_in = nullptr;
   unsigned char* buffer_out = nullptr;
   int buffer_in_size = 0;
@@ -48,25 +93,100 @@ public:
   libusb_device* device = nullptr;
   libusb_device_handle* dev_handle = nullptr;
 
-  struct libusb_transfer* transfer_in = nullptr;
-  struct libusb_transfer* transfer_out = nullptr;
+  /* Backend carrying IN and OUT data. Set with the device, owned by the Oeradar. */
+  OeradarTransport* transport = nullptr;
+
+  /* IN requests kept posted to the transport. Each one reads into its own slice of buffer_in of in_slot_size bytes. */
+  int in_queue_depth = 1;
+  int in_slot_size = 0;
+  std::atomic<int> in_flight{0};
 
-  void init_transfer_in(LiberadCallbackIn cb, unsigned char* buffer, int buffer_size );
-  int setup_single_transfer_in(LiberadCallbackIn user_callback_in, unsigned char* buffer, int buffer_size);
+  void init_transfer_in(LiberadCallbackIn cb, unsigned char* buffer, int buffer_size, int queue_depth = 1);
   void init_transfer_out(LiberadCallbackOut user_callback_out, unsigned char* buffer, int buffer_size );
 
-  int register_transfer_out();
-  int register_transfer_in();
+  /* Signals queued by any thread, coalesced and sent by the thread handling events through a pool of OUT slots of the transport */
+  BoundedQueue<unsigned char> commands{LIBERAD_COMMAND_QUEUE_SIZE};
+  std::vector<int> out_slots_free;
+  bool out_slots_ready = false;
+  unsigned char out_signals[LIBERAD_OUT_POOL_SIZE];
+  int pending_window = -1;
+  int pending_gain = -1;
+
+  int queue_command(unsigned char signal);
+  void drain_commands();
 
-  void cb_in(struct libusb_transfer* transfer);
-  void cb_in_single(struct libusb_transfer* transfer);
-  void cb_out(struct libusb_transfer* transfer);
-  LiberadCallbackIn user_callback_in;
-  LiberadCallbackOut user_callback_out;
+  int register_transfer_in();
+  int effective_in_depth();
+
+  /* Called by the transport when an IN or OUT request of a slot finishes. status is a libusb_transfer_status. */
+  void complete_in(int slot, unsigned char* buffer, int length, int status);
+  void complete_out(int slot, int length, int status);
+  void complete_frame(const unsigned char* frame, int length, LiberadTraceBuffer* transfer, long long captured);
+  void emit_trace(const unsigned char* data, int length, unsigned long long sequence, long long captured, LiberadTraceBuffer* lent);
+  void resubmit_in(int slot, unsigned char* buffer);
+  void flush_batch();
+  void replay_trace(const Trace& trace);
+  void deliver_in(const Trace& trace);
+  void fan_out(const Trace& trace);
+  LiberadCallbackIn user_callback_in = nullptr;
+  LiberadCallbackTrace user_callback_trace = nullptr;
+  LiberadCallbackOut user_callback_out = nullptr;
+
+  /* Batched mode. IN slots are sized for in_batch_traces traces and the traces split from a transfer are collected
+  * in batch and passed to user_callback_batch together.
+  */
+  LiberadCallbackBatch user_callback_batch = nullptr;
+  int in_batch_traces = 1;
+  std::vector<Trace> batch;
+
+  /* Splits received data into traces of TRACE_LENGTH bytes. nullptr delivers every transfer as one trace. */
+  TraceFramer* framer = nullptr;
+
+  /* Optional ring filled by complete_in and drained by liberad_read_trace / liberad_try_read_trace */
+  TraceRing* trace_ring = nullptr;
+
+  /* Optional cache of the newest trace, read by liberad_get_latest_trace / liberad_wait_trace_after */
+  LatestTrace* latest_trace = nullptr;
+
+  /* Records delivered traces into a survey file while open. Created by liberad_start_recording and reused for later recordings. */
+  std::atomic<SurveyRecorder*> recorder{nullptr};
+
+  /* Thread handling events of a capture started by liberad_start_stepped_capture, and its IN buffer if the user set none */
+  std::thread capture_thread;
+  std::vector<unsigned char> capture_buffer;
+
+  /* Optional pool of buffers lent to user_callback_in_pooled instead of reusing buffer_in */
+  TracePool* trace_pool = nullptr;
+  LiberadCallbackInPooled user_callback_in_pooled = nullptr;
+
+  /* Processing stages received traces pass through before fan_out, in the order they were enabled. The last one
+  * passes on to stage_output.
+  */
+  std::vector<TraceStage*> stages;
+  void add_stage(TraceStage* stage);
+  struct StageOutput : public TraceSink {
+    Oeradar* radar = nullptr;
+    void accept(const Trace& trace);
+  } stage_output;
+  BinningStage* binning = nullptr;
+  StackingStage* stacking = nullptr;
+  PreprocessStage* preprocess = nullptr;
+  GainStage* gain_stage = nullptr;
+  MigrationStage* migration = nullptr;
+  PyramidStage* pyramid = nullptr;
+
+  /* Set while handled by the library executor. With a lane, traces are delivered on an executor worker thread. */
+  std::atomic<bool> executor_served{false};
+  std::atomic<ExecutorLane*> lane{nullptr};
 
   void run();
+  void flush_recording();
   void run_single();
-  bool wireless;
+  /* Connected through the Oerad USB dongle, which splits traces into packets of varying size */
+  bool wireless = false;
+
+  Oeradar();
+  ~Oeradar();
 
 };
 
@@ -82,6 +202,77 @@ int liberad_init(LogLevel lvl);
 /* Checks all usb connected devices and populates a vector with hardware-backed Oeradar isntances */
 int liberad_get_valid_devices(vector<Oeradar*>* gprs);
 
+/* Creates an Oeradar backed by a simulated device producing synthetic traces. params may be nullptr for defaults. */
+Oeradar* liberad_create_simulated_device(const LiberadSimParams* params = nullptr);
+
+/* Creates an Oeradar replaying the survey recorded at path through the same callbacks, rings and executor as a live
+* device. params may be nullptr to replay at the original timing. Returns nullptr if the file can't be read.
+*/
+Oeradar* liberad_create_replay_device(const char* path, const LiberadReplayParams* params = nullptr);
+
+/* Continues a replay from trace index */
+int liberad_replay_seek(Oeradar* device, unsigned long long index);
+
+/* Continues a replay from the first trace captured offset_ns or later after the first trace of the survey */
+int liberad_replay_seek_time(Oeradar* device, long long offset_ns);
+
+/* Fills info with the trace count, duration and progress of a replay */
+int liberad_get_replay_info(Oeradar* device, LiberadReplayInfo* info);
+
+/* Turns the traces of the device into one trace per spatial bin along the survey line, using the encoder
+* position of each trace. params may be nullptr for defaults. The device must not be RUNNING.
+*/
+int liberad_enable_binning(Oeradar* device, const LiberadBinningParams* params = nullptr);
+
+/* Fills stats with the counters of the binning of the device */
+int liberad_get_binning_stats(Oeradar* device, LiberadBinningStats* stats);
+
+/* Averages every fold consecutive traces of the device into one. params may be nullptr for defaults. The device
+* must not be RUNNING.
+*/
+int liberad_enable_stacking(Oeradar* device, const LiberadStackingParams* params = nullptr);
+
+/* Fills stats with the counters of the stacking of the device */
+int liberad_get_stacking_stats(Oeradar* device, LiberadStackingStats* stats);
+
+/* Runs dewow, time zero alignment and background removal on the traces of the device as they arrive. params may be
+* nullptr for defaults. The device must not be RUNNING.
+*/
+int liberad_enable_preprocessing(Oeradar* device, const LiberadPreprocessParams* params = nullptr);
+
+/* Fills stats with the counters of the preprocessing of the device */
+int liberad_get_preprocess_stats(Oeradar* device, LiberadPreprocessStats* stats);
+
+/* Applies time varying gain, SEC and AGC, to the traces of the device as they arrive. params may be nullptr for
+* defaults. The device must not be RUNNING.
+*/
+int liberad_enable_gain(Oeradar* device, const LiberadGainParams* params = nullptr);
+
+/* Fills stats with the counters of the time varying gain of the device */
+int liberad_get_gain_stats(Oeradar* device, LiberadGainStats* stats);
+
+/* Migrates the traces of the device into a sliding window of migrated traces as they arrive. The device must not be
+* RUNNING.
+*/
+int liberad_enable_migration(Oeradar* device, const LiberadMigrationParams* params = nullptr);
+
+/* Copies migrated trace index of the device into out. Returns the samples copied, 0 if it is not held. */
+int liberad_read_migrated(Oeradar* device, unsigned long long index, float* out, int capacity);
+
+/* Fills info with the progress of the migration of the device */
+int liberad_get_migration_info(Oeradar* device, LiberadMigrationInfo* info);
+
+/* Keeps a multi-resolution tile pyramid of the traces of the device as they arrive, for viewers. The device must not
+* be RUNNING.
+*/
+int liberad_enable_pyramid(Oeradar* device, const LiberadPyramidParams* params = nullptr);
+
+/* Returns the tile pyramid of the device, nullptr if it is not enabled */
+TilePyramid* liberad_get_pyramid(Oeradar* device);
+
+/* Adds the traces of the survey file at path to pyramid */
+int liberad_build_pyramid(const char* path, TilePyramid* pyramid);
+
 /* Prints information about product - id, vendor, interfaces, endpoints, descriptors and addresses */
 int liberad_print_device_info(Oeradar* device);
 
@@ -99,15 +290,92 @@ int liberad_set_async_out_params(Oeradar* device,
                                   unsigned char* buffer_out,
                                   int out_buffer_size);
 
-/* Sets fields needed for carrying out asynchronous IN-bound data transfers from Oerad hardware. On sending data user_callback_out will be called. */
+/* Sets fields needed for carrying out asynchronous IN-bound data transfers from Oerad hardware. On receipt of data user_callback_in will be called.
+* buffer_in is split between queue_depth transfers which are kept posted to the device.
+*/
 int liberad_set_async_in_params(Oeradar* device,
                                 LiberadCallbackIn user_callback_in,
                                 unsigned char* buffer_in,
-                                int in_buffer_size);
+                                int in_buffer_size,
+                                int queue_depth = LIBERAD_IN_QUEUE_DEPTH);
 
 /* Registers an IN-bound asynchronous data transfer from an Oerad device. On receipt of data user_callback_in will be called. */
 int liberad_register_in_handling(Oeradar* device);
 
+/* Attaches a single-producer/single-consumer ring of slot_count traces to the device. Incoming traces are copied
+* into it in addition to calling user_callback_in (which may then be nullptr). Must be called before the IO loop runs.
+*/
+int liberad_enable_trace_ring(Oeradar* device, int slot_count, int slot_size = LIBERAD_RING_SLOT_SIZE);
+
+/* Copies the oldest trace from the device ring into buffer. Blocks up to timeout_ms (forever if negative). Returns the trace length or 0 on timeout. */
+int liberad_read_trace(Oeradar* device, unsigned char* buffer, int buffer_size, signed char* steps, int timeout_ms = -1);
+
+/* Copies the oldest trace from the device ring into buffer without blocking. Returns the trace length or 0 if the ring is empty. */
+int liberad_try_read_trace(Oeradar* device, unsigned char* buffer, int buffer_size, signed char* steps);
+
+/* Reads the oldest trace from the device ring together with its record - sequence, capture time, gain, window and
+* encoder position. The record's data points into buffer. Blocks up to timeout_ms (forever if negative, not at all if 0).
+*/
+int liberad_read_trace_record(Oeradar* device, Trace* trace, unsigned char* buffer, int buffer_size, int timeout_ms = -1);
+
+/* Calls cb with the full record of every received trace, in addition to any other callback. */
+int liberad_set_trace_callback(Oeradar* device, LiberadCallbackTrace cb);
+
+/* Keeps a copy of the newest trace of the device, truncated to slot_size, for liberad_get_latest_trace and
+* liberad_wait_trace_after. Must be called before the IO loop runs.
+*/
+int liberad_enable_latest_trace(Oeradar* device, int slot_size = LIBERAD_RING_SLOT_SIZE);
+
+/* Copies the newest trace of the device and its record into buffer without waiting. Safe to call from any thread.
+* Returns the trace length or 0 if no trace arrived yet.
+*/
+int liberad_get_latest_trace(Oeradar* device, Trace* trace, unsigned char* buffer, int buffer_size);
+
+/* Like liberad_get_latest_trace but only returns a trace with a sequence number above sequence, waiting up to
+* timeout_ms for it (forever if negative). Pass LIBERAD_NO_SEQUENCE to take any trace. Returns 0 on timeout.
+*/
+int liberad_wait_trace_after(Oeradar* device, unsigned long long sequence, Trace* trace, unsigned char* buffer, int buffer_size, int timeout_ms);
+
+/* Fills stats with the written, read, overflow and truncation counters of the device ring */
+int liberad_get_ring_stats(Oeradar* device, LiberadRingStats* stats);
+
+/* Turns trace framing on or off. With framing, received data is split into traces of frame_length bytes ending with
+* CONTROL_B, however the link divides it. Without, every transfer is delivered as one trace. On by default.
+*/
+int liberad_set_framing(Oeradar* device, bool enable, int frame_length = TRACE_LENGTH);
+
+/* Fills stats with the trace, reassembly and resynchronization counters of the device framer */
+int liberad_get_framer_stats(Oeradar* device, LiberadFramerStats* stats);
+
+/* Sizes IN transfers for traces_per_transfer traces and calls cb once per transfer with all traces split from it, in
+* addition to any other callback. buffer_in needs LIBERAD_BATCH_BUFFER_SIZE(traces_per_transfer) bytes per queued
+* transfer. Must be called before IN transfers are registered.
+*/
+int liberad_set_batch_callback(Oeradar* device, LiberadCallbackBatch cb, int traces_per_transfer);
+
+/* Records every trace delivered from now on into a survey file at path, written by a library thread. params may be
+* nullptr for defaults. May be called while the IO loop runs.
+*/
+int liberad_start_recording(Oeradar* device, const char* path, const LiberadRecorderParams* params = nullptr);
+
+/* Stops recording, writes the remaining traces and completes the survey file */
+int liberad_stop_recording(Oeradar* device);
+
+/* Fills stats with the trace, chunk, byte, drop and write time counters of the current or last recording */
+int liberad_get_recorder_stats(Oeradar* device, LiberadRecorderStats* stats);
+
+/* IN transfers read into buffer_count pool-owned buffers which are lent to cb without copying. Must be called before IN transfers are registered. */
+int liberad_enable_trace_pool(Oeradar* device, LiberadCallbackInPooled cb, int buffer_count, int buffer_size = LIBERAD_POOL_BUFFER_SIZE);
+
+/* Keeps a lent trace buffer beyond the callback it was passed to. Each retain needs a matching release. */
+void liberad_trace_retain(LiberadTraceBuffer* trace);
+
+/* Releases a lent trace buffer back to its pool. May be called from any thread. */
+void liberad_trace_release(LiberadTraceBuffer* trace);
+
+/* Number of traces dropped because the device trace pool had no free buffer */
+unsigned long long liberad_get_pool_starved(Oeradar* device);
+
 
 
 /* Sends signals to Oerad hardware to start transmission with the passed TimeWindow and Gain parameters */
@@ -124,7 +392,8 @@ int liberad_start_io_async(Oeradar* device,
                                 unsigned char* buffer_in,
                                 int inLength,
                                 unsigned char* buffer_out,
-                                int outLength);
+                                int outLength,
+                                int in_queue_depth = LIBERAD_IN_QUEUE_DEPTH);
 
 /* Sends signals to Oerad hardware to start signal transmission via an asynchronous mechanism. Requires OUT-bound data transfer fields to be set. */
 int liberad_start_transmission_async(Oeradar* device,
@@ -141,9 +410,34 @@ int liberad_handle_io_async(Oeradar* device);
 /* Stop loop handling asynchronous IN and OUT transfers. */
 void liberad_stop_io(Oeradar* device);
 
+/* Starts a library-owned executor handling IO of all added devices. One thread handles USB events, any further threads
+* deliver traces to user code. Threads can be pinned to cpu_ids and given SCHED_FIFO rt_priority.
+*/
+int liberad_executor_start(int threads, const int* cpu_ids = nullptr, int cpu_count = 0, int rt_priority = 0);
+
+/* Adds a TRANSMITTING device to the executor instead of running liberad_handle_io_async for it. */
+int liberad_executor_add(Oeradar* device);
+
+/* Removes a device from the executor. */
+int liberad_executor_remove(Oeradar* device);
+
+/* Removes all devices and stops the executor. */
+void liberad_executor_stop();
+
 
 
-/* Gets a single trace sent from the Oerad hardware via a synchronous mechanism. Stores it in buffer_in. */
+/* Starts the device and keeps it capturing on a library thread, so the newest trace can be taken at any time with
+* liberad_get_latest_trace, liberad_wait_trace_after or liberad_get_current_trace. IN parameters set beforehand are
+* kept; without a buffer_in the library allocates one.
+*/
+int liberad_start_stepped_capture(Oeradar* device, TimeWindow length, Gain level, int in_queue_depth = LIBERAD_IN_QUEUE_DEPTH);
+
+/* Stops the capture started by liberad_start_stepped_capture. The newest trace stays readable. */
+int liberad_stop_stepped_capture(Oeradar* device);
+
+/* Gets a single trace sent from the Oerad hardware via a synchronous mechanism. Stores the newest complete trace in buffer_in.
+* During a stepped capture it returns the next trace received instead of reading from the device.
+*/
 int liberad_get_current_trace(Oeradar* device, unsigned char* buffer_in, int buffer_size);
 
 /* Gets a single trace sent from the Oerad hardware via an asynchronous mechanism. Stores it in buffer_in and calls user_callback_in on receipt of data. */
@@ -0,0 +1,144 @@
+#include "../include/EradBinning.h"
+#include <math.h>
+#include <string.h>
+
+BinningStage::BinningStage(const LiberadBinningParams& params) :
+  params(params),
+  bins_per_step((params.direction < 0 ? -1.0 : 1.0) / (params.steps_per_meter * params.spacing_m)){
+}
+
+/* Sorts a trace into its bin. A trace reaching a later bin completes the bin being filled. */
+void BinningStage::accept(const Trace& trace){
+
+  traces.fetch_add(1, std::memory_order_relaxed);
+  double x = (double)trace.position * bins_per_step;
+  long long k = (long long)floor(x + 0.5);
+
+  if (!filling){
+    open(k, trace, x - k);
+    return;
+  }
+  if (k < bin){
+    reversed.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (k == bin){
+    if (trace.length != length || trace.gain != first_trace.gain || trace.window != first_trace.window){
+      mismatched.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    add(trace, x - k);
+    return;
+  }
+
+  close();
+  if (k > bin + 1) fill_gap(k, trace, x);
+  open(k, trace, x - k);
+}
+
+/* Starts filling bin with trace. Buffers keep their capacity, so this allocates only for longer traces. */
+void BinningStage::open(long long bin, const Trace& trace, double offset){
+
+  filling = true;
+  this->bin = bin;
+  length = trace.length;
+  count = 0;
+  first_trace = trace;
+  sums.assign(trace.sample_count, 0);
+  nearest.resize(length);
+  add(trace, offset);
+}
+
+void BinningStage::add(const Trace& trace, double offset){
+
+  if (params.mode == LIBERAD_BIN_STACK){
+    const unsigned char* samples = trace.samples;
+    uint32_t* sum = sums.data();
+    for (int i = 0; i < trace.sample_count; i++) sum[i] += samples[i];
+    if (count == 0) memcpy(nearest.data(), trace.data, length);
+  } else if (count == 0 || fabs(offset) < nearest_offset){
+    memcpy(nearest.data(), trace.data, length);
+    nearest_offset = fabs(offset);
+    nearest_trace = trace;
+  }
+  last_trace = trace;
+  count++;
+}
+
+/* Passes on the bin being filled: the rounded mean of its traces with the trailer of the first one, or the trace
+* nearest to its centre
+*/
+void BinningStage::close(){
+
+  out.resize(length);
+  memcpy(out.data(), nearest.data(), length);
+  if (params.mode == LIBERAD_BIN_STACK){
+    uint32_t half = count / 2;
+    for (size_t i = 0; i < sums.size(); i++) out[i] = (unsigned char)((sums[i] + half) / count);
+  }
+
+  emit(bin, params.mode == LIBERAD_BIN_STACK ? last_trace : nearest_trace);
+  previous.assign(out.begin(), out.end());
+}
+
+/* Fills the bins between the bin just passed on and bin, which trace at x reached, by interpolating linearly
+* between the two
+*/
+void BinningStage::fill_gap(long long bin, const Trace& trace, double x){
+
+  long long gap = bin - emitted_bin - 1;
+  if (gap > params.max_gap_bins || trace.length != length){
+    skipped.fetch_add(gap, std::memory_order_relaxed);
+    return;
+  }
+
+  int sample_count = trace.sample_count;
+  for (long long b = emitted_bin + 1; b < bin; b++){
+    double w = (double)(b - emitted_bin) / (x - (double)emitted_bin);
+    if (w > 1.0) w = 1.0;
+    float wf = (float)w;
+    memcpy(out.data(), previous.data(), length);
+    for (int i = 0; i < sample_count; i++){
+      out[i] = (unsigned char)lrintf((float)previous[i] + wf * ((float)trace.samples[i] - (float)previous[i]));
+    }
+    emit(b, trace);
+    interpolated.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/* Passes on the contents of out as the trace of bin, with the capture state of like, the position of the centre
+* of the bin and the steps since the bin before
+*/
+void BinningStage::emit(long long bin, const Trace& like){
+
+  long long position = llround((double)bin / bins_per_step);
+  long long steps = emitted ? position - emitted_position : 0;
+  if (steps > 127) steps = 127;
+  if (steps < -128) steps = -128;
+
+  Trace binned = like;
+  binned.sequence = sequence++;
+  binned.steps = (signed char)steps;
+  binned.position = position;
+  if (length >= 2) out[length - 2] = (unsigned char)binned.steps;
+  binned.data = out.data();
+  binned.length = length;
+  binned.samples = out.data();
+  binned.sample_count = length >= 2 ? length - 2 : length;
+  binned.lent = nullptr;
+
+  emitted = true;
+  emitted_bin = bin;
+  emitted_position = position;
+  bins.fetch_add(1, std::memory_order_relaxed);
+  next->accept(binned);
+}
+
+void BinningStage::get_stats(LiberadBinningStats* stats) const {
+  stats->traces = traces.load(std::memory_order_relaxed);
+  stats->bins = bins.load(std::memory_order_relaxed);
+  stats->interpolated = interpolated.load(std::memory_order_relaxed);
+  stats->skipped = skipped.load(std::memory_order_relaxed);
+  stats->reversed = reversed.load(std::memory_order_relaxed);
+  stats->mismatched = mismatched.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,319 @@
+#include "../include/EradCodec.h"
+#include "../include/EradRecord.h"
+#include <string.h>
+
+/* Predictors a packed trace starts with */
+enum PackMode {PACK_INTRA = 0, PACK_INTER = 1, PACK_BOTH = 2};
+
+/* Rice parameters go up to 9, residuals after zigzag to 1020. Quotients from 16 on are escaped: 16 ones followed
+* by the residual in 10 bits.
+*/
+#define PACK_K_BITS 4
+#define PACK_MAX_K 9
+#define PACK_ESCAPE 16
+#define PACK_RAW_BITS 10
+
+static inline uint32_t zigzag(int r){
+  return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+static inline int unzigzag(uint32_t u){
+  return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+static inline int predict(int mode, const unsigned char* data, const unsigned char* previous, int i){
+  int before = i > 0 ? data[i - 1] : 128;
+  if (mode == PACK_INTRA) return before;
+  if (mode == PACK_INTER) return previous[i];
+  return i > 0 ? previous[i] + before - previous[i - 1] : previous[0];
+}
+
+static inline int rice_bits(uint32_t u, int k){
+  uint32_t q = u >> k;
+  return q < PACK_ESCAPE ? (int)q + 1 + k : PACK_ESCAPE + PACK_RAW_BITS;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/* Appends bits LSB first, 32 at a time */
+class BitWriter {
+
+public:
+
+  BitWriter(unsigned char* out, int capacity) : out(out), capacity(capacity){}
+
+  /* bits up to 32 */
+  inline void put(uint32_t value, int bits){
+    acc |= (uint64_t)value << count;
+    count += bits;
+    if (count >= 32){
+      if (pos + 4 <= capacity) memcpy(out + pos, &acc, 4);
+      pos += 4;
+      acc >>= 32;
+      count -= 32;
+    }
+  }
+
+  /* @return bytes written, 0 if they didn't fit */
+  int finish(){
+    while (count > 0){
+      if (pos < capacity) out[pos] = (unsigned char)acc;
+      pos++;
+      acc >>= 8;
+      count -= 8;
+    }
+    return pos <= capacity ? pos : 0;
+  }
+
+private:
+
+  unsigned char* out;
+  int capacity;
+  int pos = 0;
+  uint64_t acc = 0;
+  int count = 0;
+};
+
+class BitReader {
+
+public:
+
+  BitReader(const unsigned char* in, int available) : in(in), available(available){}
+
+  /* Tops the buffer up to at least 56 bits, or to the end of the input */
+  inline void refill(){
+    if (pos + 8 <= available){
+      uint64_t next;
+      memcpy(&next, in + pos, 8);
+      acc |= next << count;
+      pos += (63 - count) >> 3;
+      count |= 56;
+      return;
+    }
+    while (count <= 56 && pos < available){
+      acc |= (uint64_t)in[pos++] << count;
+      count += 8;
+    }
+  }
+
+  /* Takes bits up to 32 from the refilled buffer. Reading past the end sets failed. */
+  inline uint32_t take(int bits){
+    if (bits > count){
+      failed = true;
+      return 0;
+    }
+    uint32_t value = (uint32_t)(acc & ((1ull << bits) - 1));
+    acc >>= bits;
+    count -= bits;
+    return value;
+  }
+
+  /* Ones before the next zero, at most PACK_ESCAPE */
+  inline int ones() const {
+    uint64_t inverted = ~acc;
+    int n = inverted ? __builtin_ctzll(inverted) : 64;
+    return n < PACK_ESCAPE ? n : PACK_ESCAPE;
+  }
+
+  /* @return bytes consumed, rounded up to whole bytes */
+  int consumed() const { return pos - count / 8; }
+
+  bool failed = false;
+
+private:
+
+  const unsigned char* in;
+  int available;
+  int pos = 0;
+  uint64_t acc = 0;
+  int count = 0;
+};
+
+// -------------------------------------------------------------------------------------------------
+
+/* Codes the residuals of a trace with predictor MODE, one block at a time */
+template <int MODE>
+static void pack_samples(const unsigned char* data, int length, const unsigned char* previous, BitWriter& writer){
+
+  uint32_t u[LIBERAD_PACK_BLOCK];
+  for (int start = 0; start < length; start += LIBERAD_PACK_BLOCK){
+    int n = length - start < LIBERAD_PACK_BLOCK ? length - start : LIBERAD_PACK_BLOCK;
+    uint32_t sum = 0;
+    for (int j = 0; j < n; j++){
+      u[j] = zigzag(data[start + j] - predict(MODE, data, previous, start + j));
+      sum += u[j];
+    }
+
+    /* Rice parameter near log2 of the mean residual, refined by the cost of its neighbours */
+    int guess = 0;
+    while (guess < PACK_MAX_K && ((uint32_t)n << (guess + 1)) <= sum) guess++;
+    int best = guess;
+    uint32_t best_bits = ~0u;
+    for (int k = guess > 0 ? guess - 1 : 0; k <= guess + 1 && k <= PACK_MAX_K; k++){
+      uint32_t bits = (uint32_t)n * (k + 1);
+      for (int j = 0; j < n; j++) bits += u[j] >> k;
+      if (bits < best_bits){
+        best_bits = bits;
+        best = k;
+      }
+    }
+
+    writer.put((uint32_t)best, PACK_K_BITS);
+    uint32_t mask = (1u << best) - 1;
+    for (int j = 0; j < n; j++){
+      uint32_t q = u[j] >> best;
+      if (q < PACK_ESCAPE) writer.put(((1u << q) - 1) | ((u[j] & mask) << (q + 1)), (int)q + 1 + best);
+      else writer.put(((1u << PACK_ESCAPE) - 1) | (u[j] << PACK_ESCAPE), PACK_ESCAPE + PACK_RAW_BITS);
+    }
+  }
+}
+
+template <int MODE>
+static bool unpack_samples(BitReader& reader, const unsigned char* previous, unsigned char* data, int length){
+
+  for (int start = 0; start < length; start += LIBERAD_PACK_BLOCK){
+    int n = length - start < LIBERAD_PACK_BLOCK ? length - start : LIBERAD_PACK_BLOCK;
+    reader.refill();
+    int k = (int)reader.take(PACK_K_BITS);
+    if (k > PACK_MAX_K) return false;
+    uint32_t mask = (1u << k) - 1;
+
+    for (int j = 0; j < n; j++){
+      reader.refill();
+      int q = reader.ones();
+      uint32_t u;
+      if (q < PACK_ESCAPE){
+        uint32_t code = reader.take(q + 1 + k);
+        u = ((uint32_t)q << k) | ((code >> (q + 1)) & mask);
+      } else {
+        u = reader.take(PACK_ESCAPE + PACK_RAW_BITS) >> PACK_ESCAPE;
+      }
+
+      int i = start + j;
+      int value = predict(MODE, data, previous, i) + unzigzag(u);
+      if ((unsigned)value > 255) return false;
+      data[i] = (unsigned char)value;
+    }
+    if (reader.failed) return false;
+  }
+  return true;
+}
+
+int liberad_pack_trace(const unsigned char* data, int length, const unsigned char* previous, int previous_length,
+                       unsigned char* out, int capacity){
+
+  if (capacity < 1) return 0;
+  if (previous_length != length) previous = nullptr;
+
+  /* Picks the predictor leaving the smallest residuals */
+  int mode = PACK_INTRA;
+  if (previous && length > 0){
+    int sums[3] = {0, 0, 0};
+    sums[1] = sums[2] = data[0] > previous[0] ? data[0] - previous[0] : previous[0] - data[0];
+    sums[0] = data[0] > 128 ? data[0] - 128 : 128 - data[0];
+    for (int i = 1; i < length; i++){
+      int intra = data[i] - data[i - 1];
+      int inter = data[i] - previous[i];
+      int both = intra - (previous[i] - previous[i - 1]);
+      sums[0] += intra < 0 ? -intra : intra;
+      sums[1] += inter < 0 ? -inter : inter;
+      sums[2] += both < 0 ? -both : both;
+    }
+    if (sums[1] < sums[mode]) mode = PACK_INTER;
+    if (sums[2] < sums[mode]) mode = PACK_BOTH;
+  }
+
+  out[0] = (unsigned char)mode;
+  BitWriter writer(out + 1, capacity - 1);
+  if (mode == PACK_INTRA) pack_samples<PACK_INTRA>(data, length, previous, writer);
+  else if (mode == PACK_INTER) pack_samples<PACK_INTER>(data, length, previous, writer);
+  else pack_samples<PACK_BOTH>(data, length, previous, writer);
+
+  int bytes = writer.finish();
+  return bytes || length == 0 ? bytes + 1 : 0;
+}
+
+int liberad_unpack_trace(const unsigned char* in, int available, const unsigned char* previous, int previous_length,
+                         unsigned char* data, int length){
+
+  if (available < 1 || in[0] > PACK_BOTH) return 0;
+  int mode = in[0];
+  if (mode != PACK_INTRA && (!previous || previous_length != length)) return 0;
+
+  BitReader reader(in + 1, available - 1);
+  bool ok;
+  if (mode == PACK_INTRA) ok = unpack_samples<PACK_INTRA>(reader, previous, data, length);
+  else if (mode == PACK_INTER) ok = unpack_samples<PACK_INTER>(reader, previous, data, length);
+  else ok = unpack_samples<PACK_BOTH>(reader, previous, data, length);
+  return ok ? reader.consumed() + 1 : 0;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+size_t liberad_pack_chunk(const unsigned char* chunk, unsigned char* payload, size_t capacity){
+
+  const LiberadChunkHeader* h = (const LiberadChunkHeader*)chunk;
+  size_t records = (size_t)h->trace_count * sizeof(LiberadTraceRecord);
+  if (records > capacity) return 0;
+
+  size_t end = sizeof(LiberadChunkHeader) + h->payload_bytes;
+  size_t offset = sizeof(LiberadChunkHeader);
+  size_t packed = records;
+  const unsigned char* previous = nullptr;
+  int previous_length = 0;
+
+  for (uint32_t t = 0; t < h->trace_count; t++){
+    if (offset + sizeof(LiberadTraceRecord) > end) return 0;
+    const LiberadTraceRecord* r = (const LiberadTraceRecord*)(chunk + offset);
+    const unsigned char* data = chunk + offset + sizeof(LiberadTraceRecord);
+    memcpy(payload + t * sizeof(LiberadTraceRecord), r, sizeof(LiberadTraceRecord));
+
+    size_t room = capacity - packed;
+    int bytes = liberad_pack_trace(data, r->length, previous, previous_length, payload + packed, room > 0x7FFFFFFF ? 0x7FFFFFFF : (int)room);
+    if (bytes == 0) return 0;
+    packed += bytes;
+
+    previous = data;
+    previous_length = r->length;
+    offset += sizeof(LiberadTraceRecord) + ((r->length + 7u) & ~7u);
+  }
+  return packed;
+}
+
+bool liberad_unpack_chunk(const unsigned char* chunk, unsigned char* image){
+
+  const LiberadChunkHeader* h = (const LiberadChunkHeader*)chunk;
+  const unsigned char* payload = chunk + sizeof(LiberadChunkHeader);
+  size_t records = (size_t)h->trace_count * sizeof(LiberadTraceRecord);
+  if (records > h->payload_bytes) return false;
+
+  LiberadChunkHeader* out = (LiberadChunkHeader*)image;
+  *out = *h;
+  out->type = LIBERAD_CHUNK_TRACES;
+  out->payload_bytes = h->unpacked_bytes;
+
+  size_t end = sizeof(LiberadChunkHeader) + h->unpacked_bytes;
+  size_t offset = sizeof(LiberadChunkHeader);
+  size_t packed = records;
+  const unsigned char* previous = nullptr;
+  int previous_length = 0;
+
+  for (uint32_t t = 0; t < h->trace_count; t++){
+    LiberadTraceRecord r;
+    memcpy(&r, payload + t * sizeof(LiberadTraceRecord), sizeof(r));
+    size_t padded = (r.length + 7u) & ~7u;
+    if (offset + sizeof(LiberadTraceRecord) + padded > end) return false;
+
+    unsigned char* data = image + offset + sizeof(LiberadTraceRecord);
+    memcpy(image + offset, &r, sizeof(r));
+    int bytes = liberad_unpack_trace(payload + packed, (int)(h->payload_bytes - packed), previous, previous_length, data, r.length);
+    if (bytes == 0) return false;
+    memset(data + r.length, 0, padded - r.length);
+    packed += bytes;
+
+    previous = data;
+    previous_length = r.length;
+    offset += sizeof(LiberadTraceRecord) + padded;
+  }
+  return offset == end;
+}
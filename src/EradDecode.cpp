@@ -0,0 +1,485 @@
+#include "../include/liberad.h"
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIBERAD_DECODE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LIBERAD_DECODE_ARM
+#include <arm_neon.h>
+#endif
+
+typedef void (*DecodeInt16)(const unsigned char* samples, int count, int shift, short* out);
+typedef void (*DecodeFloat)(const unsigned char* samples, int count, float scale, float* out);
+typedef int (*FindByte)(const unsigned char* data, int count, unsigned char value);
+typedef void (*EncodeFloat)(const float* values, int count, unsigned char* samples);
+typedef void (*StackSamples)(const unsigned char* samples, int count, uint16_t* sums, unsigned char* low, unsigned char* high);
+
+struct DecodeKernels {
+  LiberadDecodeIsa isa;
+  DecodeInt16 int16;
+  DecodeFloat f32;
+  FindByte find;
+  EncodeFloat encode;
+  StackSamples stack;
+};
+
+// -------------------------------------------------------------------------------------------------
+// Reference implementation. The SIMD paths must give exactly the same results.
+
+static void decode_int16_scalar(const unsigned char* samples, int count, int shift, short* out){
+  for (int i = 0; i < count; i++){
+    out[i] = (short)(((int)samples[i] - 128) * (1 << shift));
+  }
+}
+
+static void decode_float_scalar(const unsigned char* samples, int count, float scale, float* out){
+  for (int i = 0; i < count; i++){
+    out[i] = (float)((int)samples[i] - 128) * scale;
+  }
+}
+
+static int find_byte_scalar(const unsigned char* data, int count, unsigned char value){
+  for (int i = 0; i < count; i++){
+    if (data[i] == value) return i;
+  }
+  return count;
+}
+
+static void encode_float_scalar(const float* values, int count, unsigned char* samples){
+  for (int i = 0; i < count; i++){
+    long value = lrintf(values[i]);
+    samples[i] = (unsigned char)((value < -128 ? -128 : value > 127 ? 127 : value) + 128);
+  }
+}
+
+static void stack_samples_scalar(const unsigned char* samples, int count, uint16_t* sums, unsigned char* low, unsigned char* high){
+  for (int i = 0; i < count; i++){
+    sums[i] = (uint16_t)(sums[i] + samples[i]);
+    if (samples[i] < low[i]) low[i] = samples[i];
+    if (samples[i] > high[i]) high[i] = samples[i];
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+// x86. Flipping the top bit turns an unsigned sample into sample - 128 as a signed byte.
+
+#ifdef LIBERAD_DECODE_X86
+
+__attribute__((target("sse2")))
+static void decode_int16_sse2(const unsigned char* samples, int count, int shift, short* out){
+  const __m128i bias = _mm_set1_epi8((char)0x80);
+  const __m128i bits = _mm_cvtsi32_si128(shift);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    __m128i raw = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(samples + i)), bias);
+    __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(raw, raw), 8);
+    __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(raw, raw), 8);
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sll_epi16(lo, bits));
+    _mm_storeu_si128((__m128i*)(out + i + 8), _mm_sll_epi16(hi, bits));
+  }
+  decode_int16_scalar(samples + i, count - i, shift, out + i);
+}
+
+__attribute__((target("sse2")))
+static void decode_float_sse2(const unsigned char* samples, int count, float scale, float* out){
+  const __m128i bias = _mm_set1_epi8((char)0x80);
+  const __m128 factor = _mm_set1_ps(scale);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    __m128i raw = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(samples + i)), bias);
+    __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(raw, raw), 8);
+    __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(raw, raw), 8);
+    __m128i words[4] = {
+      _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16), _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16),
+      _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16), _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)
+    };
+    for (int k = 0; k < 4; k++){
+      _mm_storeu_ps(out + i + 4 * k, _mm_mul_ps(_mm_cvtepi32_ps(words[k]), factor));
+    }
+  }
+  decode_float_scalar(samples + i, count - i, scale, out + i);
+}
+
+__attribute__((target("sse2")))
+static int find_byte_sse2(const unsigned char* data, int count, unsigned char value){
+  const __m128i needle = _mm_set1_epi8((char)value);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    int hits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), needle));
+    if (hits) return i + __builtin_ctz(hits);
+  }
+  return i + find_byte_scalar(data + i, count - i, value);
+}
+
+/* Rounds to nearest even like lrintf, then narrows with signed saturation to -128..127 */
+__attribute__((target("sse2")))
+static void encode_float_sse2(const float* values, int count, unsigned char* samples){
+  const __m128i bias = _mm_set1_epi8((char)0x80);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    __m128i a = _mm_cvtps_epi32(_mm_loadu_ps(values + i));
+    __m128i b = _mm_cvtps_epi32(_mm_loadu_ps(values + i + 4));
+    __m128i c = _mm_cvtps_epi32(_mm_loadu_ps(values + i + 8));
+    __m128i d = _mm_cvtps_epi32(_mm_loadu_ps(values + i + 12));
+    __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    _mm_storeu_si128((__m128i*)(samples + i), _mm_xor_si128(bytes, bias));
+  }
+  encode_float_scalar(values + i, count - i, samples + i);
+}
+
+__attribute__((target("sse2")))
+static void stack_samples_sse2(const unsigned char* samples, int count, uint16_t* sums, unsigned char* low, unsigned char* high){
+  const __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    __m128i raw = _mm_loadu_si128((const __m128i*)(samples + i));
+    __m128i lo = _mm_loadu_si128((const __m128i*)(sums + i));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(sums + i + 8));
+    _mm_storeu_si128((__m128i*)(sums + i), _mm_add_epi16(lo, _mm_unpacklo_epi8(raw, zero)));
+    _mm_storeu_si128((__m128i*)(sums + i + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(raw, zero)));
+    _mm_storeu_si128((__m128i*)(low + i), _mm_min_epu8(_mm_loadu_si128((const __m128i*)(low + i)), raw));
+    _mm_storeu_si128((__m128i*)(high + i), _mm_max_epu8(_mm_loadu_si128((const __m128i*)(high + i)), raw));
+  }
+  stack_samples_scalar(samples + i, count - i, sums + i, low + i, high + i);
+}
+
+__attribute__((target("avx2")))
+static void decode_int16_avx2(const unsigned char* samples, int count, int shift, short* out){
+  const __m128i bias = _mm_set1_epi8((char)0x80);
+  const __m128i bits = _mm_cvtsi32_si128(shift);
+  int i = 0;
+  for (; i + 32 <= count; i += 32){
+    __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(samples + i)), bias);
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(samples + i + 16)), bias);
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_sll_epi16(_mm256_cvtepi8_epi16(a), bits));
+    _mm256_storeu_si256((__m256i*)(out + i + 16), _mm256_sll_epi16(_mm256_cvtepi8_epi16(b), bits));
+  }
+  decode_int16_sse2(samples + i, count - i, shift, out + i);
+}
+
+__attribute__((target("avx2")))
+static void decode_float_avx2(const unsigned char* samples, int count, float scale, float* out){
+  const __m128i bias = _mm_set1_epi8((char)0x80);
+  const __m256 factor = _mm256_set1_ps(scale);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    __m128i raw = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(samples + i)), bias);
+    __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(raw));
+    __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(raw, 8)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(lo, factor));
+    _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(hi, factor));
+  }
+  decode_float_scalar(samples + i, count - i, scale, out + i);
+}
+
+__attribute__((target("avx2")))
+static int find_byte_avx2(const unsigned char* data, int count, unsigned char value){
+  const __m256i needle = _mm256_set1_epi8((char)value);
+  int i = 0;
+  for (; i + 32 <= count; i += 32){
+    unsigned hits = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), needle));
+    if (hits) return i + __builtin_ctz(hits);
+  }
+  return i + find_byte_sse2(data + i, count - i, value);
+}
+
+__attribute__((target("avx2")))
+static void stack_samples_avx2(const unsigned char* samples, int count, uint16_t* sums, unsigned char* low, unsigned char* high){
+  int i = 0;
+  for (; i + 32 <= count; i += 32){
+    __m256i raw = _mm256_loadu_si256((const __m256i*)(samples + i));
+    __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(raw));
+    __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(raw, 1));
+    _mm256_storeu_si256((__m256i*)(sums + i), _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(sums + i)), lo));
+    _mm256_storeu_si256((__m256i*)(sums + i + 16), _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(sums + i + 16)), hi));
+    _mm256_storeu_si256((__m256i*)(low + i), _mm256_min_epu8(_mm256_loadu_si256((const __m256i*)(low + i)), raw));
+    _mm256_storeu_si256((__m256i*)(high + i), _mm256_max_epu8(_mm256_loadu_si256((const __m256i*)(high + i)), raw));
+  }
+  stack_samples_sse2(samples + i, count - i, sums + i, low + i, high + i);
+}
+
+#endif
+
+// -------------------------------------------------------------------------------------------------
+// NEON
+
+#ifdef LIBERAD_DECODE_ARM
+
+static void decode_int16_neon(const unsigned char* samples, int count, int shift, short* out){
+  const uint8x16_t bias = vdupq_n_u8(0x80);
+  const int16x8_t bits = vdupq_n_s16((short)shift);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    int8x16_t raw = vreinterpretq_s8_u8(veorq_u8(vld1q_u8(samples + i), bias));
+    vst1q_s16(out + i, vshlq_s16(vmovl_s8(vget_low_s8(raw)), bits));
+    vst1q_s16(out + i + 8, vshlq_s16(vmovl_s8(vget_high_s8(raw)), bits));
+  }
+  decode_int16_scalar(samples + i, count - i, shift, out + i);
+}
+
+static void decode_float_neon(const unsigned char* samples, int count, float scale, float* out){
+  const uint8x16_t bias = vdupq_n_u8(0x80);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    int8x16_t raw = vreinterpretq_s8_u8(veorq_u8(vld1q_u8(samples + i), bias));
+    int16x8_t lo = vmovl_s8(vget_low_s8(raw));
+    int16x8_t hi = vmovl_s8(vget_high_s8(raw));
+    vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(lo))), scale));
+    vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(lo))), scale));
+    vst1q_f32(out + i + 8, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(hi))), scale));
+    vst1q_f32(out + i + 12, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(hi))), scale));
+  }
+  decode_float_scalar(samples + i, count - i, scale, out + i);
+}
+
+/* NEON has no movemask, so a block with a match is searched again byte by byte */
+static int find_byte_neon(const unsigned char* data, int count, unsigned char value){
+  const uint8x16_t needle = vdupq_n_u8(value);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    uint8x16_t hits = vceqq_u8(vld1q_u8(data + i), needle);
+    uint64x2_t lanes = vreinterpretq_u64_u8(hits);
+    if (vgetq_lane_u64(lanes, 0) | vgetq_lane_u64(lanes, 1)) return i + find_byte_scalar(data + i, 16, value);
+  }
+  return i + find_byte_scalar(data + i, count - i, value);
+}
+
+#ifdef __aarch64__
+static void encode_float_neon(const float* values, int count, unsigned char* samples){
+  const uint8x16_t bias = vdupq_n_u8(0x80);
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    int16x8_t lo = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(values + i))), vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(values + i + 4))));
+    int16x8_t hi = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(values + i + 8))), vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(values + i + 12))));
+    int8x16_t bytes = vcombine_s8(vqmovn_s16(lo), vqmovn_s16(hi));
+    vst1q_u8(samples + i, veorq_u8(vreinterpretq_u8_s8(bytes), bias));
+  }
+  encode_float_scalar(values + i, count - i, samples + i);
+}
+#else
+/* 32 bit NEON has no conversion rounding to nearest */
+#define encode_float_neon encode_float_scalar
+#endif
+
+static void stack_samples_neon(const unsigned char* samples, int count, uint16_t* sums, unsigned char* low, unsigned char* high){
+  int i = 0;
+  for (; i + 16 <= count; i += 16){
+    uint8x16_t raw = vld1q_u8(samples + i);
+    vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), vget_low_u8(raw)));
+    vst1q_u16(sums + i + 8, vaddw_u8(vld1q_u16(sums + i + 8), vget_high_u8(raw)));
+    vst1q_u8(low + i, vminq_u8(vld1q_u8(low + i), raw));
+    vst1q_u8(high + i, vmaxq_u8(vld1q_u8(high + i), raw));
+  }
+  stack_samples_scalar(samples + i, count - i, sums + i, low + i, high + i);
+}
+
+#endif
+
+// -------------------------------------------------------------------------------------------------
+
+/* @return kernels for isa, with int16 set to nullptr if this CPU or build doesn't support it */
+static DecodeKernels decode_kernels(LiberadDecodeIsa isa){
+
+  DecodeKernels kernels = {isa, nullptr, nullptr, nullptr, nullptr, nullptr};
+
+  switch (isa){
+    case LIBERAD_DECODE_SCALAR:
+      kernels.int16 = decode_int16_scalar;
+      kernels.f32 = decode_float_scalar;
+      kernels.find = find_byte_scalar;
+      kernels.encode = encode_float_scalar;
+      kernels.stack = stack_samples_scalar;
+      break;
+#ifdef LIBERAD_DECODE_X86
+    case LIBERAD_DECODE_SSE2:
+      if (!__builtin_cpu_supports("sse2")) break;
+      kernels.int16 = decode_int16_sse2;
+      kernels.f32 = decode_float_sse2;
+      kernels.find = find_byte_sse2;
+      kernels.encode = encode_float_sse2;
+      kernels.stack = stack_samples_sse2;
+      break;
+    case LIBERAD_DECODE_AVX2:
+      if (!__builtin_cpu_supports("avx2")) break;
+      kernels.int16 = decode_int16_avx2;
+      kernels.f32 = decode_float_avx2;
+      kernels.find = find_byte_avx2;
+      kernels.encode = encode_float_sse2;
+      kernels.stack = stack_samples_avx2;
+      break;
+#endif
+#ifdef LIBERAD_DECODE_ARM
+    case LIBERAD_DECODE_NEON:
+      kernels.int16 = decode_int16_neon;
+      kernels.f32 = decode_float_neon;
+      kernels.find = find_byte_neon;
+      kernels.encode = encode_float_neon;
+      kernels.stack = stack_samples_neon;
+      break;
+#endif
+    case LIBERAD_DECODE_AUTO: {
+      static const LiberadDecodeIsa preferred[] = {LIBERAD_DECODE_AVX2, LIBERAD_DECODE_NEON, LIBERAD_DECODE_SSE2};
+      for (LiberadDecodeIsa candidate : preferred){
+        kernels = decode_kernels(candidate);
+        if (kernels.int16) return kernels;
+      }
+      return decode_kernels(LIBERAD_DECODE_SCALAR);
+    }
+    default:
+      break;
+  }
+
+  return kernels;
+}
+
+/* Kernels of every instruction set, the LIBERAD_DECODE_AUTO entry being a copy of the best available one */
+static const DecodeKernels* kernels_for(LiberadDecodeIsa isa){
+  static const DecodeKernels table[] = {
+    decode_kernels(LIBERAD_DECODE_AUTO), decode_kernels(LIBERAD_DECODE_SCALAR), decode_kernels(LIBERAD_DECODE_SSE2),
+    decode_kernels(LIBERAD_DECODE_AVX2), decode_kernels(LIBERAD_DECODE_NEON)
+  };
+  return &table[isa];
+}
+
+/* Kernels in use, replaced as a whole so a decode never mixes two instruction sets. nullptr until selected. */
+static std::atomic<const DecodeKernels*> active_kernels{nullptr};
+
+static const DecodeKernels* current_kernels(){
+  const DecodeKernels* kernels = active_kernels.load(std::memory_order_acquire);
+  return kernels ? kernels : kernels_for(LIBERAD_DECODE_AUTO);
+}
+
+/* Selects the instruction set used by the decoder. Intended for validating the SIMD paths against the scalar
+* reference and for benchmarks; the default is the best instruction set of the CPU.
+* @param LiberadDecodeIsa isa - instruction set to use, LIBERAD_DECODE_AUTO for the best available
+* @return LIBERAD_ERR if isa is not available on this CPU or in this build
+* @return the selected instruction set else
+*/
+int liberad_set_decode_isa(LiberadDecodeIsa isa){
+
+  if (isa < LIBERAD_DECODE_AUTO || isa > LIBERAD_DECODE_NEON || !kernels_for(isa)->int16){
+    ELOG(LIBERAD_DEBUG) << "Decoder instruction set " << (int)isa << " not available";
+    return LIBERAD_ERR;
+  }
+
+  const DecodeKernels* kernels = kernels_for(isa);
+  active_kernels.store(kernels, std::memory_order_release);
+  ELOG(LIBERAD_DEBUG) << "Decoder instruction set " << (int)kernels->isa;
+  return kernels->isa;
+}
+
+/* @return instruction set the decoder runs on */
+LiberadDecodeIsa liberad_get_decode_isa(){
+  return current_kernels()->isa;
+}
+
+/* Gain levels double the amplitude from one level to the next, so samples taken at a lower level are
+* brought to the LEVEL5 scale by a power of two.
+* @param Gain gain - gain the trace was recorded with
+* @return shift in bits, 0 for unknown values
+*/
+static int gain_shift(Gain gain){
+  if (gain < LEVEL1 || gain > LEVEL5) return 0;
+  return LEVEL5 - gain;
+}
+
+/* Factor bringing samples recorded at gain to the amplitude scale of LEVEL5
+* @param Gain gain - gain the trace was recorded with
+* @return 2^(LEVEL5 - gain), 1 for unknown values
+*/
+float liberad_gain_scale(Gain gain){
+  return (float)(1 << gain_shift(gain));
+}
+
+/* Decodes quantized samples to signed 16 bit values
+* @param const unsigned char* samples - quantized samples, without the trace trailer
+* @param int count - number of samples
+* @param int shift - left shift applied to every value, 0 to 7
+* @param short* out - count decoded values
+*/
+void liberad_decode_int16(const unsigned char* samples, int count, int shift, short* out){
+  current_kernels()->int16(samples, count, shift, out);
+}
+
+/* Decodes quantized samples to scaled floats
+* @param const unsigned char* samples - quantized samples, without the trace trailer
+* @param int count - number of samples
+* @param float scale - factor applied to every value
+* @param float* out - count decoded values
+*/
+void liberad_decode_float(const unsigned char* samples, int count, float scale, float* out){
+  current_kernels()->f32(samples, count, scale, out);
+}
+
+/* Searches a byte stream for a value, e.g. the delimiter ending each trace
+* @param const unsigned char* data - bytes to search
+* @param int count - number of bytes
+* @param unsigned char value - byte to find
+* @return index of the first byte equal to value, count if there is none
+*/
+int liberad_find_byte(const unsigned char* data, int count, unsigned char value){
+  return current_kernels()->find(data, count, value);
+}
+
+/* Quantizes signed values back to samples, the inverse of liberad_decode_float with a scale of 1
+* @param const float* values - signed values, sample - 128
+* @param int count - number of values
+* @param unsigned char* samples - count samples, values rounded to the nearest integer, ties to even, plus 128 and
+* clipped to 0 and 255
+*/
+void liberad_encode_float(const float* values, int count, unsigned char* samples){
+  current_kernels()->encode(values, count, samples);
+}
+
+/* Adds quantized samples to running sums and keeps the extremes seen at each index, for stacking traces
+* @param const unsigned char* samples - quantized samples, without the trace trailer
+* @param int count - number of samples
+* @param uint16_t* sums - count sums. They hold up to 257 traces without overflowing.
+* @param unsigned char* low - count lowest samples so far, 255 before the first trace
+* @param unsigned char* high - count highest samples so far, 0 before the first trace
+*/
+void liberad_stack_samples(const unsigned char* samples, int count, uint16_t* sums, unsigned char* low, unsigned char* high){
+  current_kernels()->stack(samples, count, sums, low, high);
+}
+
+/* Decodes a batch of traces into a sample matrix, one trace per row
+* @param const Trace* traces - traces to decode, with samples and sample_count set
+* @param int count - number of traces
+* @param LiberadSampleMatrix* matrix - destination. Its rows are set to count.
+* @param bool scale_by_gain - bring every row to the LEVEL5 amplitude scale
+* @return LIBERAD_ERR if count exceeds the capacity of matrix
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_decode_traces(const Trace* traces, int count, LiberadSampleMatrix* matrix, bool scale_by_gain){
+
+  if (count < 0 || count > matrix->capacity){
+    ELOG(LIBERAD_ERROR) << "Can't decode " << count << " traces into a matrix of " << matrix->capacity << " rows";
+    return LIBERAD_ERR;
+  }
+
+  const DecodeKernels* kernels = current_kernels();
+
+  for (int row = 0; row < count; row++){
+    const Trace& trace = traces[row];
+    int samples = trace.samples ? std::min(trace.sample_count, matrix->columns) : 0;
+    int shift = scale_by_gain ? gain_shift(trace.gain) : 0;
+
+    if (matrix->format == LIBERAD_SAMPLES_INT16){
+      short* out = matrix->row_int16(row);
+      kernels->int16(trace.samples, samples, shift, out);
+      std::fill(out + samples, out + matrix->stride, (short)0);
+    } else {
+      float* out = matrix->row_float(row);
+      kernels->f32(trace.samples, samples, (float)(1 << shift), out);
+      std::fill(out + samples, out + matrix->stride, 0.0f);
+    }
+  }
+
+  matrix->rows = count;
+  return LIBERAD_SUCCESS;
+}
@@ -0,0 +1,225 @@
+#include "../include/liberad.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Side of the square tiles a block is transposed in: 64 rows of 64 bytes in and out fit the L1 cache */
+#define LIBERAD_TRANSPOSE_TILE 64
+
+static uint64_t liberad_round_up(uint64_t value, uint64_t align){
+  return (value + align - 1) / align * align;
+}
+
+/* Transposes rows x columns bytes into columns x rows, one tile at a time, so reads and writes both stay within a
+* few cache lines per row
+*/
+static void liberad_transpose(const unsigned char* in, int rows, int columns, unsigned char* out){
+
+  for (int r0 = 0; r0 < rows; r0 += LIBERAD_TRANSPOSE_TILE){
+    int r1 = std::min(r0 + LIBERAD_TRANSPOSE_TILE, rows);
+    for (int c0 = 0; c0 < columns; c0 += LIBERAD_TRANSPOSE_TILE){
+      int c1 = std::min(c0 + LIBERAD_TRANSPOSE_TILE, columns);
+      for (int c = c0; c < c1; c++){
+        unsigned char* o = out + (size_t)c * rows;
+        for (int r = r0; r < r1; r++) o[r] = in[(size_t)r * columns + c];
+      }
+    }
+  }
+}
+
+/* Writes the rows and records of a block of traces starting at trace first */
+static bool liberad_write_block(int fd, const LiberadDepthHeader& header, uint64_t first, int count, const unsigned char* block,
+                                unsigned char* rows, const std::vector<LiberadTraceRecord>& records){
+
+  int samples = (int)header.sample_count;
+  liberad_transpose(block, count, samples, rows);
+  for (int k = 0; k < samples; k++){
+    if (!liberad_write_all(fd, rows + (size_t)k * count, count, header.rows_offset + k * header.row_stride + first)) return false;
+  }
+  return liberad_write_all(fd, (const unsigned char*)records.data(), count * sizeof(LiberadTraceRecord),
+                           header.records_offset + first * sizeof(LiberadTraceRecord));
+}
+
+/* Converts a survey file into a depth-major store, see EradDepth.h. The store is sized up front and filled one block
+* of traces at a time; its header is marked complete once every block was written and flushed, so a store cut short
+* is refused by DepthStore.
+*/
+int liberad_transpose_survey(const char* survey_path, const char* store_path, const LiberadTransposeParams* params){
+
+  LiberadTransposeParams p;
+  if (params) p = *params;
+  if (p.block_traces < 1){
+    ELOG(LIBERAD_ERROR) << "Invalid transpose parameters";
+    return LIBERAD_ERR;
+  }
+
+  SurveyFile survey;
+  if (survey.open(survey_path) != LIBERAD_SUCCESS) return LIBERAD_ERR;
+
+  LiberadSurveyCursor cursor = survey.seek_index(0);
+  Trace trace;
+  if (!survey.read(cursor, &trace) || trace.sample_count <= 0){
+    ELOG(LIBERAD_ERROR) << "Survey file holds no traces: " << survey_path;
+    return LIBERAD_ERR;
+  }
+
+  LiberadDepthHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LIBERAD_DEPTH_MAGIC, sizeof(header.magic));
+  header.version = LIBERAD_DEPTH_VERSION;
+  header.trace_count = survey.trace_count();
+  header.sample_count = (uint32_t)trace.sample_count;
+  header.records_offset = LIBERAD_RECORD_ALIGN;
+  header.rows_offset = liberad_round_up(header.records_offset + header.trace_count * sizeof(LiberadTraceRecord), LIBERAD_RECORD_ALIGN);
+  header.row_stride = liberad_round_up(header.trace_count, LIBERAD_DEPTH_ROW_ALIGN);
+  header.survey = survey.header();
+
+  int fd = ::open(store_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0){
+    ELOG(LIBERAD_ERROR) << "Could not create depth store " << store_path << ": " << strerror(errno);
+    return LIBERAD_ERR;
+  }
+
+  std::vector<unsigned char> first_block(LIBERAD_RECORD_ALIGN);
+  memcpy(&first_block[0], &header, sizeof(header));
+  if (ftruncate(fd, (off_t)(header.rows_offset + header.sample_count * header.row_stride)) != 0 ||
+      !liberad_write_all(fd, &first_block[0], first_block.size(), 0)){
+    ELOG(LIBERAD_ERROR) << "Could not write depth store " << store_path << ": " << strerror(errno);
+    ::close(fd);
+    return LIBERAD_ERR;
+  }
+
+  int samples = trace.sample_count;
+  int block_traces = (int)std::min<uint64_t>(p.block_traces, header.trace_count);
+  std::vector<unsigned char> block((size_t)block_traces * samples);
+  std::vector<unsigned char> rows(block.size());
+  std::vector<LiberadTraceRecord> records;
+  records.reserve(block_traces);
+
+  uint64_t written = 0;
+  bool ok = true;
+  bool more = true;
+  while (ok && more){
+    unsigned char* row = &block[records.size() * samples];
+    int n = std::min(trace.sample_count, samples);
+    memcpy(row, trace.samples, n);
+    memset(row + n, 128, samples - n);
+
+    LiberadTraceRecord r;
+    memset(&r, 0, sizeof(r));
+    r.sequence = trace.sequence;
+    r.timestamp_ns = trace.timestamp_ns;
+    r.position = trace.position;
+    r.length = (uint16_t)trace.length;
+    r.gain = (uint8_t)trace.gain;
+    r.window = (uint8_t)trace.window;
+    r.steps = trace.steps;
+    records.push_back(r);
+
+    more = written + records.size() < header.trace_count && survey.read(cursor, &trace);
+    if ((int)records.size() == block_traces || !more){
+      ok = liberad_write_block(fd, header, written, (int)records.size(), &block[0], &rows[0], records);
+      written += records.size();
+      records.clear();
+    }
+  }
+
+  /* Damaged chunks of the survey are skipped, leaving fewer traces than it announced */
+  header.trace_count = written;
+  header.flags = LIBERAD_DEPTH_COMPLETE;
+  ok = ok && fdatasync(fd) == 0 && liberad_write_all(fd, (const unsigned char*)&header, sizeof(header), 0) && fdatasync(fd) == 0;
+  if (!ok) ELOG(LIBERAD_ERROR) << "Could not write depth store " << store_path << ": " << strerror(errno);
+  ::close(fd);
+  return ok ? LIBERAD_SUCCESS : LIBERAD_ERR;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+DepthStore::~DepthStore(){
+  close();
+}
+
+/* Maps a depth store and checks that its header describes a complete store fitting the file
+* @param const char* path - store written by liberad_transpose_survey
+* @return LIBERAD_ERR if the file can't be mapped, is not a complete depth store or is cut off
+* @return LIBERAD_SUCCESS else
+*/
+int DepthStore::open(const char* path){
+
+  close();
+
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0){
+    ELOG(LIBERAD_ERROR) << "Could not open depth store " << path << ": " << strerror(errno);
+    return LIBERAD_ERR;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LiberadDepthHeader)){
+    ELOG(LIBERAD_ERROR) << "Not a depth store: " << path;
+    ::close(fd);
+    return LIBERAD_ERR;
+  }
+
+  void* memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (memory == MAP_FAILED){
+    ELOG(LIBERAD_ERROR) << "Could not map depth store " << path << ": " << strerror(errno);
+    return LIBERAD_ERR;
+  }
+  map = (unsigned char*)memory;
+  map_size = st.st_size;
+
+  const LiberadDepthHeader& h = *(const LiberadDepthHeader*)map;
+  if (memcmp(h.magic, LIBERAD_DEPTH_MAGIC, sizeof(h.magic)) != 0 || h.version != LIBERAD_DEPTH_VERSION ||
+      !(h.flags & LIBERAD_DEPTH_COMPLETE) || h.row_stride < h.trace_count ||
+      h.records_offset + h.trace_count * sizeof(LiberadTraceRecord) > h.rows_offset ||
+      h.rows_offset + (uint64_t)h.sample_count * h.row_stride > map_size){
+    ELOG(LIBERAD_ERROR) << "Not a complete depth store of a known version: " << path;
+    close();
+    return LIBERAD_ERR;
+  }
+  file_header = h;
+  return LIBERAD_SUCCESS;
+}
+
+void DepthStore::close(){
+
+  if (map) munmap(map, map_size);
+  map = nullptr;
+  map_size = 0;
+  file_header = LiberadDepthHeader();
+}
+
+const LiberadTraceRecord* DepthStore::records() const {
+  return map ? (const LiberadTraceRecord*)(map + file_header.records_offset) : nullptr;
+}
+
+const unsigned char* DepthStore::slice(int sample) const {
+  if (!map || sample < 0 || sample >= (int)file_header.sample_count) return nullptr;
+  return map + file_header.rows_offset + (uint64_t)sample * file_header.row_stride;
+}
+
+/* Sums the rows of the samples into out one row at a time, so each row is read once and in order
+* @param int first_sample - first sample of the depth window
+* @param int end_sample - sample after the last one of the depth window
+* @param float* out - receives trace_count values, in quantization steps
+*/
+int DepthStore::amplitude_map(int first_sample, int end_sample, float* out) const {
+
+  if (!map || first_sample < 0 || end_sample > (int)file_header.sample_count || first_sample >= end_sample) return LIBERAD_ERR;
+
+  size_t n = (size_t)file_header.trace_count;
+  std::fill(out, out + n, 0.0f);
+  for (int k = first_sample; k < end_sample; k++){
+    const unsigned char* row = slice(k);
+    for (size_t t = 0; t < n; t++) out[t] += (float)std::abs((int)row[t] - 128);
+  }
+  float scale = 1.0f / (float)(end_sample - first_sample);
+  for (size_t t = 0; t < n; t++) out[t] *= scale;
+  return LIBERAD_SUCCESS;
+}
@@ -0,0 +1,383 @@
+#include "EradExecutor.h"
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define LIBERAD_LANE_SLOTS 256
+#define LIBERAD_LANE_BATCH 64
+#define LIBERAD_PUMP_WAIT_US 100000
+
+extern libusb_context* context;
+
+static EventExecutor executor;
+
+// -------------------------------------------------------------------------------------------------
+
+ExecutorLane::ExecutorLane(Oeradar* device, ExecutorWorker* worker) :
+  device(device),
+  worker(worker),
+  copies(LIBERAD_LANE_SLOTS, LIBERAD_RING_SLOT_SIZE),
+  lent(LIBERAD_LANE_SLOTS),
+  scratch(LIBERAD_RING_SLOT_SIZE){
+}
+
+/* Queues a completed trace for the worker. Lent buffers are retained until the worker has delivered them.
+* If the worker falls behind by a full lane the trace is dropped.
+*/
+void ExecutorLane::handoff(const Trace& trace){
+
+  bool queued;
+  LiberadTraceBuffer* lent_trace = trace.lent;
+  if (lent_trace){
+    device->trace_pool->retain(lent_trace);
+    queued = lent.push(lent_trace);
+    if (!queued) device->trace_pool->release(lent_trace);
+  } else {
+    queued = copies.push(trace);
+  }
+
+  if (!queued){
+    dropped++;
+    ELOG(LIBERAD_DEBUG) << "Executor lane full, trace dropped";
+    return;
+  }
+  worker->notify();
+}
+
+bool ExecutorLane::drain(){
+
+  int delivered = 0;
+  LiberadTraceBuffer* trace;
+  while (delivered < LIBERAD_LANE_BATCH && lent.pop(trace)){
+    device->deliver_in(trace->trace);
+    device->trace_pool->release(trace);
+    delivered++;
+  }
+
+  Trace record;
+  while (delivered < LIBERAD_LANE_BATCH && copies.pop(&record, &scratch[0], (int)scratch.size()) > 0){
+    device->deliver_in(record);
+    delivered++;
+  }
+
+  return delivered > 0;
+}
+
+void ExecutorLane::discard(){
+
+  int count = 0;
+  LiberadTraceBuffer* trace;
+  while (lent.pop(trace)){
+    device->trace_pool->release(trace);
+    count++;
+  }
+  signed char steps;
+  while (copies.pop(&scratch[0], (int)scratch.size(), &steps) > 0) count++;
+
+  if (count > 0) ELOG(LIBERAD_DEBUG) << "Discarded " << count << " undelivered traces";
+}
+
+// -------------------------------------------------------------------------------------------------
+
+void ExecutorWorker::start(int cpu, int rt_priority){
+  running = true;
+  thread = std::thread(&ExecutorWorker::loop, this);
+  liberad_configure_thread(thread, cpu, rt_priority);
+}
+
+void ExecutorWorker::stop(){
+  running = false;
+  {
+    std::lock_guard<std::mutex> lock(wait_mutex);
+    wake.notify_one();
+  }
+  if (thread.joinable()) thread.join();
+}
+
+void ExecutorWorker::add(ExecutorLane* lane){
+  std::lock_guard<std::mutex> lock(lanes_mutex);
+  lanes.push_back(lane);
+}
+
+/* Returns once the worker no longer touches the lane */
+void ExecutorWorker::remove(ExecutorLane* lane){
+  std::lock_guard<std::mutex> lock(lanes_mutex);
+  lanes.erase(std::remove(lanes.begin(), lanes.end(), lane), lanes.end());
+}
+
+size_t ExecutorWorker::load(){
+  std::lock_guard<std::mutex> lock(lanes_mutex);
+  return lanes.size();
+}
+
+void ExecutorWorker::notify(){
+  pending.fetch_add(1, std::memory_order_seq_cst);
+  if (sleeping.load(std::memory_order_seq_cst)){
+    std::lock_guard<std::mutex> lock(wait_mutex);
+    wake.notify_one();
+  }
+}
+
+/* Delivers queued traces of all lanes round-robin and sleeps when there is nothing to deliver */
+void ExecutorWorker::loop(){
+
+  while (running){
+
+    pending.store(0, std::memory_order_seq_cst);
+    bool busy = false;
+    {
+      std::lock_guard<std::mutex> lock(lanes_mutex);
+      for (size_t i = 0; i < lanes.size(); i++){
+        if (lanes[i]->drain()) busy = true;
+      }
+    }
+    if (busy) continue;
+
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    sleeping.store(true, std::memory_order_seq_cst);
+    if (pending.load(std::memory_order_seq_cst) == 0 && running){
+      wake.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    sleeping.store(false, std::memory_order_relaxed);
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+int EventExecutor::start(int threads, const int* cpu_ids, int cpu_count, int rt_priority){
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (running){
+    ELOG(LIBERAD_ERROR) << "Executor already running";
+    return LIBERAD_ERR;
+  }
+
+  if (threads < 1){
+    ELOG(LIBERAD_ERROR) << "Executor needs at least one thread";
+    return LIBERAD_ERR;
+  }
+
+  running = true;
+  pump_thread = std::thread(&EventExecutor::pump, this);
+  liberad_configure_thread(pump_thread, cpu_count > 0 ? cpu_ids[0] : -1, rt_priority);
+
+  for (int i = 1; i < threads; i++){
+    ExecutorWorker* worker = new ExecutorWorker();
+    worker->start(cpu_count > 0 ? cpu_ids[i % cpu_count] : -1, rt_priority);
+    workers.push_back(worker);
+  }
+
+  ELOG(LIBERAD_INFO) << "Executor started with " << threads << " threads";
+  return LIBERAD_SUCCESS;
+}
+
+void EventExecutor::stop(){
+
+  std::vector<Oeradar*> served;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!running) return;
+    served = devices;
+  }
+
+  for (size_t i = 0; i < served.size(); i++) remove(served[i]);
+
+  running = false;
+  libusb_interrupt_event_handler(context);
+  if (pump_thread.joinable()) pump_thread.join();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  free_retired();
+  for (size_t i = 0; i < workers.size(); i++){
+    workers[i]->stop();
+    delete workers[i];
+  }
+  workers.clear();
+  ELOG(LIBERAD_INFO) << "Executor stopped";
+}
+
+/* Deletes lanes of removed devices. The event thread may still have been handing off to them when
+* they were removed, so this only happens on the event thread between event handling or after it stopped.
+*/
+void EventExecutor::free_retired(){
+  for (size_t i = 0; i < retired.size(); i++){
+    retired[i]->discard();
+    delete retired[i];
+  }
+  retired.clear();
+}
+
+/* Adds a TRANSMITTING device. With worker threads its traces are handed to the least loaded worker. */
+int EventExecutor::add(Oeradar* device){
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (!running){
+    ELOG(LIBERAD_ERROR) << "Executor not running. Needs a call to liberad_executor_start";
+    return LIBERAD_ERR;
+  }
+
+  if (device->state != Oeradar::TRANSMITTING){
+    ELOG(LIBERAD_ERROR) << "Device not transmitting or already handled";
+    return LIBERAD_ERR;
+  }
+
+  if (!workers.empty()){
+    ExecutorWorker* worker = workers[0];
+    for (size_t i = 1; i < workers.size(); i++){
+      if (workers[i]->load() < worker->load()) worker = workers[i];
+    }
+    ExecutorLane* lane = new ExecutorLane(device, worker);
+    worker->add(lane);
+    device->lane = lane;
+  }
+
+  devices.push_back(device);
+  device->executor_served = true;
+  device->state = Oeradar::RUNNING;
+  ELOG(LIBERAD_INFO) << "Device added to executor";
+  return LIBERAD_SUCCESS;
+}
+
+/* Removes a device. Traces already handed to its worker and not yet delivered are dropped. Returns once the
+* event thread no longer polls its transport. Must not be called from a callback running on an executor thread.
+*/
+int EventExecutor::remove(Oeradar* device){
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  std::vector<Oeradar*>::iterator it = std::find(devices.begin(), devices.end(), device);
+  if (it == devices.end()){
+    ELOG(LIBERAD_ERROR) << "Device not handled by executor";
+    return LIBERAD_ERR;
+  }
+  devices.erase(it);
+
+  ExecutorLane* lane = device->lane.exchange(nullptr);
+  if (lane){
+    lane->worker->remove(lane);
+    retired.push_back(lane);
+  }
+
+  /* The event thread polls transports without the lock, so a pass that began before may still hold the device */
+  if (polling && std::this_thread::get_id() != pump_thread.get_id()){
+    unsigned long long pass = passes;
+    polled.wait(lock, [&]{ return passes != pass; });
+  }
+
+  device->executor_served = false;
+  device->state = Oeradar::TRANSMITTING;
+  ELOG(LIBERAD_INFO) << "Device removed from executor";
+  return LIBERAD_SUCCESS;
+}
+
+/* Sends queued commands and handles events for every device until the executor is stopped. Transports
+* with their own event source are polled, then the thread waits on the shared libusb context until the
+* earliest event any of them expects. Their interrupt() also wakes the libusb wait.
+*/
+void EventExecutor::pump(){
+
+  std::vector<Oeradar*> served;
+  while (running){
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_retired();
+      served = devices;
+      for (size_t i = 0; i < served.size(); i++) served[i]->drain_commands();
+      polling = true;
+    }
+
+    long wait_us = LIBERAD_PUMP_WAIT_US;
+    for (size_t i = 0; i < served.size(); i++){
+      OeradarTransport* transport = served[i]->transport;
+      if (transport->shares_libusb_context()) continue;
+      transport->handle_events(0);
+      long next = transport->next_event_us();
+      if (next >= 0 && next < wait_us) wait_us = next;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      polling = false;
+      passes++;
+    }
+    polled.notify_all();
+
+    struct timeval tv = {0, wait_us};
+    int r = libusb_handle_events_timeout_completed(context, &tv, NULL);
+    if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED){
+      ELOG(LIBERAD_ERROR) << "Libusb error handling events: " << r;
+    }
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/* Pins a thread to a CPU and/or switches it to SCHED_FIFO. Failures are logged and otherwise ignored -
+* realtime priority usually needs CAP_SYS_NICE.
+* @param std::thread& thread - running thread
+* @param int cpu - CPU index to pin to, negative to leave unpinned
+* @param int rt_priority - SCHED_FIFO priority, 0 to keep the default scheduler
+*/
+void liberad_configure_thread(std::thread& thread, int cpu, int rt_priority){
+#ifdef __linux__
+  if (cpu >= 0){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int r = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if (r != 0) ELOG(LIBERAD_WARN) << "Could not pin thread to cpu " << cpu << ": " << r;
+  }
+  if (rt_priority > 0){
+    struct sched_param param;
+    param.sched_priority = rt_priority;
+    int r = pthread_setschedparam(thread.native_handle(), SCHED_FIFO, &param);
+    if (r != 0) ELOG(LIBERAD_WARN) << "Could not set realtime priority " << rt_priority << ": " << r;
+  }
+#else
+  if (cpu >= 0 || rt_priority > 0) ELOG(LIBERAD_WARN) << "Thread pinning and priority not supported on this platform";
+#endif
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/* Starts the library-owned executor. One thread handles USB events for every device added with
+* liberad_executor_add(). Any further threads deliver traces to user callbacks and rings, so slow
+* user code on one device doesn't delay the others. Devices must not also be handled by
+* liberad_handle_io_async().
+* @param int threads - number of threads, at least 1
+* @param const int* cpu_ids - CPUs to pin the threads to in order, the event thread first. May be nullptr.
+* @param int cpu_count - number of entries in cpu_ids. Threads wrap around if there are fewer CPUs than threads.
+* @param int rt_priority - SCHED_FIFO priority for the threads, 0 for the default scheduler
+* @return LIBERAD_NOT_INIT if liberad is not init
+* @return LIBERAD_ERR if the executor is already running
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_executor_start(int threads, const int* cpu_ids, int cpu_count, int rt_priority){
+  if (!liberad_check_init()) return LIBERAD_NOT_INIT;
+  return executor.start(threads, cpu_ids, cpu_count, rt_priority);
+}
+
+/* Adds a TRANSMITTING device to the executor. The device becomes RUNNING.
+* @return LIBERAD_ERR if the executor isn't running or the device is not TRANSMITTING
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_executor_add(Oeradar* device){
+  return executor.add(device);
+}
+
+/* Removes a device from the executor. The device goes back to TRANSMITTING and its posted transfers
+* complete on whichever thread handles libusb events next.
+* @return LIBERAD_ERR if the device is not handled by the executor
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_executor_remove(Oeradar* device){
+  return executor.remove(device);
+}
+
+/* Removes all devices and stops the executor threads */
+void liberad_executor_stop(){
+  executor.stop();
+}
@@ -0,0 +1,108 @@
+#ifndef ERADEXECUTOR_H
+#define ERADEXECUTOR_H
+
+#include "../include/liberad.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ExecutorWorker;
+
+/* Hand-off of completed traces from the event thread to the worker delivering them for one device.
+* Traces in user buffers are copied into a ring, lent pool buffers are passed on by reference.
+*/
+class ExecutorLane {
+
+public:
+
+  ExecutorLane(Oeradar* device, ExecutorWorker* worker);
+
+  /* Event thread side */
+  void handoff(const Trace& trace);
+
+  /* Worker thread side. Delivers up to a bounded number of traces.
+  * @return true if any trace was delivered
+  */
+  bool drain();
+
+  /* Drops traces still queued, returning lent buffers to their pool */
+  void discard();
+
+  Oeradar* device;
+  ExecutorWorker* worker;
+  std::atomic<unsigned long long> dropped{0};
+
+private:
+
+  TraceRing copies;
+  BoundedQueue<LiberadTraceBuffer*> lent;
+  std::vector<unsigned char> scratch;
+};
+
+/* Thread delivering traces of the devices assigned to it */
+class ExecutorWorker {
+
+public:
+
+  void start(int cpu, int rt_priority);
+  void stop();
+
+  void add(ExecutorLane* lane);
+  void remove(ExecutorLane* lane);
+  size_t load();
+
+  /* Called by the event thread after a hand-off */
+  void notify();
+
+private:
+
+  void loop();
+
+  std::thread thread;
+  std::atomic<bool> running{false};
+
+  std::mutex lanes_mutex;
+  std::vector<ExecutorLane*> lanes;
+
+  std::atomic<unsigned> pending{0};
+  std::atomic<bool> sleeping{false};
+  std::mutex wait_mutex;
+  std::condition_variable wake;
+};
+
+/* Library-owned executor serving every device added to it. One thread handles libusb events for
+* all devices, so they don't contend for the libusb event lock. With more than one thread the
+* remaining threads deliver traces to user code, each for its own subset of devices.
+*/
+class EventExecutor {
+
+public:
+
+  int start(int threads, const int* cpu_ids, int cpu_count, int rt_priority);
+  void stop();
+
+  int add(Oeradar* device);
+  int remove(Oeradar* device);
+
+private:
+
+  void pump();
+  void free_retired();
+
+  std::mutex mutex;
+  std::thread pump_thread;
+  std::atomic<bool> running{false};
+  std::vector<ExecutorWorker*> workers;
+  std::vector<Oeradar*> devices;
+  std::vector<ExecutorLane*> retired;
+  /* Passes of the event thread over transports with their own event source, counted when a pass ends */
+  bool polling = false;
+  unsigned long long passes = 0;
+  std::condition_variable polled;
+};
+
+/* Pins a thread to a CPU (if cpu >= 0) and gives it realtime priority (if rt_priority > 0) */
+void liberad_configure_thread(std::thread& thread, int cpu, int rt_priority);
+
+#endif
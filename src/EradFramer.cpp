@@ -0,0 +1,144 @@
+#include "../include/liberad.h"
+#include <string.h>
+
+TraceFramer::TraceFramer(int frame_length, unsigned char delimiter) :
+  length(frame_length),
+  delimiter(delimiter),
+  carry(frame_length),
+  joined(frame_length){
+}
+
+/* Splits data into traces. In sync, the trace starting at the current position must end with the delimiter
+* exactly frame_length bytes on; a trace continued from the previous fragment is checked the same way before
+* it is copied together. When the check fails the framer loses sync and searches for the next boundary.
+* @param const unsigned char* data - next fragment of the stream, e.g. a completed IN transfer
+* @param int count - number of bytes in data
+* @param LiberadFrameSink sink - called with each complete trace, in order. The trace stays valid until the next
+* push, or as long as data if it lies within data.
+* @param void* context - passed to sink
+*/
+void TraceFramer::push(const unsigned char* data, int count, LiberadFrameSink sink, void* context){
+
+  int p = 0;
+  while (p < count){
+
+    if (!synced){
+      int end = find_boundary(data + p, count - p);
+      if (end < 0){
+        discarded.fetch_add(count - p, std::memory_order_relaxed);
+        return;
+      }
+      synced = true;
+      /* A whole trace ending at the boundary is kept, anything before it belongs to a broken one */
+      if (end + 1 >= length){
+        discarded.fetch_add(end + 1 - length, std::memory_order_relaxed);
+        frames.fetch_add(1, std::memory_order_relaxed);
+        sink(context, data + p + end + 1 - length, length);
+      } else {
+        discarded.fetch_add(end + 1, std::memory_order_relaxed);
+      }
+      p += end + 1;
+      continue;
+    }
+
+    if (carried > 0){
+      int need = length - carried;
+      if (count - p < need){
+        memcpy(&carry[carried], data + p, count - p);
+        carried += count - p;
+        return;
+      }
+      if (data[p + need - 1] != delimiter){
+        lose_sync();
+        resync_carry(data + p, count - p);
+        continue;
+      }
+      memcpy(&carry[carried], data + p, need);
+      carried = 0;
+      p += need;
+      frames.fetch_add(1, std::memory_order_relaxed);
+      assembled.fetch_add(1, std::memory_order_relaxed);
+      /* The joined trace moves out of the way of the next partial one, so it stays valid until the next push */
+      carry.swap(joined);
+      sink(context, &joined[0], length);
+      continue;
+    }
+
+    if (count - p < length){
+      memcpy(&carry[0], data + p, count - p);
+      carried = count - p;
+      return;
+    }
+    if (data[p + length - 1] != delimiter){
+      lose_sync();
+      continue;
+    }
+    frames.fetch_add(1, std::memory_order_relaxed);
+    sink(context, data + p, length);
+    p += length;
+  }
+}
+
+void TraceFramer::reset(){
+  synced = true;
+  carried = 0;
+}
+
+void TraceFramer::get_stats(LiberadFramerStats* stats) const {
+  stats->frames = frames.load(std::memory_order_relaxed);
+  stats->assembled = assembled.load(std::memory_order_relaxed);
+  stats->resyncs = resyncs.load(std::memory_order_relaxed);
+  stats->discarded = discarded.load(std::memory_order_relaxed);
+}
+
+/* Leaves sync. A partial trace is kept for resync_carry(), which must be called next if there is one. */
+void TraceFramer::lose_sync(){
+  synced = false;
+  resyncs.fetch_add(1, std::memory_order_relaxed);
+  ELOG(LIBERAD_DEBUG) << "Trace delimiter missing, resynchronizing";
+}
+
+/* A carried trace didn't end where expected, usually because part of it was lost. Its real end is then often
+* in the carried bytes already, with the beginning of the next trace after it. A delimiter in the carry is taken
+* as that end if the next trace, continuing into data, ends with a delimiter too, or if data is too short to tell.
+* The bytes after it stay carried and the framer is back in sync; otherwise the carry is dropped.
+* @param const unsigned char* data - rest of the fragment following the carry
+* @param int count - bytes in data
+*/
+void TraceFramer::resync_carry(const unsigned char* data, int count){
+
+  int k = liberad_find_byte(&carry[0], carried, delimiter);
+  while (k < carried){
+    int next_end = k + length - carried;
+    if (next_end >= count || data[next_end] == delimiter){
+      discarded.fetch_add(k + 1, std::memory_order_relaxed);
+      carried -= k + 1;
+      memmove(&carry[0], &carry[k + 1], carried);
+      synced = true;
+      return;
+    }
+    k += 1 + liberad_find_byte(&carry[k + 1], carried - k - 1, delimiter);
+  }
+
+  discarded.fetch_add(carried, std::memory_order_relaxed);
+  carried = 0;
+}
+
+/* Finds the end of a trace in data. Samples may take the value of the delimiter, so a delimiter is only
+* taken as a boundary if the byte a trace further on is a delimiter too. Where the stream ends before that
+* can be checked, the last byte is preferred since transfers usually end with a trace; otherwise the first
+* unconfirmed delimiter is used and a wrong guess is caught by the check of the next trace.
+* @param const unsigned char* data - bytes to search
+* @param int count - number of bytes
+* @return index of the delimiter ending a trace, -1 if there is none
+*/
+int TraceFramer::find_boundary(const unsigned char* data, int count) const {
+
+  int k = liberad_find_byte(data, count, delimiter);
+  while (k < count){
+    if (k + length >= count) return data[count - 1] == delimiter ? count - 1 : k;
+    if (data[k + length] == delimiter) return k;
+    k += 1 + liberad_find_byte(data + k + 1, count - k - 1, delimiter);
+  }
+  return -1;
+}
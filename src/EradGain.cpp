@@ -0,0 +1,91 @@
+#include "../include/EradGain.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+GainStage::GainStage(const LiberadGainParams& params) : params(params){
+}
+
+/* Scales the samples of a trace and passes it on */
+void GainStage::accept(const Trace& trace){
+
+  traces.fetch_add(1, std::memory_order_relaxed);
+  int count = trace.sample_count;
+  work.resize(count);
+  liberad_decode_float(trace.samples, count, 1.0f, work.data());
+
+  bool sec = params.linear_per_ns != 0 || params.exponential_db_per_ns != 0;
+  if (sec){
+    const float* gain = sec_table(trace.window, count).data();
+    float* x = work.data();
+    for (int i = 0; i < count; i++) x[i] *= gain[i];
+  }
+  if (params.agc_window > 0) agc(count);
+
+  out.resize(trace.length);
+  memcpy(out.data(), trace.data, trace.length);
+  unsigned char* samples = out.data() + (trace.samples - trace.data);
+  liberad_encode_float(work.data(), count, samples);
+
+  Trace scaled = trace;
+  scaled.data = out.data();
+  scaled.samples = samples;
+  scaled.lent = nullptr;
+  next->accept(scaled);
+}
+
+/* @return SEC factor of every sample of traces of sample_count samples captured with window, computed on first use */
+const std::vector<float>& GainStage::sec_table(TimeWindow window, int sample_count){
+
+  std::vector<float>& table = tables[std::make_pair((int)window, sample_count)];
+  if ((int)table.size() == sample_count) return table;
+
+  table.resize(sample_count);
+  double interval = liberad_window_ns(params.model, window) / (sample_count > 0 ? sample_count : 1);
+  double decibels = params.exponential_db_per_ns * log(10.0) / 20.0;
+  for (int i = 0; i < sample_count; i++){
+    double t = i * interval;
+    double gain = (1.0 + params.linear_per_ns * t) * exp(decibels * t);
+    table[i] = (float)(gain < 0 ? 0 : gain > params.max_gain ? params.max_gain : gain);
+  }
+  table_count.fetch_add(1, std::memory_order_relaxed);
+  return table;
+}
+
+/* Scales each sample so the mean amplitude of the agc_window samples centred on it, fewer at the ends of the
+* trace, becomes agc_target
+*/
+void GainStage::agc(int sample_count){
+
+  float* x = work.data();
+  prefix.resize(sample_count + 1);
+  float* sum = prefix.data();
+  sum[0] = 0;
+  for (int i = 0; i < sample_count; i++) sum[i + 1] = sum[i] + fabsf(x[i]);
+
+  /* The gain target / mean is capped at max_gain by not letting the mean fall below target / max_gain. The window
+  * is cut short only near the ends of the trace.
+  */
+  int half = params.agc_window / 2;
+  float target = params.agc_target;
+  float floor = params.agc_target / params.max_gain;
+  int inner_first = std::min(half, sample_count);
+  int inner_end = std::max(inner_first, sample_count - half - 1);
+  for (int i = 0; i < inner_first; i++){
+    int end = std::min(sample_count, i + half + 1);
+    x[i] *= target / std::max((sum[end] - sum[0]) / (float)end, floor);
+  }
+  float inner_scale = 1.0f / (float)(2 * half + 1);
+  for (int i = inner_first; i < inner_end; i++){
+    x[i] *= target / std::max((sum[i + half + 1] - sum[i - half]) * inner_scale, floor);
+  }
+  for (int i = inner_end; i < sample_count; i++){
+    int first = std::max(0, i - half);
+    x[i] *= target / std::max((sum[sample_count] - sum[first]) / (float)(sample_count - first), floor);
+  }
+}
+
+void GainStage::get_stats(LiberadGainStats* stats) const {
+  stats->traces = traces.load(std::memory_order_relaxed);
+  stats->tables = table_count.load(std::memory_order_relaxed);
+}
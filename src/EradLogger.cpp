@@ -0,0 +1,145 @@
+#include "../include/liberad.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+#define LIBERAD_LOG_BATCH_SIZE 65536
+#define LIBERAD_LOG_IDLE_MS 2
+
+struct LogRecord {
+  LogLevel level;
+  int length;
+  char text[LIBERAD_LOG_RECORD_SIZE];
+};
+
+/* Writes text to fd, retrying short writes */
+static void liberad_write_fd(int fd, const char* text, size_t length){
+  while (length > 0){
+    ssize_t r = write(fd, text, length);
+    if (r <= 0) return;
+    text += r;
+    length -= r;
+  }
+}
+
+/* Background writer of the asynchronous log. Producers only push records into a lock-free queue and
+* never wait for the writer, which picks records up in batches and sleeps briefly when there are none.
+*/
+class AsyncLog {
+
+public:
+
+  ~AsyncLog(){
+    stop();
+  }
+
+  void start(int queue_size){
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running) return;
+    /* The queue is never freed - a thread that checked the mode just before it was switched off may still push to it */
+    if (!queue) queue = new BoundedQueue<LogRecord>(queue_size);
+    running = true;
+    writer = std::thread(&AsyncLog::loop, this);
+    active.store(queue, std::memory_order_release);
+  }
+
+  /* Flushes queued records and joins the writer */
+  void stop(){
+    std::lock_guard<std::mutex> lock(mutex);
+    active.store(nullptr, std::memory_order_release);
+    running = false;
+    if (writer.joinable()) writer.join();
+  }
+
+  void write_line(const char* text, int length){
+    int fd = sink.load(std::memory_order_relaxed);
+    if (fd >= 0){
+      char line[LIBERAD_LOG_RECORD_SIZE + 1];
+      memcpy(line, text, length);
+      line[length] = '\n';
+      liberad_write_fd(fd, line, length + 1);
+    } else {
+      cout.write(text, length);
+      cout << endl;
+    }
+  }
+
+  std::atomic<BoundedQueue<LogRecord>*> active{nullptr};
+  std::atomic<int> sink{-1};
+  std::atomic<unsigned long long> dropped{0};
+
+private:
+
+  void loop(){
+
+    std::string batch;
+    batch.reserve(LIBERAD_LOG_BATCH_SIZE + LIBERAD_LOG_RECORD_SIZE + 1);
+    LogRecord record;
+
+    while (true){
+      bool stopping = !running;
+      batch.clear();
+      while (batch.size() < LIBERAD_LOG_BATCH_SIZE && queue->pop(record)){
+        batch.append(record.text, record.length);
+        batch.push_back('\n');
+      }
+
+      if (!batch.empty()){
+        int fd = sink.load(std::memory_order_relaxed);
+        if (fd >= 0) liberad_write_fd(fd, batch.data(), batch.size());
+        else cout.write(batch.data(), batch.size()).flush();
+      } else if (stopping){
+        break;
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(LIBERAD_LOG_IDLE_MS));
+      }
+    }
+  }
+
+  std::mutex mutex;
+  std::thread writer;
+  std::atomic<bool> running{false};
+  BoundedQueue<LogRecord>* queue = nullptr;
+};
+
+static AsyncLog async_log;
+
+void liberad_log_emit(LogLevel level, const char* text, int length){
+
+  BoundedQueue<LogRecord>* queue = async_log.active.load(std::memory_order_acquire);
+  if (!queue){
+    async_log.write_line(text, length);
+    return;
+  }
+
+  LogRecord record;
+  record.level = level;
+  record.length = length;
+  memcpy(record.text, text, length);
+  if (!queue->push(record)) async_log.dropped++;
+}
+
+/* Sets the destination of log messages.
+* @param int fd - file descriptor to write to, e.g. an opened log file, a pipe or a socket to a log
+* daemon. Liberad does not close it. -1 writes to cout.
+*/
+void liberad_set_log_sink(int fd){
+  async_log.sink = fd;
+}
+
+/* Switches asynchronous logging on or off. Switching it off writes out all queued messages first.
+* @param bool enabled - true to queue messages for a background writer thread
+* @param int queue_size - number of messages the queue holds. Only used the first time it is enabled.
+* @return LIBERAD_SUCCESS
+*/
+int liberad_set_log_async(bool enabled, int queue_size){
+  if (enabled) async_log.start(queue_size);
+  else async_log.stop();
+  return LIBERAD_SUCCESS;
+}
+
+unsigned long long liberad_get_log_dropped(){
+  return async_log.dropped;
+}
@@ -0,0 +1,134 @@
+#include "../include/EradMigration.h"
+#include "EradParallel.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+/* Output samples summed together by one thread, small enough for their rows of the aperture to stay in cache */
+#define LIBERAD_MIGRATION_TILE 64
+
+MigrationWindow::MigrationWindow(const LiberadMigrationParams& params) : params(params){
+  this->params.window_traces = std::max(params.window_traces, 2 * params.aperture + 1);
+}
+
+void MigrationWindow::push(const Trace& trace){
+  decoded.resize(trace.sample_count);
+  liberad_decode_float(trace.samples, trace.sample_count, liberad_gain_scale(trace.gain), decoded.data());
+  push(decoded.data(), trace.sample_count, trace.window);
+}
+
+void MigrationWindow::push(const float* samples, int sample_count, TimeWindow window){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (sample_count != this->sample_count || window != this->window || travel.empty()) restart(sample_count, window);
+
+  int slot = (int)(pushed % params.window_traces);
+  float* in = &inputs[(size_t)slot * stride];
+  memcpy(in, samples, sample_count * sizeof(float));
+  std::fill(in + sample_count, in + stride, 0.0f);
+  std::fill(&outputs[(size_t)slot * stride], &outputs[(size_t)slot * stride] + stride, 0.0f);
+
+  int tiles = (sample_count + LIBERAD_MIGRATION_TILE - 1) / LIBERAD_MIGRATION_TILE;
+  ParallelPool::shared().run(tiles, 1, [this](int begin, int end){
+    migrate_tile(begin * LIBERAD_MIGRATION_TILE, std::min(end * LIBERAD_MIGRATION_TILE, this->sample_count));
+  });
+
+  unsigned long long first = pushed > (unsigned long long)params.aperture ? pushed - params.aperture : 0;
+  for (unsigned long long j = first; j < pushed; j++) contributors[j % params.window_traces]++;
+  contributors[slot] = (uint16_t)(pushed - first + 1);
+  pushed++;
+}
+
+/* Empties the section and computes the travel times for traces of sample_count samples captured with window */
+void MigrationWindow::restart(int sample_count, TimeWindow window){
+
+  base += pushed;
+  pushed = 0;
+  this->sample_count = sample_count;
+  this->window = window;
+  stride = sample_count + 1;
+  inputs.assign((size_t)params.window_traces * stride, 0.0f);
+  outputs.assign((size_t)params.window_traces * stride, 0.0f);
+  contributors.assign(params.window_traces, 0);
+
+  size_t entries = (size_t)(params.aperture + 1) * sample_count;
+  travel.assign(entries, 0);
+  weight_at.assign(entries, 0.0f);
+  weight_after.assign(entries, 0.0f);
+
+  /* Two way time t0 of an output sample becomes sqrt(t0^2 + (2x / v)^2) at a trace x metres away */
+  double interval = liberad_window_ns(params.model, window) / (sample_count > 0 ? sample_count : 1);
+  for (int offset = 0; offset <= params.aperture; offset++){
+    double lateral = 2.0 * offset * params.spacing_m / params.velocity_m_per_ns;
+    for (int k = 0; k < sample_count; k++){
+      double t0 = k * interval;
+      double t = sqrt(t0 * t0 + lateral * lateral);
+      double position = t / interval;
+      int sample = (int)position;
+      if (sample >= sample_count) continue;
+      double fraction = position - sample;
+      double obliquity = t > 0 ? t0 / t : 1.0;
+      size_t entry = (size_t)offset * sample_count + k;
+      travel[entry] = sample;
+      weight_at[entry] = (float)((1.0 - fraction) * obliquity);
+      weight_after[entry] = (float)(fraction * obliquity);
+    }
+  }
+}
+
+/* Adds the contributions of input trace in, offset traces away, to samples first_sample to end_sample of out */
+static inline void contribute(float* out, const float* in, const int32_t* travel, const float* at, const float* after,
+                              int first_sample, int end_sample){
+  for (int k = first_sample; k < end_sample; k++){
+    int sample = travel[k];
+    out[k] += in[sample] * at[k] + in[sample + 1] * after[k];
+  }
+}
+
+/* Sums the pairs formed by the newest trace over samples first_sample to end_sample: its contributions to itself
+* and the aperture traces before it, and theirs to it
+*/
+void MigrationWindow::migrate_tile(int first_sample, int end_sample){
+
+  int traces = params.window_traces;
+  unsigned long long newest = pushed;
+  unsigned long long first = newest > (unsigned long long)params.aperture ? newest - params.aperture : 0;
+  float* newest_out = &outputs[(size_t)(newest % traces) * stride];
+  const float* newest_in = &inputs[(size_t)(newest % traces) * stride];
+
+  for (unsigned long long j = first; j <= newest; j++){
+    size_t table = (size_t)(newest - j) * sample_count;
+    const int32_t* times = &travel[table];
+    const float* at = &weight_at[table];
+    const float* after = &weight_after[table];
+    const float* in = &inputs[(size_t)(j % traces) * stride];
+    contribute(newest_out, in, times, at, after, first_sample, end_sample);
+    if (j != newest){
+      contribute(&outputs[(size_t)(j % traces) * stride], newest_in, times, at, after, first_sample, end_sample);
+    }
+  }
+}
+
+int MigrationWindow::read(unsigned long long index, float* out, int capacity){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (index < base || index - base >= pushed) return 0;
+  unsigned long long n = index - base;
+  if (pushed - n > (unsigned long long)params.window_traces) return 0;
+
+  int slot = (int)(n % params.window_traces);
+  const float* row = &outputs[(size_t)slot * stride];
+  float scale = 1.0f / contributors[slot];
+  int count = std::min(capacity, sample_count);
+  for (int k = 0; k < count; k++) out[k] = row[k] * scale;
+  return count;
+}
+
+void MigrationWindow::get_info(LiberadMigrationInfo* info){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  info->traces = base + pushed;
+  info->complete = base + (pushed > (unsigned long long)params.aperture ? pushed - params.aperture : 0);
+  info->first = base + (pushed > (unsigned long long)params.window_traces ? pushed - params.window_traces : 0);
+  info->sample_count = sample_count;
+}
@@ -0,0 +1,129 @@
+#include "EradParallel.h"
+
+ParallelPool::~ParallelPool(){
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+}
+
+ParallelPool& ParallelPool::shared(){
+  static ParallelPool pool;
+  return pool;
+}
+
+void ParallelPool::start(){
+  started = true;
+  unsigned cpus = std::thread::hardware_concurrency();
+  int workers = cpus > 1 ? (int)cpus - 1 : 0;
+  ranges = std::vector<Range>(workers + 1);
+  for (int i = 0; i < workers; i++) threads.push_back(std::thread(&ParallelPool::loop, this, i));
+}
+
+void ParallelPool::run(int count, int grain, const std::function<void(int, int)>& body){
+
+  if (count <= 0) return;
+  if (grain < 1) grain = 1;
+
+  std::unique_lock<std::mutex> running(run_mutex, std::try_to_lock);
+  if (!running || count <= grain){
+    body(0, count);
+    return;
+  }
+
+  int caller;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!started) start();
+    this->body = &body;
+    this->grain = grain;
+    int participants = (int)ranges.size();
+    for (int i = 0; i < participants; i++){
+      std::lock_guard<std::mutex> range_lock(ranges[i].mutex);
+      ranges[i].begin = (int)((long long)count * i / participants);
+      ranges[i].end = (int)((long long)count * (i + 1) / participants);
+    }
+    caller = participants - 1;
+    busy = (int)threads.size();
+    generation++;
+  }
+  wake.notify_all();
+
+  work(caller);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this]{ return busy == 0; });
+  this->body = nullptr;
+}
+
+/* Runs parts of the job, first from the participant's own range, then stolen ones, until none are left */
+void ParallelPool::work(int participant){
+  int begin, end;
+  while (take(participant, &begin, &end) || (steal(participant) && take(participant, &begin, &end))){
+    (*body)(begin, end);
+  }
+}
+
+/* Takes up to grain parts from the front of the participant's range */
+bool ParallelPool::take(int participant, int* begin, int* end){
+  Range& own = ranges[participant];
+  std::lock_guard<std::mutex> lock(own.mutex);
+  if (own.begin >= own.end) return false;
+  *begin = own.begin;
+  own.begin = own.end - own.begin > grain ? own.begin + grain : own.end;
+  *end = own.begin;
+  return true;
+}
+
+/* Moves the back half of the largest range left into the participant's own, which is empty
+* @return false if no parts are left
+*/
+bool ParallelPool::steal(int participant){
+
+  while (true){
+    int victim = -1;
+    int largest = 0;
+    for (int i = 0; i < (int)ranges.size(); i++){
+      if (i == participant) continue;
+      std::lock_guard<std::mutex> lock(ranges[i].mutex);
+      if (ranges[i].end - ranges[i].begin > largest){
+        largest = ranges[i].end - ranges[i].begin;
+        victim = i;
+      }
+    }
+    if (victim < 0) return false;
+
+    std::lock(ranges[victim].mutex, ranges[participant].mutex);
+    std::lock_guard<std::mutex> victim_lock(ranges[victim].mutex, std::adopt_lock);
+    std::lock_guard<std::mutex> own_lock(ranges[participant].mutex, std::adopt_lock);
+    Range& from = ranges[victim];
+    int left = from.end - from.begin;
+    if (left <= 0) continue;
+    int middle = from.begin + left / 2;
+    ranges[participant].begin = middle;
+    ranges[participant].end = from.end;
+    from.end = middle;
+    return true;
+  }
+}
+
+void ParallelPool::loop(int participant){
+
+  unsigned long long seen = 0;
+  while (true){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&]{ return stopping || generation != seen; });
+      if (stopping) return;
+      seen = generation;
+    }
+    work(participant);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      busy--;
+    }
+    done.notify_one();
+  }
+}
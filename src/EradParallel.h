@@ -0,0 +1,65 @@
+#ifndef ERADPARALLEL_H
+#define ERADPARALLEL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+/* Threads running the parts of a block operation, e.g. filtering a sample matrix or migrating a section, in
+* parallel. Started on first use with one thread per CPU besides the caller, which takes part in its own job. One
+* job runs at a time; a second caller meanwhile runs its job on its own thread.
+* A job is split into one contiguous range per thread, so neighbouring parts run on the same core. Each thread
+* works through its range grain by grain and, once done, steals the back half of the largest range left.
+*/
+class ParallelPool {
+
+public:
+
+  ~ParallelPool();
+
+  /* Calls body(begin, end) for ranges of at most grain parts covering 0 to count, on the pool threads and the
+  * calling thread, and returns once all of them are done
+  */
+  void run(int count, int grain, const std::function<void(int, int)>& body);
+
+  /* Pool shared by the library */
+  static ParallelPool& shared();
+
+private:
+
+  /* Parts of the job left to a thread */
+  struct Range {
+    std::mutex mutex;
+    int begin = 0;
+    int end = 0;
+  };
+
+  void start();
+  void loop(int participant);
+  void work(int participant);
+  bool take(int participant, int* begin, int* end);
+  bool steal(int participant);
+
+  std::vector<std::thread> threads;
+  bool started = false;
+  bool stopping = false;
+
+  std::mutex run_mutex;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+
+  /* Job being run, one range per thread and one for the caller. generation tells workers a new job from the one
+  * they finished.
+  */
+  const std::function<void(int, int)>* body = nullptr;
+  int grain = 1;
+  std::vector<Range> ranges;
+  int busy = 0;
+  unsigned long long generation = 0;
+};
+
+#endif
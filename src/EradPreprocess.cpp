@@ -0,0 +1,146 @@
+#include "../include/EradPreprocess.h"
+#include "../include/EradDecode.h"
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Rounds half away from zero. Unlike lrintf it inlines, so the loops using it vectorize. */
+static inline int round_to_int(float value){
+  return (int)(value + (value < 0 ? -0.5f : 0.5f));
+}
+
+PreprocessStage::PreprocessStage(const LiberadPreprocessParams& params) : params(params){
+}
+
+/* Filters a trace and passes it on */
+void PreprocessStage::accept(const Trace& trace){
+
+  traces.fetch_add(1, std::memory_order_relaxed);
+  if (trace.sample_count != sample_count || trace.gain != gain || trace.window != window) reshape(trace);
+
+  liberad_decode_int16(trace.samples, sample_count, 0, work.data());
+  if (params.dewow_window > 1) dewow();
+  if (params.time_zero != LIBERAD_TIME_ZERO_OFF) align_time_zero();
+  if (params.background_window > 0) remove_background();
+
+  out.resize(trace.length);
+  memcpy(out.data(), trace.data, trace.length);
+  unsigned char* samples = out.data() + (trace.samples - trace.data);
+  const short* filtered = work.data();
+  int count = sample_count;
+  for (int i = 0; i < count; i++){
+    int value = filtered[i] + 128;
+    samples[i] = (unsigned char)(value < 0 ? 0 : value > 255 ? 255 : value);
+  }
+
+  Trace processed = trace;
+  processed.data = out.data();
+  processed.samples = samples;
+  processed.lent = nullptr;
+  next->accept(processed);
+}
+
+/* Sizes the buffers for traces shaped like trace and empties the background */
+void PreprocessStage::reshape(const Trace& trace){
+
+  sample_count = trace.sample_count;
+  gain = trace.gain;
+  window = trace.window;
+
+  work.assign(sample_count, 0);
+  prefix.assign(sample_count + 1, 0);
+  dewow_scale.resize(sample_count);
+  int half = params.dewow_window / 2;
+  for (int i = 0; i < sample_count; i++){
+    int first = std::max(0, i - half);
+    int end = std::min(sample_count, i + half + 1);
+    dewow_scale[i] = 1.0f / (float)(end - first);
+  }
+
+  history.assign((size_t)std::max(params.background_window, 0) * sample_count, 0);
+  background.assign(sample_count, 0);
+  history_head = 0;
+  history_count = 0;
+  background_traces.store(0, std::memory_order_relaxed);
+}
+
+/* Subtracts from each sample the mean of the dewow_window samples centred on it, fewer at the ends of the trace,
+* from running sums so the cost doesn't depend on the window
+*/
+void PreprocessStage::dewow(){
+
+  short* x = work.data();
+  int32_t* sum = prefix.data();
+  int count = sample_count;
+  for (int i = 0; i < count; i++) sum[i + 1] = sum[i] + x[i];
+
+  /* The window is cut short only near the ends of the trace */
+  int half = params.dewow_window / 2;
+  const float* scale = dewow_scale.data();
+  int inner_first = std::min(half, count);
+  int inner_end = std::max(inner_first, count - half - 1);
+  for (int i = 0; i < inner_first; i++){
+    int end = std::min(count, i + half + 1);
+    x[i] = (short)(x[i] - round_to_int((float)(sum[end] - sum[0]) * scale[i]));
+  }
+  float inner_scale = 1.0f / (float)(2 * half + 1);
+  for (int i = inner_first; i < inner_end; i++){
+    x[i] = (short)(x[i] - round_to_int((float)(sum[i + half + 1] - sum[i - half]) * inner_scale));
+  }
+  for (int i = inner_end; i < count; i++){
+    int first = std::max(0, i - half);
+    x[i] = (short)(x[i] - round_to_int((float)(sum[count] - sum[first]) * scale[i]));
+  }
+}
+
+/* Shifts the trace towards the first sample so time zero comes first, padding its end with zeros */
+void PreprocessStage::align_time_zero(){
+
+  short* x = work.data();
+  int count = sample_count;
+  int zero = params.time_zero_sample;
+  if (params.time_zero == LIBERAD_TIME_ZERO_PICK){
+    int peak = 0;
+    for (int i = 0; i < count; i++) peak = std::max(peak, std::abs((int)x[i]));
+    int threshold = std::max(1, (int)ceilf(params.time_zero_threshold * (float)peak));
+    zero = 0;
+    while (zero < count && std::abs((int)x[zero]) < threshold) zero++;
+  }
+  if (zero < 0) zero = 0;
+  if (zero > count) zero = count;
+
+  memmove(x, x + zero, (count - zero) * sizeof(short));
+  memset(x + count - zero, 0, zero * sizeof(short));
+  time_zero.store(zero, std::memory_order_relaxed);
+}
+
+/* Adds the trace to the background, dropping the oldest trace once it holds background_window, and subtracts
+* the mean of the traces it holds
+*/
+void PreprocessStage::remove_background(){
+
+  short* x = work.data();
+  int32_t* sums = background.data();
+  int count = sample_count;
+  short* slot = history.data() + (size_t)history_head * count;
+
+  if (history_count == params.background_window){
+    for (int i = 0; i < count; i++) sums[i] -= slot[i];
+  } else {
+    history_count++;
+  }
+  memcpy(slot, x, count * sizeof(short));
+  for (int i = 0; i < count; i++) sums[i] += x[i];
+  history_head = (history_head + 1) % params.background_window;
+
+  float scale = 1.0f / (float)history_count;
+  for (int i = 0; i < count; i++) x[i] = (short)(x[i] - round_to_int((float)sums[i] * scale));
+  background_traces.store(history_count, std::memory_order_relaxed);
+}
+
+void PreprocessStage::get_stats(LiberadPreprocessStats* stats) const {
+  stats->traces = traces.load(std::memory_order_relaxed);
+  stats->time_zero = time_zero.load(std::memory_order_relaxed);
+  stats->background_traces = background_traces.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,186 @@
+#include "../include/EradPyramid.h"
+#include "../include/EradDecode.h"
+#include <algorithm>
+#include <string.h>
+
+/* Parameters out of range are clamped, as pyramids may be built without liberad_enable_pyramid checking them: a
+* factor above 16 would overflow the 16 bit sums of level 1.
+*/
+TilePyramid::TilePyramid(const LiberadPyramidParams& params) : params(params){
+  this->params.tile_columns = std::min(std::max(params.tile_columns, 1), 1 << 16);
+  this->params.factor = std::min(std::max(params.factor, 2), 16);
+  unsigned long long traces_per_column = 1;
+  for (int level = 0; level < LIBERAD_PYRAMID_LEVELS; level++){
+    levels[level].traces_per_column = traces_per_column;
+    traces_per_column *= this->params.factor;
+  }
+}
+
+void TilePyramid::push(const Trace& trace){
+  push(trace.samples, trace.sample_count);
+}
+
+/* Publishes the trace at level 0 and merges it into the column being built at level 1, which cascades upwards each
+* time a column completes. Each level does factor times less work than the one below, so a trace costs about
+* factor / (factor - 1) merges however many levels there are.
+*/
+void TilePyramid::push(const unsigned char* samples, int count){
+
+  if (count <= 0) return;
+  if (sample_count == 0){
+    sample_count = count;
+    first_sum.assign(count, 0);
+    padded.resize(count);
+    mean.resize(count);
+    for (int level = 1; level < LIBERAD_PYRAMID_LEVELS; level++){
+      levels[level].sum.assign(count, 0);
+      levels[level].low.assign(count, 255);
+      levels[level].high.assign(count, 0);
+    }
+  }
+  if (count != sample_count){
+    int n = count < sample_count ? count : sample_count;
+    memcpy(padded.data(), samples, n);
+    memset(padded.data() + n, 128, sample_count - n);
+    samples = padded.data();
+  }
+
+  if (params.keep_traces) publish(0, samples, samples, samples);
+
+  Level& first = levels[1];
+  liberad_stack_samples(samples, sample_count, first_sum.data(), first.low.data(), first.high.data());
+  if (++first.merged == params.factor){
+    int n = sample_count;
+    /* Dividing by factor is multiplying by 2^32 / factor rounded up, exact for sums below 2^16 */
+    uint64_t half = params.factor / 2;
+    uint64_t reciprocal = (1ull << 32) / params.factor + 1;
+    const uint16_t* sum = first_sum.data();
+    uint64_t* wide = first.sum.data();
+    unsigned char* m = mean.data();
+    for (int i = 0; i < n; i++){
+      m[i] = (unsigned char)(((sum[i] + half) * reciprocal) >> 32);
+      wide[i] = sum[i];
+    }
+    publish(1, m, first.low.data(), first.high.data());
+    merge(2, wide, first.low.data(), first.high.data());
+
+    memset(first_sum.data(), 0, n * sizeof(uint16_t));
+    memset(first.low.data(), 255, n);
+    memset(first.high.data(), 0, n);
+    first.merged = 0;
+  }
+
+  pushed.fetch_add(1, std::memory_order_release);
+}
+
+/* Merges a complete column of the level below into the column being built at level */
+void TilePyramid::merge(int level, const uint64_t* sum, const unsigned char* low, const unsigned char* high){
+
+  if (level >= LIBERAD_PYRAMID_LEVELS) return;
+  Level& l = levels[level];
+  int n = sample_count;
+  uint64_t* s = l.sum.data();
+  unsigned char* lo = l.low.data();
+  unsigned char* hi = l.high.data();
+  for (int i = 0; i < n; i++) s[i] += sum[i];
+  for (int i = 0; i < n; i++) lo[i] = low[i] < lo[i] ? low[i] : lo[i];
+  for (int i = 0; i < n; i++) hi[i] = high[i] > hi[i] ? high[i] : hi[i];
+  if (++l.merged < params.factor) return;
+
+  /* Rounded (s + traces / 2) / traces without a division per sample: (s + 0.5) / traces is at least 0.5 / traces away
+  * from an integer, far more than the rounding error of the product
+  */
+  double scale = 1.0 / (double)l.traces_per_column;
+  double half = (double)(l.traces_per_column / 2) + 0.5;
+  unsigned char* m = mean.data();
+  for (int i = 0; i < n; i++) m[i] = (unsigned char)(int)(((double)s[i] + half) * scale);
+  publish(level, m, lo, hi);
+  merge(level + 1, s, lo, hi);
+
+  memset(s, 0, n * sizeof(uint64_t));
+  memset(lo, 255, n);
+  memset(hi, 0, n);
+  l.merged = 0;
+}
+
+/* Appends a column to level, adding a tile when the last one is full. Tiles are only added by the pushing thread,
+* which therefore reads the tile list without the lock.
+*/
+void TilePyramid::publish(int level, const unsigned char* mean, const unsigned char* low, const unsigned char* high){
+
+  Level& l = levels[level];
+  unsigned long long c = l.columns.load(std::memory_order_relaxed);
+  size_t t = (size_t)(c / params.tile_columns);
+  size_t offset = (size_t)(c % params.tile_columns) * sample_count;
+  size_t block = (size_t)params.tile_columns * sample_count;
+
+  if (t == l.tiles.size()){
+    std::unique_ptr<Tile> tile(new Tile());
+    tile->data.reset(new unsigned char[level == 0 ? block : 3 * block]);
+    std::lock_guard<std::mutex> lock(mutex);
+    l.tiles.push_back(std::move(tile));
+  }
+
+  unsigned char* data = l.tiles[t]->data.get();
+  memcpy(data + offset, mean, sample_count);
+  if (level > 0){
+    memcpy(data + block + offset, low, sample_count);
+    memcpy(data + 2 * block + offset, high, sample_count);
+  }
+  l.columns.store(c + 1, std::memory_order_release);
+}
+
+unsigned long long TilePyramid::traces() const {
+  return pushed.load(std::memory_order_acquire);
+}
+
+unsigned long long TilePyramid::columns(int level) const {
+  if (level < 0 || level >= LIBERAD_PYRAMID_LEVELS) return 0;
+  return levels[level].columns.load(std::memory_order_acquire);
+}
+
+int TilePyramid::level_for(unsigned long long traces, int pixels) const {
+
+  int level = 0;
+  if (pixels <= 0) pixels = 1;
+  while (level + 1 < LIBERAD_PYRAMID_LEVELS && levels[level + 1].columns.load(std::memory_order_acquire) > 0 &&
+         (traces + levels[level].traces_per_column - 1) / levels[level].traces_per_column > (unsigned long long)pixels){
+    level++;
+  }
+  return level;
+}
+
+/* Only the tiles overlapping the range are visited, so the cost depends on the columns returned, not on the span.
+* The last tile may still be filling: its columns are those complete when it was fetched.
+*/
+int TilePyramid::fetch(int level, unsigned long long first_trace, unsigned long long end_trace, std::vector<LiberadTile>* tiles){
+
+  if (level < 0 || level >= LIBERAD_PYRAMID_LEVELS) return 0;
+  const Level& l = levels[level];
+  std::lock_guard<std::mutex> lock(mutex);
+
+  unsigned long long available = l.columns.load(std::memory_order_acquire);
+  unsigned long long first = first_trace / l.traces_per_column;
+  unsigned long long end = (end_trace + l.traces_per_column - 1) / l.traces_per_column;
+  if (end > available) end = available;
+  if (first >= end) return 0;
+
+  unsigned long long tile_columns = params.tile_columns;
+  size_t block = (size_t)tile_columns * sample_count;
+  int added = 0;
+  for (unsigned long long t = first / tile_columns; t <= (end - 1) / tile_columns; t++){
+    const unsigned char* data = l.tiles[t]->data.get();
+    LiberadTile tile;
+    tile.level = level;
+    tile.first_column = t * tile_columns;
+    tile.columns = (int)(available - tile.first_column < tile_columns ? available - tile.first_column : tile_columns);
+    tile.traces_per_column = l.traces_per_column;
+    tile.sample_count = sample_count;
+    tile.mean = data;
+    tile.min = level == 0 ? data : data + block;
+    tile.max = level == 0 ? data : data + 2 * block;
+    tiles->push_back(tile);
+    added++;
+  }
+  return added;
+}
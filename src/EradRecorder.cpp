@@ -0,0 +1,497 @@
+#include "../include/liberad.h"
+#include "../include/EradCodec.h"
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Table for the reflected IEEE polynomial, built on first use */
+static const uint32_t* liberad_crc32_table(){
+  static uint32_t table[256];
+  static bool built = [](){
+    for (uint32_t i = 0; i < 256; i++){
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    return true;
+  }();
+  (void)built;
+  return table;
+}
+
+uint32_t liberad_crc32(uint32_t crc, const void* data, size_t length){
+
+  const uint32_t* table = liberad_crc32_table();
+  const unsigned char* p = (const unsigned char*)data;
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+void liberad_index_chunk(const unsigned char* chunk, uint64_t chunk_offset, uint64_t first_index, std::vector<LiberadIndexEntry>* entries){
+
+  const LiberadChunkHeader* h = (const LiberadChunkHeader*)chunk;
+  size_t end = sizeof(LiberadChunkHeader) + h->payload_bytes;
+  size_t offset = sizeof(LiberadChunkHeader);
+  uint32_t done = 0;
+
+  while (done < h->trace_count && offset + sizeof(LiberadTraceRecord) <= end){
+    LiberadIndexEntry entry;
+    entry.chunk_offset = chunk_offset;
+    entry.record_offset = (uint32_t)offset;
+    entry.trace_count = 0;
+    entry.first_index = first_index + done;
+
+    while (entry.trace_count < LIBERAD_INDEX_STRIDE && done < h->trace_count && offset + sizeof(LiberadTraceRecord) <= end){
+      const LiberadTraceRecord* r = (const LiberadTraceRecord*)(chunk + offset);
+      if (entry.trace_count == 0){
+        entry.first_timestamp_ns = r->timestamp_ns;
+        entry.min_position = entry.max_position = r->position;
+      }
+      entry.last_timestamp_ns = r->timestamp_ns;
+      if (r->position < entry.min_position) entry.min_position = r->position;
+      if (r->position > entry.max_position) entry.max_position = r->position;
+      offset += sizeof(LiberadTraceRecord) + ((r->length + 7u) & ~7u);
+      entry.trace_count++;
+      done++;
+    }
+    entries->push_back(entry);
+  }
+}
+
+/* Writes count bytes at offset, continuing after partial writes and interruptions.
+* @return true if all bytes were written
+*/
+bool liberad_write_all(int fd, const unsigned char* data, size_t count, long long offset){
+
+  while (count > 0){
+    ssize_t w = pwrite(fd, data, count, offset);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    data += w;
+    count -= w;
+    offset += w;
+  }
+  return true;
+}
+
+static long long liberad_steady_ns(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -------------------------------------------------------------------------------------------------
+
+SurveyRecorder::~SurveyRecorder(){
+  if (is_open()) close();
+}
+
+/* Creates a survey file, writes its header and starts the writer thread. Memory for all chunks is allocated
+* here, so recording allocates nothing per trace.
+* @param const char* path - file to create. An existing file is overwritten.
+* @param const LiberadRecorderParams& params - chunk size, buffering and durability settings
+* @param const LiberadRecordHeader& header - device and capture state for the file header. Magic, version and
+* layout fields are filled in here.
+* @return LIBERAD_ERR if already recording or the file can't be created
+* @return LIBERAD_SUCCESS else
+*/
+int SurveyRecorder::open(const char* path, const LiberadRecorderParams& params, const LiberadRecordHeader& header){
+
+  if (is_open()){
+    ELOG(LIBERAD_ERROR) << "Recorder already open";
+    return LIBERAD_ERR;
+  }
+
+  this->params = params;
+  if (this->params.chunk_count < 2) this->params.chunk_count = 2;
+  int size = params.chunk_size > LIBERAD_RECORD_ALIGN ? params.chunk_size : LIBERAD_RECORD_ALIGN;
+  chunk_size = (uint32_t)((size + LIBERAD_RECORD_ALIGN - 1) / LIBERAD_RECORD_ALIGN * LIBERAD_RECORD_ALIGN);
+  flush_interval_ns = (int64_t)params.flush_interval_ms * 1000000;
+
+  fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0){
+    ELOG(LIBERAD_ERROR) << "Could not create survey file " << path << ": " << strerror(errno);
+    return LIBERAD_ERR;
+  }
+
+  this->header = header;
+  memcpy(this->header.magic, LIBERAD_RECORD_MAGIC, sizeof(this->header.magic));
+  this->header.version = params.compress ? LIBERAD_RECORD_VERSION : 1;
+  this->header.header_size = LIBERAD_RECORD_ALIGN;
+  this->header.align = LIBERAD_RECORD_ALIGN;
+  this->header.flags = 0;
+  this->header.trace_count = 0;
+  this->header.chunk_count = 0;
+  memset(this->header.description, 0, sizeof(this->header.description));
+  if (params.description) strncpy(this->header.description, params.description, sizeof(this->header.description) - 1);
+
+  std::vector<unsigned char> block(LIBERAD_RECORD_ALIGN);
+  memcpy(&block[0], &this->header, sizeof(this->header));
+  if (!liberad_write_all(fd, &block[0], block.size(), 0) || fdatasync(fd) != 0){
+    ELOG(LIBERAD_ERROR) << "Could not write survey file header: " << strerror(errno);
+    ::close(fd);
+    fd = -1;
+    return LIBERAD_ERR;
+  }
+
+  void* memory = nullptr;
+  if (posix_memalign(&memory, LIBERAD_RECORD_ALIGN, (size_t)chunk_size * this->params.chunk_count) != 0){
+    ELOG(LIBERAD_ERROR) << "Could not allocate recorder chunks";
+    ::close(fd);
+    fd = -1;
+    return LIBERAD_ERR;
+  }
+  storage = (unsigned char*)memory;
+  if (params.compress){
+    if (posix_memalign(&memory, LIBERAD_RECORD_ALIGN, chunk_size) != 0){
+      ELOG(LIBERAD_ERROR) << "Could not allocate recorder chunks";
+      free(storage);
+      storage = nullptr;
+      ::close(fd);
+      fd = -1;
+      return LIBERAD_ERR;
+    }
+    packed = (unsigned char*)memory;
+  }
+
+  chunks.assign(this->params.chunk_count, Chunk());
+  free_chunks = new BoundedQueue<int>(this->params.chunk_count);
+  full_chunks = new BoundedQueue<int>(this->params.chunk_count);
+  for (int i = 0; i < this->params.chunk_count; i++){
+    chunks[i].data = storage + (size_t)i * chunk_size;
+    free_chunks->push(i);
+  }
+
+  filling = nullptr;
+  pending = 0;
+  next_chunk_index = 0;
+  offset = LIBERAD_RECORD_ALIGN;
+  allocated = LIBERAD_RECORD_ALIGN;
+  unsynced = 0;
+  traces_written = 0;
+  index.clear();
+  traces = 0;
+  written_chunks = 0;
+  bytes = 0;
+  unpacked_bytes = 0;
+  dropped = 0;
+  syncs = 0;
+  write_errors = 0;
+  max_write_us = 0;
+  pack_us = 0;
+
+  stopping = false;
+  writer = std::thread(&SurveyRecorder::writer_loop, this);
+  recording.store(true, std::memory_order_seq_cst);
+  ELOG(LIBERAD_INFO) << "Recording to " << path;
+  return LIBERAD_SUCCESS;
+}
+
+/* Stops recording, waits for every chunk to be written, appends the index, completes the file header with the
+* trace and chunk counts and releases the space preallocated beyond the data.
+* @return LIBERAD_ERR if not recording or a chunk could not be written
+* @return LIBERAD_SUCCESS else
+*/
+int SurveyRecorder::close(){
+
+  if (!is_open()){
+    ELOG(LIBERAD_ERROR) << "Recorder not open";
+    return LIBERAD_ERR;
+  }
+
+  /* Once no record() call is under way, the chunk being filled belongs to this thread */
+  {
+    std::lock_guard<std::mutex> lock(seal_mutex);
+    recording.store(false, std::memory_order_seq_cst);
+    while (active.load(std::memory_order_seq_cst) > 0) std::this_thread::yield();
+    if (filling) seal();
+  }
+
+  stopping = true;
+  {
+    std::lock_guard<std::mutex> lock(wait_mutex);
+    wake.notify_one();
+  }
+  writer.join();
+
+  header.flags = LIBERAD_RECORD_COMPLETE;
+  if (write_index()) header.flags |= LIBERAD_RECORD_INDEXED;
+  header.trace_count = traces_written;
+  header.chunk_count = written_chunks.load(std::memory_order_relaxed);
+  bool ok = liberad_write_all(fd, (const unsigned char*)&header, sizeof(header), 0);
+  ok = ftruncate(fd, offset) == 0 && ok;
+  ok = fsync(fd) == 0 && ok;
+  ::close(fd);
+  fd = -1;
+
+  free(storage);
+  free(packed);
+  storage = packed = nullptr;
+  delete free_chunks;
+  delete full_chunks;
+  free_chunks = full_chunks = nullptr;
+
+  if (!ok || write_errors > 0){
+    ELOG(LIBERAD_ERROR) << "Survey file incomplete, " << write_errors << " chunks could not be written";
+    return LIBERAD_ERR;
+  }
+  ELOG(LIBERAD_INFO) << "Recorded " << header.trace_count << " traces in " << header.chunk_count << " chunks";
+  return LIBERAD_SUCCESS;
+}
+
+/* Appends a trace to the chunk being filled. Called by the thread delivering traces. Only copies the trace;
+* a full chunk, or one whose first trace is older than the flush interval, is passed to the writer first.
+* @param const Trace& trace - trace to record
+*/
+void SurveyRecorder::record(const Trace& trace){
+
+  active.fetch_add(1, std::memory_order_seq_cst);
+  while (flushing.load(std::memory_order_seq_cst)){
+    active.fetch_sub(1, std::memory_order_seq_cst);
+    while (flushing.load(std::memory_order_seq_cst)) std::this_thread::yield();
+    active.fetch_add(1, std::memory_order_seq_cst);
+  }
+  if (!recording.load(std::memory_order_seq_cst)){
+    active.fetch_sub(1, std::memory_order_release);
+    return;
+  }
+
+  uint32_t length = trace.length < 0xFFFF ? (uint32_t)trace.length : 0xFFFF;
+  uint32_t need = sizeof(LiberadTraceRecord) + ((length + 7) & ~7u);
+
+  if (filling && (filling->used + need > chunk_size || trace.timestamp_ns - filling->first_timestamp_ns >= flush_interval_ns)){
+    seal();
+  }
+
+  if (!filling){
+    int i;
+    if (need > chunk_size - sizeof(LiberadChunkHeader) || !free_chunks->pop(i)){
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      active.fetch_sub(1, std::memory_order_release);
+      return;
+    }
+    filling = &chunks[i];
+    filling->used = sizeof(LiberadChunkHeader);
+    filling->traces = 0;
+    filling->index = next_chunk_index++;
+    filling->first_sequence = trace.sequence;
+    filling->first_timestamp_ns = trace.timestamp_ns;
+  }
+
+  unsigned char* p = filling->data + filling->used;
+  LiberadTraceRecord* r = (LiberadTraceRecord*)p;
+  r->sequence = trace.sequence;
+  r->timestamp_ns = trace.timestamp_ns;
+  r->position = trace.position;
+  r->length = (uint16_t)length;
+  r->gain = (uint8_t)trace.gain;
+  r->window = (uint8_t)trace.window;
+  r->steps = trace.steps;
+  memset(r->reserved, 0, sizeof(r->reserved));
+  memcpy(p + sizeof(LiberadTraceRecord), trace.data, length);
+  memset(p + sizeof(LiberadTraceRecord) + length, 0, need - sizeof(LiberadTraceRecord) - length);
+
+  filling->used += need;
+  filling->traces++;
+  filling->last_timestamp_ns = trace.timestamp_ns;
+  traces.fetch_add(1, std::memory_order_relaxed);
+
+  active.fetch_sub(1, std::memory_order_release);
+}
+
+/* Passes the chunk being filled to the writer once no record() call is under way. Traces delivered meanwhile wait
+* for the few microseconds this takes instead of being dropped. Called when IO stops, as the flush interval is only
+* checked when a trace arrives.
+*/
+void SurveyRecorder::flush(){
+
+  std::lock_guard<std::mutex> lock(seal_mutex);
+  if (!is_open()) return;
+  flushing.store(true, std::memory_order_seq_cst);
+  while (active.load(std::memory_order_seq_cst) > 0) std::this_thread::yield();
+  if (filling) seal();
+  flushing.store(false, std::memory_order_seq_cst);
+}
+
+/* Passes the chunk being filled to the writer. The queue of full chunks holds every chunk, so this can't fail. */
+void SurveyRecorder::seal(){
+
+  pending.fetch_add(1, std::memory_order_relaxed);
+  full_chunks->push((int)(filling - &chunks[0]));
+  filling = nullptr;
+  notify_writer();
+}
+
+void SurveyRecorder::notify_writer(){
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping.load(std::memory_order_seq_cst)){
+    std::lock_guard<std::mutex> lock(wait_mutex);
+    wake.notify_one();
+  }
+}
+
+/* Writes full chunks in order and returns them to the producer. Sleeps while there is nothing to write and
+* exits once stopping is set and every chunk is written.
+*/
+void SurveyRecorder::writer_loop(){
+
+  for (;;){
+
+    int i;
+    if (full_chunks->pop(i)){
+      write_chunk(chunks[i]);
+      free_chunks->push(i);
+      continue;
+    }
+    if (stopping) break;
+
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    sleeping.store(true, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (full_chunks->pop(i)){
+      sleeping.store(false, std::memory_order_relaxed);
+      lock.unlock();
+      write_chunk(chunks[i]);
+      free_chunks->push(i);
+      continue;
+    }
+    if (!stopping) wake.wait(lock);
+    sleeping.store(false, std::memory_order_relaxed);
+  }
+}
+
+/* Completes the header of a chunk, packs it if that makes it smaller, pads it to the file alignment and writes it
+* with a single call. Space is preallocated ahead of the write position and the file is flushed at every durability
+* point.
+* @param Chunk& chunk - sealed chunk
+*/
+void SurveyRecorder::write_chunk(Chunk& chunk){
+
+  long long start = liberad_steady_ns();
+  uint32_t total = (chunk.used + LIBERAD_RECORD_ALIGN - 1) / LIBERAD_RECORD_ALIGN * LIBERAD_RECORD_ALIGN;
+  memset(chunk.data + chunk.used, 0, total - chunk.used);
+
+  LiberadChunkHeader* h = (LiberadChunkHeader*)chunk.data;
+  memcpy(h->magic, LIBERAD_CHUNK_MAGIC, sizeof(h->magic));
+  h->type = LIBERAD_CHUNK_TRACES;
+  h->chunk_bytes = total;
+  h->payload_bytes = chunk.used - sizeof(LiberadChunkHeader);
+  h->trace_count = chunk.traces;
+  h->chunk_index = chunk.index;
+  h->first_sequence = chunk.first_sequence;
+  h->first_timestamp_ns = chunk.first_timestamp_ns;
+  h->last_timestamp_ns = chunk.last_timestamp_ns;
+  h->unpacked_bytes = 0;
+  memset(h->reserved, 0, sizeof(h->reserved));
+
+  /* The index refers to records by their offset in the unpacked chunk */
+  size_t entries = index.size();
+  liberad_index_chunk(chunk.data, offset, traces_written, &index);
+
+  /* Packing is skipped while the disk is behind, so compression never causes traces to be dropped */
+  unsigned char* out = chunk.data;
+  uint32_t out_total = total;
+  if (packed && pending.load(std::memory_order_relaxed) <= params.chunk_count / 2){
+    long long pack_start = liberad_steady_ns();
+    size_t bytes = liberad_pack_chunk(chunk.data, packed + sizeof(LiberadChunkHeader), chunk_size - sizeof(LiberadChunkHeader));
+    uint32_t packed_total = (uint32_t)((sizeof(LiberadChunkHeader) + bytes + LIBERAD_RECORD_ALIGN - 1) / LIBERAD_RECORD_ALIGN * LIBERAD_RECORD_ALIGN);
+    if (bytes > 0 && packed_total < total){
+      LiberadChunkHeader* p = (LiberadChunkHeader*)packed;
+      *p = *h;
+      p->type = LIBERAD_CHUNK_PACKED;
+      p->chunk_bytes = packed_total;
+      p->payload_bytes = (uint32_t)bytes;
+      p->unpacked_bytes = h->payload_bytes;
+      memset(packed + sizeof(LiberadChunkHeader) + bytes, 0, packed_total - sizeof(LiberadChunkHeader) - bytes);
+      out = packed;
+      out_total = packed_total;
+    }
+    pack_us.fetch_add((liberad_steady_ns() - pack_start) / 1000, std::memory_order_relaxed);
+  }
+  LiberadChunkHeader* written = (LiberadChunkHeader*)out;
+  written->checksum = liberad_crc32(0, out + sizeof(LiberadChunkHeader), written->payload_bytes);
+
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (params.preallocate_bytes > 0 && offset + out_total > allocated){
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, params.preallocate_bytes) == 0){
+      allocated += params.preallocate_bytes;
+    } else {
+      ELOG(LIBERAD_DEBUG) << "Preallocation not supported: " << strerror(errno);
+      params.preallocate_bytes = 0;
+    }
+  }
+#endif
+
+  if (!liberad_write_all(fd, out, out_total, offset)){
+    index.resize(entries);
+    pending.fetch_sub(1, std::memory_order_relaxed);
+    write_errors.fetch_add(1, std::memory_order_relaxed);
+    ELOG(LIBERAD_ERROR) << "Could not write survey chunk " << chunk.index << ": " << strerror(errno);
+    return;
+  }
+  offset += out_total;
+  traces_written += chunk.traces;
+  written_chunks.fetch_add(1, std::memory_order_relaxed);
+  bytes.fetch_add(out_total, std::memory_order_relaxed);
+  unpacked_bytes.fetch_add(total, std::memory_order_relaxed);
+
+  if (params.sync_every > 0 && ++unsynced >= params.sync_every){
+    if (fdatasync(fd) != 0) ELOG(LIBERAD_ERROR) << "Could not flush survey file: " << strerror(errno);
+    syncs.fetch_add(1, std::memory_order_relaxed);
+    unsynced = 0;
+  }
+
+  pending.fetch_sub(1, std::memory_order_relaxed);
+  long long us = (liberad_steady_ns() - start) / 1000;
+  if (us > max_write_us.load(std::memory_order_relaxed)) max_write_us.store(us, std::memory_order_relaxed);
+}
+
+/* Appends the index chunk after the last trace chunk. Called once the writer thread has finished.
+* @return true if the index was written
+*/
+bool SurveyRecorder::write_index(){
+
+  if (index.empty()) return false;
+
+  size_t payload = index.size() * sizeof(LiberadIndexEntry);
+  size_t total = (sizeof(LiberadChunkHeader) + payload + LIBERAD_RECORD_ALIGN - 1) / LIBERAD_RECORD_ALIGN * LIBERAD_RECORD_ALIGN;
+  if (total > 0xFFFFFFFFu){
+    ELOG(LIBERAD_WARN) << "Survey index too large, readers will build it from the traces";
+    return false;
+  }
+
+  std::vector<unsigned char> block(total, 0);
+  memcpy(&block[sizeof(LiberadChunkHeader)], &index[0], payload);
+  LiberadChunkHeader* h = (LiberadChunkHeader*)&block[0];
+  memcpy(h->magic, LIBERAD_CHUNK_MAGIC, sizeof(h->magic));
+  h->type = LIBERAD_CHUNK_INDEX;
+  h->chunk_bytes = (uint32_t)total;
+  h->payload_bytes = (uint32_t)payload;
+  h->trace_count = 0;
+  h->chunk_index = next_chunk_index;
+  h->first_sequence = 0;
+  h->first_timestamp_ns = index.front().first_timestamp_ns;
+  h->last_timestamp_ns = index.back().last_timestamp_ns;
+  h->checksum = liberad_crc32(0, &block[sizeof(LiberadChunkHeader)], payload);
+
+  if (!liberad_write_all(fd, &block[0], total, offset)){
+    ELOG(LIBERAD_ERROR) << "Could not write survey index: " << strerror(errno);
+    return false;
+  }
+  offset += total;
+  return true;
+}
+
+void SurveyRecorder::get_stats(LiberadRecorderStats* stats) const {
+  stats->traces = traces.load(std::memory_order_relaxed);
+  stats->chunks = written_chunks.load(std::memory_order_relaxed);
+  stats->bytes = bytes.load(std::memory_order_relaxed);
+  stats->unpacked_bytes = unpacked_bytes.load(std::memory_order_relaxed);
+  stats->dropped = dropped.load(std::memory_order_relaxed);
+  stats->syncs = syncs.load(std::memory_order_relaxed);
+  stats->write_errors = write_errors.load(std::memory_order_relaxed);
+  stats->max_write_us = max_write_us.load(std::memory_order_relaxed);
+  stats->pack_us = pack_us.load(std::memory_order_relaxed);
+}
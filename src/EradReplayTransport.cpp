@@ -0,0 +1,231 @@
+#include "EradReplayTransport.h"
+#include <algorithm>
+#include <string.h>
+
+/* Most traces passed on by one handle_events() call, so signals and interrupts are served between bursts */
+#define LIBERAD_REPLAY_BURST 64
+
+extern libusb_context* context;
+
+ReplayTransport::ReplayTransport(Oeradar* radar, SurveyFile* file, const LiberadReplayParams& params) :
+  radar(radar),
+  file(file),
+  params(params){
+
+  ready.reserve(LIBERAD_REPLAY_BURST);
+  held.reserve(LIBERAD_REPLAY_BURST);
+  load_next();
+}
+
+ReplayTransport::~ReplayTransport(){
+  delete file;
+}
+
+int ReplayTransport::open(){
+  ELOG(LIBERAD_INFO) << "Opened replayed survey of " << file->trace_count() << " traces";
+  return LIBERAD_SUCCESS;
+}
+
+int ReplayTransport::configure(){
+  return LIBERAD_SUCCESS;
+}
+
+int ReplayTransport::close(){
+  return LIBERAD_SUCCESS;
+}
+
+int ReplayTransport::setup_in(int count){
+  return LIBERAD_SUCCESS;
+}
+
+int ReplayTransport::setup_out(int count){
+  return LIBERAD_SUCCESS;
+}
+
+/* Posted IN requests only mark the device as listening; traces are passed on from the file, not read into them.
+* The replay clock starts with the first request.
+*/
+int ReplayTransport::submit_in(int slot, unsigned char* buffer, int length){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (origin == Clock::time_point()) anchor(Clock::now());
+
+  PostedIn request = {slot, buffer};
+  posted.push_back(request);
+  wake.notify_one();
+  return 0;
+}
+
+int ReplayTransport::submit_out(int slot, unsigned char* buffer, int length){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Completion done = {slot, buffer, length, LIBUSB_TRANSFER_COMPLETED, false};
+  completions.push_back(done);
+  wake.notify_one();
+  return 0;
+}
+
+/* Retires the posted requests. The replay clock stops and starts again with the next request. */
+void ReplayTransport::cancel_all(){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  while (!posted.empty()){
+    Completion done = {posted.front().slot, posted.front().buffer, 0, LIBUSB_TRANSFER_CANCELLED, true};
+    completions.push_back(done);
+    posted.pop_front();
+  }
+  origin = Clock::time_point();
+  wake.notify_one();
+}
+
+int ReplayTransport::write_sync(unsigned char* data, int length, int* actual, unsigned int timeout_ms){
+  *actual = length;
+  return 0;
+}
+
+/* Copies the next trace into buffer once it is due, like a blocking bulk read. A timeout of 0 waits indefinitely,
+* as in libusb. At the end of a survey that doesn't loop the read times out.
+*/
+int ReplayTransport::read_sync(unsigned char* buffer, int length, int* actual, unsigned int timeout_ms){
+
+  std::unique_lock<std::mutex> lock(mutex);
+  Clock::time_point now = Clock::now();
+  if (origin == Clock::time_point()) anchor(now);
+
+  Clock::time_point deadline = now + std::chrono::milliseconds(timeout_ms);
+  while (!has_next || now < due()){
+    if (timeout_ms > 0 && now >= deadline){
+      *actual = 0;
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+    if (!has_next && timeout_ms == 0){
+      *actual = 0;
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+    if (!has_next) wake.wait_until(lock, deadline);
+    else wake.wait_until(lock, timeout_ms > 0 ? std::min(due(), deadline) : due());
+    now = Clock::now();
+  }
+
+  *actual = std::min(length, next.length);
+  memcpy(buffer, next.data, *actual);
+  load_next();
+  return 0;
+}
+
+/* Waits until a trace is due, an OUT signal or cancellation completes or interrupt() is called. Due traces are
+* then passed to the Oeradar on the calling thread, followed by the completions.
+*/
+int ReplayTransport::handle_events(long timeout_us){
+
+  std::unique_lock<std::mutex> lock(mutex);
+  Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeout_us < 0 ? 0 : timeout_us);
+
+  ready.clear();
+  while (true){
+    Clock::time_point now = Clock::now();
+    while (!posted.empty() && has_next && ready.size() < LIBERAD_REPLAY_BURST && due() <= now){
+      ready.push_back(next);
+      if (cursor.image && (held.empty() || held.back() != cursor.image)) held.push_back(cursor.image);
+      load_next();
+    }
+    if (!ready.empty() || !completions.empty() || interrupted) break;
+    if (timeout_us >= 0 && now >= deadline) break;
+
+    if (posted.empty() || !has_next){
+      if (timeout_us < 0) wake.wait(lock);
+      else wake.wait_until(lock, deadline);
+    } else {
+      wake.wait_until(lock, timeout_us < 0 ? due() : std::min(due(), deadline));
+    }
+  }
+
+  interrupted = false;
+  std::deque<Completion> done;
+  done.swap(completions);
+  lock.unlock();
+
+  for (size_t i = 0; i < ready.size(); i++) radar->replay_trace(ready[i]);
+  radar->flush_batch();
+  held.clear();
+
+  for (size_t i = 0; i < done.size(); i++){
+    if (done[i].in) radar->complete_in(done[i].slot, done[i].buffer, done[i].length, done[i].status);
+    else radar->complete_out(done[i].slot, done[i].length, done[i].status);
+  }
+  return 0;
+}
+
+/* Also wakes the libusb event loop, since an executor serving this device may be waiting there */
+void ReplayTransport::interrupt(){
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    interrupted = true;
+    wake.notify_one();
+  }
+  if (context) libusb_interrupt_event_handler(context);
+}
+
+long ReplayTransport::next_event_us(){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!completions.empty() || interrupted) return 0;
+  if (posted.empty() || !has_next) return -1;
+
+  long long wait = std::chrono::duration_cast<std::chrono::microseconds>(due() - Clock::now()).count();
+  return wait > 0 ? (long)wait : 0;
+}
+
+void ReplayTransport::seek(unsigned long long index){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  cursor = file->seek_index(index);
+  load_next();
+  if (origin != Clock::time_point()) anchor(Clock::now());
+  wake.notify_one();
+}
+
+void ReplayTransport::seek_time(long long offset_ns){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  cursor = file->seek_time(file->first_timestamp_ns() + offset_ns);
+  load_next();
+  if (origin != Clock::time_point()) anchor(Clock::now());
+  wake.notify_one();
+}
+
+void ReplayTransport::get_info(LiberadReplayInfo* info){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  info->trace_count = file->trace_count();
+  info->next_index = has_next ? next_index : file->trace_count();
+  info->duration_ns = file->last_timestamp_ns() - file->first_timestamp_ns();
+  info->position_ns = has_next ? next.timestamp_ns - file->first_timestamp_ns() : info->duration_ns;
+  info->finished = !has_next;
+}
+
+/* Reads the trace at the cursor into next. After the last trace a looping replay continues with the first one,
+* which is due at once as the replay clock is anchored anew.
+*/
+void ReplayTransport::load_next(){
+
+  has_next = file->read(cursor, &next);
+  if (!has_next && params.loop && file->trace_count() > 0){
+    cursor = file->seek_index(0);
+    has_next = file->read(cursor, &next);
+    if (has_next && origin != Clock::time_point()) anchor(Clock::now());
+  }
+  if (has_next) next_index = cursor.index - 1;
+}
+
+/* Replays the next trace at now and the following ones at their recorded distance from it */
+void ReplayTransport::anchor(Clock::time_point now){
+  origin = now;
+  origin_ns = has_next ? next.timestamp_ns : 0;
+}
+
+ReplayTransport::Clock::time_point ReplayTransport::due() const {
+  if (params.speed <= 0.0) return origin;
+  long long offset = (long long)((next.timestamp_ns - origin_ns) / params.speed);
+  return origin + std::chrono::nanoseconds(offset);
+}
@@ -0,0 +1,95 @@
+#ifndef ERADREPLAYTRANSPORT_H
+#define ERADREPLAYTRANSPORT_H
+
+#include "../include/liberad.h"
+#include "../include/EradSurvey.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/* Transport standing in for an Oerad device by replaying a recorded survey. While IN requests are posted, traces
+* are passed on from the mapped file, or the unpacked copy of a packed chunk, without copying, at their recorded timing scaled by the replay speed or as
+* fast as they are consumed. They reach callbacks, rings and executor lanes like traces of a live device, with the
+* capture state they were recorded with. OUT signals complete but don't change the recorded traces.
+*/
+class ReplayTransport : public OeradarTransport {
+
+public:
+
+  /* Takes ownership of file */
+  ReplayTransport(Oeradar* radar, SurveyFile* file, const LiberadReplayParams& params);
+  ~ReplayTransport();
+
+  int open();
+  int configure();
+  int close();
+
+  int setup_in(int count);
+  int setup_out(int count);
+  int submit_in(int slot, unsigned char* buffer, int length);
+  int submit_out(int slot, unsigned char* buffer, int length);
+  void cancel_all();
+
+  int write_sync(unsigned char* data, int length, int* actual, unsigned int timeout_ms);
+  int read_sync(unsigned char* buffer, int length, int* actual, unsigned int timeout_ms);
+
+  int handle_events(long timeout_us);
+  void interrupt();
+  long next_event_us();
+
+  /* Continues the replay from trace index, or from the first trace offset_ns after the first trace of the survey */
+  void seek(unsigned long long index);
+  void seek_time(long long offset_ns);
+
+  void get_info(LiberadReplayInfo* info);
+
+  const SurveyFile& survey() const { return *file; }
+
+private:
+
+  typedef std::chrono::steady_clock Clock;
+
+  struct PostedIn {
+    int slot;
+    unsigned char* buffer;
+  };
+
+  struct Completion {
+    int slot;
+    unsigned char* buffer;
+    int length;
+    int status;
+    bool in;
+  };
+
+  void load_next();
+  void anchor(Clock::time_point now);
+  Clock::time_point due() const;
+
+  Oeradar* radar;
+  SurveyFile* file;
+  LiberadReplayParams params;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool interrupted = false;
+  std::deque<PostedIn> posted;
+  std::deque<Completion> completions;
+  std::vector<Trace> ready;
+  /* Unpacked chunks of the traces in ready, kept until they are delivered */
+  std::vector<std::shared_ptr<const std::vector<unsigned char> > > held;
+
+  /* Next trace to replay and the cursor after it */
+  LiberadSurveyCursor cursor;
+  Trace next;
+  unsigned long long next_index = 0;
+  bool has_next = false;
+
+  /* Steady clock time at which the trace recorded at origin_ns is replayed. Unset until someone listens. */
+  Clock::time_point origin;
+  long long origin_ns = 0;
+};
+
+#endif
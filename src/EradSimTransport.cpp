@@ -0,0 +1,401 @@
+#include "EradSimTransport.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+extern libusb_context* context;
+
+/* Reflectors of the synthetic subsurface: two way travel time at the apex in samples of the SHORT window,
+* position of the apex in encoder steps and reflection amplitude. The pattern repeats every
+* LIBERAD_SIM_SECTION steps so a long survey keeps producing hyperbolas.
+*/
+#define LIBERAD_SIM_SECTION 600.0f
+static const float liberad_sim_reflectors[][3] = {
+  {120.0f, 150.0f, 45.0f},
+  {260.0f, 420.0f, -30.0f},
+  {390.0f, 280.0f, 22.0f},
+};
+
+/* Ricker wavelet centred at 0 with a width of w samples */
+static float liberad_ricker(float t, float w){
+  float r = t / w;
+  return (1.0f - 2.0f * r * r) * expf(-r * r);
+}
+
+SimulatedTransport::SimulatedTransport(Oeradar* radar, const LiberadSimParams& params) :
+  radar(radar),
+  params(params),
+  noise_state(params.seed ? params.seed : 1),
+  packet_state(noise_state ^ 0x9e3779b9u){
+
+  if (this->params.trace_length < 3) this->params.trace_length = TRACE_LENGTH;
+}
+
+int SimulatedTransport::open(){
+  ELOG(LIBERAD_INFO) << "Opened simulated device";
+  return LIBERAD_SUCCESS;
+}
+
+int SimulatedTransport::configure(){
+  return LIBERAD_SUCCESS;
+}
+
+int SimulatedTransport::close(){
+  ELOG(LIBERAD_INFO) << "Closed simulated device. Missed traces: " << missed;
+  return LIBERAD_SUCCESS;
+}
+
+int SimulatedTransport::setup_in(int count){
+  return LIBERAD_SUCCESS;
+}
+
+int SimulatedTransport::setup_out(int count){
+  return LIBERAD_SUCCESS;
+}
+
+/* The trace clock starts with the first posted request, so traces produced before anyone listens don't count as missed */
+int SimulatedTransport::submit_in(int slot, unsigned char* buffer, int length){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (next_due == Clock::time_point()) next_due = Clock::now() + std::chrono::microseconds(params.trace_period_us);
+
+  PostedIn request = {slot, buffer, length};
+  posted.push_back(request);
+  wake.notify_one();
+  return 0;
+}
+
+/* OUT signals take effect immediately and complete on the next handle_events() */
+int SimulatedTransport::submit_out(int slot, unsigned char* buffer, int length){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (int i = 0; i < length; i++) apply_signal(buffer[i]);
+
+  Completion done = {slot, buffer, length, LIBUSB_TRANSFER_COMPLETED, false};
+  completions.push_back(done);
+  wake.notify_one();
+  return 0;
+}
+
+void SimulatedTransport::cancel_all(){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  while (!posted.empty()){
+    Completion done = {posted.front().slot, posted.front().buffer, 0, LIBUSB_TRANSFER_CANCELLED, true};
+    completions.push_back(done);
+    posted.pop_front();
+  }
+  wake.notify_one();
+}
+
+int SimulatedTransport::write_sync(unsigned char* data, int length, int* actual, unsigned int timeout_ms){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (int i = 0; i < length; i++) apply_signal(data[i]);
+  *actual = length;
+  return 0;
+}
+
+/* Waits for the next trace like a blocking bulk read. A timeout of 0 waits indefinitely, as in libusb. */
+int SimulatedTransport::read_sync(unsigned char* buffer, int length, int* actual, unsigned int timeout_ms){
+
+  std::unique_lock<std::mutex> lock(mutex);
+  if (packets_pending()){
+    *actual = next_packet(buffer, length);
+    return 0;
+  }
+
+  Clock::time_point now = Clock::now();
+  if (next_due == Clock::time_point()) next_due = now;
+
+  Clock::time_point deadline = now + std::chrono::milliseconds(timeout_ms);
+  while (now < next_due){
+    if (timeout_ms > 0 && now >= deadline){
+      *actual = 0;
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+    wake.wait_until(lock, timeout_ms > 0 ? std::min(next_due, deadline) : next_due);
+    now = Clock::now();
+  }
+
+  std::chrono::microseconds period(params.trace_period_us);
+  if (period.count() > 0){
+    while (next_due + period <= now){
+      next_due += period;
+      missed++;
+    }
+  }
+  next_due += period;
+  *actual = generate(buffer, length);
+  return 0;
+}
+
+/* Fills posted requests whose trace is due and counts traces that came due with nothing posted.
+* Packets left of a trace already due are sent first, without waiting.
+*/
+void SimulatedTransport::catch_up(Clock::time_point now){
+
+  if (next_due == Clock::time_point()) return;
+
+  while (!posted.empty() && packets_pending()){
+    PostedIn& request = posted.front();
+    Completion done = {request.slot, request.buffer, next_packet(request.buffer, request.length), LIBUSB_TRANSFER_COMPLETED, true};
+    completions.push_back(done);
+    posted.pop_front();
+  }
+
+  std::chrono::microseconds period(params.trace_period_us);
+  if (period.count() <= 0){
+    while (!posted.empty()){
+      PostedIn& request = posted.front();
+      int traces = 0;
+      Completion done = {request.slot, request.buffer, fill(request.buffer, request.length, params.traces_per_transfer, &traces), LIBUSB_TRANSFER_COMPLETED, true};
+      completions.push_back(done);
+      posted.pop_front();
+    }
+    return;
+  }
+
+  while (next_due <= now){
+    if (posted.empty()){
+      long long behind = (now - next_due) / period + 1;
+      missed += behind;
+      next_due += period * behind;
+      break;
+    }
+    PostedIn& request = posted.front();
+    int traces = 0;
+    long long due = (now - next_due) / period + 1;
+    Completion done = {request.slot, request.buffer, fill(request.buffer, request.length, due, &traces), LIBUSB_TRANSFER_COMPLETED, true};
+    completions.push_back(done);
+    posted.pop_front();
+    next_due += period * traces;
+  }
+}
+
+/* Waits until a trace is due, an OUT signal or cancellation completes or interrupt() is called, then
+* reports completions to the Oeradar on the calling thread.
+*/
+int SimulatedTransport::handle_events(long timeout_us){
+
+  std::unique_lock<std::mutex> lock(mutex);
+  Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeout_us < 0 ? 0 : timeout_us);
+
+  while (true){
+    Clock::time_point now = Clock::now();
+    catch_up(now);
+    if (!completions.empty() || interrupted) break;
+    if (timeout_us >= 0 && now >= deadline) break;
+
+    if (posted.empty()){
+      if (timeout_us < 0) wake.wait(lock);
+      else wake.wait_until(lock, deadline);
+    } else {
+      wake.wait_until(lock, timeout_us < 0 ? next_due : std::min(next_due, deadline));
+    }
+  }
+
+  interrupted = false;
+  std::deque<Completion> ready;
+  ready.swap(completions);
+  lock.unlock();
+
+  for (size_t i = 0; i < ready.size(); i++){
+    if (ready[i].in) radar->complete_in(ready[i].slot, ready[i].buffer, ready[i].length, ready[i].status);
+    else radar->complete_out(ready[i].slot, ready[i].length, ready[i].status);
+  }
+  return 0;
+}
+
+/* Also wakes the libusb event loop, since an executor serving this device may be waiting there */
+void SimulatedTransport::interrupt(){
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    interrupted = true;
+    wake.notify_one();
+  }
+  if (context) libusb_interrupt_event_handler(context);
+}
+
+long SimulatedTransport::next_event_us(){
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!completions.empty() || interrupted) return 0;
+  if (posted.empty() || next_due == Clock::time_point()) return -1;
+  if (packets_pending()) return 0;
+  if (params.trace_period_us <= 0) return 0;
+
+  long long wait = std::chrono::duration_cast<std::chrono::microseconds>(next_due - Clock::now()).count();
+  return wait > 0 ? (long)wait : 0;
+}
+
+void SimulatedTransport::apply_signal(unsigned char signal){
+  if (signal == SHORT || signal == LONG) window = signal;
+  else if (signal >= LEVEL1 && signal <= LEVEL5) gain = signal;
+  else ELOG(LIBERAD_WARN) << "Simulated device ignored unknown signal " << (int)signal;
+}
+
+/* Writes the next trace into buffer, or two traces every doubled_every-th transfer if they fit.
+* A buffer shorter than a trace receives its beginning only. With packets, the trace is queued and
+* the first packet of it written instead.
+* @return number of bytes written
+*/
+int SimulatedTransport::generate(unsigned char* buffer, int length){
+
+  int n = params.trace_length;
+
+  if (params.packet_size > 0){
+    bool doubled = params.doubled_every > 0 && (produced + 1) % params.doubled_every == 0;
+    size_t end = stream.size();
+    stream.resize(end + (doubled ? 2 : 1) * n);
+    generate_trace(&stream[end]);
+    if (doubled) generate_trace(&stream[end + n]);
+    return next_packet(buffer, length);
+  }
+
+  bool doubled = params.doubled_every > 0 && (produced + 1) % params.doubled_every == 0 && length >= 2 * n;
+
+  if (length < n){
+    std::vector<unsigned char> trace(n);
+    generate_trace(&trace[0]);
+    memcpy(buffer, &trace[0], length);
+    return length;
+  }
+
+  generate_trace(buffer);
+  if (!doubled) return n;
+  generate_trace(buffer + n);
+  return 2 * n;
+}
+
+bool SimulatedTransport::packets_pending() const {
+  return stream_sent < stream.size();
+}
+
+/* Writes the next packet of the queued traces into buffer. Packets are 1 to packet_size bytes long and cut
+* traces at arbitrary points; every packet_loss_every-th packet is dropped and the one after it sent instead.
+* @return number of bytes written, 0 if no trace is queued
+*/
+int SimulatedTransport::next_packet(unsigned char* buffer, int length){
+
+  while (packets_pending()){
+    packet_state ^= packet_state << 13;
+    packet_state ^= packet_state >> 17;
+    packet_state ^= packet_state << 5;
+    int size = 1 + (int)(packet_state % (unsigned)params.packet_size);
+    size = std::min(size, std::min(length, (int)(stream.size() - stream_sent)));
+
+    const unsigned char* packet = &stream[stream_sent];
+    stream_sent += size;
+    packets++;
+    if (params.packet_loss_every > 0 && packets % params.packet_loss_every == 0) continue;
+
+    memcpy(buffer, packet, size);
+    if (!packets_pending()){
+      stream.clear();
+      stream_sent = 0;
+    }
+    return size;
+  }
+
+  stream.clear();
+  stream_sent = 0;
+  return 0;
+}
+
+/* Completes a transfer with the traces that are due, as many as fit up to traces_per_transfer. Without
+* packets at least one trace, or the beginning of one, is written.
+* @param unsigned char* buffer - buffer of the transfer
+* @param int length - size of buffer
+* @param long long due - traces due
+* @param int* traces - receives the number of due traces used
+* @return number of bytes written
+*/
+int SimulatedTransport::fill(unsigned char* buffer, int length, long long due, int* traces){
+
+  int written = generate(buffer, length);
+  *traces = 1;
+  if (params.packet_size > 0) return written;
+
+  long long most = std::min(due, (long long)params.traces_per_transfer);
+  while (*traces < most && length - written >= params.trace_length){
+    written += generate(buffer + written, length - written);
+    (*traces)++;
+  }
+  return written;
+}
+
+/* xorshift32, summed into a roughly gaussian value with unit variance */
+float SimulatedTransport::next_noise(){
+  float sum = 0.0f;
+  for (int i = 0; i < 3; i++){
+    noise_state ^= noise_state << 13;
+    noise_state ^= noise_state >> 17;
+    noise_state ^= noise_state << 5;
+    sum += (float)(noise_state & 0xffff) / 65535.0f;
+  }
+  return (sum - 1.5f) * 2.0f;
+}
+
+void SimulatedTransport::build_background(){
+
+  int samples = params.trace_length - 2;
+  float stretch = window == LONG ? 2.0f : 1.0f;
+  direct.resize(samples);
+  wow_envelope.resize(samples);
+  values.resize(samples);
+  for (int i = 0; i < samples; i++){
+    float t = i * stretch;
+    direct[i] = 100.0f * liberad_ricker(t - 12.0f, 4.0f);
+    wow_envelope[i] = 1.0f - expf(-t / 150.0f);
+  }
+  background_window = window;
+}
+
+/* Synthesizes one trace: a direct wave, hyperbolic reflections from the reflectors passing under the
+* antenna, attenuation with depth, a slowly drifting low frequency offset (wow) and noise. Samples are
+* unsigned bytes centred at 128 followed by the encoder steps and the CONTROL_B delimiter. The gain level
+* scales the amplitude and a LONG time window fits twice the time into the same number of samples.
+*/
+void SimulatedTransport::generate_trace(unsigned char* trace){
+
+  produced++;
+
+  step_remainder += params.steps_per_trace;
+  int steps = (int)step_remainder;
+  steps = std::max(-127, std::min(127, steps));
+  step_remainder -= steps;
+  position += steps;
+
+  if (background_window != window) build_background();
+
+  int samples = params.trace_length - 2;
+  float stretch = window == LONG ? 2.0f : 1.0f;
+  float scale = 0.25f * (float)(1 << (gain - LEVEL1));
+  float wow = 25.0f * sinf((float)produced * 0.013f);
+
+  for (int i = 0; i < samples; i++) values[i] = direct[i] + wow * wow_envelope[i] + 1.5f * next_noise();
+
+  /* The wavelet is negligible beyond a few widths, so each reflection only touches the samples around it */
+  for (int k = 0; k < 3; k++){
+    float dx = fmodf((float)position - liberad_sim_reflectors[k][1], LIBERAD_SIM_SECTION);
+    if (dx < -LIBERAD_SIM_SECTION / 2) dx += LIBERAD_SIM_SECTION;
+    if (dx > LIBERAD_SIM_SECTION / 2) dx -= LIBERAD_SIM_SECTION;
+    dx *= 0.8f;
+
+    float t0 = liberad_sim_reflectors[k][0];
+    float tk = sqrtf(t0 * t0 + dx * dx);
+    float amplitude = liberad_sim_reflectors[k][2] * expf(-0.004f * tk);
+    int first = std::max(0, (int)((tk - 20.0f) / stretch));
+    int last = std::min(samples - 1, (int)((tk + 20.0f) / stretch));
+    for (int i = first; i <= last; i++) values[i] += amplitude * liberad_ricker(i * stretch - tk, 5.0f);
+  }
+
+  for (int i = 0; i < samples; i++){
+    long sample = lrintf(values[i] * scale) + 128;
+    trace[i] = (unsigned char)std::max(0L, std::min(255L, sample));
+  }
+
+  trace[samples] = (unsigned char)(signed char)steps;
+  trace[samples + 1] = CONTROL_B;
+}
@@ -0,0 +1,101 @@
+#ifndef ERADSIMTRANSPORT_H
+#define ERADSIMTRANSPORT_H
+
+#include "../include/liberad.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/* Transport standing in for an Oerad device. Posted IN requests are filled with synthetic traces at the
+* configured trace period, OUT signals change the simulated gain and time window. Completions are reported
+* from handle_events() like those of a real device, so the whole IO path runs without hardware.
+*/
+class SimulatedTransport : public OeradarTransport {
+
+public:
+
+  SimulatedTransport(Oeradar* radar, const LiberadSimParams& params);
+
+  int open();
+  int configure();
+  int close();
+
+  int setup_in(int count);
+  int setup_out(int count);
+  int submit_in(int slot, unsigned char* buffer, int length);
+  int submit_out(int slot, unsigned char* buffer, int length);
+  void cancel_all();
+
+  int write_sync(unsigned char* data, int length, int* actual, unsigned int timeout_ms);
+  int read_sync(unsigned char* buffer, int length, int* actual, unsigned int timeout_ms);
+
+  int handle_events(long timeout_us);
+  void interrupt();
+  long next_event_us();
+
+  /* Traces the simulated device produced while no IN request was posted */
+  std::atomic<unsigned long long> missed{0};
+
+private:
+
+  typedef std::chrono::steady_clock Clock;
+
+  struct PostedIn {
+    int slot;
+    unsigned char* buffer;
+    int length;
+  };
+
+  struct Completion {
+    int slot;
+    unsigned char* buffer;
+    int length;
+    int status;
+    bool in;
+  };
+
+  void apply_signal(unsigned char signal);
+  void catch_up(Clock::time_point now);
+  int generate(unsigned char* buffer, int length);
+  int fill(unsigned char* buffer, int length, long long due, int* traces);
+  int next_packet(unsigned char* buffer, int length);
+  bool packets_pending() const;
+  void generate_trace(unsigned char* trace);
+  void build_background();
+  float next_noise();
+
+  Oeradar* radar;
+  LiberadSimParams params;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool interrupted = false;
+  std::deque<PostedIn> posted;
+  std::deque<Completion> completions;
+  Clock::time_point next_due;
+
+  /* Device state, changed by OUT signals */
+  unsigned char window = SHORT;
+  unsigned char gain = LEVEL3;
+
+  /* Generator state */
+  unsigned int noise_state;
+  /* Direct wave and wow envelope, which only change with the time window */
+  std::vector<float> direct;
+  std::vector<float> wow_envelope;
+  std::vector<float> values;
+  unsigned char background_window = 0;
+  unsigned long long produced = 0;
+  float step_remainder = 0.0f;
+  long position = 0;
+
+  /* Traces generated but not yet sent in packets, and the state choosing packet sizes and losses */
+  std::vector<unsigned char> stream;
+  size_t stream_sent = 0;
+  unsigned int packet_state;
+  unsigned long long packets = 0;
+};
+
+#endif
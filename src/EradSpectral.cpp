@@ -0,0 +1,223 @@
+#include "../include/liberad.h"
+#include "EradParallel.h"
+#include <map>
+#include <math.h>
+#include <memory>
+#include <mutex>
+
+/* Rows handed to a processing thread at a time */
+#define LIBERAD_SPECTRAL_GRAIN 8
+
+/* Twiddles and bit reversal of a radix 2 transform. Twiddles are laid out stage after stage, so each butterfly
+* loop reads them contiguously.
+*/
+struct FftPlan {
+  int size;
+  std::vector<int> reverse;
+  std::vector<float> cos;
+  std::vector<float> sin;
+};
+
+/* Plans by transform size, made on first use and kept */
+static std::mutex plans_mutex;
+static std::map<int, std::shared_ptr<const FftPlan>> plans;
+
+static std::shared_ptr<const FftPlan> plan_for(int size){
+
+  std::lock_guard<std::mutex> lock(plans_mutex);
+  std::shared_ptr<const FftPlan>& cached = plans[size];
+  if (cached) return cached;
+
+  std::shared_ptr<FftPlan> plan(new FftPlan());
+  plan->size = size;
+  plan->reverse.resize(size);
+  int bits = 0;
+  while ((1 << bits) < size) bits++;
+  for (int i = 0; i < size; i++){
+    int r = 0;
+    for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+    plan->reverse[i] = r;
+  }
+  for (int half = 1; half < size; half *= 2){
+    for (int j = 0; j < half; j++){
+      double angle = -M_PI * j / half;
+      plan->cos.push_back((float)::cos(angle));
+      plan->sin.push_back((float)::sin(angle));
+    }
+  }
+  cached = plan;
+  return cached;
+}
+
+/* Combines the two halves of a block of 2 * half values of the transform */
+static void butterflies(float* re, float* im, int half, const float* wr, const float* wi){
+  float* br = re + half;
+  float* bi = im + half;
+  for (int j = 0; j < half; j++){
+    float tr = br[j] * wr[j] - bi[j] * wi[j];
+    float ti = br[j] * wi[j] + bi[j] * wr[j];
+    br[j] = re[j] - tr;
+    bi[j] = im[j] - ti;
+    re[j] += tr;
+    im[j] += ti;
+  }
+}
+
+/* Forward transform in place of a complex signal held as separate real and imaginary parts */
+static void fft(const FftPlan& plan, float* re, float* im){
+
+  int size = plan.size;
+  const int* reverse = plan.reverse.data();
+  for (int i = 0; i < size; i++){
+    int r = reverse[i];
+    if (r > i){
+      float t = re[i]; re[i] = re[r]; re[r] = t;
+      t = im[i]; im[i] = im[r]; im[r] = t;
+    }
+  }
+
+  /* The first two stages multiply by 1 and -i only */
+  if (size >= 4){
+    for (int start = 0; start < size; start += 4){
+      float* r = re + start;
+      float* m = im + start;
+      float r0 = r[0] + r[1], i0 = m[0] + m[1], r1 = r[0] - r[1], i1 = m[0] - m[1];
+      float r2 = r[2] + r[3], i2 = m[2] + m[3], r3 = r[2] - r[3], i3 = m[2] - m[3];
+      r[0] = r0 + r2; m[0] = i0 + i2;
+      r[2] = r0 - r2; m[2] = i0 - i2;
+      r[1] = r1 + i3; m[1] = i1 - r3;
+      r[3] = r1 - i3; m[3] = i1 + r3;
+    }
+  }
+  const float* wr = plan.cos.data();
+  const float* wi = plan.sin.data();
+  int first = 1;
+  if (size >= 4){
+    first = 4;
+    wr += 3;
+    wi += 3;
+  }
+  for (int half = first; half < size; half *= 2){
+    for (int start = 0; start < size; start += 2 * half){
+      butterflies(re + start, im + start, half, wr, wi);
+    }
+    wr += half;
+    wi += half;
+  }
+}
+
+/* Inverse transform without the 1 / size scaling: the forward transform with real and imaginary parts swapped */
+static void inverse_fft(const FftPlan& plan, float* re, float* im){
+  fft(plan, im, re);
+}
+
+float liberad_window_ns(LiberadModel model, TimeWindow window){
+  switch (model){
+    case LIBERAD_DIPOLO: return window == LONG ? 150.0f : 75.0f;
+    case LIBERAD_SCUDO: return window == LONG ? 100.0f : 50.0f;
+    case LIBERAD_CONCRETTO: return window == LONG ? 15.0f : 7.5f;
+  }
+  return 0;
+}
+
+float liberad_centre_mhz(LiberadModel model){
+  switch (model){
+    case LIBERAD_DIPOLO: return 250.0f;
+    case LIBERAD_SCUDO: return 400.0f;
+    case LIBERAD_CONCRETTO: return 2000.0f;
+  }
+  return 0;
+}
+
+/* Response of the band-pass at frequency f: 1 inside the pass band, a raised cosine down to 0 at low / 2 and
+* 1.5 * high
+*/
+static float band_response(float f, float low, float high){
+  if (f >= low && f <= high) return 1.0f;
+  float edge = f < low ? (low - f) / (low / 2) : (f - high) / (high / 2);
+  if (edge >= 1.0f) return 0.0f;
+  return 0.5f + 0.5f * cosf((float)M_PI * edge);
+}
+
+/* Filters the rows of a sample matrix in the frequency domain. Band-passing pairs rows into one complex
+* transform, as a real and symmetric response keeps them apart; the envelope needs the one sided spectrum of each
+* row, so it transforms them one by one.
+* @param LiberadSampleMatrix* matrix - decoded traces in LIBERAD_SAMPLES_FLOAT format, filtered in place
+* @param const LiberadSpectralParams* params - device model, time window, pass band and output
+* @return LIBERAD_ERR if the matrix is not in float format or the pass band is invalid
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_filter_traces(LiberadSampleMatrix* matrix, const LiberadSpectralParams* params){
+
+  if (matrix->format != LIBERAD_SAMPLES_FLOAT){
+    ELOG(LIBERAD_ERROR) << "Spectral filtering needs a float sample matrix";
+    return LIBERAD_ERR;
+  }
+
+  LiberadSpectralParams p;
+  if (params) p = *params;
+  float window_ns = liberad_window_ns(p.model, p.window);
+  float low = p.low_mhz > 0 ? p.low_mhz : liberad_centre_mhz(p.model) / 2;
+  float high = p.high_mhz > 0 ? p.high_mhz : liberad_centre_mhz(p.model) * 2;
+  /* The sample interval is the time window over the samples of the traces, not over the padded columns */
+  int columns = p.sample_count > 0 ? p.sample_count : matrix->columns;
+  if (window_ns <= 0 || !(low < high) || p.sample_count < 0 || columns > matrix->columns){
+    ELOG(LIBERAD_ERROR) << "Invalid spectral filter parameters";
+    return LIBERAD_ERR;
+  }
+
+  int size = 1;
+  while (size < columns) size *= 2;
+  std::shared_ptr<const FftPlan> plan = plan_for(size);
+
+  /* Response per bin, with the weights of the analytic signal folded in for the envelope: 2 for positive
+  * frequencies, 0 for negative ones, 1 at 0 and Nyquist. Both include the 1 / size of the inverse transform.
+  */
+  std::vector<float> response(size);
+  float bin_mhz = 1000.0f * columns / window_ns / size;
+  bool envelope = p.output == LIBERAD_SPECTRAL_ENVELOPE;
+  for (int k = 0; k < size; k++){
+    int folded = k <= size / 2 ? k : size - k;
+    float weight = band_response(folded * bin_mhz, low, high) / size;
+    if (envelope && k > 0 && k < size / 2) weight *= 2;
+    if (envelope && k > size / 2) weight = 0;
+    response[k] = weight;
+  }
+
+  int rows = matrix->rows;
+  ParallelPool::shared().run(rows, LIBERAD_SPECTRAL_GRAIN, [&](int begin, int end){
+
+    /* Scratch of each thread, kept between calls */
+    static thread_local std::vector<float> scratch;
+    if (scratch.size() < 2 * (size_t)size) scratch.resize(2 * (size_t)size);
+    float* re = scratch.data();
+    float* im = re + size;
+    const float* h = response.data();
+    int step = envelope ? 1 : 2;
+    for (int row = begin; row < end; row += step){
+      float* a = matrix->row_float(row);
+      float* b = !envelope && row + 1 < end ? matrix->row_float(row + 1) : nullptr;
+      std::copy(a, a + columns, re);
+      std::fill(re + columns, re + size, 0.0f);
+      if (b) std::copy(b, b + columns, im);
+      else std::fill(im, im + columns, 0.0f);
+      std::fill(im + columns, im + size, 0.0f);
+
+      fft(*plan, re, im);
+      for (int k = 0; k < size; k++){
+        re[k] *= h[k];
+        im[k] *= h[k];
+      }
+      inverse_fft(*plan, re, im);
+
+      if (envelope){
+        for (int i = 0; i < columns; i++) a[i] = sqrtf(re[i] * re[i] + im[i] * im[i]);
+      } else {
+        std::copy(re, re + columns, a);
+        if (b) std::copy(im, im + columns, b);
+      }
+    }
+  });
+
+  return LIBERAD_SUCCESS;
+}
@@ -0,0 +1,90 @@
+#include "../include/EradStack.h"
+#include "../include/EradDecode.h"
+#include <string.h>
+
+StackingStage::StackingStage(const LiberadStackingParams& params) : params(params){
+}
+
+/* Adds a trace to the stack, passing the stack on once it holds fold traces */
+void StackingStage::accept(const Trace& trace){
+
+  traces.fetch_add(1, std::memory_order_relaxed);
+  if (count > 0 && (trace.length != length || trace.gain != last_trace.gain || trace.window != last_trace.window)){
+    partial.fetch_add(1, std::memory_order_relaxed);
+    emit();
+  }
+  if (count == 0) reset(trace);
+
+  liberad_stack_samples(trace.samples, trace.sample_count, sums.data(), low.data(), high.data());
+  steps += trace.steps;
+  keep_frame(trace);
+  if (++count == params.fold) emit();
+}
+
+/* Empties the stack for traces shaped like trace. Buffers keep their capacity. */
+void StackingStage::reset(const Trace& trace){
+
+  length = trace.length;
+  steps = 0;
+  sums.assign(trace.sample_count, 0);
+  low.assign(trace.sample_count, 255);
+  high.assign(trace.sample_count, 0);
+}
+
+/* Copies what surrounds the samples of trace, its trailer in particular, as its data is gone once accept returns.
+* Partial stacks are built from this copy when a change of gain, time window or length arrives.
+*/
+void StackingStage::keep_frame(const Trace& trace){
+
+  offset = (int)(trace.samples - trace.data);
+  int tail = offset + trace.sample_count;
+  frame.resize(length);
+  memcpy(frame.data(), trace.data, offset);
+  memcpy(frame.data() + tail, trace.data + tail, length - tail);
+  last_trace = trace;
+  last_trace.data = nullptr;
+  last_trace.samples = nullptr;
+}
+
+/* Passes on the rounded mean of the stack, without the extremes of each sample if they are rejected, with the
+* trailer of the last trace carrying the steps of all of them
+*/
+void StackingStage::emit(){
+
+  const Trace& like = last_trace;
+  out.resize(length);
+  memcpy(out.data(), frame.data(), length);
+
+  int samples = (int)sums.size();
+  unsigned char* mean = out.data() + offset;
+  /* Dividing by kept is multiplying by 2^32 / kept rounded up, exact for sums below 2^16 */
+  bool rejected = params.reject_extremes && count >= 3;
+  uint32_t kept = rejected ? count - 2 : count;
+  uint64_t reciprocal = (1ull << 32) / kept + 1;
+  if (rejected){
+    for (int i = 0; i < samples; i++) mean[i] = (unsigned char)(((sums[i] - low[i] - high[i] + kept / 2) * reciprocal) >> 32);
+  } else {
+    for (int i = 0; i < samples; i++) mean[i] = (unsigned char)(((sums[i] + kept / 2) * reciprocal) >> 32);
+  }
+
+  if (steps > 127) steps = 127;
+  if (steps < -128) steps = -128;
+
+  Trace stacked = like;
+  stacked.sequence = sequence++;
+  stacked.steps = (signed char)steps;
+  if (length >= 2) out[length - 2] = (unsigned char)stacked.steps;
+  stacked.data = out.data();
+  stacked.samples = mean;
+  stacked.lent = nullptr;
+
+  count = 0;
+  stacks.fetch_add(1, std::memory_order_relaxed);
+  next->accept(stacked);
+}
+
+void StackingStage::get_stats(LiberadStackingStats* stats) const {
+  stats->traces = traces.load(std::memory_order_relaxed);
+  stats->stacks = stacks.load(std::memory_order_relaxed);
+  stats->partial = partial.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,456 @@
+#include "../include/liberad.h"
+#include "../include/EradCodec.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Largest unpacked chunk accepted, well above any chunk size a recorder would use */
+#define LIBERAD_MAX_UNPACKED (1u << 30)
+
+SurveyFile::~SurveyFile(){
+  close();
+}
+
+/* Maps a survey file and builds the table of its trace chunks from the chunk headers. Chunk types other than
+* trace chunks are skipped. Reading stops at the first chunk that is cut off or has no valid header, which is
+* where a recording interrupted by a power loss ends.
+* @param const char* path - survey file written by SurveyRecorder
+* @return LIBERAD_ERR if the file can't be mapped or is not a survey file of a known version
+* @return LIBERAD_SUCCESS else
+*/
+int SurveyFile::open(const char* path){
+
+  close();
+
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0){
+    ELOG(LIBERAD_ERROR) << "Could not open survey file " << path << ": " << strerror(errno);
+    return LIBERAD_ERR;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LiberadRecordHeader)){
+    ELOG(LIBERAD_ERROR) << "Not a survey file: " << path;
+    ::close(fd);
+    return LIBERAD_ERR;
+  }
+
+  /* Private and writable, so traces can be lent to callbacks taking non-const buffers without touching the file */
+  void* memory = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (memory == MAP_FAILED){
+    ELOG(LIBERAD_ERROR) << "Could not map survey file " << path << ": " << strerror(errno);
+    return LIBERAD_ERR;
+  }
+  map = (unsigned char*)memory;
+  map_size = st.st_size;
+
+  memcpy(&file_header, map, sizeof(file_header));
+  if (memcmp(file_header.magic, LIBERAD_RECORD_MAGIC, sizeof(file_header.magic)) != 0 ||
+      file_header.version < 1 || file_header.version > LIBERAD_RECORD_VERSION ||
+      file_header.header_size < sizeof(LiberadRecordHeader) || file_header.align == 0){
+    ELOG(LIBERAD_ERROR) << "Not a survey file of a known version: " << path;
+    close();
+    return LIBERAD_ERR;
+  }
+
+  size_t offset = file_header.header_size;
+  while (offset + sizeof(LiberadChunkHeader) <= map_size){
+    const LiberadChunkHeader* h = (const LiberadChunkHeader*)(map + offset);
+    if (memcmp(h->magic, LIBERAD_CHUNK_MAGIC, sizeof(h->magic)) != 0) break;
+    if (h->chunk_bytes < sizeof(LiberadChunkHeader) || h->chunk_bytes % file_header.align != 0 ||
+        offset + h->chunk_bytes > map_size || h->payload_bytes > h->chunk_bytes - sizeof(LiberadChunkHeader) ||
+        (h->type == LIBERAD_CHUNK_PACKED && h->unpacked_bytes > LIBERAD_MAX_UNPACKED)) break;
+
+    if (h->type == LIBERAD_CHUNK_TRACES || h->type == LIBERAD_CHUNK_PACKED){
+      ChunkEntry entry = {map + offset, h, traces, h->type == LIBERAD_CHUNK_PACKED};
+      chunks.push_back(entry);
+      traces += h->trace_count;
+    } else if (h->type == LIBERAD_CHUNK_INDEX){
+      stored_index = h;
+    }
+    offset += h->chunk_bytes;
+  }
+
+  checked.reset(new std::atomic<unsigned char>[chunks.size()]);
+  for (size_t i = 0; i < chunks.size(); i++) checked[i].store(0, std::memory_order_relaxed);
+  images.assign(chunks.size(), std::weak_ptr<const std::vector<unsigned char> >());
+
+  if (!(file_header.flags & LIBERAD_RECORD_COMPLETE)){
+    ELOG(LIBERAD_WARN) << "Survey file " << path << " was not closed, reading its " << chunks.size() << " intact chunks";
+  }
+  ELOG(LIBERAD_INFO) << "Opened survey file " << path << " with " << traces << " traces";
+  return LIBERAD_SUCCESS;
+}
+
+void SurveyFile::close(){
+
+  if (map) munmap(map, map_size);
+  map = nullptr;
+  map_size = 0;
+  chunks.clear();
+  checked.reset();
+  images.clear();
+  traces = 0;
+  stored_index = nullptr;
+  indexed.store(false, std::memory_order_relaxed);
+  blocks.clear();
+  block_chunks.clear();
+  tree_min.clear();
+  tree_max.clear();
+  tree_leaves = 0;
+}
+
+int64_t SurveyFile::first_timestamp_ns() const {
+  return chunks.empty() ? 0 : chunks.front().header->first_timestamp_ns;
+}
+
+int64_t SurveyFile::last_timestamp_ns() const {
+  return chunks.empty() ? 0 : chunks.back().header->last_timestamp_ns;
+}
+
+/* Checks the payload of a chunk against its checksum the first time it is read from */
+bool SurveyFile::verify(size_t chunk) const {
+
+  unsigned char state = checked[chunk].load(std::memory_order_acquire);
+  if (state == 0){
+    const LiberadChunkHeader* h = chunks[chunk].header;
+    bool intact = liberad_crc32(0, chunks[chunk].data + sizeof(LiberadChunkHeader), h->payload_bytes) == h->checksum;
+    if (!intact) ELOG(LIBERAD_WARN) << "Survey chunk " << h->chunk_index << " damaged, skipping " << h->trace_count << " traces";
+    state = intact ? 1 : 2;
+    checked[chunk].store(state, std::memory_order_release);
+  }
+  return state == 1;
+}
+
+uint32_t SurveyFile::unpacked_payload(size_t chunk) const {
+  return chunks[chunk].packed ? chunks[chunk].header->unpacked_bytes : chunks[chunk].header->payload_bytes;
+}
+
+/* Returns the trace chunk as written by the recorder: the mapped chunk, or for a packed chunk its unpacked copy.
+* The copy is shared with other cursors holding it, or made and then held by cursor.
+* @return chunk header followed by the records, nullptr if a packed chunk is damaged
+*/
+const unsigned char* SurveyFile::records(size_t chunk, LiberadSurveyCursor& cursor) const {
+
+  if (!chunks[chunk].packed) return chunks[chunk].data;
+  if (cursor.image && cursor.image_chunk == chunk) return cursor.image->data();
+
+  std::shared_ptr<const std::vector<unsigned char> > image;
+  {
+    std::lock_guard<std::mutex> lock(images_mutex);
+    image = images[chunk].lock();
+  }
+  if (!image){
+    /* Unpacked without holding the lock; a cursor unpacking the same chunk at the same time keeps its own copy */
+    std::shared_ptr<std::vector<unsigned char> > unpacked = std::make_shared<std::vector<unsigned char> >(sizeof(LiberadChunkHeader) + unpacked_payload(chunk));
+    if (!liberad_unpack_chunk(chunks[chunk].data, unpacked->data())){
+      ELOG(LIBERAD_WARN) << "Packed survey chunk " << chunks[chunk].header->chunk_index << " damaged";
+      return nullptr;
+    }
+    image = unpacked;
+    std::lock_guard<std::mutex> lock(images_mutex);
+    images[chunk] = image;
+  }
+  cursor.image = image;
+  cursor.image_chunk = chunk;
+  return image->data();
+}
+
+/* Moves a cursor past the rest of its chunk */
+void SurveyFile::skip_damaged(LiberadSurveyCursor& cursor) const {
+  cursor.index = chunks[cursor.chunk].first_index + chunks[cursor.chunk].header->trace_count;
+  cursor.chunk++;
+  cursor.offset = sizeof(LiberadChunkHeader);
+}
+
+/* Reads the trace at cursor and advances it. Traces of damaged chunks are skipped, so the index of the trace read
+* may be above the index of the cursor passed in.
+* @param LiberadSurveyCursor& cursor - position of the trace, moved to the next one
+* @param Trace* trace - filled with the recorded state of the trace. device_id is the id recorded in the file header.
+* @return false at the end of the survey
+*/
+bool SurveyFile::read(LiberadSurveyCursor& cursor, Trace* trace) const {
+
+  while (cursor.index < traces && cursor.chunk < chunks.size()){
+
+    const ChunkEntry& entry = chunks[cursor.chunk];
+    if (cursor.index >= entry.first_index + entry.header->trace_count){
+      cursor.chunk++;
+      cursor.offset = sizeof(LiberadChunkHeader);
+      continue;
+    }
+    const unsigned char* base = verify(cursor.chunk) ? records(cursor.chunk, cursor) : nullptr;
+    if (!base){
+      checked[cursor.chunk].store(2, std::memory_order_release);
+      skip_damaged(cursor);
+      continue;
+    }
+
+    const LiberadTraceRecord* r = (const LiberadTraceRecord*)(base + cursor.offset);
+    size_t end = sizeof(LiberadChunkHeader) + unpacked_payload(cursor.chunk);
+    size_t next = cursor.offset + sizeof(LiberadTraceRecord) + ((r->length + 7u) & ~7u);
+    if (cursor.offset + sizeof(LiberadTraceRecord) > end || next > end){
+      checked[cursor.chunk].store(2, std::memory_order_release);
+      skip_damaged(cursor);
+      continue;
+    }
+
+    unsigned char* data = (unsigned char*)base + cursor.offset + sizeof(LiberadTraceRecord);
+    trace->sequence = r->sequence;
+    trace->timestamp_ns = r->timestamp_ns;
+    trace->device_id = file_header.device_id;
+    trace->gain = (Gain)r->gain;
+    trace->window = (TimeWindow)r->window;
+    trace->steps = r->steps;
+    trace->position = r->position;
+    trace->data = data;
+    trace->length = r->length;
+    trace->samples = data;
+    trace->sample_count = r->length >= 2 ? r->length - 2 : r->length;
+    trace->lent = nullptr;
+
+    cursor.offset = next;
+    cursor.index++;
+    return true;
+  }
+  return false;
+}
+
+/* Finds trace index by a binary search over the chunks and a walk over the records of its chunk
+* @param unsigned long long index - trace index from 0
+* @return cursor at the trace, or at the end of the survey
+*/
+LiberadSurveyCursor SurveyFile::seek_index(unsigned long long index) const {
+
+  LiberadSurveyCursor cursor;
+  if (index >= traces){
+    cursor.index = traces;
+    cursor.chunk = chunks.size();
+    return cursor;
+  }
+
+  size_t lo = 0, hi = chunks.size();
+  while (hi - lo > 1){
+    size_t mid = (lo + hi) / 2;
+    if (chunks[mid].first_index <= index) lo = mid;
+    else hi = mid;
+  }
+  /* Empty chunks share their first index with the next one */
+  while (lo + 1 < chunks.size() && index >= chunks[lo].first_index + chunks[lo].header->trace_count) lo++;
+
+  cursor.chunk = lo;
+  cursor.index = chunks[lo].first_index;
+  cursor.offset = sizeof(LiberadChunkHeader);
+  const unsigned char* data = records(lo, cursor);
+  if (!data) return cursor;
+  size_t end = sizeof(LiberadChunkHeader) + unpacked_payload(lo);
+  while (cursor.index < index && cursor.offset + sizeof(LiberadTraceRecord) <= end){
+    const LiberadTraceRecord* r = (const LiberadTraceRecord*)(data + cursor.offset);
+    cursor.offset += sizeof(LiberadTraceRecord) + ((r->length + 7u) & ~7u);
+    cursor.index++;
+  }
+  return cursor;
+}
+
+/* Finds the first trace captured at or after timestamp_ns. Blocks and chunks are in capture order, so the block,
+* or the chunk if the file has no index, is found by a binary search on their last capture times and the trace by
+* a walk within it.
+* @param int64_t timestamp_ns - steady_clock time as recorded, see LiberadRecordHeader for wall clock time
+* @return cursor at the trace, or at the end of the survey if all traces are older
+*/
+LiberadSurveyCursor SurveyFile::seek_time(int64_t timestamp_ns) const {
+
+  if (stored_index || indexed.load(std::memory_order_acquire)){
+    ensure_index();
+    size_t lo = 0, hi = blocks.size();
+    while (lo < hi){
+      size_t mid = (lo + hi) / 2;
+      if (blocks[mid].last_timestamp_ns < timestamp_ns) lo = mid + 1;
+      else hi = mid;
+    }
+    if (lo >= blocks.size()) return seek_index(traces);
+
+    /* The index may be intact while the chunk it points to is damaged, which read() then skips */
+    LiberadSurveyCursor cursor = block_cursor(lo);
+    const unsigned char* data = verify(cursor.chunk) ? records(cursor.chunk, cursor) : nullptr;
+    if (!data) return cursor;
+    size_t end = sizeof(LiberadChunkHeader) + unpacked_payload(cursor.chunk);
+    for (uint32_t i = 0; i < blocks[lo].trace_count && cursor.offset + sizeof(LiberadTraceRecord) <= end; i++){
+      const LiberadTraceRecord* r = (const LiberadTraceRecord*)(data + cursor.offset);
+      if (r->timestamp_ns >= timestamp_ns) break;
+      cursor.offset += sizeof(LiberadTraceRecord) + ((r->length + 7u) & ~7u);
+      cursor.index++;
+    }
+    return cursor;
+  }
+
+  size_t lo = 0, hi = chunks.size();
+  while (lo < hi){
+    size_t mid = (lo + hi) / 2;
+    if (chunks[mid].header->trace_count == 0 || chunks[mid].header->last_timestamp_ns < timestamp_ns) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo >= chunks.size()) return seek_index(traces);
+
+  LiberadSurveyCursor cursor = seek_index(chunks[lo].first_index);
+  const unsigned char* data = records(lo, cursor);
+  if (!data) return cursor;
+  size_t end = sizeof(LiberadChunkHeader) + unpacked_payload(lo);
+  while (cursor.offset + sizeof(LiberadTraceRecord) <= end){
+    const LiberadTraceRecord* r = (const LiberadTraceRecord*)(data + cursor.offset);
+    if (r->timestamp_ns >= timestamp_ns) break;
+    cursor.offset += sizeof(LiberadTraceRecord) + ((r->length + 7u) & ~7u);
+    cursor.index++;
+  }
+  return cursor;
+}
+
+/* Reads the index chunk into blocks, mapping the chunk offset of each entry to its chunk
+* @return false if the index is damaged or doesn't match the trace chunks
+*/
+bool SurveyFile::load_index() const {
+
+  const unsigned char* payload = (const unsigned char*)stored_index + sizeof(LiberadChunkHeader);
+  if (liberad_crc32(0, payload, stored_index->payload_bytes) != stored_index->checksum) return false;
+
+  size_t count = stored_index->payload_bytes / sizeof(LiberadIndexEntry);
+  blocks.resize(count);
+  memcpy(blocks.data(), payload, count * sizeof(LiberadIndexEntry));
+  block_chunks.resize(count);
+
+  size_t chunk = 0;
+  for (size_t i = 0; i < count; i++){
+    const LiberadIndexEntry& entry = blocks[i];
+    while (chunk < chunks.size() && (uint64_t)(chunks[chunk].data - map) < entry.chunk_offset) chunk++;
+    if (chunk == chunks.size() || (uint64_t)(chunks[chunk].data - map) != entry.chunk_offset) return false;
+
+    const ChunkEntry& c = chunks[chunk];
+    if (entry.record_offset < sizeof(LiberadChunkHeader) ||
+        entry.record_offset + sizeof(LiberadTraceRecord) > sizeof(LiberadChunkHeader) + unpacked_payload(chunk) ||
+        entry.first_index < c.first_index || entry.first_index + entry.trace_count > c.first_index + c.header->trace_count) return false;
+    block_chunks[i] = chunk;
+  }
+  return true;
+}
+
+/* Loads the index of the file, or builds it from the intact trace chunks, and the position tree over it. Runs once,
+* on the first lookup needing it.
+*/
+void SurveyFile::ensure_index() const {
+
+  if (indexed.load(std::memory_order_acquire)) return;
+  std::lock_guard<std::mutex> lock(index_mutex);
+  if (indexed.load(std::memory_order_relaxed)) return;
+
+  if (!stored_index || !load_index()){
+    if (stored_index) ELOG(LIBERAD_WARN) << "Survey index damaged, building it from the traces";
+    else ELOG(LIBERAD_INFO) << "Survey file has no index, building it from " << traces << " traces";
+    blocks.clear();
+    block_chunks.clear();
+    for (size_t i = 0; i < chunks.size(); i++){
+      LiberadSurveyCursor scratch;
+      const unsigned char* base = verify(i) ? records(i, scratch) : nullptr;
+      if (!base) continue;
+      liberad_index_chunk(base, (uint64_t)(chunks[i].data - map), chunks[i].first_index, &blocks);
+      block_chunks.resize(blocks.size(), i);
+    }
+  }
+
+  tree_leaves = 1;
+  while (tree_leaves < blocks.size()) tree_leaves *= 2;
+  tree_min.assign(2 * tree_leaves, INT64_MAX);
+  tree_max.assign(2 * tree_leaves, INT64_MIN);
+  for (size_t i = 0; i < blocks.size(); i++){
+    tree_min[tree_leaves + i] = blocks[i].min_position;
+    tree_max[tree_leaves + i] = blocks[i].max_position;
+  }
+  for (size_t node = tree_leaves - 1; node > 0; node--){
+    tree_min[node] = std::min(tree_min[2 * node], tree_min[2 * node + 1]);
+    tree_max[node] = std::max(tree_max[2 * node], tree_max[2 * node + 1]);
+  }
+
+  indexed.store(true, std::memory_order_release);
+}
+
+/* Last block starting at or before trace index, blocks.size() if there is none */
+size_t SurveyFile::block_of(unsigned long long index) const {
+
+  size_t lo = 0, hi = blocks.size();
+  while (lo < hi){
+    size_t mid = (lo + hi) / 2;
+    if (blocks[mid].first_index <= index) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo == 0 ? blocks.size() : lo - 1;
+}
+
+/* First block from block from on whose positions overlap [min_position, max_position], searched in the subtree of
+* node covering blocks first to last - 1. Subtrees entirely outside the range are not entered.
+* @return block, blocks.size() if there is none
+*/
+size_t SurveyFile::next_block_in_range(size_t node, size_t first, size_t last, size_t from, int64_t min_position, int64_t max_position) const {
+
+  if (last <= from || first >= blocks.size()) return blocks.size();
+  if (tree_min[node] > max_position || tree_max[node] < min_position) return blocks.size();
+  if (node >= tree_leaves) return first;
+
+  size_t middle = (first + last) / 2;
+  size_t found = next_block_in_range(2 * node, first, middle, from, min_position, max_position);
+  if (found < blocks.size()) return found;
+  return next_block_in_range(2 * node + 1, middle, last, from, min_position, max_position);
+}
+
+LiberadSurveyCursor SurveyFile::block_cursor(size_t block) const {
+
+  LiberadSurveyCursor cursor;
+  cursor.index = blocks[block].first_index;
+  cursor.chunk = block_chunks[block];
+  cursor.offset = blocks[block].record_offset;
+  return cursor;
+}
+
+bool SurveyFile::position_range(int64_t* min_position, int64_t* max_position) const {
+
+  ensure_index();
+  if (blocks.empty()) return false;
+  *min_position = tree_min[1];
+  *max_position = tree_max[1];
+  return true;
+}
+
+/* Reads traces within an encoder position range. Within a block overlapping the range traces are read one by one;
+* the next overlapping block is found through the position tree, skipping everything between.
+* @param LiberadSurveyCursor& cursor - where to continue, moved past the trace read
+* @param int64_t min_position - lowest encoder position wanted, in steps. Distances are steps per meter times meters.
+* @param int64_t max_position - highest encoder position wanted
+* @param Trace* trace - filled as by read()
+* @return false if no trace at or after cursor is within the range
+*/
+bool SurveyFile::read_range(LiberadSurveyCursor& cursor, int64_t min_position, int64_t max_position, Trace* trace) const {
+
+  ensure_index();
+  while (cursor.index < traces){
+
+    size_t block = block_of(cursor.index);
+    bool inside = block < blocks.size() && cursor.index < blocks[block].first_index + blocks[block].trace_count;
+    if (!inside || blocks[block].min_position > max_position || blocks[block].max_position < min_position){
+      size_t from = block < blocks.size() ? block + 1 : 0;
+      size_t next = next_block_in_range(1, 0, tree_leaves, from, min_position, max_position);
+      if (next >= blocks.size()){
+        cursor = seek_index(traces);
+        return false;
+      }
+      cursor = block_cursor(next);
+      continue;
+    }
+
+    if (!read(cursor, trace)) return false;
+    if (trace->position >= min_position && trace->position <= max_position) return true;
+  }
+  return false;
+}
@@ -0,0 +1,161 @@
+#include "EradUsbTransport.h"
+
+extern libusb_context* context;
+
+/* Wrapper for callback passed to libusb_fill_bulk_transfer for INbound transfers */
+static void LIBUSB_CALL callback_wrapper_in(struct libusb_transfer* transfer){
+  LibusbTransport::Slot* slot = reinterpret_cast<LibusbTransport::Slot*>(transfer->user_data);
+  slot->transport->radar->complete_in(slot->index, transfer->buffer, transfer->actual_length, transfer->status);
+}
+
+/* Wrapper for callback passed to libusb_fill_bulk_transfer for OUTbound transfers */
+static void LIBUSB_CALL callback_wrapper_out(struct libusb_transfer* transfer){
+  LibusbTransport::Slot* slot = reinterpret_cast<LibusbTransport::Slot*>(transfer->user_data);
+  slot->transport->radar->complete_out(slot->index, transfer->actual_length, transfer->status);
+}
+
+LibusbTransport::LibusbTransport(Oeradar* radar) : radar(radar){
+}
+
+LibusbTransport::~LibusbTransport(){
+  for (size_t i = 0; i < transfers_in.size(); i++) libusb_free_transfer(transfers_in[i]);
+  for (size_t i = 0; i < transfers_out.size(); i++) libusb_free_transfer(transfers_out[i]);
+}
+
+/* Opens the device, detaches an attached kernel driver and claims the interface.
+* @return LIBERAD_ERR if interface can't be claimed
+* @return LIBERAD_SUCCESS else
+*/
+int LibusbTransport::open(){
+
+  int r = libusb_open(radar->device, &radar->dev_handle);
+  if (r == 0) ELOG(LIBERAD_INFO) << "Successfully opened device";
+  ELOG(LIBERAD_DEBUG) << "libusb_open: " << r;
+
+  if(libusb_kernel_driver_active(radar->dev_handle, 0) == 1) {
+
+     ELOG(LIBERAD_DEBUG) << "Kernel Driver Active" ;
+     r = libusb_detach_kernel_driver(radar->dev_handle, 0);
+     ELOG(LIBERAD_DEBUG) << "Libusb detach kernel driver: " << r;
+
+     if (r != 0){
+       ELOG(LIBERAD_ERROR) << "Error detaching kernel driver: " << r;
+     }
+
+     ELOG(LIBERAD_DEBUG) << "Kernel Driver Detached";
+
+  }
+  ELOG(LIBERAD_DEBUG) << "Kernel driver not active";
+
+  r = libusb_claim_interface(radar->dev_handle, 0);
+  if (r < 0){
+    ELOG(LIBERAD_DEBUG) << "Can't claim interface " << r;
+    return LIBERAD_ERR;
+  }
+  ELOG(LIBERAD_INFO) << "Successfully claimed interface";
+  return LIBERAD_SUCCESS;
+}
+
+/* Enables UART, sets the modem handshaking, baud rate divisor, baud rate and line control */
+int LibusbTransport::configure(){
+
+  int32_t baudRate = 115200;
+  unsigned char baud[4];
+  baud[0] = baudRate & 0xff;
+  baud[1] = (baudRate >> 8) & 0xff;
+  baud[2] = (baudRate >> 16) & 0xff;
+  baud[3] = (baudRate >> 24) & 0xff;
+  int r;
+  r = libusb_control_transfer(radar->dev_handle, 0x41, 0x00, 0x0001, 0, NULL, 0, 5000);
+  ELOG(LIBERAD_DEBUG) << "Enable UART: " << r;
+  r = libusb_control_transfer(radar->dev_handle, 0x41, 0x07, 0x303, 0, NULL, 0, 5000);
+  ELOG(LIBERAD_DEBUG) << "Set modem handshaking: " << r;
+  r = libusb_control_transfer(radar->dev_handle, 0x41, 0x01, 0x20, 0, NULL, 0, 5000);
+  ELOG(LIBERAD_DEBUG) << "Set baud rate divisor: " << r;
+  r = libusb_control_transfer(radar->dev_handle, 0x41, 0x1E, 0, 0, baud, 4, 5000);
+  ELOG(LIBERAD_DEBUG) << "Set baud rate: " << r;
+  r = libusb_control_transfer(radar->dev_handle, 0x41, 0x03, 0x0800, 0, NULL, 0, 5000);
+  ELOG(LIBERAD_DEBUG) << "Set line control: " << r;
+
+  // TODO check each step for errors
+  return LIBERAD_SUCCESS;
+}
+
+/* Releases the interface and closes the device.
+* @return LIBERAD_ERR if error in releasing the interface
+*/
+int LibusbTransport::close(){
+
+  int r = libusb_release_interface(radar->dev_handle, 0);
+  ELOG(LIBERAD_DEBUG) << "Release interface: " << r;
+  if (r != 0)  return LIBERAD_ERR;
+
+  ELOG(LIBERAD_INFO) << "Released Interface";
+  libusb_close(radar->dev_handle);
+  return LIBERAD_SUCCESS;
+}
+
+void LibusbTransport::resize(std::vector<struct libusb_transfer*>& transfers, std::vector<Slot>& slots, int count){
+
+  if ((int)transfers.size() == count) return;
+
+  for (size_t i = 0; i < transfers.size(); i++) libusb_free_transfer(transfers[i]);
+  transfers.clear();
+  slots.resize(count);
+  for (int i = 0; i < count; i++){
+    transfers.push_back(libusb_alloc_transfer(0));
+    slots[i].transport = this;
+    slots[i].index = i;
+  }
+}
+
+int LibusbTransport::setup_in(int count){
+  resize(transfers_in, slots_in, count);
+  return LIBERAD_SUCCESS;
+}
+
+int LibusbTransport::setup_out(int count){
+  resize(transfers_out, slots_out, count);
+  return LIBERAD_SUCCESS;
+}
+
+/* @return 0 on success, else a libusb error code */
+int LibusbTransport::submit_in(int slot, unsigned char* buffer, int length){
+  libusb_fill_bulk_transfer(transfers_in[slot], radar->dev_handle, LIBERAD_ENDPOINT_IN, buffer, length, callback_wrapper_in, &slots_in[slot], 0);
+  return libusb_submit_transfer(transfers_in[slot]);
+}
+
+/* @return 0 on success, else a libusb error code */
+int LibusbTransport::submit_out(int slot, unsigned char* buffer, int length){
+  libusb_fill_bulk_transfer(transfers_out[slot], radar->dev_handle, LIBERAD_ENDPOINT_OUT, buffer, length, callback_wrapper_out, &slots_out[slot], 0);
+  return libusb_submit_transfer(transfers_out[slot]);
+}
+
+void LibusbTransport::cancel_all(){
+  for (size_t i = 0; i < transfers_in.size(); i++){
+    int r = libusb_cancel_transfer(transfers_in[i]);
+    ELOG(LIBERAD_DEBUG) << "Cancel transfer in " << i << ": " << r;
+  }
+  for (size_t i = 0; i < transfers_out.size(); i++){
+    int r = libusb_cancel_transfer(transfers_out[i]);
+    ELOG(LIBERAD_DEBUG) << "Cancel transfer out " << i << ": " << r;
+  }
+}
+
+int LibusbTransport::write_sync(unsigned char* data, int length, int* actual, unsigned int timeout_ms){
+  return libusb_bulk_transfer(radar->dev_handle, LIBERAD_ENDPOINT_OUT, data, length, actual, timeout_ms);
+}
+
+int LibusbTransport::read_sync(unsigned char* buffer, int length, int* actual, unsigned int timeout_ms){
+  return libusb_bulk_transfer(radar->dev_handle, LIBERAD_ENDPOINT_IN, buffer, length, actual, timeout_ms);
+}
+
+int LibusbTransport::handle_events(long timeout_us){
+  if (timeout_us < 0) return libusb_handle_events_completed(context, NULL);
+  struct timeval tv = {timeout_us / 1000000, timeout_us % 1000000};
+  return libusb_handle_events_timeout_completed(context, &tv, NULL);
+}
+
+void LibusbTransport::interrupt(){
+  libusb_interrupt_event_handler(context);
+}
@@ -0,0 +1,51 @@
+#ifndef ERADUSBTRANSPORT_H
+#define ERADUSBTRANSPORT_H
+
+#include "../include/liberad.h"
+
+/* Transport backed by a physical Oerad device through libusb. All instances share the global
+* libusb context, so their events are handled by whichever thread runs the libusb event loop.
+*/
+class LibusbTransport : public OeradarTransport {
+
+public:
+
+  explicit LibusbTransport(Oeradar* radar);
+  ~LibusbTransport();
+
+  int open();
+  int configure();
+  int close();
+
+  int setup_in(int count);
+  int setup_out(int count);
+  int submit_in(int slot, unsigned char* buffer, int length);
+  int submit_out(int slot, unsigned char* buffer, int length);
+  void cancel_all();
+
+  int write_sync(unsigned char* data, int length, int* actual, unsigned int timeout_ms);
+  int read_sync(unsigned char* buffer, int length, int* actual, unsigned int timeout_ms);
+
+  int handle_events(long timeout_us);
+  void interrupt();
+  bool shares_libusb_context() const { return true; }
+
+  /* Per transfer data passed to the libusb callbacks */
+  struct Slot {
+    LibusbTransport* transport;
+    int index;
+  };
+
+  Oeradar* radar;
+  std::vector<struct libusb_transfer*> transfers_in;
+  std::vector<struct libusb_transfer*> transfers_out;
+
+private:
+
+  void resize(std::vector<struct libusb_transfer*>& transfers, std::vector<Slot>& slots, int count);
+
+  std::vector<Slot> slots_in;
+  std::vector<Slot> slots_out;
+};
+
+#endif
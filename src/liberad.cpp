@@ -1,24 +1,18 @@
 #include "../include/liberad.h"
+#include "EradExecutor.h"
+#include "EradUsbTransport.h"
+#include "EradSimTransport.h"
+#include "EradReplayTransport.h"
+#include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <chrono>
 // #include "EradLogger.h"
 
 libusb_context *context = nullptr;
 libusb_device **devs = nullptr;
 structlog LOGCFG = {};
 
-/* Wrapper for callback passed to libusb_fill_bulk_transfer for INbound transfers */
-void LIBUSB_CALL callback_wrapper_in(struct libusb_transfer* transfer){
-    Oeradar *radar = reinterpret_cast<Oeradar*>(transfer->user_data);
-    radar->cb_in(transfer);
-}
-
-
-/* Wrapper for callback passed to libusb_fill_bulk_transfer for OUTbound transfers */
-void LIBUSB_CALL callback_wrapper_out(struct libusb_transfer* transfer){
-  Oeradar* radar = reinterpret_cast<Oeradar*>(transfer->user_data);
-  radar->cb_out(transfer);
-}
-
 
 
 
@@ -38,12 +32,12 @@ int liberad_init(LogLevel lvl){
   int r = libusb_init(&context);
   liberad_set_logger(lvl);
 
-  Elog(LIBERAD_DEBUG) << "libusb_init() = " << r;
+  ELOG(LIBERAD_DEBUG) << "libusb_init() = " << r;
   if (r < 0){
-    Elog(LIBERAD_ERROR) << "Error initializing libusb context";
+    ELOG(LIBERAD_ERROR) << "Error initializing libusb context";
     return LIBERAD_ERR;
   }
-  Elog(LIBERAD_INFO) << "Liberad successfully init";
+  ELOG(LIBERAD_INFO) << "Liberad successfully init";
   return LIBERAD_SUCCESS;
 }
 
@@ -63,7 +57,7 @@ void liberad_set_logger(LogLevel lvl){
   LOGCFG.headers = true;
   LOGCFG.level = lvl;
 
-  if (!liberad_check_init()) Elog(LIBERAD_WARN) << "Libusb not init";
+  if (!liberad_check_init()) ELOG(LIBERAD_WARN) << "Libusb not init";
 
   switch (LOGCFG.level) {
     case LIBERAD_NONE : libusb_set_debug(context, LIBUSB_LOG_LEVEL_NONE); break;
@@ -73,7 +67,7 @@ void liberad_set_logger(LogLevel lvl){
     case LIBERAD_DEBUG : libusb_set_debug(context, LIBUSB_LOG_LEVEL_INFO); break;
     case LIBERAD_DEBUG_2 : libusb_set_debug(context, LIBUSB_LOG_LEVEL_DEBUG); break;
   }
-  Elog(LIBERAD_DEBUG) << "Liberad Logging Level: " << lvl;
+  ELOG(LIBERAD_DEBUG) << "Liberad Logging Level: " << lvl;
 }
 
 /* Checks if libusb is initialized
@@ -82,7 +76,7 @@ void liberad_set_logger(LogLevel lvl){
 */
 bool liberad_check_init(){
   if (!context){
-    Elog(LIBERAD_ERROR) << "Liberad not init";
+    ELOG(LIBERAD_ERROR) << "Liberad not init";
     return false;
   }
   return true;
@@ -92,32 +86,294 @@ bool liberad_check_init(){
 
 // -------------------------------------------------------------------------------------------------
 
-/* Callback invoked when new data from GPR is available for processing.
+/* Completed transfer being split into traces by the device framer */
+struct FramedTransfer {
+  Oeradar* radar;
+  /* Pool buffer of the transfer if it was swapped out of its slot and may be lent, nullptr else */
+  LiberadTraceBuffer* lendable;
+  long long captured;
+};
+
+static void liberad_frame_sink(void* context, const unsigned char* frame, int length){
+  FramedTransfer* transfer = (FramedTransfer*)context;
+  transfer->radar->complete_frame(frame, length, transfer->lendable, transfer->captured);
+}
+
+/* Called by the transport when an IN request completes with new data from GPR.
 * This function is called internally and is not designed to be exposed to
-* the user of liberad. The function calls a user defined LiberadCallbackIn function.
-* @param libusb_transfer* transfer
+* the user of liberad. The function calls a user defined LiberadCallbackIn function
+* and then resubmits the completed slot. The remaining slots of the queue stay
+* posted to the device while the user callback runs, so the buffer handed to the user
+* is not written to by the transport until the callback returns.
+* With a trace pool enabled the filled buffer is swapped for a free one from the pool,
+* the slot is resubmitted at once and the filled buffer is lent to the user.
+* With a framer the received bytes are split into traces first, see complete_frame.
+* @param int slot - IN slot of the transport
+* @param unsigned char* buffer - buffer the slot read into
+* @param int length - number of bytes received
+* @param int status - libusb_transfer_status of the request
+*/
+void Oeradar::complete_in(int slot, unsigned char* buffer, int length, int status){
+
+  if (status == LIBUSB_TRANSFER_CANCELLED || status == LIBUSB_TRANSFER_NO_DEVICE){
+    in_flight--;
+    if (trace_pool) trace_pool->release(trace_pool->handle_of(buffer));
+    ELOG(LIBERAD_DEBUG) << "complete_in slot retired: " << status;
+    return;
+  }
+
+  long long captured = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  bool received = status == LIBUSB_TRANSFER_COMPLETED && length > 0;
+  LiberadTraceBuffer* lent = nullptr;
+  unsigned char* next_buffer = buffer;
+
+  if (received && framer){
+    if (trace_pool){
+      LiberadTraceBuffer* next = trace_pool->acquire();
+      if (next){
+        lent = trace_pool->handle_of(buffer);
+        next_buffer = next->buffer;
+        resubmit_in(slot, next_buffer);
+      }
+    }
+    FramedTransfer transfer = {this, lent, captured};
+    framer->push(buffer, length, liberad_frame_sink, &transfer);
+    flush_batch();
+    if (lent) trace_pool->release(lent);
+    else resubmit_in(slot, buffer);
+    return;
+  }
+
+  unsigned long long sequence = received ? next_sequence++ : 0;
+
+  if (received && trace_pool){
+    LiberadTraceBuffer* next = trace_pool->acquire();
+    if (next){
+      lent = trace_pool->handle_of(buffer);
+      next_buffer = next->buffer;
+    } else {
+      trace_pool->starved++;
+      ELOG(LIBERAD_DEBUG) << "Trace pool exhausted, trace dropped";
+      received = false;
+    }
+  }
+
+  if (lent) resubmit_in(slot, next_buffer);
+
+  if (received){
+    emit_trace(buffer, length, sequence, captured, lent);
+    flush_batch();
+  }
+
+  if (lent) trace_pool->release(lent);
+  else resubmit_in(slot, buffer);
+
+}
+
+/* Called for every trace the framer finds in a completed transfer. Traces are delivered where the framer
+* found them, in the transfer buffer or in its reassembly buffer. In pooled mode a trace at the start of the
+* transfer's pool buffer is lent without copying, any other trace is copied into a free buffer of the pool.
+* @param const unsigned char* frame - complete trace, only valid during the call
+* @param int length - length of the trace
+* @param LiberadTraceBuffer* transfer - pool buffer of the transfer if it may be lent, nullptr else
+* @param long long captured - completion time of the transfer
+*/
+void Oeradar::complete_frame(const unsigned char* frame, int length, LiberadTraceBuffer* transfer, long long captured){
+
+  unsigned long long sequence = next_sequence++;
+  LiberadTraceBuffer* lent = nullptr;
+
+  if (trace_pool){
+    if (transfer && frame == transfer->buffer){
+      lent = transfer;
+      trace_pool->retain(lent);
+    } else {
+      lent = length <= trace_pool->buffer_size() ? trace_pool->acquire() : nullptr;
+      if (!lent){
+        trace_pool->starved++;
+        ELOG(LIBERAD_DEBUG) << "Trace pool exhausted, trace dropped";
+        return;
+      }
+      memcpy(lent->buffer, frame, length);
+      frame = lent->buffer;
+    }
+  }
+
+  emit_trace(frame, length, sequence, captured, lent);
+  if (lent) trace_pool->release(lent);
+}
+
+/* Stamps a received trace with its capture state and passes it on, to the executor lane serving the device
+* or straight to deliver_in. In batched mode the record is also kept for flush_batch, together with a
+* reference to its pool buffer.
+* @param const unsigned char* data - the trace, including its trailer
+* @param int length - length of the trace
+* @param unsigned long long sequence - sequence number of the trace
+* @param long long captured - steady_clock time in nanoseconds the transfer completed
+* @param LiberadTraceBuffer* lent - pool buffer holding data in pooled mode, nullptr else
+*/
+void Oeradar::emit_trace(const unsigned char* data, int length, unsigned long long sequence, long long captured, LiberadTraceBuffer* lent){
+
+  Trace record;
+  record.sequence = sequence;
+  record.timestamp_ns = captured;
+  record.device_id = id;
+  record.gain = (Gain)active_gain.load(std::memory_order_relaxed);
+  record.window = (TimeWindow)active_window.load(std::memory_order_relaxed);
+  record.steps = length >= 2 ? data[length - 2] : 0;
+  position += record.steps;
+  record.position = position;
+  record.data = data;
+  record.length = length;
+  record.samples = data;
+  record.sample_count = length >= 2 ? length - 2 : length;
+  record.lent = lent;
+  if (lent){
+    lent->length = length;
+    lent->steps = record.steps;
+    lent->trace = record;
+  }
+  if (user_callback_batch){
+    if (lent) trace_pool->retain(lent);
+    batch.push_back(record);
+  }
+  ExecutorLane* worker_lane = lane.load(std::memory_order_acquire);
+  if (worker_lane) worker_lane->handoff(record);
+  else deliver_in(record);
+}
+
+/* Passes the traces collected from a transfer to user_callback_batch and drops the references they held on
+* pool buffers. Called before the transfer buffer is resubmitted, so the traces are intact during the call.
+*/
+void Oeradar::flush_batch(){
+
+  if (batch.empty()) return;
+
+  user_callback_batch(&batch[0], (int)batch.size());
+  if (trace_pool){
+    for (size_t i = 0; i < batch.size(); i++){
+      if (batch[i].lent) trace_pool->release(batch[i].lent);
+    }
+  }
+  batch.clear();
+}
+
+/* Passes on a trace that already carries its capture state, e.g. one replayed from a survey file, the way
+* emit_trace passes on received traces: into the batch, to the executor lane serving the device or straight to
+* deliver_in. The recorded sequence, capture time and encoder position are kept.
+* @param const Trace& trace - the trace and its recorded state. Its data must stay valid until flush_batch.
+*/
+void Oeradar::replay_trace(const Trace& trace){
+
+  Trace record = trace;
+  record.device_id = id;
+  record.lent = nullptr;
+  position = record.position;
+  if (user_callback_batch) batch.push_back(record);
+  ExecutorLane* worker_lane = lane.load(std::memory_order_acquire);
+  if (worker_lane) worker_lane->handoff(record);
+  else deliver_in(record);
+}
+
+/* Posts an IN slot again. If that fails the slot is retired and its pool buffer, if any, returned. */
+void Oeradar::resubmit_in(int slot, unsigned char* buffer){
+
+  int r = transport->submit_in(slot, buffer, in_slot_size);
+  ELOG(LIBERAD_DEBUG_2) << "complete_in submit slot: " << r;
+
+  if (r != 0){
+    in_flight--;
+    if (trace_pool) trace_pool->release(trace_pool->handle_of(buffer));
+    ELOG(LIBERAD_ERROR) << "Could not resubmit in transfer: " << r;
+  }
+}
+
+
+
+/* Passes a received trace through the processing stages, if any, and on to fan_out. Called by complete_in, or by
+* an executor worker thread if the device is handled by a multi-threaded executor.
+* @param const Trace& trace - received trace and its capture state. trace.lent is the pool buffer holding
+* the data, nullptr if not in pooled mode.
 */
-void LIBUSB_CALL Oeradar::cb_in(libusb_transfer* transfer){
+void Oeradar::deliver_in(const Trace& trace){
+
+  if (!stages.empty()) stages.front()->accept(trace);
+  else fan_out(trace);
+}
 
-  int r = libusb_submit_transfer(this->transfer_in);
+/* Appends a stage to the chain. The device takes ownership. */
+void Oeradar::add_stage(TraceStage* stage){
 
-  Elog(LIBERAD_DEBUG_2) << "cb_in submit transfer: " << r;
+  if (!stages.empty()) stages.back()->next = stage;
+  stage->next = &stage_output;
+  stages.push_back(stage);
+}
+
+/* Passes on a trace leaving the last stage. In pooled mode a trace the stage holds itself is copied into a pool
+* buffer first, so user_callback_in_pooled receives it like any other.
+*/
+void Oeradar::StageOutput::accept(const Trace& trace){
 
-  signed char steps = transfer->buffer[transfer->actual_length - 2];
-  user_callback_in(transfer->buffer, transfer->actual_length, steps);
+  TracePool* pool = radar->trace_pool;
+  if (!pool || trace.lent){
+    radar->fan_out(trace);
+    return;
+  }
 
+  LiberadTraceBuffer* lent = trace.length <= pool->buffer_size() ? pool->acquire() : nullptr;
+  if (!lent){
+    pool->starved++;
+    ELOG(LIBERAD_DEBUG) << "Trace pool exhausted, trace dropped";
+    return;
+  }
+  memcpy(lent->buffer, trace.data, trace.length);
+  Trace record = trace;
+  record.data = lent->buffer;
+  record.samples = lent->buffer + (trace.samples - trace.data);
+  record.lent = lent;
+  lent->length = trace.length;
+  lent->steps = trace.steps;
+  lent->trace = record;
+  radar->fan_out(record);
+  pool->release(lent);
 }
 
+/* Passes a trace to the trace ring, latest trace cache, recorder and user callbacks */
+void Oeradar::fan_out(const Trace& trace){
+
+  if (trace_ring) trace_ring->push(trace);
+  if (latest_trace) latest_trace->store(trace);
+  SurveyRecorder* survey = recorder.load(std::memory_order_acquire);
+  if (survey) survey->record(trace);
+  if (user_callback_in) user_callback_in((unsigned char*)trace.data, trace.length, trace.steps);
+  if (trace.lent && user_callback_in_pooled) user_callback_in_pooled(trace.lent);
+  if (user_callback_trace) user_callback_trace(&trace);
+
+}
 
+/* Records a gain or time window signal as in effect for traces received from now on */
+void Oeradar::signal_sent(unsigned char signal){
+  if (signal == SHORT || signal == LONG) active_window.store(signal, std::memory_order_relaxed);
+  else active_gain.store(signal, std::memory_order_relaxed);
+}
 
-/* Callback invoked when data is transfered from user to GPR.
+/* Called by the transport when an OUT request completes.
 * Function is called internally and is not designed to be exposed to
-* users of liberad. Oeradar::cb_out calls a user defined LiberadCallbackOut function.
-* @param libusb_transfer* transfer
+* users of liberad. Oeradar::complete_out returns the slot to the OUT pool, calls a user defined
+* LiberadCallbackOut function and sends any commands that were waiting for a free slot.
+* @param int slot - OUT slot of the transport
+* @param int length - number of bytes sent
+* @param int status - libusb_transfer_status of the request
 */
-void LIBUSB_CALL Oeradar::cb_out(libusb_transfer* transfer){
+void Oeradar::complete_out(int slot, int length, int status){
+
+  out_slots_free.push_back(slot);
 
-  user_callback_out(transfer->buffer, transfer->actual_length);
+  if (status == LIBUSB_TRANSFER_CANCELLED || status == LIBUSB_TRANSFER_NO_DEVICE) return;
+  if (status == LIBUSB_TRANSFER_COMPLETED && length > 0) signal_sent(out_signals[slot]);
+
+  if (user_callback_out) user_callback_out(&out_signals[slot], length);
+  drain_commands();
 
 }
 
@@ -126,43 +382,90 @@ void LIBUSB_CALL Oeradar::cb_out(libusb_transfer* transfer){
 * @param LiberadCallbackIn cb - user defined function called when new data is available from GPR
 * @param unsigned char* buffer - user allocated buffer to store incoming data from GPR
 * @param int buffer_size - size of user buffer
+* @param int queue_depth - number of IN transfers kept posted. The buffer is split evenly between them.
 */
-void Oeradar::init_transfer_in(LiberadCallbackIn cb, unsigned char* buffer, int buffer_size){
+void Oeradar::init_transfer_in(LiberadCallbackIn cb, unsigned char* buffer, int buffer_size, int queue_depth){
+
+  if (buffer_size < MIN_BUFFER_IN_SIZE && !trace_pool) ELOG(LIBERAD_WARN) << "In buffer too small, may cause errors";
 
-  if (buffer_size < MIN_BUFFER_IN_SIZE) Elog(LIBERAD_WARN) << "In buffer too small, may cause errors";
+  if (queue_depth < 1) queue_depth = 1;
 
   this->user_callback_in = cb;
   this->buffer_in_size = buffer_size;
   this->buffer_in = buffer;
+  this->in_queue_depth = queue_depth;
+}
+
+/* Returns the number of IN transfers that can be posted with the current buffers. Without a trace pool the
+* depth is reduced if a slice of buffer_in would be smaller than MIN_BUFFER_IN_SIZE, or in batched mode than
+* a batch. With a trace pool at
+* least one buffer is kept free to swap with a completed transfer.
+*/
+int Oeradar::effective_in_depth(){
+
+  int depth = in_queue_depth;
+  int slot_size = std::max(MIN_BUFFER_IN_SIZE, LIBERAD_BATCH_BUFFER_SIZE(in_batch_traces));
+  int fitting = trace_pool ? trace_pool->buffer_count() - 1 : buffer_in_size / slot_size;
+  if (fitting < 1) fitting = 1;
+
+  if (depth > fitting){
+    ELOG(LIBERAD_WARN) << "In buffers too small for " << depth << " transfers, using " << fitting;
+    depth = fitting;
+  }
+  return depth;
 }
 
-/* Allocates a libusb_transfer, fills its field params and submits it
-* Must call init_transfer_in(LiberadCallbackIn, unsigned char*, int) first to populate libusb_transfer struct
-* @return LIBERAD_ERR if unsuccessful libusb_submit_transfer
-* @return LIBERAD_SUCCESS if successfully libusb_submit_transfer
+/* Sets up IN slots of the transport up to the queue depth and submits them.
+* Each slot reads into its own slice of buffer_in, or into its own buffer from the trace pool
+* if one is enabled. If slots are already posted to the device they are left as they are.
+* Must call init_transfer_in(LiberadCallbackIn, unsigned char*, int, int) first
+* @return LIBERAD_ERR if a slot could not be submitted
+* @return LIBERAD_SUCCESS if all slots were submitted
 */
 int Oeradar::register_transfer_in(){
 
-  this->transfer_in = libusb_alloc_transfer(0);
+  if (in_flight > 0){
+    ELOG(LIBERAD_DEBUG) << "In transfers already posted: " << in_flight;
+    return LIBERAD_SUCCESS;
+  }
 
-  libusb_fill_bulk_transfer(transfer_in, dev_handle, LIBERAD_ENDPOINT_IN, buffer_in, buffer_in_size, callback_wrapper_in, this, 0);
+  int depth = effective_in_depth();
+  transport->setup_in(depth);
+  if (framer) framer->reset();
 
-  int r = libusb_submit_transfer(transfer_in);
+  in_slot_size = trace_pool ? trace_pool->buffer_size() : buffer_in_size / depth;
+  for (int i = 0; i < depth; i++){
 
-  Elog(LIBERAD_DEBUG) << "Libusb submit in transfer: " << r;
+    unsigned char* buffer = buffer_in + i * in_slot_size;
+    if (trace_pool){
+      LiberadTraceBuffer* trace = trace_pool->acquire();
+      if (!trace){
+        ELOG(LIBERAD_ERROR) << "No free buffer in trace pool";
+        return LIBERAD_ERR;
+      }
+      buffer = trace->buffer;
+    }
 
-  if (r != 0){
-    Elog(LIBERAD_ERROR) << "Could not submit in trasnfer.";
-    return LIBERAD_ERR;
+    int r = transport->submit_in(i, buffer, in_slot_size);
+
+    ELOG(LIBERAD_DEBUG) << "Submit in transfer " << i << ": " << r;
+
+    if (r != 0){
+      if (trace_pool) trace_pool->release(trace_pool->handle_of(buffer));
+      ELOG(LIBERAD_ERROR) << "Could not submit in trasnfer.";
+      return LIBERAD_ERR;
+    }
+    in_flight++;
   }
 
-  Elog(LIBERAD_INFO) << "Registered in transfer";
+  ELOG(LIBERAD_INFO) << "Registered " << depth << " in transfers";
   return LIBERAD_SUCCESS;
 }
 
-/* Sets this instance's fields for OUT transfers. Must be called before register_transfer_out()
-* @param LiberadCallbackOut cb - user defined function called when successfully sending data to GPR
-* @param unsigned char* buffer - user defined buffer for storing OUT signals
+/* Sets this instance's fields for OUT transfers.
+* @param LiberadCallbackOut cb - user defined function called when successfully sending data to GPR. May be nullptr.
+* @param unsigned char* buffer - user defined buffer for storing OUT signals. No longer required, signals are
+* sent from buffers owned by the OUT transfer pool.
 * @param int buffer_size - size of user defined buffer
 * @return
 */
@@ -172,51 +475,124 @@ void Oeradar::init_transfer_out(LiberadCallbackOut cb, unsigned char* buffer, in
   this->buffer_out_size = buffer_size;
 }
 
-/* Allocates a libusb_transfer for outgoing signals, sets its fields and submits the transfer.
-* Must be called after a call to init_transfer_out(LiberadCallbackOut, unsigned char*, int)
-* @return LIBERAD_ERR on unsuccessful libusb_transfer submission
-* @return LIBERAD_SUCCESS on successful libusb_transfer submission
+/* Queues a single byte signal for the thread handling events. Safe to call from any thread.
+* If the event loop is running it is woken up to send the signal.
+* @param unsigned char signal - TimeWindow or Gain signal
+* @return LIBERAD_ERR if the command queue is full
+* @return LIBERAD_SUCCESS else
 */
-int Oeradar::register_transfer_out(){
+int Oeradar::queue_command(unsigned char signal){
 
-  this->transfer_out = libusb_alloc_transfer(0);
-  libusb_fill_bulk_transfer(transfer_out, dev_handle, LIBERAD_ENDPOINT_OUT, buffer_out, 1, callback_wrapper_out, this, 0 );
-  int r = libusb_submit_transfer(transfer_out);
-  Elog(LIBERAD_DEBUG) << "Libusb submit out transfer: " << r;
-  if (r != 0){
-    Elog(LIBERAD_ERROR) << "Could not submit out trasnfer.";
+  if (!commands.push(signal)){
+    ELOG(LIBERAD_ERROR) << "Command queue full, signal dropped: " << (int)signal;
     return LIBERAD_ERR;
   }
 
-  Elog(LIBERAD_INFO) << "Registered out transfer";
+  if (state == RUNNING) transport->interrupt();
   return LIBERAD_SUCCESS;
 }
 
-/* Handles libusb transfer events.
-* Called by liberad_run_connection_async(Oeradar* radar) to be run on a separate
-* execution thread.
+/* Signals are either a TimeWindow or a Gain. Only the last of each kind still waiting to be sent matters. */
+static bool liberad_is_time_window_signal(unsigned char signal){
+  return signal == SHORT || signal == LONG;
+}
+
+/* Moves queued commands into the pending TimeWindow and Gain slots, dropping commands superseded by a
+* later one of the same kind, and sends pending commands through free OUT slots of the transport.
+* Must only be called by the thread handling events.
+*/
+void Oeradar::drain_commands(){
+
+  if (!out_slots_ready){
+    transport->setup_out(LIBERAD_OUT_POOL_SIZE);
+    for (int i = 0; i < LIBERAD_OUT_POOL_SIZE; i++) out_slots_free.push_back(i);
+    out_slots_ready = true;
+  }
+
+  unsigned char signal;
+  while (commands.pop(signal)){
+    int& slot = liberad_is_time_window_signal(signal) ? pending_window : pending_gain;
+    if (slot >= 0) ELOG(LIBERAD_DEBUG) << "Coalesced signal " << slot << " into " << (int)signal;
+    slot = signal;
+  }
+
+  while (!out_slots_free.empty() && (pending_window >= 0 || pending_gain >= 0)){
+
+    int& pending = pending_window >= 0 ? pending_window : pending_gain;
+    int slot = out_slots_free.back();
+    out_slots_free.pop_back();
+
+    out_signals[slot] = (unsigned char)pending;
+    pending = -1;
+
+    int r = transport->submit_out(slot, &out_signals[slot], 1);
+    ELOG(LIBERAD_DEBUG) << "Submit out transfer: " << r;
+    if (r != 0){
+      ELOG(LIBERAD_ERROR) << "Could not submit out trasnfer.";
+      out_slots_free.push_back(slot);
+      break;
+    }
+  }
+}
+
+static std::atomic<int> liberad_next_device_id{0};
+
+Oeradar::Oeradar() : id(liberad_next_device_id++){
+  framer = new TraceFramer(TRACE_LENGTH, CONTROL_B);
+  stage_output.radar = this;
+}
+
+/* Releases the transport, framer, trace ring, latest trace cache, recorder, processing stages and trace pool. An open recording is completed. The device must not be handling
+* IO, except for a stepped capture which is stopped here.
+*/
+Oeradar::~Oeradar(){
+  if (capture_thread.joinable()){
+    state = TRANSMITTING;
+    transport->interrupt();
+    capture_thread.join();
+  }
+  delete transport;
+  delete framer;
+  delete trace_ring;
+  delete latest_trace;
+  delete recorder.load();
+  for (size_t i = 0; i < stages.size(); i++) delete stages[i];
+  delete trace_pool;
+}
+
+/* Handles transport events while the device is RUNNING.
+* Called by liberad_handle_io_async(Oeradar* radar) or the thread of a stepped capture, which set the
+* state beforehand so a liberad_stop_io() right after they start is not missed.
 */
 void Oeradar::run(){
 
-  state = RUNNING;
   while(state == RUNNING){
-    int r = libusb_handle_events_completed(context, NULL);
+    drain_commands();
+    int r = transport->handle_events(-1);
     if (r < 0){
-      Elog(LIBERAD_ERROR) << "Libusb error handling events: " << r;
+      ELOG(LIBERAD_ERROR) << "Error handling events: " << r;
       state = TRANSMITTING;
       break;
     }
   }
+  flush_recording();
+}
+
+/* Writes the traces recorded so far once IO stops, as no further trace may come to complete the chunk */
+void Oeradar::flush_recording(){
+  SurveyRecorder* survey = recorder.load(std::memory_order_acquire);
+  if (survey) survey->flush();
 }
 
-/* Handles libusb transfer events and is called by liberad_get_current_trace_async().
+/* Handles transport events and is called by liberad_get_current_trace_async().
 */
 void Oeradar::run_single(){
   for (int i = 0; i<5; i++){
-    Elog(LIBERAD_DEBUG) << "run single";
-    int r = libusb_handle_events_completed(context, NULL);
+    ELOG(LIBERAD_DEBUG) << "run single";
+    drain_commands();
+    int r = transport->handle_events(-1);
     if (r < 0){
-      Elog(LIBERAD_ERROR) << "Libusb error handling events: " << r;
+      ELOG(LIBERAD_ERROR) << "Error handling events: " << r;
     }
   }
 }
@@ -241,58 +617,129 @@ int liberad_get_valid_devices(vector<Oeradar*>* devices){
   count = liberad_filter_valid(devs, countAll, devices);
 
   if (count <= 0){
-    Elog(LIBERAD_WARN) << "No valid Oerad devices found";
+    ELOG(LIBERAD_WARN) << "No valid Oerad devices found";
     return LIBERAD_ERR;
   }
 
-  Elog(LIBERAD_INFO) << "Found " << count << "valid Oerad devices";
+  ELOG(LIBERAD_INFO) << "Found " << count << "valid Oerad devices";
   return count;
 
 }
 
-/* If device is valid, opens and sets the libusb_device_handle* field of the Oeradar instance.
-* If a kernel driver is attached to the device, it is detached. The Oeradar usb interface is claimed.
-* @param Oeradar* device - pointer to an Oeradar instance
-* @return LIBERAD_SUCCESS on successfully opening and claiming the interface of the Oeradar instance. Note
-* that this will be returned evein if GPR has not been powered up.
-* @return LIBERAD_ERR if interface can't be claimed.
+/* Creates an Oeradar instance backed by a simulated device instead of USB hardware. The simulated device
+* produces synthetic traces at the configured rate and follows gain and time window signals, so the
+* asynchronous IO path, executor and trace consumers can be exercised without hardware. The instance is
+* used with the same liberad_ functions as a physical device, starting from liberad_connect_to_device().
+* @param const LiberadSimParams* params - trace rate, length, encoder steps and doubled trace pattern. nullptr for defaults.
+* @return new Oeradar instance in state ON_BUS
 */
-int liberad_connect_to_device(Oeradar* radar){
+Oeradar* liberad_create_simulated_device(const LiberadSimParams* params){
 
-  if (!liberad_check_init()) return LIBERAD_NOT_INIT;
+  LiberadSimParams defaults;
+  Oeradar* radar = new Oeradar();
+  radar->transport = new SimulatedTransport(radar, params ? *params : defaults);
+  if (params && params->trace_length != TRACE_LENGTH && params->trace_length >= 3){
+    liberad_set_framing(radar, true, params->trace_length);
+  }
+  radar->wireless = params && params->packet_size > 0;
+  radar->state = Oeradar::ON_BUS;
+  ELOG(LIBERAD_INFO) << "Created simulated device";
+  return radar;
+}
 
-  if (radar->state < Oeradar::ON_BUS){
-    Elog(LIBERAD_ERROR) << "Oeradar object not associated with address on USB bus.";
+/* Creates an Oeradar instance replaying a survey recorded with liberad_start_recording(). The file is mapped into
+* memory and its traces are passed to callbacks, rings and executor lanes without being copied, each with the
+* sequence, capture time, gain, time window and encoder position it was recorded with. They are replayed while IN
+* transfers are posted, at their original timing, faster or as fast as they are consumed, so a processing pipeline
+* can be run on field data without hardware. The instance is used like a physical device, starting from
+* liberad_connect_to_device().
+* @param const char* path - survey file
+* @param const LiberadReplayParams* params - replay speed and looping. nullptr replays once at the original timing.
+* @return new Oeradar instance in state ON_BUS, nullptr if the file is not a readable survey file
+*/
+Oeradar* liberad_create_replay_device(const char* path, const LiberadReplayParams* params){
+
+  SurveyFile* file = new SurveyFile();
+  if (file->open(path) != LIBERAD_SUCCESS){
+    delete file;
+    return nullptr;
+  }
+
+  LiberadReplayParams defaults;
+  Oeradar* radar = new Oeradar();
+  radar->product_id = file->header().product_id;
+  radar->transport = new ReplayTransport(radar, file, params ? *params : defaults);
+  radar->state = Oeradar::ON_BUS;
+  ELOG(LIBERAD_INFO) << "Created replay device";
+  return radar;
+}
+
+/* Continues a replay from trace index. Traces from there on are replayed at their original distance from
+* each other starting now. Safe to call from any thread, including callbacks of the device.
+* @param Oeradar* device - device created by liberad_create_replay_device
+* @param unsigned long long index - trace index from 0. Past the last trace the replay finishes.
+* @return LIBERAD_ERR if device is not a replay
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_replay_seek(Oeradar* device, unsigned long long index){
+
+  ReplayTransport* replay = dynamic_cast<ReplayTransport*>(device->transport);
+  if (!replay){
+    ELOG(LIBERAD_ERROR) << "Device is not a replay";
     return LIBERAD_ERR;
   }
 
-  int r = 0;
+  replay->seek(index);
+  return LIBERAD_SUCCESS;
+}
 
-  r = libusb_open(radar->device, &radar->dev_handle);
-  if (r == 0) Elog(LIBERAD_INFO) << "Successfully opened device";
-  Elog(LIBERAD_DEBUG) << "libusb_open: " << r;
+/* Continues a replay from the first trace captured offset_ns or later after the first trace of the survey.
+* Safe to call from any thread, including callbacks of the device.
+* @return LIBERAD_ERR if device is not a replay
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_replay_seek_time(Oeradar* device, long long offset_ns){
 
-  if(libusb_kernel_driver_active(radar->dev_handle, 0) == 1) {
+  ReplayTransport* replay = dynamic_cast<ReplayTransport*>(device->transport);
+  if (!replay){
+    ELOG(LIBERAD_ERROR) << "Device is not a replay";
+    return LIBERAD_ERR;
+  }
 
-     Elog(LIBERAD_DEBUG) << "Kernel Driver Active" ;
-     r = libusb_detach_kernel_driver(radar->dev_handle, 0);
-     Elog(LIBERAD_DEBUG) << "Libusb detach kernel driver: " << r;
+  replay->seek_time(offset_ns);
+  return LIBERAD_SUCCESS;
+}
 
-     if (r != 0){
-       Elog(LIBERAD_ERROR) << "Error detaching kernel driver: " << r;
-     }
+/* Reads the trace count, duration and progress of a replay. Safe to call from any thread.
+* @return LIBERAD_ERR if device is not a replay
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_replay_info(Oeradar* device, LiberadReplayInfo* info){
 
-     Elog(LIBERAD_DEBUG) << "Kernel Driver Detached";
+  ReplayTransport* replay = dynamic_cast<ReplayTransport*>(device->transport);
+  if (!replay) return LIBERAD_ERR;
 
-  }
-  Elog(LIBERAD_DEBUG) << "Kernel driver not active";
+  replay->get_info(info);
+  return LIBERAD_SUCCESS;
+}
 
-  r = libusb_claim_interface(radar->dev_handle, 0);
-  if (r < 0){
-    Elog(LIBERAD_DEBUG) << "Can't claim interface " << r;
+/* If device is valid, opens and sets the libusb_device_handle* field of the Oeradar instance.
+* If a kernel driver is attached to the device, it is detached. The Oeradar usb interface is claimed.
+* @param Oeradar* device - pointer to an Oeradar instance
+* @return LIBERAD_SUCCESS on successfully opening and claiming the interface of the Oeradar instance. Note
+* that this will be returned evein if GPR has not been powered up.
+* @return LIBERAD_ERR if interface can't be claimed.
+*/
+int liberad_connect_to_device(Oeradar* radar){
+
+  if (!liberad_check_init()) return LIBERAD_NOT_INIT;
+
+  if (radar->state < Oeradar::ON_BUS){
+    ELOG(LIBERAD_ERROR) << "Oeradar object not associated with address on USB bus.";
     return LIBERAD_ERR;
   }
-  Elog(LIBERAD_INFO) << "Successfully claimed interface";
+
+  if (radar->transport->open() != LIBERAD_SUCCESS) return LIBERAD_ERR;
 
   radar->state = Oeradar::CONNECTED;
   return LIBERAD_SUCCESS;
@@ -303,10 +750,23 @@ int liberad_connect_to_device(Oeradar* radar){
 int liberad_print_device_info(Oeradar* radar){
 
   if (radar->state < Oeradar::ON_BUS){
-    Elog(LIBERAD_ERROR) << "Oeradar object not associated with address on USB bus";
+    ELOG(LIBERAD_ERROR) << "Oeradar object not associated with address on USB bus";
     return LIBERAD_ERR;
   }
 
+  ReplayTransport* replay = dynamic_cast<ReplayTransport*>(radar->transport);
+  if (replay){
+    const LiberadRecordHeader& header = replay->survey().header();
+    cout << "Replayed survey of " << header.model << " (" << replay->survey().trace_count() << " traces)" << endl;
+    if (header.description[0]) cout << header.description << endl;
+    return LIBERAD_SUCCESS;
+  }
+
+  if (!radar->device){
+    cout << "Simulated Oerad device" << endl;
+    return 0;
+  }
+
   libusb_device_descriptor desc;
   int r = libusb_get_device_descriptor(radar->device, &desc);
   if (r < 0){
@@ -366,30 +826,13 @@ int liberad_print_device_info(Oeradar* radar){
 int liberad_init_device(Oeradar* device){
 
     if (device->state < Oeradar::CONNECTED){
-      Elog(LIBERAD_ERROR) << "Oeradar device not connected. Need to call to liberad_connect_to_device";
+      ELOG(LIBERAD_ERROR) << "Oeradar device not connected. Need to call to liberad_connect_to_device";
       return LIBERAD_ERR;
     }
 
-    int32_t baudRate = 115200;
-    unsigned char *baud = new unsigned char[4];
-    baud[0] = baudRate & 0xff;
-    baud[1] = (baudRate >> 8) & 0xff;
-    baud[2] = (baudRate >> 16) & 0xff;
-    baud[3] = (baudRate >> 24) & 0xff;
-    int r;
-    r = libusb_control_transfer(device->dev_handle, 0x41, 0x00, 0x0001, 0, NULL, 0, 5000);
-    Elog(LIBERAD_DEBUG) << "Enable UART: " << r;
-    r = libusb_control_transfer(device->dev_handle, 0x41, 0x07, 0x303, 0, NULL, 0, 5000);
-    Elog(LIBERAD_DEBUG) << "Set modem handshaking: " << r;
-    r = libusb_control_transfer(device->dev_handle, 0x41, 0x01, 0x20, 0, NULL, 0, 5000);
-    Elog(LIBERAD_DEBUG) << "Set baud rate divisor: " << r;
-    r = libusb_control_transfer(device->dev_handle, 0x41, 0x1E, 0, 0, baud, 4, 5000);
-    Elog(LIBERAD_DEBUG) << "Set baud rate: " << r;
-    r = libusb_control_transfer(device->dev_handle, 0x41, 0x03, 0x0800, 0, NULL, 0, 5000);
-    Elog(LIBERAD_DEBUG) << "Set line control: " << r;
+    device->transport->configure();
 
     device->state = Oeradar::INIT;
-    // TODO check each step for errors
     return LIBERAD_SUCCESS;
 }
 
@@ -405,15 +848,13 @@ int liberad_init_device(Oeradar* device){
 int liberad_start_transmission(Oeradar* device, TimeWindow length, Gain level){
 
   if (device->state < Oeradar::INIT){
-    Elog(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
+    ELOG(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
     return LIBERAD_ERR;
   }
 
-  liberad_send_signal_sync(device, length);
-  liberad_send_signal_sync(device, level);
   if (liberad_send_signal_sync(device, length) == LIBERAD_SUCCESS &&
       liberad_send_signal_sync(device, level) == LIBERAD_SUCCESS){
-        Elog(LIBERAD_INFO) << "Transmission started";
+        ELOG(LIBERAD_INFO) << "Transmission started";
         device->state = Oeradar::TRANSMITTING;
         return LIBERAD_SUCCESS;
   }
@@ -421,31 +862,24 @@ int liberad_start_transmission(Oeradar* device, TimeWindow length, Gain level){
 
 }
 
-/* Sets this Oeradar instance to transmit via an asynchronous mechanism. Requires that all fields
-* relating to asynchronous communication are set - user_callback_in, user_callback_out, buffer_in, buffer_out,
-* buffer_in_size and buffer_out_size. This can be done via a call to liberad_set_async_in_params() and
+/* Sets this Oeradar instance to transmit via an asynchronous mechanism. The TimeWindow and Gain signals
+* are queued and sent by the thread handling events. A LiberadCallbackOut may be set beforehand with
 * liberad_set_async_out_params().
 * @param Oeradar* device - pointer to active device instance. Needs to be INIT
 * @param TimeWindow length - operational time window of GPR (SHORT or LONG)
 * @param Gain level - hardware gain level {LEVEL1, LEVEL2, LEVEL3, LEVEL4 or LEVEL5}
-* @return LIBERAD_ERR if device not init
-* @return LIBERAD_OERADAR_FIELDS_EMPTY if Oeradar instance fields for asynchronous communication not set
+* @return LIBERAD_ERR if device not init or the command queue is full
 * @return LIBERAD_SUCCESS on successful start of transmission. Note that this will be returned evein if GPR has
 * not been powered up.
 */
 int liberad_start_transmission_async(Oeradar* device, TimeWindow length, Gain level){
 
   if (device->state < Oeradar::INIT){
-    Elog(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
+    ELOG(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
     return LIBERAD_ERR;
   }
 
-  if (device->buffer_out_size == 0 || device->buffer_out == nullptr){
-    Elog(LIBERAD_ERROR) << "Buffers for outgoing data not set";
-    return LIBERAD_OERADAR_FIELDS_EMPTY;
-  }
-
-  if (liberad_set_time_window_async(device, length) != LIBERAD_SUCCESS &&
+  if (liberad_set_time_window_async(device, length) != LIBERAD_SUCCESS ||
       liberad_set_gain_async(device, level) != LIBERAD_SUCCESS){
         return LIBERAD_ERR;
   }
@@ -472,7 +906,7 @@ int liberad_start_transmission_async(Oeradar* device, TimeWindow length, Gain le
 int liberad_get_current_trace_async(Oeradar* device, LiberadCallbackIn cb_in, unsigned char* buffer, int buffer_size){
 
   if (device->state < Oeradar::TRANSMITTING){
-    Elog(LIBERAD_ERROR) << "Device not started transmission. Need to call liberad_start_transmission";
+    ELOG(LIBERAD_ERROR) << "Device not started transmission. Need to call liberad_start_transmission";
     return LIBERAD_ERR;
   }
 
@@ -488,12 +922,12 @@ int liberad_get_current_trace_async(Oeradar* device, LiberadCallbackIn cb_in, un
 int liberad_get_current_trace_async(Oeradar* device){
 
   if (device->state < Oeradar::TRANSMITTING){
-    Elog(LIBERAD_ERROR) << "Device not started transmission. Need to call liberad_start_transmission";
+    ELOG(LIBERAD_ERROR) << "Device not started transmission. Need to call liberad_start_transmission";
     return LIBERAD_ERR;
   }
 
-  if (device->buffer_in_size == 0 || device->buffer_in == nullptr){
-    Elog(LIBERAD_ERROR) << "Buffers for incoming data not set";
+  if ((device->buffer_in_size == 0 || device->buffer_in == nullptr) && !device->trace_pool){
+    ELOG(LIBERAD_ERROR) << "Buffers for incoming data not set";
     return LIBERAD_OERADAR_FIELDS_EMPTY;
   }
 
@@ -520,7 +954,7 @@ int liberad_set_async_out_params(Oeradar* device,
                                   int out_buffer_size){
 
   if (device->state < Oeradar::INIT){
-    Elog(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
+    ELOG(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
     return LIBERAD_ERR;
   }
 
@@ -534,20 +968,22 @@ int liberad_set_async_out_params(Oeradar* device,
 * @param LiberadCallbackOut cb_in - user defined function to be called when new data is available from GPR
 * @param unsigned char* buffer_in - pointer to user allocated buffer to store incoming data
 * @param int in_buffer_size - size of user allocated buffer
+* @param int queue_depth - number of IN transfers kept posted to the device, each using in_buffer_size / queue_depth bytes
 * @return LIBERAD_ERR if device has not been initialized
 * @return LIBERAD_SUCCESS else
 */
 int liberad_set_async_in_params(Oeradar* device,
                                 LiberadCallbackIn cb_in,
                                 unsigned char* buffer_in,
-                                int in_buffer_size){
+                                int in_buffer_size,
+                                int queue_depth){
 
   if (device->state < Oeradar::INIT){
-    Elog(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
+    ELOG(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
     return LIBERAD_ERR;
   }
 
-  device->init_transfer_in(cb_in, buffer_in, in_buffer_size);
+  device->init_transfer_in(cb_in, buffer_in, in_buffer_size, queue_depth);
   return LIBERAD_SUCCESS;
 
 }
@@ -557,12 +993,12 @@ int liberad_set_async_in_params(Oeradar* device,
 int liberad_register_in_handling(Oeradar* device){
 
   if (device->state < Oeradar::INIT){
-    Elog(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
+    ELOG(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
     return LIBERAD_ERR;
   }
 
-  if (device->buffer_in_size == 0 || device->buffer_in == nullptr){
-    Elog(LIBERAD_ERROR) << "Buffers for incoming data not set";
+  if ((device->buffer_in_size == 0 || device->buffer_in == nullptr) && !device->trace_pool){
+    ELOG(LIBERAD_ERROR) << "Buffers for incoming data not set";
     return LIBERAD_OERADAR_FIELDS_EMPTY;
   }
 
@@ -571,6 +1007,699 @@ int liberad_register_in_handling(Oeradar* device){
 }
 
 
+/* Attaches a trace ring to the device. Every trace received by complete_in is copied into the ring
+* where a consumer thread can read it with liberad_read_trace() or liberad_try_read_trace(),
+* so slow processing does not stall the thread handling USB events.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param int slot_count - number of traces the ring can hold, rounded up to a power of two
+* @param int slot_size - maximum size of a single trace. Longer traces are truncated.
+* @return LIBERAD_ERR if device is not initialized or the IO loop is running
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_trace_ring(Oeradar* device, int slot_count, int slot_size){
+
+  if (device->state < Oeradar::INIT){
+    ELOG(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
+    return LIBERAD_ERR;
+  }
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't replace trace ring while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (slot_count < 1 || slot_size < 1){
+    ELOG(LIBERAD_ERROR) << "Invalid trace ring size";
+    return LIBERAD_ERR;
+  }
+
+  delete device->trace_ring;
+  device->trace_ring = new TraceRing(slot_count, slot_size);
+  ELOG(LIBERAD_INFO) << "Trace ring enabled with " << device->trace_ring->capacity() << " slots";
+  return LIBERAD_SUCCESS;
+}
+
+/* Reads the oldest trace from the device ring, waiting for one if the ring is empty.
+* Must only be called from a single consumer thread per device.
+* @param Oeradar* device - pointer to device with an enabled trace ring
+* @param unsigned char* buffer - user allocated buffer to store the trace
+* @param int buffer_size - size of user buffer. Longer traces are truncated.
+* @param signed char* steps - receives the encoder steps of the trace. May be nullptr.
+* @param int timeout_ms - maximum time to wait. Negative waits indefinitely.
+* @return number of bytes copied, 0 on timeout
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if no trace ring is enabled
+*/
+int liberad_read_trace(Oeradar* device, unsigned char* buffer, int buffer_size, signed char* steps, int timeout_ms){
+
+  if (!device->trace_ring){
+    ELOG(LIBERAD_ERROR) << "Trace ring not enabled";
+    return LIBERAD_OERADAR_FIELDS_EMPTY;
+  }
+
+  return device->trace_ring->pop_wait(buffer, buffer_size, steps, timeout_ms);
+}
+
+/* Reads the oldest trace from the device ring together with its record. Gaps in Trace::sequence show
+* traces dropped on the way, e.g. by a full ring.
+* Must only be called from a single consumer thread per device.
+* @param Oeradar* device - pointer to device with an enabled trace ring
+* @param Trace* trace - filled with the record of the trace. Its data and samples point into buffer.
+* @param unsigned char* buffer - user allocated buffer to store the trace
+* @param int buffer_size - size of user buffer. Longer traces are truncated.
+* @param int timeout_ms - maximum time to wait. Negative waits indefinitely, 0 doesn't wait.
+* @return number of bytes copied, 0 on timeout
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if no trace ring is enabled
+*/
+int liberad_read_trace_record(Oeradar* device, Trace* trace, unsigned char* buffer, int buffer_size, int timeout_ms){
+
+  if (!device->trace_ring){
+    ELOG(LIBERAD_ERROR) << "Trace ring not enabled";
+    return LIBERAD_OERADAR_FIELDS_EMPTY;
+  }
+
+  return device->trace_ring->pop_wait(trace, buffer, buffer_size, timeout_ms);
+}
+
+/* Sets a callback receiving the record of every trace - data, sequence number, capture time, gain, time window
+* and cumulative encoder position. It is called after user_callback_in and the pooled callback, on the same thread.
+* The record and the data it points to are only valid during the call.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param LiberadCallbackTrace cb - user defined function, nullptr to remove it
+* @return LIBERAD_ERR if the IO loop is running
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_set_trace_callback(Oeradar* device, LiberadCallbackTrace cb){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't replace trace callback while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  device->user_callback_trace = cb;
+  return LIBERAD_SUCCESS;
+}
+
+/* Reads the oldest trace from the device ring without blocking.
+* Must only be called from a single consumer thread per device.
+* @return number of bytes copied, 0 if the ring is empty
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if no trace ring is enabled
+*/
+int liberad_try_read_trace(Oeradar* device, unsigned char* buffer, int buffer_size, signed char* steps){
+
+  if (!device->trace_ring){
+    ELOG(LIBERAD_ERROR) << "Trace ring not enabled";
+    return LIBERAD_OERADAR_FIELDS_EMPTY;
+  }
+
+  return device->trace_ring->pop(buffer, buffer_size, steps);
+}
+
+/* Attaches a cache holding a copy of the newest trace of the device. Unlike the ring it is never full and any
+* number of threads can read it, but traces between two reads are skipped.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param int slot_size - maximum size of the trace kept. Longer traces are truncated.
+* @return LIBERAD_ERR if the IO loop is running or slot_size is invalid
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_latest_trace(Oeradar* device, int slot_size){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't replace latest trace cache while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (slot_size < 1){
+    ELOG(LIBERAD_ERROR) << "Invalid latest trace size";
+    return LIBERAD_ERR;
+  }
+
+  delete device->latest_trace;
+  device->latest_trace = new LatestTrace(slot_size);
+  return LIBERAD_SUCCESS;
+}
+
+/* Copies the newest trace of the device and its record into buffer. Does not wait and never blocks the thread
+* delivering traces, so it returns within microseconds. Compare trace->sequence between calls to tell a new trace
+* from one already seen.
+* @param Oeradar* device - pointer to device with a latest trace cache
+* @param Trace* trace - filled with the record of the trace. Its data and samples point into buffer.
+* @param unsigned char* buffer - user allocated buffer to store the trace
+* @param int buffer_size - size of user buffer. Longer traces are truncated.
+* @return number of bytes copied, 0 if no trace arrived yet
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if no latest trace cache is enabled
+*/
+int liberad_get_latest_trace(Oeradar* device, Trace* trace, unsigned char* buffer, int buffer_size){
+
+  if (!device->latest_trace){
+    ELOG(LIBERAD_ERROR) << "Latest trace cache not enabled";
+    return LIBERAD_OERADAR_FIELDS_EMPTY;
+  }
+
+  return device->latest_trace->load(trace, buffer, buffer_size);
+}
+
+/* Copies the newest trace of the device into buffer once its sequence number is above sequence. A stepped survey
+* passes the sequence of the trace it last used to get the first one captured after it.
+* @param Oeradar* device - pointer to device with a latest trace cache
+* @param unsigned long long sequence - newest sequence already seen, LIBERAD_NO_SEQUENCE to take any trace
+* @param Trace* trace - filled with the record of the trace. Its data and samples point into buffer.
+* @param unsigned char* buffer - user allocated buffer to store the trace
+* @param int buffer_size - size of user buffer. Longer traces are truncated.
+* @param int timeout_ms - maximum time to wait. Negative waits indefinitely, 0 doesn't wait.
+* @return number of bytes copied, 0 on timeout
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if no latest trace cache is enabled
+*/
+int liberad_wait_trace_after(Oeradar* device, unsigned long long sequence, Trace* trace, unsigned char* buffer, int buffer_size, int timeout_ms){
+
+  if (!device->latest_trace){
+    ELOG(LIBERAD_ERROR) << "Latest trace cache not enabled";
+    return LIBERAD_OERADAR_FIELDS_EMPTY;
+  }
+
+  return device->latest_trace->wait_newer(sequence, trace, buffer, buffer_size, timeout_ms);
+}
+
+/* Reads the counters of the device ring. Safe to call from any thread.
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if no trace ring is enabled
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_ring_stats(Oeradar* device, LiberadRingStats* stats){
+
+  if (!device->trace_ring) return LIBERAD_OERADAR_FIELDS_EMPTY;
+
+  device->trace_ring->get_stats(stats);
+  return LIBERAD_SUCCESS;
+}
+
+
+/* Switches the device to batched acquisition. Each IN transfer asks for traces_per_transfer traces, so traces
+* waiting in the device arrive with a single completion, and all traces split from a transfer are passed to cb in one
+* call. This saves a completion, a resubmit and a callback per trace when many devices are served by a slow CPU.
+* Other callbacks, the trace ring and the executor still receive each trace as before. cb runs on the thread handling
+* events; the records and the data they point to are only valid during the call.
+* @param Oeradar* device - pointer to device. Must not have IN transfers posted.
+* @param LiberadCallbackBatch cb - user defined function, nullptr to turn batching off
+* @param int traces_per_transfer - traces each IN transfer is sized for. buffer_in must hold
+* LIBERAD_BATCH_BUFFER_SIZE(traces_per_transfer) bytes per queued transfer, as must pool buffers in pooled mode.
+* @return LIBERAD_ERR if transfers are posted or traces_per_transfer is below 1
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_set_batch_callback(Oeradar* device, LiberadCallbackBatch cb, int traces_per_transfer){
+
+  if (device->in_flight > 0){
+    ELOG(LIBERAD_ERROR) << "Can't change batching while in transfers are posted";
+    return LIBERAD_ERR;
+  }
+
+  if (traces_per_transfer < 1){
+    ELOG(LIBERAD_ERROR) << "Invalid batch size " << traces_per_transfer;
+    return LIBERAD_ERR;
+  }
+
+  device->user_callback_batch = cb;
+  device->in_batch_traces = cb ? traces_per_transfer : 1;
+  device->batch.clear();
+  /* A batch can hold one more trace completed from the previous transfer, and a doubled one */
+  device->batch.reserve(device->in_batch_traces + 2);
+  ELOG(LIBERAD_INFO) << "Batches of " << device->in_batch_traces << " traces";
+  return LIBERAD_SUCCESS;
+}
+
+/* Turns splitting of received data into traces on or off. Transfers over a wired link normally hold one trace,
+* sometimes two, while the wireless dongle divides traces into packets of varying size and can lose packets.
+* With framing every trace of frame_length bytes ending with CONTROL_B is delivered on its own, whatever the
+* transfers look like, and a damaged trace is dropped instead of shifting all that follow. Traces are only
+* copied if they are spread over several transfers.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param bool enable - true to split transfers into traces, false to deliver each transfer as one trace
+* @param int frame_length - bytes per trace including the steps and delimiter trailer
+* @return LIBERAD_ERR if the IO loop is running or frame_length is too short
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_set_framing(Oeradar* device, bool enable, int frame_length){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't change framing while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (frame_length < 3){
+    ELOG(LIBERAD_ERROR) << "Invalid frame length " << frame_length;
+    return LIBERAD_ERR;
+  }
+
+  delete device->framer;
+  device->framer = enable ? new TraceFramer(frame_length, CONTROL_B) : nullptr;
+  ELOG(LIBERAD_INFO) << "Framing " << (enable ? "enabled" : "disabled");
+  return LIBERAD_SUCCESS;
+}
+
+/* Reads the counters of the device framer. Safe to call from any thread.
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if framing is disabled
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_framer_stats(Oeradar* device, LiberadFramerStats* stats){
+
+  if (!device->framer) return LIBERAD_OERADAR_FIELDS_EMPTY;
+
+  device->framer->get_stats(stats);
+  return LIBERAD_SUCCESS;
+}
+
+
+/* Starts recording every trace the device delivers into a survey file. The thread delivering traces only copies
+* each trace into a chunk in memory; a library thread writes full chunks, preallocating file space ahead and flushing
+* the file at durability points, so a power loss costs at most the chunks not yet flushed. If the disk can't keep up
+* traces are dropped from the recording, never from the capture. The file records the device model, the gain, time
+* window, capture time, sequence number and encoder position of every trace. See EradRecord.h for the format.
+* @param Oeradar* device - pointer to device
+* @param const char* path - file to create. An existing file is overwritten.
+* @param const LiberadRecorderParams* params - chunk size, buffering and durability settings. nullptr for defaults.
+* @return LIBERAD_ERR if the device is already recording or the file can't be created
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_start_recording(Oeradar* device, const char* path, const LiberadRecorderParams* params){
+
+  SurveyRecorder* survey = device->recorder.load(std::memory_order_acquire);
+  if (!survey){
+    survey = new SurveyRecorder();
+    device->recorder.store(survey, std::memory_order_release);
+  }
+
+  LiberadRecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.product_id = (uint16_t)device->product_id;
+  header.trace_length = (uint16_t)(device->framer ? device->framer->frame_length() : TRACE_LENGTH);
+  header.device_id = device->id;
+  if (device->product_id) snprintf(header.model, sizeof(header.model), "Oerad GPR %04X", device->product_id);
+  else snprintf(header.model, sizeof(header.model), "Simulated Oerad GPR");
+  header.created_unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  header.created_steady_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  header.gain = (uint8_t)device->active_gain.load(std::memory_order_relaxed);
+  header.window = (uint8_t)device->active_window.load(std::memory_order_relaxed);
+
+  LiberadRecorderParams defaults;
+  return survey->open(path, params ? *params : defaults, header);
+}
+
+/* Stops recording and completes the survey file. Traces delivered while this runs may or may not be recorded.
+* @return LIBERAD_ERR if the device is not recording or not all traces could be written
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_stop_recording(Oeradar* device){
+
+  SurveyRecorder* survey = device->recorder.load(std::memory_order_acquire);
+  if (!survey || !survey->is_open()){
+    ELOG(LIBERAD_ERROR) << "Device not recording";
+    return LIBERAD_ERR;
+  }
+
+  return survey->close();
+}
+
+/* Reads the counters of the current or last recording. Safe to call from any thread.
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if the device never recorded
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_recorder_stats(Oeradar* device, LiberadRecorderStats* stats){
+
+  SurveyRecorder* survey = device->recorder.load(std::memory_order_acquire);
+  if (!survey) return LIBERAD_OERADAR_FIELDS_EMPTY;
+
+  survey->get_stats(stats);
+  return LIBERAD_SUCCESS;
+}
+
+
+/* Switches the device to pooled buffer mode. Instead of slices of buffer_in, IN transfers read into
+* buffers owned by a pool of buffer_count equally sized buffers. On receipt of data the filled buffer is
+* replaced with a free one, the transfer is resubmitted and cb is called with a handle to the filled
+* buffer. The handle stays valid after cb returns if it is retained with liberad_trace_retain() and can
+* be released from any thread with liberad_trace_release(). No memory is allocated per trace.
+* @param Oeradar* device - pointer to device. Must not have IN transfers posted.
+* @param LiberadCallbackInPooled cb - user defined function called with each lent buffer. May be nullptr.
+* @param int buffer_count - number of buffers in the pool. Must exceed the IN queue depth; buffers beyond
+* it are what the user can hold on to without traces being dropped.
+* @param int buffer_size - size of each buffer
+* @return LIBERAD_ERR if device is not initialized, transfers are posted or the pool is too small
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_trace_pool(Oeradar* device, LiberadCallbackInPooled cb, int buffer_count, int buffer_size){
+
+  if (device->state < Oeradar::INIT){
+    ELOG(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
+    return LIBERAD_ERR;
+  }
+
+  if (device->in_flight > 0){
+    ELOG(LIBERAD_ERROR) << "Can't replace trace pool while in transfers are posted";
+    return LIBERAD_ERR;
+  }
+
+  if (buffer_count < 2 || buffer_size < MIN_BUFFER_IN_SIZE){
+    ELOG(LIBERAD_ERROR) << "Trace pool needs at least 2 buffers of MIN_BUFFER_IN_SIZE";
+    return LIBERAD_ERR;
+  }
+
+  delete device->trace_pool;
+  device->trace_pool = new TracePool(buffer_count, buffer_size);
+  device->user_callback_in_pooled = cb;
+  ELOG(LIBERAD_INFO) << "Trace pool enabled with " << buffer_count << " buffers of " << buffer_size << " bytes";
+  return LIBERAD_SUCCESS;
+}
+
+/* Takes an additional reference on a lent trace buffer so it outlives the callback it was passed to */
+void liberad_trace_retain(LiberadTraceBuffer* trace){
+  trace->pool->retain(trace);
+}
+
+/* Drops a reference on a lent trace buffer. The buffer returns to its pool with the last reference. */
+void liberad_trace_release(LiberadTraceBuffer* trace){
+  trace->pool->release(trace);
+}
+
+/* Number of traces dropped because every buffer of the device trace pool was held by the user */
+unsigned long long liberad_get_pool_starved(Oeradar* device){
+  if (!device->trace_pool) return 0;
+  return device->trace_pool->starved;
+}
+
+/* Turns the traces of the device into one trace per spatial bin along the survey line. The encoder position of a
+* trace gives its bin; the traces of a bin are stacked or the one nearest its centre is kept, and the bin is
+* delivered once the antenna leaves it, stamped with the position of its centre. Bins are delivered in survey order,
+* each once. The ring, latest trace cache, recorder and trace callbacks all receive binned traces; the batch
+* callback still receives the traces as captured.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param const LiberadBinningParams* params - encoder calibration, bin spacing and mode, nullptr for defaults
+* @return LIBERAD_ERR if the IO loop is running, binning is already enabled or params are invalid
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_binning(Oeradar* device, const LiberadBinningParams* params){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't enable binning while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (device->binning){
+    ELOG(LIBERAD_ERROR) << "Binning is already enabled";
+    return LIBERAD_ERR;
+  }
+
+  LiberadBinningParams p;
+  if (params) p = *params;
+  if (!(p.steps_per_meter > 0) || !(p.spacing_m > 0) || p.max_gap_bins < 0){
+    ELOG(LIBERAD_ERROR) << "Invalid binning parameters";
+    return LIBERAD_ERR;
+  }
+
+  device->binning = new BinningStage(p);
+  device->add_stage(device->binning);
+  return LIBERAD_SUCCESS;
+}
+
+/* Copies the binning counters of the device. Safe to call while traces are delivered.
+* @param Oeradar* device - pointer to device with binning enabled
+* @param LiberadBinningStats* stats - receives the counters
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if binning is not enabled
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_binning_stats(Oeradar* device, LiberadBinningStats* stats){
+
+  if (!device->binning) return LIBERAD_OERADAR_FIELDS_EMPTY;
+  device->binning->get_stats(stats);
+  return LIBERAD_SUCCESS;
+}
+
+/* Averages every fold consecutive traces of the device into one, raising the signal to noise ratio by up to the
+* square root of fold and lowering the trace rate by fold. Samples are summed straight from the IN or pool buffers
+* the traces were received in. The ring, latest trace cache, recorder and trace callbacks receive only the stacks;
+* the batch callback still receives the traces as captured. Stages run in the order they were enabled, so stacking
+* enabled after binning stacks binned traces.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param const LiberadStackingParams* params - fold and outlier rejection, nullptr for defaults
+* @return LIBERAD_ERR if the IO loop is running, stacking is already enabled or params are invalid
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_stacking(Oeradar* device, const LiberadStackingParams* params){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't enable stacking while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (device->stacking){
+    ELOG(LIBERAD_ERROR) << "Stacking is already enabled";
+    return LIBERAD_ERR;
+  }
+
+  LiberadStackingParams p;
+  if (params) p = *params;
+  if (p.fold < 1 || p.fold > LIBERAD_MAX_FOLD){
+    ELOG(LIBERAD_ERROR) << "Invalid stacking fold " << p.fold;
+    return LIBERAD_ERR;
+  }
+
+  device->stacking = new StackingStage(p);
+  device->add_stage(device->stacking);
+  return LIBERAD_SUCCESS;
+}
+
+/* Copies the stacking counters of the device. Safe to call while traces are delivered.
+* @param Oeradar* device - pointer to device with stacking enabled
+* @param LiberadStackingStats* stats - receives the counters
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if stacking is not enabled
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_stacking_stats(Oeradar* device, LiberadStackingStats* stats){
+
+  if (!device->stacking) return LIBERAD_OERADAR_FIELDS_EMPTY;
+  device->stacking->get_stats(stats);
+  return LIBERAD_SUCCESS;
+}
+
+/* Runs the standard preprocessing chain on the traces of the device as they arrive, so processed radargrams can be
+* shown live: dewow removes the low frequency drift of each trace, time zero alignment shifts the direct wave to the
+* first sample and background removal subtracts the running mean of the last background_window traces, removing
+* horizontal banding. Each trace is delivered as soon as it is processed. The ring, latest trace cache, recorder and
+* trace callbacks receive processed traces; the batch callback still receives the traces as captured.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param const LiberadPreprocessParams* params - filters and their windows, nullptr for defaults
+* @return LIBERAD_ERR if the IO loop is running, preprocessing is already enabled or params are invalid
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_preprocessing(Oeradar* device, const LiberadPreprocessParams* params){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't enable preprocessing while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (device->preprocess){
+    ELOG(LIBERAD_ERROR) << "Preprocessing is already enabled";
+    return LIBERAD_ERR;
+  }
+
+  LiberadPreprocessParams p;
+  if (params) p = *params;
+  if (p.dewow_window < 0 || p.background_window < 0 || p.background_window > 65536 || p.time_zero_sample < 0 ||
+      p.time_zero < LIBERAD_TIME_ZERO_OFF || p.time_zero > LIBERAD_TIME_ZERO_PICK ||
+      !(p.time_zero_threshold > 0 && p.time_zero_threshold <= 1)){
+    ELOG(LIBERAD_ERROR) << "Invalid preprocessing parameters";
+    return LIBERAD_ERR;
+  }
+
+  device->preprocess = new PreprocessStage(p);
+  device->add_stage(device->preprocess);
+  return LIBERAD_SUCCESS;
+}
+
+/* Copies the preprocessing counters of the device. Safe to call while traces are delivered.
+* @param Oeradar* device - pointer to device with preprocessing enabled
+* @param LiberadPreprocessStats* stats - receives the counters
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if preprocessing is not enabled
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_preprocess_stats(Oeradar* device, LiberadPreprocessStats* stats){
+
+  if (!device->preprocess) return LIBERAD_OERADAR_FIELDS_EMPTY;
+  device->preprocess->get_stats(stats);
+  return LIBERAD_SUCCESS;
+}
+
+/* Applies time varying gain to the traces of the device as they arrive, on the thread delivering them, so viewers
+* receive traces ready to draw. SEC multiplies every sample by a factor growing with its two way travel time, taken
+* from a table computed once per time window and trace length. AGC scales every sample so the mean amplitude
+* around it reaches a target. The ring, latest trace cache, recorder and trace callbacks receive the scaled traces;
+* the batch callback still receives the traces as captured.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param const LiberadGainParams* params - device model, SEC and AGC settings, nullptr for defaults
+* @return LIBERAD_ERR if the IO loop is running, gain is already enabled or params are invalid
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_gain(Oeradar* device, const LiberadGainParams* params){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't enable gain while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (device->gain_stage){
+    ELOG(LIBERAD_ERROR) << "Gain is already enabled";
+    return LIBERAD_ERR;
+  }
+
+  LiberadGainParams p;
+  if (params) p = *params;
+  if (p.agc_window < 0 || !(p.agc_target > 0) || !(p.max_gain > 0) || liberad_window_ns(p.model, SHORT) <= 0){
+    ELOG(LIBERAD_ERROR) << "Invalid gain parameters";
+    return LIBERAD_ERR;
+  }
+
+  device->gain_stage = new GainStage(p);
+  device->add_stage(device->gain_stage);
+  return LIBERAD_SUCCESS;
+}
+
+/* Copies the gain counters of the device. Safe to call while traces are delivered.
+* @param Oeradar* device - pointer to device with gain enabled
+* @param LiberadGainStats* stats - receives the counters
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if gain is not enabled
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_gain_stats(Oeradar* device, LiberadGainStats* stats){
+
+  if (!device->gain_stage) return LIBERAD_OERADAR_FIELDS_EMPTY;
+  device->gain_stage->get_stats(stats);
+  return LIBERAD_SUCCESS;
+}
+
+/* Migrates the traces of the device as they arrive, collapsing diffraction hyperbolas onto the reflectors causing
+* them, so migrated sections are available during the survey. Traces are meant to be equidistant, e.g. binned with
+* liberad_enable_binning beforehand, and are passed on unchanged; migrated traces are read with
+* liberad_read_migrated. Each new trace only adds its contributions within the aperture, computed in parallel on
+* the library's processing threads.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param const LiberadMigrationParams* params - device model, velocity, trace spacing, aperture and window, nullptr
+* for defaults
+* @return LIBERAD_ERR if the IO loop is running, migration is already enabled or params are invalid
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_migration(Oeradar* device, const LiberadMigrationParams* params){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't enable migration while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (device->migration){
+    ELOG(LIBERAD_ERROR) << "Migration is already enabled";
+    return LIBERAD_ERR;
+  }
+
+  LiberadMigrationParams p;
+  if (params) p = *params;
+  if (!(p.velocity_m_per_ns > 0) || !(p.spacing_m > 0) || p.aperture < 0 || p.aperture > 4096 ||
+      p.window_traces > 1 << 20 || liberad_window_ns(p.model, SHORT) <= 0){
+    ELOG(LIBERAD_ERROR) << "Invalid migration parameters";
+    return LIBERAD_ERR;
+  }
+
+  device->migration = new MigrationStage(p);
+  device->add_stage(device->migration);
+  return LIBERAD_SUCCESS;
+}
+
+/* Copies a migrated trace. Traces are complete once aperture traces after them arrived; LiberadMigrationInfo tells
+* which are. Safe to call while traces are delivered.
+* @param Oeradar* device - pointer to device with migration enabled
+* @param unsigned long long index - trace index, counted from the first trace migrated
+* @param float* out - receives the migrated samples, at the LEVEL5 amplitude scale
+* @param int capacity - size of out. Longer traces are truncated.
+* @return number of samples copied, 0 if the trace is not held
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if migration is not enabled
+*/
+int liberad_read_migrated(Oeradar* device, unsigned long long index, float* out, int capacity){
+
+  if (!device->migration) return LIBERAD_OERADAR_FIELDS_EMPTY;
+  return device->migration->window.read(index, out, capacity);
+}
+
+/* Copies the progress of the migration of the device. Safe to call while traces are delivered.
+* @param Oeradar* device - pointer to device with migration enabled
+* @param LiberadMigrationInfo* info - receives the traces migrated, complete and held
+* @return LIBERAD_OERADAR_FIELDS_EMPTY if migration is not enabled
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_get_migration_info(Oeradar* device, LiberadMigrationInfo* info){
+
+  if (!device->migration) return LIBERAD_OERADAR_FIELDS_EMPTY;
+  device->migration->window.get_info(info);
+  return LIBERAD_SUCCESS;
+}
+
+/* Keeps a tile pyramid of the traces of the device as they arrive: the traces themselves and, level by level,
+* the min, max and mean of factor columns of the level below, in tiles of tile_columns traces. Viewers fetch the
+* tiles of the level matching their zoom, so drawing costs the same however long the survey. Traces are passed on
+* unchanged; enable the pyramid after the stages whose output should be shown.
+* @param Oeradar* device - pointer to device. Must not be RUNNING.
+* @param const LiberadPyramidParams* params - tile size, factor between levels and whether to keep the traces,
+* nullptr for defaults
+* @return LIBERAD_ERR if the IO loop is running, the pyramid is already enabled or params are invalid
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_enable_pyramid(Oeradar* device, const LiberadPyramidParams* params){
+
+  if (device->state == Oeradar::RUNNING){
+    ELOG(LIBERAD_ERROR) << "Can't enable the tile pyramid while IO is handled. Call liberad_stop_io first";
+    return LIBERAD_ERR;
+  }
+
+  if (device->pyramid){
+    ELOG(LIBERAD_ERROR) << "The tile pyramid is already enabled";
+    return LIBERAD_ERR;
+  }
+
+  LiberadPyramidParams p;
+  if (params) p = *params;
+  if (p.tile_columns < 1 || p.tile_columns > 1 << 16 || p.factor < 2 || p.factor > 16){
+    ELOG(LIBERAD_ERROR) << "Invalid tile pyramid parameters";
+    return LIBERAD_ERR;
+  }
+
+  device->pyramid = new PyramidStage(p);
+  device->add_stage(device->pyramid);
+  return LIBERAD_SUCCESS;
+}
+
+/* Returns the tile pyramid of the device. Its tiles may be fetched from any thread while traces are delivered.
+* @param Oeradar* device - pointer to device
+* @return the pyramid, owned by the device, nullptr if it is not enabled
+*/
+TilePyramid* liberad_get_pyramid(Oeradar* device){
+
+  return device->pyramid ? &device->pyramid->pyramid : nullptr;
+}
+
+/* Adds the traces of a recorded survey to a tile pyramid, e.g. to view it without replaying it. The file is mapped
+* and read in place. Tiles of pyramid may be fetched from another thread meanwhile.
+* @param const char* path - survey file written by liberad_start_recording
+* @param TilePyramid* pyramid - pyramid receiving the traces, usually new, with keep_traces off as the file holds them
+* @return LIBERAD_ERR if the file can't be read
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_build_pyramid(const char* path, TilePyramid* pyramid){
+
+  SurveyFile file;
+  if (file.open(path) != LIBERAD_SUCCESS) return LIBERAD_ERR;
+
+  LiberadSurveyCursor cursor = file.seek_index(0);
+  Trace trace;
+  while (file.read(cursor, &trace)) pyramid->push(trace);
+  return LIBERAD_SUCCESS;
+}
+
+
 
 /* Sets this Oeradar instance to transmit with the given parameters and initializes an
 * asynchronous mechanism for handling incoming and outgoing data.
@@ -583,6 +1712,7 @@ int liberad_register_in_handling(Oeradar* device){
 * @param int inLenght - size of buffer_in
 * @param unsigned char* buffer_out - pointer to buffer to store outgoing signals.
 * @param int outLength - size of buffer_out
+* @param int in_queue_depth - number of IN transfers kept posted to the device. buffer_in is split between them.
 * @return LIBERAD_ERR if Oeradar instance has not been initialized
 * @return LIBERAD_SUCCESS if successfully started an asynchronous transmission. Note that this will be returned evein if GPR has
 * not been powered up.
@@ -595,19 +1725,20 @@ int liberad_start_io_async(Oeradar* device,
                                 unsigned char* buffer_in,
                                 int inLength,
                                 unsigned char* buffer_out,
-                                int outLength){
+                                int outLength,
+                                int in_queue_depth){
 
 
   if (device->state < Oeradar::INIT){
-    Elog(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
+    ELOG(LIBERAD_ERROR) << "Device not initialized. Needs a call to liberad_init_device(Oeradar*)";
     return LIBERAD_ERR;
   }
 
   device->init_transfer_out(callback_out, buffer_out, outLength);
-  if (liberad_set_time_window_async(device, length) != LIBERAD_SUCCESS &&
+  if (liberad_set_time_window_async(device, length) != LIBERAD_SUCCESS ||
       liberad_set_gain_async(device, level) != LIBERAD_SUCCESS){ return LIBERAD_ERR; }
 
-  device->init_transfer_in(callback_in, buffer_in, inLength);
+  device->init_transfer_in(callback_in, buffer_in, inLength, in_queue_depth);
   if( device->register_transfer_in() != LIBERAD_SUCCESS) return LIBERAD_ERR;
 
   device->state = Oeradar::TRANSMITTING;
@@ -626,38 +1757,149 @@ int liberad_start_io_async(Oeradar* device,
 int liberad_handle_io_async(Oeradar* device){
 
   if (device->state < Oeradar::TRANSMITTING){
-    Elog(LIBERAD_ERROR) << "Device not started transmission. Need to call liberad_start_transmission_async";
+    ELOG(LIBERAD_ERROR) << "Device not started transmission. Need to call liberad_start_transmission_async";
+    return LIBERAD_ERR;
+  }
+
+  if (device->executor_served){
+    ELOG(LIBERAD_ERROR) << "Device is handled by the executor";
     return LIBERAD_ERR;
   }
 
+  device->state = Oeradar::RUNNING;
   device->run();
   return LIBERAD_SUCCESS;
 
 }
 
 void liberad_stop_io(Oeradar* device){
-  Elog(LIBERAD_INFO)<< "Stopped connection";
+  if (device->executor_served){
+    liberad_executor_remove(device);
+    device->flush_recording();
+  }
+  ELOG(LIBERAD_INFO)<< "Stopped connection";
   device->state = Oeradar::TRANSMITTING;
+  device->transport->interrupt();
 }
 
-/* Gets a single trace synchronously by the pointed Oeradar instance.
+/* Starts asynchronous transmission and handles its events on a library thread until
+* liberad_stop_stepped_capture, keeping the newest trace in the latest trace cache. Stepped surveys then take
+* traces from the cache instead of waiting for the device on every step. A latest trace cache is enabled if there
+* is none. Callbacks, rings and pools set up beforehand are served as with liberad_handle_io_async.
+* @param Oeradar* device - pointer to device. Must be initialized and not handling IO.
+* @param TimeWindow length - operational time window of GPR (SHORT or LONG)
+* @param Gain level - hardware gain level {LEVEL1, LEVEL2, LEVEL3, LEVEL4 or LEVEL5}
+* @param int in_queue_depth - number of IN transfers kept posted to the device
+* @return LIBERAD_ERR if the device is not initialized, already handling IO or could not be started
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_start_stepped_capture(Oeradar* device, TimeWindow length, Gain level, int in_queue_depth){
+
+  if (device->state == Oeradar::RUNNING || device->executor_served){
+    ELOG(LIBERAD_ERROR) << "Device is already handling IO";
+    return LIBERAD_ERR;
+  }
+
+  /* A capture stopped with liberad_stop_io leaves its thread to be joined */
+  if (device->capture_thread.joinable()) device->capture_thread.join();
+
+  if (!device->latest_trace && liberad_enable_latest_trace(device) != LIBERAD_SUCCESS) return LIBERAD_ERR;
+
+  unsigned char* buffer = device->buffer_in;
+  int buffer_size = device->buffer_in_size;
+  if ((!buffer || buffer_size == 0) && !device->trace_pool){
+    if (in_queue_depth < 1) in_queue_depth = 1;
+    device->capture_buffer.resize(in_queue_depth * std::max(LIBERAD_POOL_BUFFER_SIZE, LIBERAD_BATCH_BUFFER_SIZE(device->in_batch_traces)));
+    buffer = &device->capture_buffer[0];
+    buffer_size = (int)device->capture_buffer.size();
+  }
+
+  if (liberad_start_io_async(device, length, level, device->user_callback_in, device->user_callback_out,
+                             buffer, buffer_size, device->buffer_out, device->buffer_out_size, in_queue_depth) != LIBERAD_SUCCESS){
+    return LIBERAD_ERR;
+  }
+
+  device->state = Oeradar::RUNNING;
+  device->capture_thread = std::thread(&Oeradar::run, device);
+  ELOG(LIBERAD_INFO) << "Stepped capture started";
+  return LIBERAD_SUCCESS;
+}
+
+/* Stops the thread of a capture started by liberad_start_stepped_capture. The device keeps TRANSMITTING and the
+* newest trace stays in the cache.
+* @param Oeradar* device - pointer to device
+* @return LIBERAD_ERR if no stepped capture is running
+* @return LIBERAD_SUCCESS else
+*/
+int liberad_stop_stepped_capture(Oeradar* device){
+
+  if (!device->capture_thread.joinable()){
+    ELOG(LIBERAD_ERROR) << "No stepped capture running";
+    return LIBERAD_ERR;
+  }
+
+  liberad_stop_io(device);
+  device->capture_thread.join();
+  return LIBERAD_SUCCESS;
+}
+
+/* Newest complete trace found by liberad_get_current_trace */
+struct CurrentTrace {
+  unsigned char* buffer;
+  int buffer_size;
+  int length;
+};
+
+static void liberad_keep_current_trace(void* context, const unsigned char* frame, int length){
+  CurrentTrace* current = (CurrentTrace*)context;
+  current->length = length < current->buffer_size ? length : current->buffer_size;
+  memcpy(current->buffer, frame, current->length);
+}
+
+/* Gets a single trace synchronously by the pointed Oeradar instance. With framing enabled the reads are
+* joined and split into traces, so a trace arriving in several packets or together with another one is
+* still found, and buffer_in receives the newest complete trace of at least five reads. During a stepped
+* capture the device is not read here: the call returns the first trace captured after it, within one trace period.
 * @param Oeradar* device - pointer to device
 * @param unsigned char* buffer_in - pointer to user allocated buffer to store incoming data
 * @param int bufferLenght - size of user allocated buffer.
 * @return LIBERAD_ERR if device not started TRANSMITTING
-* @return number of transfered bytes. Should be 585 as of January 2019.
+* @return length of the trace - TRACE_LENGTH, 585 as of January 2019. With framing 0 if no complete trace
+* arrived, without it the number of bytes of the last read. During a stepped capture 0 if no trace arrived in 600 ms.
 */
 int liberad_get_current_trace(Oeradar* device, unsigned char* buffer_in, int bufferLength){
 
   if (device->state < Oeradar::TRANSMITTING){
-    Elog(LIBERAD_ERROR) << "Device not started transmission. Need to call liberad_start_transmission";
+    ELOG(LIBERAD_ERROR) << "Device not started transmission. Need to call liberad_start_transmission";
     return LIBERAD_ERR;
   }
 
-  int actual;
+  if (device->capture_thread.joinable() && device->state == Oeradar::RUNNING && device->latest_trace){
+    Trace trace;
+    return device->latest_trace->wait_newer(device->latest_trace->sequence(), &trace, buffer_in, bufferLength, 600);
+  }
+
+  int actual = 0;
+
+  if (device->framer){
+    std::vector<unsigned char> received(bufferLength > MIN_BUFFER_IN_SIZE ? bufferLength : MIN_BUFFER_IN_SIZE);
+    CurrentTrace current = {buffer_in, bufferLength, 0};
+    /* Packets of the dongle can be much shorter than a trace, so reading goes on until one is complete or the device
+    * stops sending, but no longer than the five reads of an unframed device may take
+    */
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(5 * 600);
+    for (int i = 0; i < 5 || (current.length == 0 && actual > 0); i++){
+      long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (remaining <= 0) break;
+      device->transport->read_sync(&received[0], (int)received.size(), &actual, remaining < 600 ? (int)remaining : 600);
+      if (actual > 0) device->framer->push(&received[0], actual, liberad_keep_current_trace, &current);
+    }
+    return current.length;
+  }
+
   bool ok_signal = false;
   for (int i = 0; i < 5; i++){
-    libusb_bulk_transfer(device->dev_handle, (0x81 | LIBUSB_ENDPOINT_IN), buffer_in, bufferLength, &actual, 600);
+    device->transport->read_sync(buffer_in, bufferLength, &actual, 600);
     if (actual == TRACE_LENGTH) ok_signal = true;
   }
   if (ok_signal) return TRACE_LENGTH;
@@ -669,32 +1911,34 @@ int liberad_get_current_trace(Oeradar* device, unsigned char* buffer_in, int buf
 
 
 
-/* Sets the passed Oeradar instance's operational time window via an asynchronous mechanism
+/* Sets the passed Oeradar instance's operational time window via an asynchronous mechanism. The signal is
+* queued and sent by the thread handling events, so this is safe to call from any thread. A time window
+* still waiting to be sent is replaced by a newer one.
 * @param Oeradar* device - pointer to device
 * @param TimeWindow length - operational time window signal of GPR. Can be SHORT or LONG.
-* @return LIBERAD_SUCCESS on successful transfer registration.
+* @return LIBERAD_ERR if the command queue is full
+* @return LIBERAD_SUCCESS on successfully queueing the signal.
 */
 int liberad_set_time_window_async(Oeradar* device, TimeWindow length){
 
-  memcpy(device->buffer_out, &length, 1 );
   device->window = length;
-  return device->register_transfer_out();
+  return device->queue_command(length);
 
 }
 
 
-/*Sets the passed Oeradar instance's hardware gain level via an asynchronous mechanism. Fills the buffer
-* pointed to by Oeradar::buffer_out with gain command to be sent to device. The pointer has to be set beforehand
-* with liberad_start_transmission_async() or liberad_set_async_out_params().
+/*Sets the passed Oeradar instance's hardware gain level via an asynchronous mechanism. The signal is queued
+* and sent by the thread handling events, so this is safe to call from any thread. A gain level still
+* waiting to be sent is replaced by a newer one.
 * @param Oeradar* device - pointer to device instance
 * @param Gain level - gain signal
-* @return LIBERAD_ERR on unsuccessful libusb_transfer submission
-* @return LIBERAD_SUCCESS on successful libusb_transfer submission
+* @return LIBERAD_ERR if the command queue is full
+* @return LIBERAD_SUCCESS on successfully queueing the signal.
 */
 int liberad_set_gain_async(Oeradar* device, Gain level){
-  memcpy(device->buffer_out, &level, 1 );
+
   device->gain = level;
-  return device->register_transfer_out();
+  return device->queue_command(level);
 
 }
 
@@ -726,7 +1970,7 @@ int liberad_set_gain(Oeradar* device, Gain level){
 
 
 
-/* Cancels any pending in or out asynchronous transfers, releases the device interface & closes
+/* Cancels all pending in and out asynchronous transfers, releases the device interface & closes
 * the connection with it. Oeradar instance is still listed on the USB BUS i.e. device->libusb_device
 * pointer still points to the device.
 * @param Oeradar* device - pointer to device instance
@@ -734,23 +1978,8 @@ int liberad_set_gain(Oeradar* device, Gain level){
 * @return LIBERAD_SUCCESS on successful releasing.
 */
 int liberad_disconnect_device(Oeradar* device){
-  if (device->transfer_in){
-    int r = libusb_cancel_transfer(device->transfer_in);
-    Elog(LIBERAD_DEBUG) << "Cancel transfer in: " << r;
-  }
-
-  if (device->transfer_out){
-    int r = libusb_cancel_transfer(device->transfer_out);
-    Elog(LIBERAD_DEBUG) << "Cancel transfer out: " << r;
-
-  }
-
-  int r = libusb_release_interface(device->dev_handle, 0);
-  Elog(LIBERAD_DEBUG) << "Release interface: " << r;
-  if (r != 0)  return LIBERAD_ERR;
-
-  Elog(LIBERAD_INFO) << "Released Interface";
-  libusb_close(device->dev_handle);
+  device->transport->cancel_all();
+  if (device->transport->close() != LIBERAD_SUCCESS) return LIBERAD_ERR;
 
   device->state = Oeradar::ON_BUS;
   return LIBERAD_SUCCESS;
@@ -763,7 +1992,8 @@ void liberad_exit(){
   libusb_free_device_list(devs, 1);
   libusb_exit(context);
 
-  Elog(LIBERAD_INFO) << "Liberad exit & freed resources";
+  ELOG(LIBERAD_INFO) << "Liberad exit & freed resources";
+  liberad_set_log_async(false);
 }
 
 
@@ -784,6 +2014,9 @@ ssize_t liberad_filter_valid(libusb_device ** connected, ssize_t countAll, vecto
     if (liberad_is_device_valid(connected[i])){
       Oeradar* radar = new Oeradar();
       radar->device = connected[i];
+      libusb_device_descriptor desc;
+      if (libusb_get_device_descriptor(connected[i], &desc) == 0) radar->product_id = desc.idProduct;
+      radar->transport = new LibusbTransport(radar);
       radar->state = Oeradar::ON_BUS;
       valid->push_back(radar);
     }
@@ -800,7 +2033,7 @@ bool liberad_is_device_valid(libusb_device* device){
 
   libusb_device_descriptor desc;
   int r = libusb_get_device_descriptor(device, &desc);
-  Elog(LIBERAD_DEBUG) << "Libusb get device descriptor: " << r;
+  ELOG(LIBERAD_DEBUG) << "Libusb get device descriptor: " << r;
 
   if (desc.idVendor == 4292 && (desc.idProduct == 60000 ||
                                 desc.idProduct == 0x8A9F ||
@@ -821,18 +2054,19 @@ bool liberad_is_device_valid(libusb_device* device){
 ssize_t liberad_send_signal_sync(Oeradar* device, unsigned char signal){
 
   if (device->state < Oeradar::INIT) {
-    Elog(LIBERAD_ERROR) << "Device not initialized";
+    ELOG(LIBERAD_ERROR) << "Device not initialized";
     return LIBERAD_ERR;
   }
 
   int actual = 0;
-  int r = libusb_bulk_transfer(device->dev_handle, LIBERAD_ENDPOINT_OUT, &signal, 1, &actual, 400 );
+  int r = device->transport->write_sync(&signal, 1, &actual, 400);
 
-  Elog(LIBERAD_DEBUG) << "Libusb bulk transfer signal: " << signal << " to device result: " << r;
+  ELOG(LIBERAD_DEBUG) << "Bulk transfer signal: " << signal << " to device result: " << r;
   if (actual == 0){
-    Elog(LIBERAD_ERROR) << "Error sending signal to device";
+    ELOG(LIBERAD_ERROR) << "Error sending signal to device";
     return LIBERAD_ERR;
   }
 
+  device->signal_sent(signal);
   return LIBERAD_SUCCESS;
 }